@@ -31,6 +31,11 @@ struct Option
     std::string discardTypeStr;
     bool isDebug;
     std::string cmprOptForSyncStr;
+    std::string hashAlgoForSyncStr;
+    std::string aioEngineStr;
+    uint64_t ioSchedMbPerSec;
+    uint64_t ioSchedIops;
+    bool isIoSchedBacklogFirst;
     cybozu::Option opt;
 
     Option(int argc, char *argv[]) {
@@ -56,7 +61,17 @@ struct Option
         opt.appendBoolOpt(&a.keepOneColdSnapshot, "keep-one-cold-snap", ": keep just one cold snapshot per volume.");
         opt.appendOpt(&a.maxOpenDiffs, DEFAULT_MAX_OPEN_DIFFS, "maxopen", "NUM : max number of wdiff files to open together.");
         opt.appendOpt(&a.pctApplySleep, DEFAULT_PCT_APPLY_SLEEP, "apply-sleep-pct", "PERCENTAGE : sleep percentage in diff application. (default: 0)");
+        opt.appendOpt(&a.mergeConcurrency, DEFAULT_MERGE_CONCURRENCY, "merge-th", "NUM : number of threads to merge/apply wdiffs by address range. (default: 1)");
+        opt.appendOpt(&a.applyIoDepthMb, DEFAULT_APPLY_IO_DEPTH_MB, "apply-qd", "SIZE : in-flight IO size of each writer queue in diff application [MiB].");
+        opt.appendOpt(&a.applyMaxIoKb, DEFAULT_APPLY_MAX_IO_KB, "apply-io", "SIZE : max size of a write IO merged from adjacent ones in diff application [KiB].");
+        opt.appendOpt(&a.applyPrefetchConcurrency, DEFAULT_APPLY_PREFETCH_CONCURRENCY, "apply-prefetch-th", "NUM : number of threads to read ahead and uncompress IOs for each writer queue in diff application. (default: 1, 0 means no prefetch)");
+        opt.appendOpt(&a.hashTreeMb, DEFAULT_HASH_TREE_MB, "hash-tree-mb", "SIZE : region size to compare hashes hierarchically in hash-repl/resync-repl [MiB]. (default: 0, that means the flat mode)");
+        opt.appendOpt(&ioSchedMbPerSec, DEFAULT_IO_SCHED_MB_PER_SEC, "io-mbps", "SIZE : max throughput of apply/restore/merge shared by all the volumes [MiB/sec]. (default: 0 means unlimited)");
+        opt.appendOpt(&ioSchedIops, DEFAULT_IO_SCHED_IOPS, "io-iops", "NUM : max IOPS of apply/restore/merge shared by all the volumes. (default: 0 means unlimited)");
+        opt.appendBoolOpt(&isIoSchedBacklogFirst, "io-backlog-first", ": give more IO budget to volumes with more wdiffs to apply.");
         opt.appendOpt(&cmprOptForSyncStr, DEFAULT_CMPR_OPT_FOR_SYNC, "sync-cmpr", "COMPRESSION_OPT : compression option for full/hash replsync like 'snappy:0:1'.");
+        opt.appendOpt(&hashAlgoForSyncStr, DEFAULT_HASH_ALGO_FOR_SYNC, "sync-hash", "ALGO : hash algorithm proposed in hash-repl/resync-repl: murmur3/xxh128.");
+        opt.appendOpt(&aioEngineStr, DEFAULT_AIO_ENGINE, "aio", "ENGINE : asynchronous IO engine: libaio/io_uring/io_uring_sqpoll.");
 #ifdef ENABLE_EXEC_PROTOCOL
         opt.appendBoolOpt(&a.allowExec, "allow-exec", ": allow exec protocol for test. This is NOT SECURE.");
 #endif
@@ -73,6 +88,9 @@ struct Option
         util::verifyNotZero(a.maxForegroundTasks, "maxForegroundTasks");
         util::verifyNotZero(a.maxWdiffSendNr, "maxWdiffSendNr");
         util::verifyNotZero(a.fsyncIntervalSize, "fsyncIntervalSize");
+        util::verifyNotZero(a.mergeConcurrency, "mergeConcurrency");
+        util::verifyNotZero(a.applyIoDepthMb, "applyIoDepthMb");
+        util::verifyNotZero(a.applyMaxIoKb, "applyMaxIoKb");
         a.discardType = parseDiscardType(discardTypeStr, __func__);
         a.keepAliveParams.verify();
         if (a.pctApplySleep >= 100) {
@@ -80,6 +98,10 @@ struct Option
                 << a.pctApplySleep;
         }
         a.cmprOptForSync = parseCompressOpt(cmprOptForSyncStr);
+        a.hashAlgoForSync = parseHashAlgo(hashAlgoForSyncStr);
+        cybozu::aio::defaultAioEngine() = cybozu::aio::parseAioEngine(aioEngineStr);
+        a.ioSched.setLimit(ioSchedMbPerSec * MEBI, ioSchedIops);
+        a.ioSched.setBacklogFirst(isIoSchedBacklogFirst);
     }
 };
 
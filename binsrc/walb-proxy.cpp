@@ -50,6 +50,8 @@ struct Option
         opt.appendOpt(&p.retryTimeout, DEFAULT_RETRY_TIMEOUT_SEC, "rto", "PERIOD : retry timeout (total period) [sec].");
         opt.appendOpt(&p.baseDirStr, DEFAULT_BASE_DIR, "b", "PATH : base directory");
         opt.appendOpt(&p.maxConversionMb, DEFAULT_MAX_CONVERSION_MB, "wl", "SIZE : max memory size of wlog-wdiff conversion [MiB].");
+        opt.appendOpt(&p.wlogRecvConcurrency, DEFAULT_WLOG_RECV_CONCURRENCY, "wlth"
+                      , "NUM : num of worker threads to compress received wlogs in wlog-transfer.");
         std::string hostName = cybozu::net::getHostName();
         opt.appendOpt(&p.nodeId, hostName, "id", "STRING : node identifier");
         opt.appendOpt(&p.socketTimeout, DEFAULT_SOCKET_TIMEOUT_SEC, "to", "PERIOD : Socket timeout [sec].");
@@ -70,6 +72,7 @@ struct Option
         util::verifyNotZero(p.maxWdiffSendMb, "maxWdiffSendMb");
         util::verifyNotZero(p.maxWdiffSendNr, "maxWdiffSendNr");
         util::verifyNotZero(p.maxConversionMb, "maxConversionMb");
+        util::verifyNotZero(p.wlogRecvConcurrency, "wlogRecvConcurrency");
         p.keepAliveParams.verify();
         if (p.minDelaySecForRetry > p.maxDelaySecForRetry) {
             LOGs.warn() << "reset maxDelaySecForRetry do to bad value"
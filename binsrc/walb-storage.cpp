@@ -10,6 +10,7 @@
 #include "cybozu/serializer.hpp"
 #include "cybozu/option.hpp"
 #include "file_path.hpp"
+#include "tmp_file.hpp"
 #include "net_util.hpp"
 #include "server_util.hpp"
 #include "walb_util.hpp"
@@ -36,6 +37,8 @@ struct Option
     bool isDebug;
     uint64_t defaultFullScanBytesPerSec;
     std::string cmprOptForSyncStr;
+    std::string hashAlgoForSyncStr;
+    std::string aioEngineStr;
     cybozu::Option opt;
 
     Option(int argc, char *argv[]) {
@@ -55,6 +58,18 @@ struct Option
         std::string hostName = cybozu::net::getHostName();
         opt.appendOpt(&s.nodeId, hostName, "id", "STRING : node identifier");
         opt.appendOpt(&s.maxWlogSendMb, DEFAULT_MAX_WLOG_SEND_MB, "wl", "SIZE : max wlog size to send at once [MiB].");
+        opt.appendOpt(&s.wlogSendConcurrency, DEFAULT_WLOG_SEND_CONCURRENCY, "wlth"
+                      , "NUM : num of worker threads to verify and compress wlogs in wlog-transfer.");
+        opt.appendBoolOpt(&s.coalescesWlog, "wl-coalesce"
+                          , ": convert wlogs to a diff before wlog-transfer to coalesce overwritten blocks.");
+        opt.appendOpt(&s.maxWlogCoalesceMb, DEFAULT_WLOG_COALESCE_MB, "wl-coalesce-mb"
+                      , "SIZE : max memory size to coalesce wlogs. Exceeded data are spilled to the base directory [MiB].");
+        opt.appendOpt(&s.wlogReadAheadMb, DEFAULT_WLOG_READ_AHEAD_MB, "wlra"
+                      , "SIZE : max read-ahead size of the log device in wlog-transfer [MiB].");
+        opt.appendOpt(&s.wlogReadIoKb, DEFAULT_WLOG_READ_IO_KB, "wlio"
+                      , "SIZE : max IO size to read the log device in wlog-transfer [KiB].");
+        opt.appendOpt(&s.hashTreeMb, DEFAULT_HASH_TREE_MB, "hash-tree-mb"
+                      , "SIZE : region size to compare hashes hierarchically in hash-bkp [MiB]. (default: 0, that means the flat mode)");
         opt.appendOpt(&s.implicitSnapshotIntervalSec, DEFAULT_IMPLICIT_SNAPSHOT_INTERVAL_SEC, "snapintvl"
                       , "PERIOD : implicit snapshot interval [sec].");
         opt.appendOpt(&s.minDelaySecForRetry, DEFAULT_MIN_DELAY_SEC_FOR_RETRY, "delay", "PERIOD : mininum waiting time for next retry [sec].");
@@ -63,6 +78,8 @@ struct Option
         opt.appendOpt(&defaultFullScanBytesPerSec, DEFAULT_FULL_SCAN_BYTES_PER_SEC, "fst", "SIZE : default full scan throughput [bytes/s]");
         opt.appendOpt(&s.tsDeltaGetterIntervalSec, DEFAULT_TS_DELTA_INTERVAL_SEC, "tsdintvl", "PERIOD : ts-delta getter interval [sec].");
         opt.appendOpt(&cmprOptForSyncStr, DEFAULT_CMPR_OPT_FOR_SYNC, "sync-cmpr", "COMPRESSION_OPT : compression option for full/hash sync like 'snappy:0:1'.");
+        opt.appendOpt(&hashAlgoForSyncStr, DEFAULT_HASH_ALGO_FOR_SYNC, "sync-hash", "ALGO : hash algorithm proposed in hash-bkp: murmur3/xxh128.");
+        opt.appendOpt(&aioEngineStr, DEFAULT_AIO_ENGINE, "aio", "ENGINE : asynchronous IO engine: libaio/io_uring/io_uring_sqpoll.");
 #ifdef ENABLE_EXEC_PROTOCOL
         opt.appendBoolOpt(&s.allowExec, "allow-exec", ": allow exec protocol for test. This is NOT SECURE.");
 #endif
@@ -78,11 +95,20 @@ struct Option
         util::verifyNotZero(s.maxBackgroundTasks, "maxBackgroundTasks");
         util::verifyNotZero(s.maxForegroundTasks, "maxForegroundTasks");
         util::verifyNotZero(s.maxWlogSendMb, "maxWlogSendMb");
+        util::verifyNotZero(s.wlogSendConcurrency, "wlogSendConcurrency");
+        util::verifyNotZero(s.maxWlogCoalesceMb, "maxWlogCoalesceMb");
+        util::verifyNotZero(s.wlogReadAheadMb, "wlogReadAheadMb");
+        util::verifyNotZero(s.wlogReadIoKb, "wlogReadIoKb");
+        if (s.wlogReadIoKb % 4 != 0 || s.wlogReadIoKb * KIBI > s.wlogReadAheadMb * MEBI) {
+            throw cybozu::Exception("bad wlogReadIoKb") << s.wlogReadIoKb << s.wlogReadAheadMb;
+        }
         util::verifyNotZero(s.implicitSnapshotIntervalSec, "implicitSnapshotIntervalSec");
         util::verifyNotZero(s.tsDeltaGetterIntervalSec, "tsDeltaGetterIntervalSec");
         s.keepAliveParams.verify();
         s.fullScanLbPerSec = defaultFullScanBytesPerSec / LOGICAL_BLOCK_SIZE;
         s.cmprOptForSync = parseCompressOpt(cmprOptForSyncStr);
+        s.hashAlgoForSync = parseHashAlgo(hashAlgoForSyncStr);
+        cybozu::aio::defaultAioEngine() = cybozu::aio::parseAioEngine(aioEngineStr);
         if (s.minDelaySecForRetry > s.maxDelaySecForRetry) {
             LOGs.warn() << "reset maxDelaySecForRetry do to bad value"
                         << s.maxDelaySecForRetry << s.minDelaySecForRetry;
@@ -95,6 +121,7 @@ struct StorageThreads {
     explicit StorageThreads(Option &opt)
     {
         util::makeDir(gs.baseDirStr, "storageServer", false);
+        cybozu::removeAllTmpFiles(gs.baseDirStr); // spilled wlogs of coalescing.
         StorageSingleton &g = getStorageGlobal();
         g.archive = parseSocketAddr(opt.archiveDStr);
         g.proxyV = parseMultiSocketAddr(opt.multiProxyDStr);
@@ -106,11 +106,29 @@ void setupSetFullScanBps(cybozu::Option& opt)
     static uint64_t size;
     opt.appendParam(&size, "maxFullScanBps", "max full-scan throughput [bytes/sec] (0 means unlimited)");
 }
+void setupSetIoSched(cybozu::Option& opt)
+{
+    static std::string name;
+    opt.appendParam(&name, "name", ": bps/iops/backlog-first/weight/prio");
+    setupOpt(opt, "(volId) value", ": bps [bytes/sec] (0 means unlimited), iops (0 means unlimited), backlog-first 0/1, weight volId value, prio volId value");
+}
+void setupNbdExport(cybozu::Option& opt)
+{
+    setupVolIdGid(opt);
+    static std::string addr;
+    opt.appendParam(&addr, "addr", ": HOST:PORT or unix:PATH");
+    setupOpt(opt, "(acceptTimeoutSec)", ": 0 means no timeout");
+}
 void setupVirtualFullScan(cybozu::Option& opt)
 {
     setupVolIdGid(opt);
     setupOpt(opt, "(bulk size) (scanning size)");
 }
+void setupBlockHash(cybozu::Option& opt)
+{
+    setupVolIdGid(opt);
+    setupOpt(opt, "(bulk size) (scanning size) (hash algorithm)", ": scanning size 0 means the whole device, hash algorithm is murmur3 (default) or xxh128.");
+}
 void setupVirtualFullScanCmd(cybozu::Option& opt)
 {
     static std::string devPath;
@@ -200,7 +218,9 @@ const CommandInfo g_cmdTbl[] = {
     { resizeCN, c2xResizeClient, setupResize, verifyResizeParam, "resize a volume in a storage or an archive." },
     { kickCN, c2xKickClient, setupKick, verifyKickParam, "kick background tasks if necessary." },
     { setFullScanBpsCN, c2sSetFullScanBpsClient, setupSetFullScanBps, verifySetFullScanBps, "set max full scan bytes per second parameter." },
-    { blockHashCN, c2aBlockHashClient, setupVirtualFullScan, verifyVirtualFullScanParam, "calculate block hash of a volume in an archive." },
+    { setIoSchedCN, c2aSetIoSchedClient, setupSetIoSched, verifyIoSchedParam, "set parameters of the IO scheduler for apply/restore/merge in an archive." },
+    { nbdExportCN, c2aNbdExportClient, setupNbdExport, verifyNbdExportParam, "export a snapshot of a volume in an archive through NBD without restoring it." },
+    { blockHashCN, c2aBlockHashClient, setupBlockHash, verifyBlockHashParam, "calculate block hash of a volume in an archive." },
     { virtualFullScanCN, c2aVirtualFullScanClient, setupVirtualFullScanCmd, verifyVirtualFullScanCmdParam, "virtual full scan of a volume in an archive." },
     { getCN, c2xGetClient, setupGet, verifyNoneParam, "get some information from a server." },
     { execCN, c2xGetStrVecClient, setupStrVec, verifyNoneParam, "execute a command-line at a server's side." },
@@ -9,6 +9,7 @@
 #include "util.hpp"
 #include "walb_diff_merge.hpp"
 #include "host_info.hpp"
+#include "file_path.hpp"
 
 using namespace walb;
 
@@ -19,6 +20,8 @@ struct Option : public cybozu::Option
     std::string outputWdiff, cmprStr;
     bool doStat;
     CompressOpt cmpr;
+    size_t nrThreads;
+    std::string tmpDir;
 
     Option() {
         setDescription("Merge wdiff files.");
@@ -27,6 +30,8 @@ struct Option : public cybozu::Option
         appendOpt(&outputWdiff, "-", "o", "WDIFF_PATH: output wdiff path (default: stdout).");
         appendBoolOpt(&doStat, "stat", ": put statistics.");
         appendOpt(&cmprStr, "snappy:0:1", "cmpr", "type:level:concurrency : compression for output (default: snappy:0:1)");
+        appendOpt(&nrThreads, 1, "th", "NUM : number of threads to merge by address range (default: 1).");
+        appendOpt(&tmpDir, "", "tmp", "DIR_PATH : directory for temporary files with -th (default: output directory).");
         appendHelp("h", ": put this message.");
     }
     uint32_t maxIoBlocks() const {
@@ -44,6 +49,13 @@ struct Option : public cybozu::Option
             goto error;
         }
         cmpr.parse(cmprStr);
+        if (nrThreads == 0) {
+            ::fprintf(::stderr, "-th must not be 0.\n");
+            goto error;
+        }
+        if (tmpDir.empty()) {
+            tmpDir = outputWdiff == "-" ? "." : cybozu::FilePath(outputWdiff).parent().str();
+        }
         return true;
       error:
         usage();
@@ -51,27 +63,57 @@ struct Option : public cybozu::Option
     }
 };
 
-int doMain(int argc, char *argv[])
+template <typename Merger>
+void putStat(const Merger &merger)
+{
+    std::cerr << "mergeIn  " << merger.statIn() << std::endl
+              << "mergeOut " << merger.statOut() << std::endl
+              << "mergeMemUsage " << merger.memUsageStr() << std::endl;
+}
+
+void mergeSerially(const Option &opt, cybozu::util::File &file)
 {
-    Option opt;
-    if (!opt.parse(argc, argv)) return 1;
     DiffMerger merger;
-    for (std::string &path : opt.inputWdiffs) {
+    for (const std::string &path : opt.inputWdiffs) {
         merger.addWdiff(path);
     }
-    cybozu::util::File file;
-    if (opt.outputWdiff == "-") {
-        file.setFd(1);
-    } else {
-        file.open(opt.outputWdiff, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    }
     merger.setMaxIoBlocks(opt.maxIoBlocks());
     merger.setShouldValidateUuid(false);
+    merger.setPassThroughCmprType(opt.cmpr.type);
 #if 0
     merger.mergeToFd(file.fd());
 #else
     merger.mergeToFdInParallel(file.fd(), opt.cmpr);
 #endif
+    if (opt.doStat) putStat(merger);
+}
+
+void mergeByRange(const Option &opt, cybozu::util::File &file)
+{
+    ParallelDiffMerger merger(opt.nrThreads);
+    merger.addWdiffs(opt.inputWdiffs);
+    merger.setMaxIoBlocks(opt.maxIoBlocks());
+    merger.setShouldValidateUuid(false);
+    merger.setPassThroughCmprType(opt.cmpr.type);
+    merger.mergeToFd(file.fd(), opt.cmpr, opt.tmpDir);
+    if (opt.doStat) putStat(merger);
+}
+
+int doMain(int argc, char *argv[])
+{
+    Option opt;
+    if (!opt.parse(argc, argv)) return 1;
+    cybozu::util::File file;
+    if (opt.outputWdiff == "-") {
+        file.setFd(1);
+    } else {
+        file.open(opt.outputWdiff, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if (opt.nrThreads == 1) {
+        mergeSerially(opt, file);
+    } else {
+        mergeByRange(opt, file);
+    }
 #if 0
     /*
      * currently we prefer prompt quit of the command
@@ -80,11 +122,6 @@ int doMain(int argc, char *argv[])
     file.fdatasync();
 #endif
     file.close();
-    if (opt.doStat) {
-        std::cerr << "mergeIn  " << merger.statIn() << std::endl
-                  << "mergeOut " << merger.statOut() << std::endl
-                  << "mergeMemUsage " << merger.memUsageStr() << std::endl;
-    }
     return 0;
 }
 
@@ -31,14 +31,81 @@
 #include <linux/fs.h>
 #include <libaio.h>
 
+/*
+ * io_uring engine is available if the kernel header exists.
+ * Define DISABLE_IO_URING to build without it.
+ */
+#if !defined(DISABLE_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define CYBOZU_AIO_IO_URING
+#endif
+#endif
+
 #include "linux/walb/common.h"
 #include "util.hpp"
 #include "fileio.hpp"
 #include "memory_buffer.hpp"
+#ifdef CYBOZU_AIO_IO_URING
+#include "io_uring_util.hpp"
+#endif
 
 namespace cybozu {
 namespace aio {
 
+/**
+ * Backend of Aio class.
+ * IO_URING_SQPOLL uses a kernel thread to poll the submission queue,
+ * which requires Linux 5.11 or later for non-root users.
+ */
+enum class AioEngine : uint8_t
+{
+    LIBAIO,
+    IO_URING,
+    IO_URING_SQPOLL,
+};
+
+inline const char *toStr(AioEngine engine)
+{
+    switch (engine) {
+    case AioEngine::LIBAIO: return "libaio";
+    case AioEngine::IO_URING: return "io_uring";
+    case AioEngine::IO_URING_SQPOLL: return "io_uring_sqpoll";
+    }
+    throw RT_ERR("bad AioEngine: %d", int(engine));
+}
+
+inline bool isAioEngineAvailable(AioEngine engine)
+{
+#ifdef CYBOZU_AIO_IO_URING
+    (void)engine;
+    return true;
+#else
+    return engine == AioEngine::LIBAIO;
+#endif
+}
+
+inline AioEngine parseAioEngine(const std::string &s)
+{
+    for (AioEngine engine : {AioEngine::LIBAIO, AioEngine::IO_URING, AioEngine::IO_URING_SQPOLL}) {
+        if (s != toStr(engine)) continue;
+        if (!isAioEngineAvailable(engine)) {
+            throw RT_ERR("AioEngine is not available in this build: %s", s.c_str());
+        }
+        return engine;
+    }
+    throw RT_ERR("bad AioEngine name: %s", s.c_str());
+}
+
+/**
+ * Engine used by Aio instances by default.
+ * Set it at process initialization before creating Aio instances.
+ */
+inline AioEngine& defaultAioEngine()
+{
+    static AioEngine engine = AioEngine::LIBAIO;
+    return engine;
+}
+
 /**
  * Asynchronous IO wrapper.
  *
@@ -51,6 +118,11 @@ namespace aio {
  *
  * Do not use prepareFlush().
  * Currently aio flush is not supported by Linux kernel.
+ * (io_uring engine supports it.)
+ *
+ * With io_uring engine, prepared IOs are submitted with one system call
+ * in submit(), and IOs for the area registered by registerBuffer()
+ * use the pre-mapped buffer (READ_FIXED/WRITE_FIXED).
  *
  * Thrown EofError and LibcError in waitFor()/waitOne()/wait(),
  * you can use the Aio instance continuously,
@@ -72,6 +144,8 @@ private:
         uint key;
         IoType type;
         struct iocb iocb;
+        struct iovec iov;
+        std::vector<struct iovec> iovV; // for vectored IOs.
         off_t oft;
         size_t size;
         char *buf;
@@ -94,7 +168,14 @@ private:
 
     const int fd_;
     const size_t queueSize_;
+    const AioEngine engine_;
     io_context_t ctx_;
+#ifdef CYBOZU_AIO_IO_URING
+    std::unique_ptr<IoUring> uring_;
+#endif
+    /* Registered buffer area for io_uring. */
+    char *regBuf_;
+    size_t regSize_;
 
     /*
      * submitQ_ contains prepared but not submitted IOs.
@@ -130,11 +211,15 @@ public:
      *   You must open the file/device with O_DIRECT
      *   to work it really asynchronously.
      * @queueSize queue size for aio.
-     * @isMeasureTime true if you want to measure IO begein/end time.
+     * @engine backend.
      */
-    Aio(int fd, size_t queueSize)
+    Aio(int fd, size_t queueSize, AioEngine engine = defaultAioEngine())
         : fd_(fd)
         , queueSize_(std::min(MAX_AIO_REQ_NR(), queueSize))
+        , engine_(engine)
+        , ctx_()
+        , regBuf_(nullptr)
+        , regSize_(0)
         , submitQ_()
         , pendingIOs_()
         , completedIOs_()
@@ -145,6 +230,14 @@ public:
         , key_(1) {
         assert(fd_ >= 0);
         assert(queueSize > 0);
+        if (isUring()) {
+#ifdef CYBOZU_AIO_IO_URING
+            uring_.reset(new IoUring(queueSize_, engine_ == AioEngine::IO_URING_SQPOLL));
+#else
+            throw RT_ERR("Aio: io_uring is not available: %s", toStr(engine_));
+#endif
+            return;
+        }
         const int err = ::io_queue_init(queueSize_, &ctx_);
         if (err < 0) {
             throwLibcErrorWithNo("Aio: io_queue_init failed.", -err);
@@ -156,12 +249,41 @@ public:
     }
     void release() {
         if (isReleased_) return;
+        if (isUring()) {
+#ifdef CYBOZU_AIO_IO_URING
+            uring_.reset();
+#endif
+            isReleased_ = true;
+            return;
+        }
         int err = ::io_queue_release(ctx_);
         if (err < 0) {
             throwLibcErrorWithNo("Aio: io_queue_release failed.", -err);
         }
         isReleased_ = true;
     }
+    AioEngine engine() const { return engine_; }
+    /**
+     * Register a buffer area which IOs will use repeatedly like a ring buffer.
+     * This is effective only with io_uring engine
+     * and it silently does nothing if the kernel rejects the registration.
+     * The area must be alive until release() or destruction.
+     */
+    void registerBuffer(char *buf, size_t size) {
+#ifdef CYBOZU_AIO_IO_URING
+        if (!isUring()) return;
+        if (uring_->registerBuffer(buf, size)) {
+            regBuf_ = buf;
+            regSize_ = size;
+        } else {
+            regBuf_ = nullptr;
+            regSize_ = 0;
+        }
+#else
+        (void)buf;
+        (void)size;
+#endif
+    }
     /**
      * If this returns true, the queue is full.
      * Call submit() and waitXXX() before calling additional prepareXXX().
@@ -207,6 +329,24 @@ public:
         submitQ_.push_back(std::move(iop));
         return key;
     }
+    /**
+     * Prepare a vectored write IO.
+     * The buffers pointed by iovV must be kept until the IO completes.
+     */
+    uint prepareWritev(off_t oft, std::vector<struct iovec> &&iovV) {
+        if (isQueueFull()) return 0;
+        assert(!iovV.empty());
+        const uint key = getKey();
+        AioDataPtr iop(new AioData());
+        size_t size = 0;
+        for (const struct iovec &iov : iovV) size += iov.iov_len;
+        iop->init(key, IOTYPE_WRITE, oft, size, nullptr);
+        iop->iovV = std::move(iovV);
+        ::io_prep_pwritev(&iop->iocb, fd_, iop->iovV.data(), iop->iovV.size(), oft);
+        iop->iocb.data = reinterpret_cast<void *>(key);
+        submitQ_.push_back(std::move(iop));
+        return key;
+    }
     /**
      * Prepare a flush IO.
      *
@@ -232,6 +372,12 @@ public:
     void submit() {
         size_t nr = submitQ_.size();
         if (nr == 0) return;
+#ifdef CYBOZU_AIO_IO_URING
+        if (isUring()) {
+            submitUring();
+            return;
+        }
+#endif
 
         assert(iocbs_.size() >= nr);
         double beginTime = 0;
@@ -281,6 +427,8 @@ public:
         {
             Umap::iterator it = pendingIOs_.find(key);
             if (it != pendingIOs_.end()) {
+                /* Submitted IOs of io_uring are not cancelled. */
+                if (isUring()) return false;
                 AioDataPtr& iop = it->second;
                 if (::io_cancel(ctx_, &iop->iocb, &ioEvents_[0]) == 0) {
                     pendingIOs_.erase(it);
@@ -361,7 +509,7 @@ public:
             } else if (iop->err < 0) {
                 isLibcError = true;
             }
-            assert(iop->iocb.u.c.nbytes == static_cast<uint>(iop->err));
+            assert(iop->err <= 0 || iop->type == IOTYPE_FLUSH || iop->size == static_cast<uint>(iop->err));
             queue.push(iop->key);
             nr--;
         }
@@ -399,6 +547,87 @@ public:
         }
     }
 private:
+    bool isUring() const { return engine_ != AioEngine::LIBAIO; }
+#ifdef CYBOZU_AIO_IO_URING
+    void submitUring() {
+        double beginTime = 0;
+        if (isMeasureTime_) beginTime = util::getTime();
+        while (!submitQ_.empty()) {
+            AioDataPtr iop = std::move(submitQ_.front());
+            submitQ_.pop_front();
+            struct io_uring_sqe *sqe = uring_->getSqe();
+            if (sqe == nullptr) {
+                /* The SQ is full of IOs not consumed by the SQPOLL thread. */
+                uring_->submit();
+                uring_->waitSq();
+                submitQ_.push_front(std::move(iop));
+                continue;
+            }
+            prepareSqe(*sqe, *iop);
+            iop->beginTime = beginTime;
+            const uint key = iop->key;
+            assert(pendingIOs_.find(key) == pendingIOs_.end());
+            pendingIOs_.emplace(key, std::move(iop));
+        }
+        uring_->submit();
+    }
+    void prepareSqe(struct io_uring_sqe &sqe, AioData &io) {
+        sqe.fd = fd_;
+        sqe.user_data = io.key;
+        if (io.type == IOTYPE_FLUSH) {
+            sqe.opcode = IORING_OP_FSYNC;
+            sqe.fsync_flags = IORING_FSYNC_DATASYNC;
+            return;
+        }
+        sqe.off = io.oft;
+        const bool isRead = io.type == IOTYPE_READ;
+        if (!io.iovV.empty()) {
+            sqe.opcode = IORING_OP_WRITEV;
+            sqe.addr = reinterpret_cast<uintptr_t>(io.iovV.data());
+            sqe.len = io.iovV.size();
+        } else if (regBuf_ != nullptr && regBuf_ <= io.buf && io.buf + io.size <= regBuf_ + regSize_) {
+            sqe.opcode = isRead ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+            sqe.addr = reinterpret_cast<uintptr_t>(io.buf);
+            sqe.len = io.size;
+            sqe.buf_index = 0;
+        } else {
+            io.iov.iov_base = io.buf;
+            io.iov.iov_len = io.size;
+            sqe.opcode = isRead ? IORING_OP_READV : IORING_OP_WRITEV;
+            sqe.addr = reinterpret_cast<uintptr_t>(&io.iov);
+            sqe.len = 1;
+        }
+    }
+    size_t waitUring_(size_t minNr) {
+        size_t nr = reapUring();
+        while (nr < minNr) {
+            uring_->waitCqe(minNr - nr);
+            nr += reapUring();
+        }
+        return nr;
+    }
+    size_t reapUring() {
+        double endTime = 0;
+        if (isMeasureTime_) endTime = util::getTime();
+        size_t nr = 0;
+        uint64_t userData;
+        int32_t res;
+        while (uring_->peekCqe(userData, res)) {
+            const uint key = static_cast<uint>(userData);
+            Umap::iterator it = pendingIOs_.find(key);
+            assert(it != pendingIOs_.end());
+            AioDataPtr& iop = it->second;
+            assert(iop->key == key);
+            iop->endTime = endTime;
+            /* Flush returns 0 in success. Translate it not to be an EOF error. */
+            iop->err = (iop->type == IOTYPE_FLUSH && res == 0) ? 1 : res;
+            completedIOs_.emplace(key, std::move(iop));
+            pendingIOs_.erase(it);
+            nr++;
+        }
+        return nr;
+    }
+#endif
     /**
      * Never return 0.
      */
@@ -416,6 +645,9 @@ private:
      */
     size_t wait_(size_t minNr) {
         assert(minNr <= queueSize_);
+#ifdef CYBOZU_AIO_IO_URING
+        if (isUring()) return waitUring_(minNr);
+#endif
         const int nr = ::io_getevents(ctx_, minNr, queueSize_, &ioEvents_[0], NULL);
         if (nr < 0) {
             throwLibcErrorWithNo("Aio: io_getevents failed.", -nr);
@@ -487,7 +719,7 @@ private:
         if (io.err < 0) {
             throwLibcErrorWithNo("Aio: io failed.", -io.err);
         }
-        assert(io.iocb.u.c.nbytes == static_cast<uint>(io.err));
+        assert(io.type == IOTYPE_FLUSH || io.size == static_cast<uint>(io.err));
     }
 };
 
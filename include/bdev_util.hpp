@@ -6,7 +6,10 @@
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <sys/statvfs.h>
+#include <sys/sysmacros.h>
 #include <linux/fs.h>
+#include <linux/falloc.h>
+#include <fstream>
 #include "util.hpp"
 
 namespace cybozu {
@@ -98,6 +101,7 @@ inline bool isDiscardSupported(int fd)
 }
 
 /**
+ * A hole will be punched for a regular file.
  * @fd file descriptor.
  * @offsetLb begin offset [logical block].
  * @sizeLb size [logical block].
@@ -105,12 +109,38 @@ inline bool isDiscardSupported(int fd)
 inline void issueDiscard(int fd, uint64_t offsetLb, uint64_t sizeLb)
 {
     assert(fd > 0);
+    if (!isBlockDevice(fd)) {
+        if (::fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offsetLb << 9, sizeLb << 9) < 0) {
+            throwLibcError("fallocate(FALLOC_FL_PUNCH_HOLE) failed.");
+        }
+        return;
+    }
     uint64_t range[2] = {offsetLb << 9, sizeLb << 9};
     if (::ioctl(fd, BLKDISCARD, &range) < 0) {
         throwLibcError("ioctl(BLKDISCARD) failed.");
     }
 }
 
+/**
+ * Non-destructive version of isDiscardSupported() using sysfs.
+ * Regular files are discarded by punching holes. See issueDiscard().
+ * RETURN:
+ *   true if the block device accepts discard requests, or fd is a regular file.
+ */
+inline bool isDiscardEnabled(int fd)
+{
+    struct stat s;
+    fstat(fd, s);
+    if ((s.st_mode & S_IFMT) == S_IFREG) return true;
+    if ((s.st_mode & S_IFMT) != S_IFBLK) return false;
+    const std::string path = formatString(
+        "/sys/dev/block/%u:%u/queue/discard_max_bytes", major(s.st_rdev), minor(s.st_rdev));
+    std::ifstream ifs(path);
+    uint64_t maxBytes = 0;
+    ifs >> maxBytes;
+    return maxBytes > 0;
+}
+
 /**
  * RETURN:
  *   available disk space [byte].
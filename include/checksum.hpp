@@ -9,19 +9,40 @@
 #include <cstring>
 #include <cinttypes>
 #include <cassert>
+#include <initializer_list>
+
+#if !defined(DISABLE_SIMD_CHECKSUM) && defined(__GNUC__) && defined(__x86_64__)
+#define CYBOZU_CHECKSUM_SIMD
+#include <immintrin.h>
+#endif
 
 namespace cybozu {
 namespace util {
 
 /**
- * Calculate checksum partially.
- * You must call this several time and finally call checksumFinish() to get csum.
- *
- * @data pointer to data.
- * @size data size.
- * @csum result of previous call, or salt.
+ * Checksum implementations.
+ * They produce the same results.
  */
-inline uint32_t checksumPartial(const void *data, size_t size, uint32_t csum)
+enum class ChecksumImpl
+{
+    SCALAR, SSE2, AVX2, AVX512,
+};
+
+inline const char *toStr(ChecksumImpl impl)
+{
+    switch (impl) {
+    case ChecksumImpl::SCALAR: return "scalar";
+    case ChecksumImpl::SSE2: return "sse2";
+    case ChecksumImpl::AVX2: return "avx2";
+    case ChecksumImpl::AVX512: return "avx512";
+    }
+    return "unknown";
+}
+
+/**
+ * Calculate checksum partially without SIMD instructions.
+ */
+inline uint32_t checksumPartialScalar(const void *data, size_t size, uint32_t csum)
 {
     const char *p = (const char *)data;
     uint32_t v;
@@ -40,6 +61,121 @@ inline uint32_t checksumPartial(const void *data, size_t size, uint32_t csum)
     return csum;
 }
 
+#ifdef CYBOZU_CHECKSUM_SIMD
+namespace checksum_local {
+
+/**
+ * Add 32-bit words in vector registers of Vec type with four accumulators.
+ * The additions are commutative modulo 2^32 so the result is the same as the scalar one.
+ * The remaining bytes less than a vector are added by the scalar version.
+ */
+#define CYBOZU_CHECKSUM_KERNEL(Vec, zero, load, add) \
+    const char *p = (const char *)data; \
+    Vec a0 = zero(), a1 = zero(), a2 = zero(), a3 = zero(); \
+    while (sizeof(Vec) * 4 <= size) { \
+        a0 = add(a0, load((const Vec *)p)); \
+        a1 = add(a1, load((const Vec *)(p + sizeof(Vec)))); \
+        a2 = add(a2, load((const Vec *)(p + sizeof(Vec) * 2))); \
+        a3 = add(a3, load((const Vec *)(p + sizeof(Vec) * 3))); \
+        p += sizeof(Vec) * 4; \
+        size -= sizeof(Vec) * 4; \
+    } \
+    while (sizeof(Vec) <= size) { \
+        a0 = add(a0, load((const Vec *)p)); \
+        p += sizeof(Vec); \
+        size -= sizeof(Vec); \
+    } \
+    a0 = add(add(a0, a1), add(a2, a3)); \
+    uint32_t w[sizeof(Vec) / sizeof(uint32_t)]; \
+    ::memcpy(w, &a0, sizeof(w)); \
+    for (uint32_t v : w) csum += v; \
+    return checksumPartialScalar(p, size, csum);
+
+__attribute__((target("sse2")))
+inline uint32_t checksumPartialSse2(const void *data, size_t size, uint32_t csum)
+{
+    CYBOZU_CHECKSUM_KERNEL(__m128i, _mm_setzero_si128, _mm_loadu_si128, _mm_add_epi32)
+}
+
+__attribute__((target("avx2")))
+inline uint32_t checksumPartialAvx2(const void *data, size_t size, uint32_t csum)
+{
+    CYBOZU_CHECKSUM_KERNEL(__m256i, _mm256_setzero_si256, _mm256_loadu_si256, _mm256_add_epi32)
+}
+
+__attribute__((target("avx512f")))
+inline uint32_t checksumPartialAvx512(const void *data, size_t size, uint32_t csum)
+{
+    CYBOZU_CHECKSUM_KERNEL(__m512i, _mm512_setzero_si512, _mm512_loadu_si512, _mm512_add_epi32)
+}
+
+#undef CYBOZU_CHECKSUM_KERNEL
+
+} // namespace checksum_local
+#endif
+
+inline bool isChecksumImplAvailable(ChecksumImpl impl)
+{
+#ifdef CYBOZU_CHECKSUM_SIMD
+    __builtin_cpu_init();
+    switch (impl) {
+    case ChecksumImpl::SCALAR: return true;
+    case ChecksumImpl::SSE2: return __builtin_cpu_supports("sse2");
+    case ChecksumImpl::AVX2: return __builtin_cpu_supports("avx2");
+    case ChecksumImpl::AVX512: return __builtin_cpu_supports("avx512f");
+    }
+    return false;
+#else
+    return impl == ChecksumImpl::SCALAR;
+#endif
+}
+
+using ChecksumPartialFunc = uint32_t (*)(const void *, size_t, uint32_t);
+
+/**
+ * The implementation must be available.
+ */
+inline ChecksumPartialFunc getChecksumPartialFunc(ChecksumImpl impl)
+{
+    assert(isChecksumImplAvailable(impl));
+    switch (impl) {
+#ifdef CYBOZU_CHECKSUM_SIMD
+    case ChecksumImpl::SSE2: return checksum_local::checksumPartialSse2;
+    case ChecksumImpl::AVX2: return checksum_local::checksumPartialAvx2;
+    case ChecksumImpl::AVX512: return checksum_local::checksumPartialAvx512;
+#endif
+    default: return checksumPartialScalar;
+    }
+}
+
+/**
+ * The fastest available implementation decided by CPUID.
+ */
+inline ChecksumImpl getBestChecksumImpl()
+{
+    static const ChecksumImpl best = []() {
+        for (ChecksumImpl impl : {ChecksumImpl::AVX512, ChecksumImpl::AVX2, ChecksumImpl::SSE2}) {
+            if (isChecksumImplAvailable(impl)) return impl;
+        }
+        return ChecksumImpl::SCALAR;
+    }();
+    return best;
+}
+
+/**
+ * Calculate checksum partially.
+ * You must call this several time and finally call checksumFinish() to get csum.
+ *
+ * @data pointer to data.
+ * @size data size.
+ * @csum result of previous call, or salt.
+ */
+inline uint32_t checksumPartial(const void *data, size_t size, uint32_t csum)
+{
+    static const ChecksumPartialFunc func = getChecksumPartialFunc(getBestChecksumImpl());
+    return func(data, size, csum);
+}
+
 /**
  * Finish checksum calculation.
  */
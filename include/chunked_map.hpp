@@ -0,0 +1,306 @@
+#pragma once
+/**
+ * @file
+ * @brief Sorted map stored in chunked arrays.
+ */
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <iterator>
+#include <type_traits>
+#include <cassert>
+#include <cstddef>
+
+namespace cybozu {
+
+/**
+ * Sorted map with unique keys like std::map,
+ * but items are stored in sorted arrays (chunks) of at most ChunkSize items.
+ * A search is a binary search on the first keys of chunks and then in a chunk,
+ * so it touches a few cache lines instead of chasing tree nodes.
+ * Each chunk is allocated once with ChunkSize capacity.
+ *
+ * Differences from std::map:
+ *   - Any insertion or erasure invalidates all the iterators.
+ *     Use the returned iterator to continue.
+ *   - value_type is std::pair<Key, T>. Do not change keys directly; use rekey().
+ */
+template <typename Key, typename T, size_t ChunkSize = 64>
+class ChunkedMap
+{
+    static_assert(ChunkSize >= 4, "ChunkSize too small");
+public:
+    using key_type = Key;
+    using mapped_type = T;
+    using value_type = std::pair<Key, T>;
+private:
+    using Chunk = std::vector<value_type>;
+    std::vector<Chunk> chunkV_; /* each chunk is not empty. */
+    std::vector<Key> keyV_; /* keyV_[i] is the first key of chunkV_[i]. */
+    size_t size_;
+
+    template <bool IsConst>
+    class IteratorT
+    {
+        friend class ChunkedMap;
+        using Map = typename std::conditional<IsConst, const ChunkedMap, ChunkedMap>::type;
+        Map *map_;
+        size_t ci_; /* chunk index. */
+        size_t pi_; /* position in the chunk. */
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = ChunkedMap::value_type;
+        using difference_type = std::ptrdiff_t;
+        using pointer = typename std::conditional<IsConst, const value_type *, value_type *>::type;
+        using reference = typename std::conditional<IsConst, const value_type &, value_type &>::type;
+
+        IteratorT() : map_(nullptr), ci_(0), pi_(0) {}
+        IteratorT(Map *map, size_t ci, size_t pi) : map_(map), ci_(ci), pi_(pi) {}
+        operator IteratorT<true>() const { return IteratorT<true>(map_, ci_, pi_); }
+        reference operator*() const { return map_->chunkV_[ci_][pi_]; }
+        pointer operator->() const { return &map_->chunkV_[ci_][pi_]; }
+        IteratorT& operator++() {
+            pi_++;
+            if (pi_ == map_->chunkV_[ci_].size()) {
+                ci_++;
+                pi_ = 0;
+            }
+            return *this;
+        }
+        IteratorT operator++(int) {
+            IteratorT ret = *this;
+            ++*this;
+            return ret;
+        }
+        IteratorT& operator--() {
+            if (pi_ == 0) {
+                ci_--;
+                pi_ = map_->chunkV_[ci_].size() - 1;
+            } else {
+                pi_--;
+            }
+            return *this;
+        }
+        IteratorT operator--(int) {
+            IteratorT ret = *this;
+            --*this;
+            return ret;
+        }
+        bool operator==(const IteratorT &rhs) const { return ci_ == rhs.ci_ && pi_ == rhs.pi_; }
+        bool operator!=(const IteratorT &rhs) const { return !(*this == rhs); }
+    };
+public:
+    using iterator = IteratorT<false>;
+    using const_iterator = IteratorT<true>;
+
+    ChunkedMap() : chunkV_(), keyV_(), size_(0) {}
+
+    iterator begin() { return iterator(this, 0, 0); }
+    iterator end() { return iterator(this, chunkV_.size(), 0); }
+    const_iterator begin() const { return cbegin(); }
+    const_iterator end() const { return cend(); }
+    const_iterator cbegin() const { return const_iterator(this, 0, 0); }
+    const_iterator cend() const { return const_iterator(this, chunkV_.size(), 0); }
+
+    bool empty() const { return size_ == 0; }
+    size_t size() const { return size_; }
+    void clear() {
+        chunkV_.clear();
+        keyV_.clear();
+        size_ = 0;
+    }
+
+    iterator lower_bound(const Key &key) {
+        size_t ci, pi;
+        lowerBound(key, ci, pi);
+        return iterator(this, ci, pi);
+    }
+    const_iterator lower_bound(const Key &key) const {
+        size_t ci, pi;
+        lowerBound(key, ci, pi);
+        return const_iterator(this, ci, pi);
+    }
+    iterator find(const Key &key) {
+        iterator it = lower_bound(key);
+        if (it != end() && it->first == key) return it;
+        return end();
+    }
+
+    /**
+     * Insert an item if the key does not exist.
+     */
+    std::pair<iterator, bool> emplace(const Key &key, T &&t) {
+        if (chunkV_.empty()) {
+            insertChunk(0);
+            chunkV_[0].emplace_back(key, std::move(t));
+            keyV_[0] = key;
+            size_++;
+            return {begin(), true};
+        }
+        size_t ci = findChunk(key);
+        Chunk *chunk = &chunkV_[ci];
+        size_t pi = lowerBoundInChunk(*chunk, key);
+        if (pi < chunk->size() && (*chunk)[pi].first == key) {
+            return {iterator(this, ci, pi), false};
+        }
+        if (chunk->size() == ChunkSize) {
+            splitChunk(ci);
+            if (pi > ChunkSize / 2) {
+                ci++;
+                pi -= ChunkSize / 2;
+            }
+            chunk = &chunkV_[ci];
+        }
+        chunk->emplace(chunk->begin() + pi, key, std::move(t));
+        if (pi == 0) keyV_[ci] = key;
+        size_++;
+        return {iterator(this, ci, pi), true};
+    }
+    std::pair<iterator, bool> emplace(const Key &key, const T &t) {
+        return emplace(key, T(t));
+    }
+
+    /**
+     * RETURN:
+     *   iterator of the next item.
+     */
+    iterator erase(iterator it) {
+        assert(it != end());
+        Chunk &chunk = chunkV_[it.ci_];
+        chunk.erase(chunk.begin() + it.pi_);
+        size_--;
+        return fixChunk(it.ci_, it.pi_);
+    }
+    iterator erase(iterator first, iterator last) {
+        if (first == last) return last;
+        if (first.ci_ == last.ci_) {
+            Chunk &chunk = chunkV_[first.ci_];
+            chunk.erase(chunk.begin() + first.pi_, chunk.begin() + last.pi_);
+            size_ -= last.pi_ - first.pi_;
+            return fixChunk(first.ci_, first.pi_);
+        }
+        /* Erase the head of the last chunk, whole middle chunks, then the tail of the first chunk. */
+        if (last.ci_ < chunkV_.size() && last.pi_ > 0) {
+            Chunk &chunk = chunkV_[last.ci_];
+            chunk.erase(chunk.begin(), chunk.begin() + last.pi_);
+            size_ -= last.pi_;
+            keyV_[last.ci_] = chunk.front().first;
+        }
+        for (size_t ci = first.ci_ + 1; ci < last.ci_; ci++) {
+            size_ -= chunkV_[ci].size();
+        }
+        chunkV_.erase(chunkV_.begin() + first.ci_ + 1, chunkV_.begin() + last.ci_);
+        keyV_.erase(keyV_.begin() + first.ci_ + 1, keyV_.begin() + last.ci_);
+        Chunk &chunk = chunkV_[first.ci_];
+        size_ -= chunk.size() - first.pi_;
+        chunk.erase(chunk.begin() + first.pi_, chunk.end());
+        return fixChunk(first.ci_, first.pi_);
+    }
+    /**
+     * Change the key of an item.
+     * The order of items must not change.
+     */
+    void rekey(iterator it, const Key &key) {
+#ifndef NDEBUG
+        if (it != begin()) {
+            iterator prev = it;
+            --prev;
+            assert(prev->first < key);
+        }
+        iterator next = it;
+        ++next;
+        assert(next == end() || key < next->first);
+#endif
+        it->first = key;
+        if (it.pi_ == 0) keyV_[it.ci_] = key;
+    }
+
+    /**
+     * For debug and test.
+     */
+    size_t nrChunks() const { return chunkV_.size(); }
+    bool isValid() const {
+        size_t nr = 0;
+        for (size_t ci = 0; ci < chunkV_.size(); ci++) {
+            const Chunk &chunk = chunkV_[ci];
+            if (chunk.empty() || chunk.size() > ChunkSize) return false;
+            if (keyV_[ci] != chunk.front().first) return false;
+            if (ci > 0 && !(chunkV_[ci - 1].back().first < chunk.front().first)) return false;
+            for (size_t pi = 1; pi < chunk.size(); pi++) {
+                if (!(chunk[pi - 1].first < chunk[pi].first)) return false;
+            }
+            nr += chunk.size();
+        }
+        return nr == size_;
+    }
+private:
+    /**
+     * The chunk that may contain the key.
+     * chunkV_ must not be empty.
+     */
+    size_t findChunk(const Key &key) const {
+        assert(!chunkV_.empty());
+        const size_t ci = std::upper_bound(keyV_.begin(), keyV_.end(), key) - keyV_.begin();
+        return ci == 0 ? 0 : ci - 1;
+    }
+    static size_t lowerBoundInChunk(const Chunk &chunk, const Key &key) {
+        return std::lower_bound(
+            chunk.begin(), chunk.end(), key,
+            [](const value_type &v, const Key &k) { return v.first < k; }) - chunk.begin();
+    }
+    void lowerBound(const Key &key, size_t &ci, size_t &pi) const {
+        if (chunkV_.empty()) {
+            ci = 0;
+            pi = 0;
+            return;
+        }
+        ci = findChunk(key);
+        pi = lowerBoundInChunk(chunkV_[ci], key);
+        if (pi == chunkV_[ci].size()) {
+            ci++;
+            pi = 0;
+        }
+    }
+    void insertChunk(size_t ci) {
+        chunkV_.emplace(chunkV_.begin() + ci);
+        chunkV_[ci].reserve(ChunkSize);
+        keyV_.emplace(keyV_.begin() + ci);
+    }
+    /**
+     * Move the latter half of a full chunk to a new chunk.
+     */
+    void splitChunk(size_t ci) {
+        insertChunk(ci + 1);
+        Chunk &src = chunkV_[ci];
+        Chunk &dst = chunkV_[ci + 1];
+        std::move(src.begin() + ChunkSize / 2, src.end(), std::back_inserter(dst));
+        src.resize(ChunkSize / 2);
+        keyV_[ci + 1] = dst.front().first;
+    }
+    /**
+     * Fix a chunk after erasure.
+     * An empty chunk is removed, and a small chunk is merged with the next one.
+     * RETURN:
+     *   iterator of the item that was at (ci, pi) after the erasure.
+     */
+    iterator fixChunk(size_t ci, size_t pi) {
+        Chunk &chunk = chunkV_[ci];
+        if (chunk.empty()) {
+            chunkV_.erase(chunkV_.begin() + ci);
+            keyV_.erase(keyV_.begin() + ci);
+            return iterator(this, ci, 0);
+        }
+        keyV_[ci] = chunk.front().first;
+        if (chunk.size() < ChunkSize / 4 && ci + 1 < chunkV_.size()
+            && chunk.size() + chunkV_[ci + 1].size() <= ChunkSize / 2) {
+            Chunk &next = chunkV_[ci + 1];
+            std::move(next.begin(), next.end(), std::back_inserter(chunk));
+            chunkV_.erase(chunkV_.begin() + ci + 1);
+            keyV_.erase(keyV_.begin() + ci + 1);
+        }
+        if (pi == chunk.size()) return iterator(this, ci + 1, 0);
+        return iterator(this, ci, pi);
+    }
+};
+
+} // namespace cybozu
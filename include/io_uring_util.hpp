@@ -0,0 +1,246 @@
+#pragma once
+/**
+ * @file
+ * @brief Minimal io_uring wrapper without liburing.
+ */
+#include <cstring>
+#include <cerrno>
+#include <cassert>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "util.hpp"
+
+namespace cybozu {
+namespace aio {
+
+/**
+ * Submission and completion rings of an io_uring instance.
+ *
+ * (1) call getSqe() and fill it once or more.
+ * (2) call submit() to pass all the filled SQEs to the kernel at once.
+ * (3) call peekCqe() to get completions, or waitCqe() to wait for them.
+ *
+ * The caller must keep the number of in-flight IOs <= entries
+ * so that the completion ring never overflows.
+ * This is not thread-safe class.
+ */
+class IoUring
+{
+private:
+    int fd_;
+    bool isSqPoll_;
+
+    void *sqRing_;
+    size_t sqRingSize_;
+    void *cqRing_;
+    size_t cqRingSize_;
+    struct io_uring_sqe *sqes_;
+    size_t sqesSize_;
+
+    unsigned *sqHead_;
+    unsigned *sqTail_;
+    unsigned sqMask_;
+    unsigned *sqFlags_;
+    unsigned *sqArray_;
+    unsigned sqEntries_;
+    unsigned sqTailLocal_; /* tail of SQEs got but not submitted. */
+
+    unsigned *cqHead_;
+    unsigned *cqTail_;
+    unsigned cqMask_;
+    struct io_uring_cqe *cqes_;
+
+    bool hasBuffers_;
+    bool isSqWaitSupported_;
+
+public:
+    /**
+     * @entries number of SQ entries. It will be rounded up to a power of 2 by the kernel.
+     * @isSqPoll true to use a kernel thread polling the submission ring.
+     *   It saves io_uring_enter() calls for submission.
+     */
+    IoUring(unsigned entries, bool isSqPoll = false)
+        : fd_(-1), isSqPoll_(isSqPoll)
+        , sqRing_(MAP_FAILED), sqRingSize_(0)
+        , cqRing_(MAP_FAILED), cqRingSize_(0)
+        , sqes_(static_cast<struct io_uring_sqe *>(MAP_FAILED)), sqesSize_(0)
+        , sqTailLocal_(0), hasBuffers_(false), isSqWaitSupported_(true) {
+        struct io_uring_params p;
+        ::memset(&p, 0, sizeof(p));
+        if (isSqPoll_) {
+            p.flags |= IORING_SETUP_SQPOLL;
+            p.sq_thread_idle = 1000; /* msec */
+        }
+        fd_ = ::syscall(__NR_io_uring_setup, entries, &p);
+        if (fd_ < 0) {
+            throwLibcError("IoUring: io_uring_setup failed.");
+        }
+        try {
+            mapRings(p);
+        } catch (...) {
+            unmapRings();
+            ::close(fd_);
+            throw;
+        }
+    }
+    ~IoUring() noexcept {
+        unmapRings();
+        if (fd_ >= 0) ::close(fd_);
+    }
+    IoUring(const IoUring &) = delete;
+    IoUring& operator=(const IoUring &) = delete;
+
+    unsigned sqEntries() const { return sqEntries_; }
+    /**
+     * Register a memory area to use IORING_OP_READ_FIXED/WRITE_FIXED with buf_index 0.
+     * Previously registered area will be unregistered.
+     *
+     * RETURN:
+     *   false if the kernel rejects it (e.g. RLIMIT_MEMLOCK).
+     */
+    bool registerBuffer(void *buf, size_t size) {
+        unregisterBuffer();
+        struct iovec iov;
+        iov.iov_base = buf;
+        iov.iov_len = size;
+        if (::syscall(__NR_io_uring_register, fd_, IORING_REGISTER_BUFFERS, &iov, 1) < 0) {
+            return false;
+        }
+        hasBuffers_ = true;
+        return true;
+    }
+    void unregisterBuffer() {
+        if (!hasBuffers_) return;
+        if (::syscall(__NR_io_uring_register, fd_, IORING_UNREGISTER_BUFFERS, nullptr, 0) < 0) {
+            throwLibcError("IoUring: unregister buffers failed.");
+        }
+        hasBuffers_ = false;
+    }
+    /**
+     * RETURN:
+     *   zero-cleared SQE, or nullptr if the submission ring is full.
+     */
+    struct io_uring_sqe *getSqe() {
+        const unsigned head = __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE);
+        if (sqTailLocal_ - head >= sqEntries_) return nullptr;
+        struct io_uring_sqe *sqe = &sqes_[sqTailLocal_ & sqMask_];
+        sqArray_[sqTailLocal_ & sqMask_] = sqTailLocal_ & sqMask_;
+        sqTailLocal_++;
+        ::memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+    /**
+     * Submit all the SQEs got by getSqe() with one system call at most.
+     * With SQPOLL, the system call is required only to wake the kernel thread up.
+     */
+    void submit() {
+        const unsigned tail = *sqTail_;
+        const unsigned nr = sqTailLocal_ - tail;
+        if (nr == 0) return;
+        __atomic_store_n(sqTail_, sqTailLocal_, __ATOMIC_RELEASE);
+        if (isSqPoll_) {
+            if (__atomic_load_n(sqFlags_, __ATOMIC_ACQUIRE) & IORING_SQ_NEED_WAKEUP) {
+                enter(0, 0, IORING_ENTER_SQ_WAKEUP);
+            }
+            return;
+        }
+        unsigned done = 0;
+        while (done < nr) {
+            const unsigned n = enter(nr - done, 0, 0);
+            if (n == 0) {
+                /* The kernel does not consume the SQEs, e.g. it drops invalid ones. */
+                throw RT_ERR("IoUring: io_uring_enter submitted nothing: %u/%u", done, nr);
+            }
+            done += n;
+        }
+    }
+    /**
+     * Wait until the submission ring has a free entry after submit().
+     * Only with SQPOLL the ring may be full after submit(),
+     * since the kernel thread consumes the SQEs asynchronously.
+     */
+    void waitSq() {
+        if (sqTailLocal_ - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE) < sqEntries_) return;
+#ifdef IORING_ENTER_SQ_WAIT
+        if (isSqWaitSupported_) {
+            const int ret = ::syscall(__NR_io_uring_enter, fd_, 0, 0, IORING_ENTER_SQ_WAIT, nullptr, 0);
+            if (ret >= 0 || errno == EINTR) return;
+            if (errno != EINVAL) throwLibcError("IoUring: io_uring_enter(SQ_WAIT) failed.");
+            isSqWaitSupported_ = false; /* Linux < 5.13. */
+        }
+#endif
+        ::usleep(100);
+    }
+    /**
+     * Pop a completion if exists.
+     */
+    bool peekCqe(uint64_t &userData, int32_t &res) {
+        const unsigned head = *cqHead_;
+        if (head == __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE)) return false;
+        const struct io_uring_cqe &cqe = cqes_[head & cqMask_];
+        userData = cqe.user_data;
+        res = cqe.res;
+        __atomic_store_n(cqHead_, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+    /**
+     * Wait for at least minNr completions in the completion ring.
+     */
+    void waitCqe(unsigned minNr) {
+        enter(0, minNr, IORING_ENTER_GETEVENTS);
+    }
+private:
+    unsigned enter(unsigned toSubmit, unsigned minComplete, unsigned flags) {
+        for (;;) {
+            const int ret = ::syscall(__NR_io_uring_enter, fd_, toSubmit, minComplete, flags, nullptr, 0);
+            if (ret >= 0) return ret;
+            if (errno == EINTR) continue;
+            throwLibcError("IoUring: io_uring_enter failed.");
+        }
+    }
+    void mapRings(const struct io_uring_params &p) {
+        sqRingSize_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cqRingSize_ = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        sqRing_ = ::mmap(nullptr, sqRingSize_, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+        if (sqRing_ == MAP_FAILED) throwLibcError("IoUring: mmap sq ring failed.");
+        cqRing_ = ::mmap(nullptr, cqRingSize_, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+        if (cqRing_ == MAP_FAILED) throwLibcError("IoUring: mmap cq ring failed.");
+        sqesSize_ = p.sq_entries * sizeof(struct io_uring_sqe);
+        sqes_ = static_cast<struct io_uring_sqe *>(
+            ::mmap(nullptr, sqesSize_, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES));
+        if (sqes_ == MAP_FAILED) throwLibcError("IoUring: mmap sqes failed.");
+
+        char *sq = static_cast<char *>(sqRing_);
+        sqHead_ = reinterpret_cast<unsigned *>(sq + p.sq_off.head);
+        sqTail_ = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+        sqMask_ = *reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+        sqEntries_ = *reinterpret_cast<unsigned *>(sq + p.sq_off.ring_entries);
+        sqFlags_ = reinterpret_cast<unsigned *>(sq + p.sq_off.flags);
+        sqArray_ = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+        sqTailLocal_ = *sqTail_;
+
+        char *cq = static_cast<char *>(cqRing_);
+        cqHead_ = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+        cqTail_ = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+        cqMask_ = *reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<struct io_uring_cqe *>(cq + p.cq_off.cqes);
+    }
+    void unmapRings() noexcept {
+        if (sqes_ != MAP_FAILED) ::munmap(sqes_, sqesSize_);
+        if (cqRing_ != MAP_FAILED) ::munmap(cqRing_, cqRingSize_);
+        if (sqRing_ != MAP_FAILED) ::munmap(sqRing_, sqRingSize_);
+        sqes_ = static_cast<struct io_uring_sqe *>(MAP_FAILED);
+        cqRing_ = MAP_FAILED;
+        sqRing_ = MAP_FAILED;
+    }
+};
+
+} // namespace aio
+} // namespace cybozu
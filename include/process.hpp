@@ -10,6 +10,7 @@
 #include <vector>
 #include <stdexcept>
 #include <sstream>
+#include <algorithm>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -121,9 +122,12 @@ inline void streamToStr(int fdr, std::string &outStr, std::exception_ptr& ep) no
 }
 
 /**
- * Call another command and get stdout as a result.
+ * Fork and execute a command with its stdout and stderr bound to the pipes.
+ * The write ends of the pipes will be closed in the parent process.
+ * RETURN:
+ *   child process id.
  */
-inline std::string call(const std::string& cmd, const std::vector<std::string> &args)
+inline pid_t spawn(const std::string& cmd, const std::vector<std::string> &args, Pipe &pipe0, Pipe &pipe1)
 {
     cybozu::FileStat stat = cybozu::FilePath(cmd).stat();
     if (!stat.exists()) {
@@ -133,7 +137,6 @@ inline std::string call(const std::string& cmd, const std::vector<std::string> &
         throw std::runtime_error("command not executable:" + cmd);
     }
 
-    Pipe pipe0, pipe1;
     pid_t cpid;
     cpid = ::fork();
     if (cpid < 0) {
@@ -155,22 +158,20 @@ inline std::string call(const std::string& cmd, const std::vector<std::string> &
         ::execv(cmd.c_str(), &argv[0]);
     }
     /* parent process. */
-
-    /* Read the stdout/stderr of the child process. */
     pipe0.closeW();
     pipe1.closeW();
-    std::string stdOutStr, stdErrStr;
-    std::exception_ptr epOut, epErr;
-    std::thread th0(streamToStr, pipe0.fdR(), std::ref(stdOutStr), std::ref(epOut));
-    std::thread th1(streamToStr, pipe1.fdR(), std::ref(stdErrStr), std::ref(epErr));
-    th0.join();
-    th1.join();
+    return cpid;
+}
 
-    /* wait for done */
+/**
+ * Wait for the child process and throw an error if it has returned non-zero.
+ */
+inline void waitChild(pid_t cpid, const std::string& cmd, const std::vector<std::string> &args,
+                      const std::string &stdErrStr)
+{
     int status;
     ::waitpid(cpid, &status, 0);
 
-    /* handle errors */
     if (status != 0) {
         std::string msg("child process has returned non-zero:");
         msg += cybozu::util::formatString("%d\n", status);
@@ -180,12 +181,81 @@ inline std::string call(const std::string& cmd, const std::vector<std::string> &
         msg += "\nstderr:" + stdErrStr;
         throw std::runtime_error(msg);
     }
+}
+
+/**
+ * Call another command and get stdout as a result.
+ */
+inline std::string call(const std::string& cmd, const std::vector<std::string> &args)
+{
+    Pipe pipe0, pipe1;
+    const pid_t cpid = spawn(cmd, args, pipe0, pipe1);
+
+    /* Read the stdout/stderr of the child process. */
+    std::string stdOutStr, stdErrStr;
+    std::exception_ptr epOut, epErr;
+    std::thread th0(streamToStr, pipe0.fdR(), std::ref(stdOutStr), std::ref(epOut));
+    std::thread th1(streamToStr, pipe1.fdR(), std::ref(stdErrStr), std::ref(epErr));
+    th0.join();
+    th1.join();
+
+    waitChild(cpid, cmd, args, stdErrStr);
     if (epOut) std::rethrow_exception(epOut);
     if (epErr) std::rethrow_exception(epErr);
 
     return stdOutStr;
 }
 
+/**
+ * Call another command and pass each line of its stdout to lineFunc
+ * without keeping the whole stdout in memory.
+ * @lineFunc void(const std::string &line). The line does not contain the newline.
+ *   If it throws, the stdout will be closed and the exception will be rethrown
+ *   after the child process ends.
+ */
+template <typename LineFunc>
+void callForEachLine(const std::string& cmd, const std::vector<std::string> &args, LineFunc &&lineFunc)
+{
+    Pipe pipe0, pipe1;
+    const pid_t cpid = spawn(cmd, args, pipe0, pipe1);
+
+    std::string stdErrStr;
+    std::exception_ptr epOut, epErr;
+    std::thread th1(streamToStr, pipe1.fdR(), std::ref(stdErrStr), std::ref(epErr));
+    try {
+        cybozu::util::File reader(pipe0.fdR());
+        std::string line;
+        char buf[4096];
+        size_t r;
+        while ((r = reader.readsome(buf, sizeof(buf))) > 0) {
+            const char *p = buf;
+            const char *end = buf + r;
+            for (;;) {
+                const char *q = std::find(p, end, '\n');
+                line.append(p, q);
+                if (q == end) break;
+                lineFunc(line);
+                line.clear();
+                p = q + 1;
+            }
+        }
+        if (!line.empty()) lineFunc(line);
+    } catch (...) {
+        epOut = std::current_exception();
+        /* The child process will get EPIPE. */
+        try { pipe0.closeR(); } catch (...) {}
+    }
+    th1.join();
+
+    try {
+        waitChild(cpid, cmd, args, stdErrStr);
+    } catch (...) {
+        if (!epOut) throw;
+    }
+    if (epOut) std::rethrow_exception(epOut);
+    if (epErr) std::rethrow_exception(epErr);
+}
+
 inline std::string call(const std::vector<std::string> &args)
 {
     if (args.empty()) throw std::runtime_error("no executable specified.");
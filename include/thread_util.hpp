@@ -1067,12 +1067,16 @@ public:
         // You called sync() before, this will not effect anything.
         fail();
     }
-    void start(size_t concurrency = 0) {
+    /**
+     * @concurrency number of worker threads. 0 means the number of CPUs.
+     * @queueSize size of input/output queues. 0 means concurrency * 2.
+     */
+    void start(size_t concurrency = 0, size_t queueSize = 0) {
         std::lock_guard<std::mutex> lock(pushMu_);
         if (concurrency == 0) {
             concurrency = std::thread::hardware_concurrency();
         }
-        const size_t qs = concurrency * 2;
+        const size_t qs = queueSize == 0 ? concurrency * 2 : queueSize;
         inQ_.resize(qs);
         outQ_.resize(qs);
         for (size_t i = 0; i < concurrency; i++) {
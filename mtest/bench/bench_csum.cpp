@@ -1,11 +1,23 @@
 #include "checksum.hpp"
+#include "sync_hash.hpp"
 #include "random.hpp"
 #include "constant.hpp"
 #include "walb_types.hpp"
 #include <cstdio>
+#include <cstdlib>
 #include <cinttypes>
+#include <algorithm>
+#include <vector>
 
 using namespace walb;
+using namespace cybozu::util;
+
+/**
+ * Compare checksum implementations and hash algorithms for sync.
+ *
+ * Usage: bench_csum [NR_LOOP]
+ * It prints median cycles and bytes per cycle for each data size and implementation/algorithm.
+ */
 
 uint64_t rdtscp()
 {
@@ -14,18 +26,61 @@ uint64_t rdtscp()
     return uint64_t(a) | (uint64_t(d) << 32);
 }
 
-int main()
+int main(int argc, char *argv[])
 {
-    cybozu::util::Xoroshiro128Plus rand(::time(0));
-    uint64_t t0, t1;
+    const size_t nrLoop = argc > 1 ? ::atoi(argv[1]) : 100;
+    const size_t sizeV[] = {
+        32, 512, 4 * KIBI, 32 * KIBI, 256 * KIBI, 1 * MEBI,
+    };
+    const ChecksumImpl implV[] = {
+        ChecksumImpl::SCALAR, ChecksumImpl::SSE2, ChecksumImpl::AVX2, ChecksumImpl::AVX512,
+    };
+    Xoroshiro128Plus rand(::time(0));
     AlignedArray buf;
-    buf.resize(32 * KIBI);
+    buf.resize(1 * MEBI);
     rand.fill(buf.data(), buf.size());
 
-    for (size_t i = 0; i < 10; i++) {
-        t0 = rdtscp();
-        const uint32_t csum = cybozu::util::calcChecksum(buf.data(), buf.size(), 0);
-        t1 = rdtscp();
-        ::printf("%" PRIu64 " %08x\n", t1 - t0, csum);
+    ::printf("best implementation: %s\n", toStr(getBestChecksumImpl()));
+    ::printf("%8s %8s %12s %10s %8s\n", "size", "impl", "cycles", "bytes/cyc", "csum");
+    for (size_t size : sizeV) {
+        const uint32_t csum0 = calcChecksum(buf.data(), size, 0);
+        for (ChecksumImpl impl : implV) {
+            if (!isChecksumImplAvailable(impl)) continue;
+            const ChecksumPartialFunc func = getChecksumPartialFunc(impl);
+            std::vector<uint64_t> cycV(nrLoop);
+            uint32_t csum = 0;
+            for (size_t i = 0; i < nrLoop; i++) {
+                const uint64_t t0 = rdtscp();
+                csum = checksumFinish(func(buf.data(), size, 0));
+                const uint64_t t1 = rdtscp();
+                cycV[i] = t1 - t0;
+            }
+            std::sort(cycV.begin(), cycV.end());
+            const uint64_t cyc = cycV[nrLoop / 2];
+            ::printf("%8zu %8s %12" PRIu64 " %10.2f %08x%s\n"
+                     , size, toStr(impl), cyc, double(size) / cyc, csum
+                     , csum == csum0 ? "" : " MISMATCH");
+        }
+    }
+
+    const uint8_t algoV[] = {
+        HASH_ALGO_MURMUR3, HASH_ALGO_XXH128,
+    };
+    ::printf("\n%8s %8s %12s %10s\n", "size", "hash", "cycles", "bytes/cyc");
+    for (size_t size : sizeV) {
+        for (uint8_t algo : algoV) {
+            const SyncHasher hasher(0, algo);
+            std::vector<uint64_t> cycV(nrLoop);
+            for (size_t i = 0; i < nrLoop; i++) {
+                const uint64_t t0 = rdtscp();
+                hasher(buf.data(), size);
+                const uint64_t t1 = rdtscp();
+                cycV[i] = t1 - t0;
+            }
+            std::sort(cycV.begin(), cycV.end());
+            const uint64_t cyc = cycV[nrLoop / 2];
+            ::printf("%8zu %8s %12" PRIu64 " %10.2f\n"
+                     , size, hashAlgoToStr(algo).c_str(), cyc, double(size) / cyc);
+        }
     }
 }
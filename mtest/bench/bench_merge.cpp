@@ -0,0 +1,91 @@
+#include "walb_diff_merge.hpp"
+#include "walb_diff_file.hpp"
+#include "random.hpp"
+#include "time.hpp"
+#include "fileio.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <set>
+#include <unistd.h>
+#include <sys/resource.h>
+
+using namespace walb;
+
+/**
+ * Merge synthetic wdiffs with DiffMerger.
+ *
+ * Usage: bench_merge [TMP_DIR] [TOTAL_RECORDS]
+ * For each number of inputs (10, 100, 1000), TOTAL_RECORDS records
+ * are spread over the inputs with random overlaps.
+ * All records are all-zero IOs so that the merge itself is measured
+ * rather than IO data copy.
+ */
+
+const uint64_t ADDR_SPACE_LB = 64 * GIBI / LBS;
+const uint32_t MAX_IO_LB = 8;
+
+void makeWdiff(const std::string &path, size_t nr, cybozu::util::Xoroshiro128Plus &rand)
+{
+    std::set<uint64_t> addrS;
+    while (addrS.size() < nr) {
+        addrS.insert(rand() % (ADDR_SPACE_LB - MAX_IO_LB));
+    }
+    SortedDiffWriter writer;
+    writer.open(path, O_CREAT | O_TRUNC | O_RDWR, 0644);
+    DiffFileHeader header;
+    writer.writeHeader(header);
+    std::set<uint64_t>::const_iterator it = addrS.begin();
+    while (it != addrS.end()) {
+        const uint64_t addr = *it;
+        ++it;
+        uint64_t blks = rand() % MAX_IO_LB + 1;
+        if (it != addrS.end()) blks = std::min(blks, *it - addr);
+        DiffRecord rec;
+        rec.init();
+        rec.io_address = addr;
+        rec.io_blocks = blks;
+        rec.setAllZero();
+        writer.writeDiff(rec, AlignedArray());
+    }
+    writer.close();
+}
+
+void raiseNofileLimit()
+{
+    struct rlimit rlim;
+    if (::getrlimit(RLIMIT_NOFILE, &rlim) < 0) return;
+    rlim.rlim_cur = rlim.rlim_max;
+    ::setrlimit(RLIMIT_NOFILE, &rlim);
+}
+
+int main(int argc, char *argv[])
+{
+    const std::string dir = argc > 1 ? argv[1] : "/tmp";
+    const size_t totalNr = argc > 2 ? ::atoi(argv[2]) : 100000;
+    const size_t inputNrV[] = {10, 100, 1000};
+
+    raiseNofileLimit();
+    cybozu::util::Xoroshiro128Plus rand(::time(0));
+    ::printf("%8s %10s %10s %12s %12s\n", "inputs", "records", "merged", "sec", "records/s");
+    for (size_t inputNr : inputNrV) {
+        StrVec pathV;
+        for (size_t i = 0; i < inputNr; i++) {
+            pathV.push_back(dir + "/bench_merge_" + cybozu::itoa(i) + ".wdiff");
+            makeWdiff(pathV.back(), totalNr / inputNr, rand);
+        }
+        cybozu::AccurateStopwatch stopwatch;
+        DiffMerger merger;
+        merger.addWdiffs(pathV);
+        merger.prepare();
+        DiffRecIo recIo;
+        size_t mergedNr = 0;
+        while (merger.getAndRemove(recIo)) mergedNr++;
+        const double sec = stopwatch.get();
+        ::printf("%8zu %10zu %10zu %12.3f %12.0f\n"
+                 , inputNr, totalNr / inputNr * inputNr, mergedNr, sec
+                 , totalNr / inputNr * inputNr / sec);
+        for (const std::string &path : pathV) ::unlink(path.c_str());
+    }
+}
@@ -326,6 +326,7 @@ aaApply = "Apply"
 aaRestore = "Restore"
 aaReplSync = "ReplSyncAsClient"
 aaResize = "Resize"
+aaNbdExport = "NbdExport"
 
 sDuringFullSync = [stFullSync, sStopped, stStartTarget]
 sDuringHashSync = [stHashSync, sStopped, stStartTarget]
@@ -1700,6 +1701,33 @@ class Controller(object):
         args = ['set-full-scan-bps', throughputU]
         self.run_ctl(sx, args)
 
+    def set_io_sched(self, ax, name, value, vol=None):
+        '''
+        Set a parameter of the IO scheduler for apply/restore/merge.
+        ax :: ServerParams - archive server.
+        name :: str - 'bps', 'iops', 'backlog-first', 'weight', or 'prio'.
+        value :: int or str - the value. 'bps' allows unit suffix like '100M'.
+            0 means unlimited for 'bps' and 'iops'.
+        vol :: str - volume name. required for 'weight' and 'prio'.
+        '''
+        verify_server_kind(ax, [K_ARCHIVE])
+        verify_type(name, str)
+        args = ['set-io-sched', name]
+        if name in ['weight', 'prio']:
+            verify_type(vol, str)
+            args.append(vol)
+        args.append(str(value))
+        self.run_ctl(ax, args)
+
+    def get_io_sched(self, ax):
+        '''
+        Get status of the IO scheduler.
+        ax :: ServerParams - archive server.
+        return :: [str] - status lines.
+        '''
+        verify_server_kind(ax, [K_ARCHIVE])
+        return self.run_ctl(ax, ['get', 'io-sched']).split('\n')
+
     def is_overflow(self, sx, vol):
         '''
         Check a storage is overflow or not.
@@ -2534,6 +2562,27 @@ class Controller(object):
         self.run_ctl(ax, ['restore', vol, str(gid)])
         self.wait_for_restored(ax, vol, gid, timeoutS)
 
+    def nbd_export(self, ax, vol, gid, addr, acceptTimeoutS=None):
+        '''
+        Export a snapshot through NBD without restoring it.
+        The archive server accepts one client and serves it until it disconnects.
+        ax :: ServerParams - archive server.
+        vol :: str       - volume name.
+        gid :: int       - generation id.
+        addr :: str      - 'HOST:PORT' or 'unix:PATH' to listen.
+        acceptTimeoutS :: int - timeout to wait for a client [sec].
+            0 means no timeout. None means the server default.
+        '''
+        verify_server_kind(ax, [K_ARCHIVE])
+        verify_type(vol, str)
+        verify_u64(gid)
+        verify_type(addr, str)
+        args = ['nbd-export', vol, str(gid), addr]
+        if acceptTimeoutS is not None:
+            verify_u64(acceptTimeoutS)
+            args.append(str(acceptTimeoutS))
+        self.run_ctl(ax, args)
+
     def _del_snapshot(self, ax, vol, gid, isCold):
         verify_server_kind(ax, [K_ARCHIVE])
         verify_type(vol, str)
@@ -3014,7 +3063,7 @@ class Controller(object):
             raise Exception('wait_for_resize:failed',
                             ax.name, vol, oldSizeMb, sizeMb, curSizeMb)
 
-    def get_block_hash(self, ax, vol, gid, bulkSizeU='64K', scanSizeU=None):
+    def get_block_hash(self, ax, vol, gid, bulkSizeU='64K', scanSizeU=None, hashAlgo=None):
         '''
         Get block hash for virtual
         ax :: ServerParams - archive server.
@@ -3023,6 +3072,7 @@ class Controller(object):
         bulkSizeU :: str - bulk size hash calculation (with unit suffix)
         scanSizeU :: str - scanning size (with unit suffix).
                            It must not exceeds the device size.
+        hashAlgo :: str  - hash algorithm: 'murmur3' (default) or 'xxh128'.
         return :: str - hash value as a string.
         '''
         verify_server_kind(ax, [K_ARCHIVE])
@@ -3030,9 +3080,13 @@ class Controller(object):
         verify_type(vol, str)
         verify_size_unit(bulkSizeU)
         verify_size_unit(scanSizeU, allowNone=True)
+        if hashAlgo is not None:
+            verify_type(hashAlgo, str)
         args = ['bhash', vol, str(gid), bulkSizeU]
-        if scanSizeU is not None:
-            args.append(scanSizeU)
+        if scanSizeU is not None or hashAlgo is not None:
+            args.append('0' if scanSizeU is None else scanSizeU)
+        if hashAlgo is not None:
+            args.append(hashAlgo)
         return self.run_ctl(ax, args)
 
     def get_ts_delta(self, ax):
@@ -0,0 +1,244 @@
+#include "alloc_map.hpp"
+#include "atomic_map.hpp"
+#include "wdev_util.hpp"
+#include "walb_logger.hpp"
+#include "cybozu/atoi.hpp"
+#include "cybozu/itoa.hpp"
+#include "cybozu/string_operation.hpp"
+#include <algorithm>
+#include <mutex>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+namespace walb {
+
+void AllocMap::add(uint64_t addr, uint64_t blks)
+{
+    if (blks == 0) return;
+    const uint64_t end = addr + blks;
+    if (!v_.empty()) {
+        std::pair<uint64_t, uint64_t> &last = v_.back();
+        if (addr < last.first) {
+            throw cybozu::Exception(NAME) << "not ascending order" << addr << last.first;
+        }
+        if (addr <= last.second) {
+            last.second = std::max(last.second, end);
+            return;
+        }
+    }
+    v_.emplace_back(addr, end);
+}
+
+uint64_t AllocMap::getNextAllocated(uint64_t addr) const
+{
+    if (!isAvailable_) return addr;
+    auto it = std::upper_bound(
+        v_.cbegin(), v_.cend(), addr,
+        [](uint64_t a, const std::pair<uint64_t, uint64_t> &p) { return a < p.second; });
+    if (it == v_.cend()) return UINT64_MAX;
+    return std::max(addr, it->first);
+}
+
+uint64_t AllocMap::getAllocatedLb() const
+{
+    uint64_t lb = 0;
+    for (const std::pair<uint64_t, uint64_t> &p : v_) lb += p.second - p.first;
+    return lb;
+}
+
+namespace alloc_map_local {
+
+const char *const DMSETUP_PATH = "/sbin/dmsetup";
+const char *const THIN_DUMP_PATH = "/usr/sbin/thin_dump";
+
+uint64_t getAttr(const std::string &line, const std::string &name)
+{
+    const std::string key = " " + name + "=\"";
+    const size_t bgn = line.find(key);
+    if (bgn == std::string::npos) {
+        throw cybozu::Exception(__func__) << "attribute not found" << name << line;
+    }
+    const size_t valBgn = bgn + key.size();
+    const size_t valEnd = line.find('"', valBgn);
+    if (valEnd == std::string::npos) {
+        throw cybozu::Exception(__func__) << "bad attribute" << name << line;
+    }
+    return cybozu::atoi(line.substr(valBgn, valEnd - valBgn));
+}
+
+void ThinDumpParser::parseLine(const std::string &line)
+{
+    if (line.find("<superblock ") != std::string::npos) {
+        blockLb_ = getAttr(line, "data_block_size");
+    } else if (line.find("<range_mapping ") != std::string::npos) {
+        v_.emplace_back(getAttr(line, "origin_begin"), getAttr(line, "length"));
+    } else if (line.find("<single_mapping ") != std::string::npos) {
+        v_.emplace_back(getAttr(line, "origin_block"), 1);
+    }
+}
+
+void ThinDumpParser::getAllocMap(AllocMap &map)
+{
+    if (blockLb_ == 0) throw cybozu::Exception(__func__) << "data_block_size not found";
+    std::sort(v_.begin(), v_.end());
+    map.clear();
+    for (const std::pair<uint64_t, uint64_t> &p : v_) {
+        map.add(p.first * blockLb_, p.second * blockLb_);
+    }
+    map.setAvailable();
+}
+
+void parseThinDump(const std::string &xml, AllocMap &map)
+{
+    ThinDumpParser parser;
+    for (const std::string &line : cybozu::Split(xml, '\n')) {
+        parser.parseLine(line);
+    }
+    parser.getAllocMap(map);
+}
+
+bool isDmDevice(uint32_t major, uint32_t minor)
+{
+    const std::string path = cybozu::util::formatString("/sys/dev/block/%u:%u/dm", major, minor);
+    return cybozu::FilePath(path).stat().exists();
+}
+
+StrVec getDmTable(uint32_t major, uint32_t minor)
+{
+    std::string s = cybozu::process::call(DMSETUP_PATH, {
+            "table", "-j", cybozu::itoa(major), "-m", cybozu::itoa(minor) });
+    cybozu::Trim(s);
+    if (s.find('\n') != std::string::npos) return {}; // multiple targets.
+    return cybozu::Split(s, ' ');
+}
+
+std::string getDmName(uint32_t major, uint32_t minor)
+{
+    std::string s = cybozu::process::call(DMSETUP_PATH, {
+            "info", "-c", "--noheadings", "-o", "name",
+            "-j", cybozu::itoa(major), "-m", cybozu::itoa(minor) });
+    cybozu::Trim(s);
+    return s;
+}
+
+void sendDmMessage(const std::string &dmName, const std::string &msg)
+{
+    cybozu::process::call(DMSETUP_PATH, { "message", dmName, "0", msg });
+}
+
+struct PoolLock
+{
+    std::mutex mu;
+    explicit PoolLock(const std::string &) : mu() {}
+};
+
+/**
+ * Metadata snapshots of a pool must be reserved by one thread at a time.
+ */
+std::mutex& getPoolMutex(const std::string &poolName)
+{
+    static AtomicMap<PoolLock> map;
+    return map.get(poolName).mu;
+}
+
+} // namespace alloc_map_local
+
+bool getFileAllocMap(int fd, AllocMap &map)
+{
+    map.clear();
+    struct stat st;
+    if (::fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) return false;
+    const uint64_t size = st.st_size;
+    off_t off = 0;
+    while (uint64_t(off) < size) {
+        const off_t dataOff = ::lseek(fd, off, SEEK_DATA);
+        if (dataOff < 0) {
+            if (errno == ENXIO) break; // no more data.
+            map.clear();
+            return false;
+        }
+        const off_t holeOff = ::lseek(fd, dataOff, SEEK_HOLE);
+        if (holeOff < 0) {
+            map.clear();
+            return false;
+        }
+        const uint64_t bgnLb = dataOff / LOGICAL_BLOCK_SIZE;
+        const uint64_t endLb = (holeOff + LOGICAL_BLOCK_SIZE - 1) / LOGICAL_BLOCK_SIZE;
+        map.add(bgnLb, endLb - bgnLb);
+        off = holeOff;
+    }
+    map.setAvailable();
+    return true;
+}
+
+bool getThinAllocMap(const std::string &bdevPath, AllocMap &map)
+{
+    using namespace alloc_map_local;
+    const char *const FUNC = __func__;
+    map.clear();
+    struct stat st;
+    if (::stat(bdevPath.c_str(), &st) < 0 || !S_ISBLK(st.st_mode)) return false;
+    if (!isDmDevice(major(st.st_rdev), minor(st.st_rdev))) return false;
+    try {
+        /* <start> <length> thin <pool dev> <dev id> [<external origin dev>] */
+        const StrVec thin = getDmTable(major(st.st_rdev), minor(st.st_rdev));
+        if (thin.size() != 5 || thin[2] != "thin") return false;
+        uint32_t poolMajor, poolMinor;
+        std::tie(poolMajor, poolMinor) = device::local::parseDeviceIdStr(thin[3]);
+        const std::string &devId = thin[4];
+
+        /* <start> <length> thin-pool <metadata dev> <data dev> <data block size> ... */
+        const StrVec pool = getDmTable(poolMajor, poolMinor);
+        if (pool.size() < 6 || pool[2] != "thin-pool") return false;
+        uint32_t metaMajor, metaMinor;
+        std::tie(metaMajor, metaMinor) = device::local::parseDeviceIdStr(pool[3]);
+        const std::string metaPath = device::local::getDevPathFromId(metaMajor, metaMinor);
+        const std::string poolName = getDmName(poolMajor, poolMinor);
+
+        /* The metadata can be read consistently only from its snapshot while the pool is active. */
+        std::lock_guard<std::mutex> lk(getPoolMutex(poolName));
+        try {
+            sendDmMessage(poolName, "reserve_metadata_snap");
+        } catch (std::exception &e) {
+            LOGs.warn() << FUNC << "could not reserve a metadata snapshot."
+                        << "Another one may be held by other tools."
+                        << "Release it by 'dmsetup message POOL 0 release_metadata_snap' if it is stale."
+                        << bdevPath << poolName << e.what();
+            return false;
+        }
+        ThinDumpParser parser;
+        try {
+            cybozu::process::callForEachLine(THIN_DUMP_PATH, {
+                    "--metadata-snap", "--dev-id", devId, metaPath },
+                [&](const std::string &line) { parser.parseLine(line); });
+        } catch (...) {
+            sendDmMessage(poolName, "release_metadata_snap");
+            throw;
+        }
+        sendDmMessage(poolName, "release_metadata_snap");
+        parser.getAllocMap(map);
+        return true;
+    } catch (std::exception &e) {
+        LOGs.warn() << FUNC << "failed to get the allocation map" << bdevPath << e.what();
+        map.clear();
+        return false;
+    }
+}
+
+AllocMap getAllocMap(const std::string &path)
+{
+    AllocMap map;
+    struct stat st;
+    if (::stat(path.c_str(), &st) < 0) return map;
+    if (S_ISREG(st.st_mode)) {
+        cybozu::util::File file(path, O_RDONLY);
+        getFileAllocMap(file.fd(), map);
+    } else if (S_ISBLK(st.st_mode)) {
+        getThinAllocMap(path, map);
+    }
+    return map;
+}
+
+} // namespace walb
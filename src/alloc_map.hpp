@@ -0,0 +1,97 @@
+#pragma once
+/**
+ * @file
+ * @brief Allocation maps of sparse files and thin volumes.
+ */
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "cybozu/exception.hpp"
+
+namespace walb {
+
+/**
+ * Allocated address ranges of a file or a block device.
+ * Unallocated ranges must be read as zero.
+ * A map that is not available means all the ranges are allocated.
+ */
+class AllocMap
+{
+private:
+    std::vector<std::pair<uint64_t, uint64_t> > v_; /* sorted [bgn, end) [logical block]. */
+    bool isAvailable_;
+
+public:
+    static constexpr const char *NAME = "AllocMap";
+    AllocMap() : v_(), isAvailable_(false) {}
+    void clear() {
+        v_.clear();
+        isAvailable_ = false;
+    }
+    void setAvailable() { isAvailable_ = true; }
+    bool isAvailable() const { return isAvailable_; }
+    /**
+     * Ranges must be added in ascending order of addr.
+     * Overlapped or contiguous ranges will be merged.
+     * @addr [logical block]
+     * @blks [logical block]
+     */
+    void add(uint64_t addr, uint64_t blks);
+    /**
+     * RETURN:
+     *   the first allocated address not less than addr, or UINT64_MAX if there is no such one.
+     *   addr if the map is not available.
+     */
+    uint64_t getNextAllocated(uint64_t addr) const;
+    size_t getNrRanges() const { return v_.size(); }
+    uint64_t getAllocatedLb() const;
+};
+
+namespace alloc_map_local {
+
+/**
+ * Parser of output of 'thin_dump --dev-id N' for a thin device.
+ * Give the output line by line.
+ */
+class ThinDumpParser
+{
+private:
+    uint64_t blockLb_; // data_block_size is in sectors, that is logical blocks.
+    std::vector<std::pair<uint64_t, uint64_t> > v_; // (block, nrBlocks)
+public:
+    ThinDumpParser() : blockLb_(0), v_() {}
+    void parseLine(const std::string &line);
+    void getAllocMap(AllocMap &map);
+};
+
+/**
+ * Parse the whole output of 'thin_dump --dev-id N'.
+ */
+void parseThinDump(const std::string &xml, AllocMap &map);
+
+} // namespace alloc_map_local
+
+/**
+ * Get the allocation map of a regular file using SEEK_DATA/SEEK_HOLE.
+ * RETURN:
+ *   false if the file system does not support them.
+ */
+bool getFileAllocMap(int fd, AllocMap &map);
+
+/**
+ * Get the allocation map of a dm-thin volume from a metadata snapshot of its pool.
+ * Only one metadata snapshot can be reserved in a pool,
+ * so calls for the same pool are serialized in the process.
+ * RETURN:
+ *   false if the device is not a thin volume or the metadata could not be read.
+ */
+bool getThinAllocMap(const std::string &bdevPath, AllocMap &map);
+
+/**
+ * RETURN:
+ *   allocation map of a regular file or a thin volume.
+ *   It is not available if the allocation is unknown.
+ */
+AllocMap getAllocMap(const std::string &path);
+
+} // namespace walb
@@ -28,9 +28,14 @@ void prepareRawFullScanner(
 }
 
 
-void prepareVirtualFullScanner(
-    VirtualFullScanner &virt, ArchiveVolState &volSt,
-    ArchiveVolInfo &volInfo, uint64_t sizeLb, const MetaSnap &snap)
+/**
+ * Open the base image (or a cold snapshot) and the wdiffs to make a virtual full image of a snapshot.
+ * RETURN:
+ *   true if a cold snapshot is used instead of the base image.
+ */
+static bool openImageAndDiffsToSync(
+    cybozu::util::File &fileR, std::vector<cybozu::util::File> &fileV,
+    ArchiveVolState &volSt, ArchiveVolInfo &volInfo, uint64_t sizeLb, const MetaSnap &snap)
 {
     MetaState st0;
     bool isCold = false;
@@ -40,21 +45,123 @@ void prepareVirtualFullScanner(
         st0 = volInfo.getMetaState();
     }
 
-    cybozu::util::File fileR;
     const uint64_t gid = (isCold ? st0.snapB.gidB : UINT64_MAX);
     prepareRawFullScanner(fileR, volSt, sizeLb, gid);
 
-    std::vector<cybozu::util::File> fileV;
     MetaDiffVec diffV = tryOpenDiffs(
         fileV, volInfo, allowEmpty, st0, [&](const MetaState &st) {
             return volInfo.getDiffMgr().getDiffListToSync(st, snap);
         });
     LOGs.debug() << "virtual-full-scan-diffs" << st0 << diffV;
+    return isCold;
+}
 
+
+void prepareVirtualFullScanner(
+    VirtualFullScanner &virt, ArchiveVolState &volSt,
+    ArchiveVolInfo &volInfo, uint64_t sizeLb, const MetaSnap &snap)
+{
+    cybozu::util::File fileR;
+    std::vector<cybozu::util::File> fileV;
+    openImageAndDiffsToSync(fileR, fileV, volSt, volInfo, sizeLb, snap);
     virt.init(std::move(fileR), std::move(fileV));
 }
 
 
+/**
+ * The index will not be used if the image is made from a cold snapshot.
+ */
+void prepareIndexedVirtualReader(
+    IndexedVirtualReader &reader, ArchiveVolState &volSt,
+    ArchiveVolInfo &volInfo, uint64_t sizeLb, const MetaSnap &snap, ChunkHashIndex &index)
+{
+    cybozu::util::File fileR;
+    std::vector<cybozu::util::File> fileV;
+    const bool isCold = openImageAndDiffsToSync(fileR, fileV, volSt, volInfo, sizeLb, snap);
+    reader.virt().init(std::move(fileR), sizeLb, std::move(fileV), INDEXED_DIFF_CACHE_SIZE);
+    if (!isCold && index.isOpen()) reader.setIndex(&index);
+}
+
+
+/**
+ * Open the chunk hash index of the base image for a hash sync server.
+ * The index will not be used if it can not be opened.
+ * The index will be reset if its hash algorithm is not hashAlgo.
+ * @hashSeed hash seed proposed by the client.
+ * @hashAlgo hash algorithm of the sync.
+ * RETURN:
+ *   hash seed to use.
+ */
+uint32_t openChunkHashIndexForSync(ChunkHashIndex &index, ArchiveVolInfo &volInfo, uint32_t hashSeed, uint8_t hashAlgo)
+{
+    try {
+        volInfo.openChunkHashIndex(index);
+    } catch (std::exception &e) {
+        LOGs.warn() << "open chunk hash index failed" << volInfo.volId << e.what();
+        index.close();
+        return hashSeed;
+    }
+    if (index.hashAlgo() != hashAlgo) {
+        LOGs.info() << "reset chunk hash index" << volInfo.volId
+                    << hashAlgoToStr(index.hashAlgo()) << hashAlgoToStr(hashAlgo);
+        index.reset(hashAlgo);
+    }
+    return index.seed();
+}
+
+
+/**
+ * The index will be removed if it can not be opened or updated.
+ * The diffs must be applied without the index then.
+ * RETURN:
+ *   false if the index is not available.
+ */
+bool beginChunkHashIndexUpdate(ChunkHashIndex &index, ArchiveVolInfo &volInfo)
+{
+    try {
+        volInfo.openChunkHashIndex(index);
+        index.beginUpdate();
+        return true;
+    } catch (std::exception &e) {
+        LOGs.warn() << "chunk hash index unavailable, remove it" << volInfo.volId << e.what();
+        index.close();
+        volInfo.removeChunkHashIndex();
+        return false;
+    }
+}
+
+
+void prepareVirtualSnapshotReader(
+    VirtualSnapshotReader &virt, ArchiveVolState &volSt,
+    ArchiveVolInfo &volInfo, uint64_t sizeLb, uint64_t gid)
+{
+    bool isCold = false;
+    const MetaState st0 = volInfo.getMetaStateForRestore(gid, isCold);
+    uint64_t cost;
+    if (!volInfo.getDiffMgr().getRestoreCost(st0, gid, cost)) {
+        throw cybozu::Exception(__func__) << "can not restore the snapshot" << volInfo.volId << gid;
+    }
+
+    cybozu::util::File fileR;
+    prepareRawFullScanner(fileR, volSt, sizeLb, isCold ? st0.snapB.gidB : UINT64_MAX);
+
+    std::vector<cybozu::util::File> fileV;
+    MetaDiffVec diffV = tryOpenDiffs(
+        fileV, volInfo, allowEmpty, st0, [&](const MetaState &st) {
+            return volInfo.getDiffMgr().getDiffListToRestore(st, gid, ga.maxOpenDiffs);
+        });
+    /* Unlike restore, all the diffs must be opened at once. */
+    const MetaState st1 = apply(st0, diffV);
+    if (st1.isApplying || st1.snapB != MetaSnap(gid)) {
+        throw cybozu::Exception(__func__) << "too many wdiffs to open" << volInfo.volId << gid
+                                          << diffV.size() << ga.maxOpenDiffs;
+    }
+    LOGs.info() << "virtual-snapshot-diffs" << volInfo.volId << gid << (isCold ? "cold" : "base") << st0 << diffV.size();
+
+    virt.init(std::move(fileR), sizeLb, std::move(fileV), INDEXED_DIFF_CACHE_SIZE);
+}
+
+
 void verifyApplicable(const std::string& volId, uint64_t gid)
 {
     ArchiveVolState& volSt = getArchiveVolState(volId);
@@ -70,91 +177,132 @@ void verifyApplicable(const std::string& volId, uint64_t gid)
 
 #define USE_AIO_FOR_APPLY_OPENED_DIFFS
 
-#ifdef USE_AIO_FOR_APPLY_OPENED_DIFFS
-const size_t ASYNC_IO_BUFFER_SIZE = (32U << 20);  // bytes
-#endif
+
+static uint64_t getTotalDiffDataSize(const MetaDiffManager &mgr)
+{
+    uint64_t totalSize = 0;
+    for (const MetaDiff &d : mgr.getAll()) totalSize += d.dataSize;
+    return totalSize;
+}
 
 
-bool applyOpenedDiffs(std::vector<cybozu::util::File>&& fileV, cybozu::lvm::Lv& lv,
+bool applyOpenedDiffs(const std::string& volId, std::vector<cybozu::util::File>&& fileV, cybozu::lvm::Lv& lv,
                       const std::atomic<int>& stopState,
-                      DiffStatistics& statIn, DiffStatistics& statOut, std::string& memUsageStr)
+                      DiffStatistics& statIn, DiffStatistics& statOut, std::string& memUsageStr,
+                      ChunkHashIndex *index)
 {
     const char *const FUNC = __func__;
     statOut.clear();
-    DiffMerger merger;
+    IoScheduler &ioSched = getArchiveGlobal().ioSched;
+    ioSched.setBacklog(volId, getTotalDiffDataSize(getArchiveVolState(volId).diffMgr));
+    ParallelDiffMerger merger(ga.mergeConcurrency);
+    merger.setPassThroughCmprType(PASS_THROUGH_ALL_CMPR); // uncompressed by prefetchers.
     merger.addWdiffs(std::move(fileV));
     merger.prepare();
-    DiffRecIo recIo;
     const std::string lvPathStr = lv.path().str();
+    const uint64_t lvSnapSizeLb = lv.sizeLb();
+    std::vector<DiffStatistics> statOutV(merger.nrRanges());
+    std::vector<size_t> totalSleepMsV(merger.nrRanges());
+    std::atomic<bool> isStopped(false);
+
+    /*
+     * Each address range is applied by its own writer queue (thread and file descriptor).
+     * IOs are read and uncompressed ahead by the prefetcher's threads.
+     * Periodic fdatasync runs in background after the IOs issued before it complete,
+     * without draining in-flight IOs.
+     * Each IO waits for the budget of the archive-wide IO scheduler.
+     */
+    merger.run([&](size_t idx, DiffMerger &rangeMerger) {
+        DiffRecIo recIo;
+        DiffRecIoPrefetcher prefetcher(rangeMerger);
+        prefetcher.start(ga.applyPrefetchConcurrency);
 #ifdef USE_AIO_FOR_APPLY_OPENED_DIFFS
-    cybozu::util::File file(lvPathStr, O_RDWR | O_DIRECT);
-    AsyncBdevWriter writer(file.fd(), ASYNC_IO_BUFFER_SIZE);
+        cybozu::util::File file(lvPathStr, O_RDWR | O_DIRECT);
+        AsyncBdevWriter writer(file.fd(), ga.applyIoDepthMb * MEBI, ga.applyMaxIoKb * KIBI);
+        BackgroundSyncer syncer(file.fd());
 #else
-    cybozu::util::File file(lvPathStr, O_RDWR);
-    AlignedArray zero;
+        cybozu::util::File file(lvPathStr, O_RDWR);
+        AlignedArray zero;
 #endif
-    const uint64_t lvSnapSizeLb = lv.sizeLb();
-    double t0 = cybozu::util::getTimeMonotonic();
-    size_t totalSleepMs = 0;
-    size_t writtenSize = 0; // bytes
+        double t0 = cybozu::util::getTimeMonotonic();
+        size_t writtenSize = 0; // bytes
 #ifndef USE_AIO_FOR_APPLY_OPENED_DIFFS
-    uint64_t fadvOffBgn = 0; // bytes
+        uint64_t fadvOffBgn = 0; // bytes
 #endif
-    Sleeper sleeper;
-    const size_t minMs = 100, maxMs = 1000;
-    sleeper.init(ga.pctApplySleep * 10, minMs, maxMs, t0);
-    while (merger.getAndRemove(recIo)) {
-        if (stopState == ForceStopping || ga.ps.isForceShutdown()) {
-            return false;
-        }
-        const DiffRecord& rec = recIo.record();
-        statOut.update(rec);
-        assert(!rec.isCompressed());
-        const uint64_t ioAddress = rec.io_address;
-        const uint64_t ioBlocks = rec.io_blocks;
-        //LOGs.debug() << "ioAddress" << ioAddress << "ioBlocks" << ioBlocks;
-        if (ioAddress + ioBlocks > lvSnapSizeLb) {
-            throw cybozu::Exception(FUNC) << "out of range" << ioAddress << ioBlocks << lvSnapSizeLb;
-        }
+        Sleeper sleeper;
+        const size_t minMs = 100, maxMs = 1000;
+        sleeper.init(ga.pctApplySleep * 10, minMs, maxMs, t0);
+        auto shouldStop = [&]() {
+            return stopState == ForceStopping || ga.ps.isForceShutdown() || merger.isFailed();
+        };
+        while (prefetcher.getAndRemove(recIo)) {
+            if (shouldStop()) {
+                isStopped = true;
+                return;
+            }
+            const DiffRecord& rec = recIo.record();
+            statOutV[idx].update(rec);
+            assert(!rec.isCompressed());
+            const uint64_t ioAddress = rec.io_address;
+            const uint64_t ioBlocks = rec.io_blocks;
+            //LOGs.debug() << "ioAddress" << ioAddress << "ioBlocks" << ioBlocks;
+            if (ioAddress + ioBlocks > lvSnapSizeLb) {
+                throw cybozu::Exception(FUNC) << "out of range" << ioAddress << ioBlocks << lvSnapSizeLb;
+            }
+            if (!ioSched.acquire(volId, ioBlocks * LOGICAL_BLOCK_SIZE, shouldStop)) {
+                isStopped = true;
+                return;
+            }
+            if (index) index->invalidate(ioAddress, ioBlocks);
 #ifdef USE_AIO_FOR_APPLY_OPENED_DIFFS
-        issueAio(writer, ga.discardType, rec, recIo.moveIoFrom());
+            issueAio(writer, ga.discardType, rec, recIo.moveIoFrom());
 #else
-        issueIo(file, ga.discardType, rec, recIo.io().data(), zero);
+            issueIo(file, ga.discardType, rec, recIo.io().data(), zero);
 #endif
 
-        writtenSize += ioBlocks * LOGICAL_BLOCK_SIZE;
-        if (writtenSize >= ga.fsyncIntervalSize) {
 #ifdef USE_AIO_FOR_APPLY_OPENED_DIFFS
-            writer.waitForAll();
+            syncer.update(writer.getCompletedLb());
 #endif
-            file.fdatasync();
-#ifndef USE_AIO_FOR_APPLY_OPENED_DIFFS
-            const uint64_t fadvOffEnd = (ioAddress + ioBlocks) * LOGICAL_BLOCK_SIZE;
-            assert(fadvOffBgn <= fadvOffEnd);
-            const uint64_t fadvLen = fadvOffEnd - fadvOffBgn;
-            file.fadvise(fadvOffBgn, fadvLen, POSIX_FADV_DONTNEED);
-            fadvOffBgn = fadvOffEnd;
+            writtenSize += ioBlocks * LOGICAL_BLOCK_SIZE;
+            if (writtenSize >= ga.fsyncIntervalSize) {
+#ifdef USE_AIO_FOR_APPLY_OPENED_DIFFS
+                writer.submit();
+                syncer.request(writer.getPreparedLb());
+#else
+                file.fdatasync();
+                const uint64_t fadvOffEnd = (ioAddress + ioBlocks) * LOGICAL_BLOCK_SIZE;
+                assert(fadvOffBgn <= fadvOffEnd);
+                const uint64_t fadvLen = fadvOffEnd - fadvOffBgn;
+                file.fadvise(fadvOffBgn, fadvLen, POSIX_FADV_DONTNEED);
+                fadvOffBgn = fadvOffEnd;
 #endif
-            writtenSize = 0;
-        }
+                writtenSize = 0;
+            }
 
-        const double t1 = cybozu::util::getTimeMonotonic();
-        if (t1 - t0 > PROGRESS_INTERVAL_SEC) {
-            LOGs.info() << FUNC << "progress" << lvPathStr
-                        << cybozu::util::formatString("%" PRIu64 "/%" PRIu64 "", ioAddress, lvSnapSizeLb);
-            t0 = t1;
+            const double t1 = cybozu::util::getTimeMonotonic();
+            if (t1 - t0 > PROGRESS_INTERVAL_SEC) {
+                LOGs.info() << FUNC << "progress" << lvPathStr << idx
+                            << cybozu::util::formatString("%" PRIu64 "/%" PRIu64 "", ioAddress, lvSnapSizeLb);
+                t0 = t1;
+            }
+            totalSleepMsV[idx] += sleeper.sleepIfNecessary(t1);
         }
-        totalSleepMs += sleeper.sleepIfNecessary(t1);
-    }
 #ifdef USE_AIO_FOR_APPLY_OPENED_DIFFS
-    writer.waitForAll();
+        writer.waitForAll();
+        syncer.wait();
 #endif
-    file.fdatasync();
-    file.close();
+        file.fdatasync();
+        file.close();
+    });
+    if (isStopped) return false;
+
+    for (const DiffStatistics &stat : statOutV) statOut.update(stat);
     statIn = merger.statIn();
     statOut.wdiffNr = -1;
     statOut.dataSize = -1;
     memUsageStr = merger.memUsageStr();
+    size_t totalSleepMs = 0;
+    for (size_t ms : totalSleepMsV) totalSleepMs += ms;
     LOGs.info() << FUNC << "totalSleepMs" << lvPathStr << totalSleepMs;
     return true;
 }
@@ -185,11 +333,15 @@ static ApplyState applyDiffsToVolumeOnce(const std::string& volId, const MetaSta
     volInfo.setMetaState(st01);
 
     cybozu::lvm::Lv lv = lvC.getLv(); // base image.
+    ChunkHashIndex index;
+    const bool useIndex = archive_local::beginChunkHashIndexUpdate(index, volInfo);
     DiffStatistics statIn, statOut;
     std::string memUsageStr;
-    if (!applyOpenedDiffs(std::move(fileV), lv, volSt.stopState, statIn, statOut, memUsageStr)) {
+    if (!applyOpenedDiffs(volId, std::move(fileV), lv, volSt.stopState, statIn, statOut, memUsageStr,
+                          useIndex ? &index : nullptr)) {
         return ApplyState::FAILURE;
     }
+    if (useIndex) index.endUpdate();
     st1 = endApplying(st01, diffV);
 
     LOGs.info() << "apply-mergeIn " << volId << statIn;
@@ -299,23 +451,19 @@ bool mergeDiffs(const std::string &volId, uint64_t gidB, bool isSize, uint64_t p
     LOGs.debug() << "merge-diffs" << mergedDiff << diffV;
     const cybozu::FilePath diffPath = volInfo.getDiffPath(mergedDiff);
     cybozu::TmpFile tmpFile(volInfo.volDir.str());
-    DiffMerger merger;
+    ParallelDiffMerger merger(ga.mergeConcurrency);
+    merger.setPassThroughCmprType(::WALB_DIFF_CMPR_SNAPPY);
     merger.addWdiffs(std::move(fileV));
-    merger.prepare();
-
-    SortedDiffWriter writer;
-    writer.setFd(tmpFile.fd());
-    DiffFileHeader wdiffH = merger.header();
-    writer.writeHeader(wdiffH);
-    DiffRecIo recIo;
-    while (merger.getAndRemove(recIo)) {
-        if (volSt.stopState == ForceStopping || ga.ps.isForceShutdown()) {
-            return false;
-        }
-        // TODO: currently we can use snappy only.
-        writer.compressAndWriteDiff(recIo.record(), recIo.io().data());
-    }
-    writer.close();
+    IoScheduler &ioSched = getArchiveGlobal().ioSched;
+    ioSched.setBacklog(volId, getTotalDiffDataSize(mgr));
+    auto shouldStop = [&]() {
+        return volSt.stopState == ForceStopping || ga.ps.isForceShutdown();
+    };
+    // TODO: currently we can use snappy only.
+    const bool merged = merger.mergeToFd(
+        tmpFile.fd(), CompressOpt(::WALB_DIFF_CMPR_SNAPPY), volInfo.volDir.str(), shouldStop,
+        [&](size_t size) { return ioSched.acquire(volId, size, shouldStop); });
+    if (!merged) return false;
 
     mergedDiff.dataSize = cybozu::FileStat(tmpFile.fd()).size();
     tmpFile.save(diffPath.str());
@@ -323,7 +471,7 @@ bool mergeDiffs(const std::string &volId, uint64_t gidB, bool isSize, uint64_t p
     volInfo.removeDiffs(diffV);
 
     LOGs.info() << "merge-mergeIn " << volId << merger.statIn();
-    LOGs.info() << "merge-mergeOut" << volId << writer.getStat();
+    LOGs.info() << "merge-mergeOut" << volId << merger.statOut();
     LOGs.info() << "merge-mergeMemUsage" << volId << merger.memUsageStr();
     LOGs.info() << "merged" << volId << diffV.size() << mergedDiff;
     return true;
@@ -393,7 +541,7 @@ static bool applyDiffsToRestore(
     LOGs.debug() << "restore-diffs" << volId << st0 << diffV;
     DiffStatistics statIn, statOut;
     std::string memUsageStr;
-    if (!applyOpenedDiffs(std::move(fileV), tmpLv, volSt.stopState, statIn, statOut, memUsageStr)) {
+    if (!applyOpenedDiffs(volId, std::move(fileV), tmpLv, volSt.stopState, statIn, statOut, memUsageStr)) {
         return false;
     }
     st1 = apply(st0, diffV);
@@ -409,7 +557,8 @@ static bool applyDiffsToRestore(
 
 /**
  * Restore a snapshot.
- * (1) create lvm snapshot of base lv. (with temporary lv name)
+ * (1) create lvm snapshot of base lv or a cold snapshot. (with temporary lv name)
+ *     The one with the smallest total size of diffs to apply is chosen.
  * (2) apply appropriate wdiff files.
  * (3) rename the lvm snapshot.
  *
@@ -429,6 +578,7 @@ bool restore(const std::string &volId, uint64_t gid)
 
     bool useCold;
     MetaState st0 = volInfo.getMetaStateForRestore(gid, useCold);
+    LOGs.info() << "restore from" << volId << gid << (useCold ? "cold" : "base") << st0;
 
     cybozu::lvm::Lv tmpLv;
     if (isThinpool()) {
@@ -575,7 +725,15 @@ void backupServer(protocol::ServerParams &p, bool isFull)
     pkt.read(curTime);
     pkt.read(bulkLb);
     pkt.read(cmprOpt);
-    logger.debug() << hostType << volId << sizeLb << curTime << bulkLb << cmprOpt;
+    uint64_t regionLb = 0;
+    uint8_t hashAlgo = HASH_ALGO_MURMUR3;
+    if (!isFull) {
+        pkt.read(regionLb);
+        pkt.read(hashAlgo);
+        if (!isValidHashTreeRegionLb(regionLb, bulkLb)) regionLb = 0;
+        if (!isValidHashAlgo(hashAlgo)) hashAlgo = HASH_ALGO_MURMUR3;
+    }
+    logger.debug() << hostType << volId << sizeLb << curTime << bulkLb << cmprOpt << regionLb << int(hashAlgo);
 
     ForegroundCounterTransaction foregroundTasksTran;
     ArchiveVolState &volSt = getArchiveVolState(volId);
@@ -602,8 +760,16 @@ void backupServer(protocol::ServerParams &p, bool isFull)
     }
     volSt.progressLb = 0;
     ZeroResetter resetter(volSt.progressLb);
+    ChunkHashIndex index;
+    uint32_t hashSeed = curTime;
+    if (!isFull) hashSeed = archive_local::openChunkHashIndexForSync(index, volInfo, hashSeed, hashAlgo);
     pkt.write(msgAccept);
-    if (!isFull) pkt.write(snapFrom);
+    if (!isFull) {
+        pkt.write(snapFrom);
+        pkt.write(regionLb);
+        pkt.write(hashSeed);
+        pkt.write(hashAlgo);
+    }
     pkt.flush();
     cybozu::Uuid uuid;
     pkt.read(uuid);
@@ -620,7 +786,7 @@ void backupServer(protocol::ServerParams &p, bool isFull)
         throw cybozu::Exception(FUNC) << "state is not" << stFrom << "but" << st;
     }
     logger.info() << (isFull ? dirtyFullSyncPN : dirtyHashSyncPN) << "started" << volId
-                  << p.clientId << sizeLb << bulkLb << cmprOpt;
+                  << p.clientId << sizeLb << bulkLb << cmprOpt << regionLb;
     bool isOk;
     std::unique_ptr<cybozu::TmpFile> tmpFileP;
     if (isFull) {
@@ -632,17 +798,14 @@ void backupServer(protocol::ServerParams &p, bool isFull)
                                    skipZero, ga.fsyncIntervalSize);
     } else {
         doAutoResizeIfNecessary(volSt, volInfo, sizeLb);
-        const uint32_t hashSeed = curTime;
         tmpFileP.reset(new cybozu::TmpFile(volInfo.volDir.str()));
-        VirtualFullScanner virt;
-        archive_local::prepareVirtualFullScanner(virt, volSt, volInfo, sizeLb, snapFrom);
-        isOk = dirtyHashSyncServer(pkt, virt, sizeLb, bulkLb, uuid, hashSeed, true, tmpFileP->fd(),
+        IndexedVirtualReader reader;
+        archive_local::prepareIndexedVirtualReader(reader, volSt, volInfo, sizeLb, snapFrom, index);
+        isOk = dirtyHashSyncServer(pkt, reader, sizeLb, bulkLb, uuid, hashSeed, hashAlgo, true, tmpFileP->fd(),
                                    ga.discardType, volSt.stopState, ga.ps, volSt.progressLb,
-                                   ga.fsyncIntervalSize);
+                                   ga.fsyncIntervalSize, cmprOpt.numCpu, regionLb);
         if (isOk) {
-            logger.info() << "hash-backup-mergeIn " << volId << virt.statIn();
-            logger.info() << "hash-backup-mergeOut" << volId << virt.statOut();
-            logger.info() << "hash-backup-mergeMemUsage" << volId << virt.memUsageStr();
+            logger.info() << "hash-backup-index" << volId << reader.nrHit() << reader.nrPut();
         }
     }
     if (!isOk) {
@@ -697,7 +860,7 @@ void delSnapshotServer(protocol::ServerParams &p, bool isCold)
         UniqueLock ul(volSt.mu);
         verifyNotStopping(volSt.stopState, volId, FUNC);
         verifyStateIn(volSt.sm.get(), aActiveOrStopped, FUNC);
-        verifyActionNotRunning(volSt.ac, aActionOnLvm, FUNC);
+        verifyActionNotRunning(volSt.ac, isCold ? aDenyForDelCold : aActionOnLvm, FUNC);
         ul.unlock();
 
         delSnapshot(volId, gid, isCold);
@@ -762,8 +925,13 @@ bool runFullReplClient(
 
     const std::string lvPath = lv.path().str();
     const std::atomic<uint64_t> fullScanLbPerSec(0);
+    const AllocMap allocMap = getAllocMap(lvPath);
+    if (allocMap.isAvailable()) {
+        logger.info() << "full-repl-client allocation map" << volId
+                      << allocMap.getAllocatedLb() << allocMap.getNrRanges();
+    }
     if (!dirtyFullSyncClient(pkt, lvPath, startLb, sizeLb, bulkLb,
-                             ga.cmprOptForSync, volSt.stopState, ga.ps, fullScanLbPerSec)) {
+                             ga.cmprOptForSync, volSt.stopState, ga.ps, fullScanLbPerSec, allocMap)) {
         logger.warn() << "full-repl-client force-stopped" << volId;
         return false;
     }
@@ -844,29 +1012,36 @@ bool runHashReplClient(
     const char *const FUNC = __func__;
     const uint64_t sizeLb = volSt.lvCache.getLv().sizeLb();
     const cybozu::Uuid uuid = volInfo.getUuid();
-    const uint32_t hashSeed = diff.timestamp;
+    uint32_t hashSeed = diff.timestamp;
+    uint64_t regionLb = getHashTreeRegionLb(ga.hashTreeMb, bulkLb);
     pkt.write(sizeLb);
     pkt.write(bulkLb);
     pkt.write(diff);
     pkt.write(uuid);
     pkt.write(ga.cmprOptForSync);
     pkt.write(hashSeed);
+    pkt.write(regionLb);
+    pkt.write(ga.hashAlgoForSync);
     pkt.flush();
     logger.debug() << "hash-repl-client" << sizeLb << bulkLb << diff
-                   << uuid << ga.cmprOptForSync << hashSeed;
+                   << uuid << ga.cmprOptForSync << hashSeed << regionLb << int(ga.hashAlgoForSync);
 
     std::string res;
     pkt.read(res);
     if (res != msgOk) throw cybozu::Exception(FUNC) << "not ok" << res;
+    pkt.read(regionLb);
+    pkt.read(hashSeed);
+    uint8_t hashAlgo;
+    pkt.read(hashAlgo);
 
     logger.info() << "hash-repl-client started" << volId << dstId << sizeLb
-                  << bulkLb << ga.cmprOptForSync << diff;
+                  << bulkLb << ga.cmprOptForSync << diff << regionLb << hashAlgoToStr(hashAlgo);
     VirtualFullScanner virt;
     archive_local::prepareVirtualFullScanner(virt, volSt, volInfo, sizeLb, diff.snapE);
     const std::atomic<uint64_t> fullScanLbPerSec(0);
     if (!dirtyHashSyncClient(pkt, virt, sizeLb, bulkLb,
-                             ga.cmprOptForSync, hashSeed,
-                             volSt.stopState, ga.ps, fullScanLbPerSec)) {
+                             ga.cmprOptForSync, hashSeed, hashAlgo,
+                             volSt.stopState, ga.ps, fullScanLbPerSec, regionLb)) {
         logger.warn() << "hash-repl-client force-stopped" << volId;
         return false;
     }
@@ -892,6 +1067,8 @@ bool runHashReplServer(
     cybozu::Uuid uuid;
     CompressOpt cmprOpt;
     uint32_t hashSeed;
+    uint64_t regionLb;
+    uint8_t hashAlgo;
     try {
         pkt.read(sizeLb);
         pkt.read(bulkLb);
@@ -899,10 +1076,14 @@ bool runHashReplServer(
         pkt.read(uuid);
         pkt.read(cmprOpt);
         pkt.read(hashSeed);
+        pkt.read(regionLb);
+        pkt.read(hashAlgo);
         logger.debug() << "hash-repl-server" << sizeLb << bulkLb << diff
-                       << uuid << cmprOpt << hashSeed;
+                       << uuid << cmprOpt << hashSeed << regionLb << int(hashAlgo);
         if (sizeLb == 0) throw cybozu::Exception(FUNC) << "sizeLb must not be 0";
         if (bulkLb == 0) throw cybozu::Exception(FUNC) << "bulkLb must not be 0";
+        if (!isValidHashTreeRegionLb(regionLb, bulkLb)) regionLb = 0;
+        if (!isValidHashAlgo(hashAlgo)) hashAlgo = HASH_ALGO_MURMUR3;
         if (!canApply(metaSt, diff)) {
             throw cybozu::Exception(FUNC) << "diff is not applicable" << metaSt << diff;
         }
@@ -914,23 +1095,29 @@ bool runHashReplServer(
     }
     volSt.progressLb = 0;
     ZeroResetter resetter(volSt.progressLb);
+    ChunkHashIndex index;
+    hashSeed = archive_local::openChunkHashIndexForSync(index, volInfo, hashSeed, hashAlgo);
     pkt.write(msgOk);
+    pkt.write(regionLb);
+    pkt.write(hashSeed);
+    pkt.write(hashAlgo);
     pkt.flush();
 
     logger.info() << "hash-repl-server started" << volId << sizeLb
-                  << bulkLb << cmprOpt << diff;
+                  << bulkLb << cmprOpt << diff << regionLb << hashAlgoToStr(hashAlgo);
     cybozu::Stopwatch stopwatch;
     StateMachineTransaction tran(volSt.sm, aArchived, atReplSync, FUNC);
     ul.unlock();
-    VirtualFullScanner virt;
-    archive_local::prepareVirtualFullScanner(virt, volSt, volInfo, sizeLb, diff.snapB);
+    IndexedVirtualReader reader;
+    archive_local::prepareIndexedVirtualReader(reader, volSt, volInfo, sizeLb, diff.snapB, index);
     cybozu::TmpFile tmpFile(volInfo.volDir.str());
-    if (!dirtyHashSyncServer(pkt, virt, sizeLb, bulkLb, uuid, hashSeed, true, tmpFile.fd(),
+    if (!dirtyHashSyncServer(pkt, reader, sizeLb, bulkLb, uuid, hashSeed, hashAlgo, true, tmpFile.fd(),
                              ga.discardType, volSt.stopState, ga.ps, volSt.progressLb,
-                             ga.fsyncIntervalSize)) {
+                             ga.fsyncIntervalSize, cmprOpt.numCpu, regionLb)) {
         logger.warn() << "hash-repl-server force-stopped" << volId;
         return false;
     }
+    logger.info() << "hash-repl-server-index" << volId << reader.nrHit() << reader.nrPut();
     diff.dataSize = cybozu::FileStat(tmpFile.fd()).size();
     tmpFile.save(volInfo.getDiffPath(diff).str());
     ul.lock();
@@ -940,9 +1127,6 @@ bool runHashReplServer(
     volInfo.setUuid(uuid);
     volSt.updateLastSyncTime();
     tran.commit(aArchived);
-    logger.info() << "hash-repl-server-mergeIn " << volId << virt.statIn();
-    logger.info() << "hash-repl-server-mergeOut" << volId << virt.statOut();
-    logger.info() << "hash-repl-server-mergeMemUsage" << volId << virt.memUsageStr();
     const std::string elapsed = util::getElapsedTimeStr(stopwatch.get());
     logger.info() << "hash-repl-server done" << volId << elapsed;
     return true;
@@ -1015,6 +1199,7 @@ bool runDiffReplClient(
     const MetaDiff mergedDiff = merge(diffV);
     LOGs.debug() << "diff-repl-diffs" << st0 << mergedDiff << diffV;
     DiffMerger merger;
+    merger.setPassThroughCmprType(cmpr.type);
     merger.addWdiffs(std::move(fileV));
     merger.prepare();
 
@@ -1114,8 +1299,9 @@ bool runResyncReplClient(
     const uint64_t sizeLb = volSt.lvCache.getLv().sizeLb();
     const MetaState metaSt = volInfo.getOldestMetaState();
     const cybozu::Uuid uuid = volInfo.getUuid();
-    const uint32_t hashSeed = uint32_t(metaSt.timestamp);
+    uint32_t hashSeed = uint32_t(metaSt.timestamp);
     const cybozu::Uuid archiveUuid = volInfo.getArchiveUuid();
+    uint64_t regionLb = getHashTreeRegionLb(ga.hashTreeMb, bulkLb);
 
     pkt.write(sizeLb);
     pkt.write(bulkLb);
@@ -1124,22 +1310,28 @@ bool runResyncReplClient(
     pkt.write(archiveUuid);
     pkt.write(ga.cmprOptForSync);
     pkt.write(hashSeed);
+    pkt.write(regionLb);
+    pkt.write(ga.hashAlgoForSync);
     pkt.flush();
     logger.debug() << "resync-repl-client" << sizeLb << bulkLb << metaSt
-                   << uuid << archiveUuid << ga.cmprOptForSync << hashSeed;
+                   << uuid << archiveUuid << ga.cmprOptForSync << hashSeed << regionLb << int(ga.hashAlgoForSync);
 
     std::string res;
     pkt.read(res);
     if (res != msgOk) throw cybozu::Exception(FUNC) << "not ok" << res;
+    pkt.read(regionLb);
+    pkt.read(hashSeed);
+    uint8_t hashAlgo;
+    pkt.read(hashAlgo);
 
     logger.info() << "resync-repl-client started" << volId << sizeLb
-                  << bulkLb << ga.cmprOptForSync << metaSt;
+                  << bulkLb << ga.cmprOptForSync << metaSt << regionLb << hashAlgoToStr(hashAlgo);
     VirtualFullScanner virt;
     archive_local::prepareVirtualFullScanner(virt, volSt, volInfo, sizeLb, metaSt.snapB);
     const std::atomic<uint64_t> fullScanLbPerSec(0);
     if (!dirtyHashSyncClient(pkt, virt, sizeLb, bulkLb,
-                             ga.cmprOptForSync, hashSeed,
-                             volSt.stopState, ga.ps, fullScanLbPerSec)) {
+                             ga.cmprOptForSync, hashSeed, hashAlgo,
+                             volSt.stopState, ga.ps, fullScanLbPerSec, regionLb)) {
         logger.warn() << "resync-repl-client force-stopped" << volId;
         return false;
     }
@@ -1164,6 +1356,8 @@ bool runResyncReplServer(
     cybozu::Uuid uuid, archiveUuid;
     CompressOpt cmprOpt;
     uint32_t hashSeed;
+    uint64_t regionLb;
+    uint8_t hashAlgo;
     try {
         pkt.read(sizeLb);
         pkt.read(bulkLb);
@@ -1172,10 +1366,16 @@ bool runResyncReplServer(
         pkt.read(archiveUuid);
         pkt.read(cmprOpt);
         pkt.read(hashSeed);
+        pkt.read(regionLb);
+        pkt.read(hashAlgo);
         logger.debug() << "resync-repl-server" << sizeLb << bulkLb << metaSt
-                       << uuid << cmprOpt << hashSeed;
+                       << uuid << cmprOpt << hashSeed << regionLb << int(hashAlgo);
         if (sizeLb == 0) throw cybozu::Exception(FUNC) << "sizeLb must not be 0";
         if (bulkLb == 0) throw cybozu::Exception(FUNC) << "bulkLb must not be 0";
+        if (!isValidHashTreeRegionLb(regionLb, bulkLb)) regionLb = 0;
+        if (!isValidHashAlgo(hashAlgo)) hashAlgo = HASH_ALGO_MURMUR3;
+        /* Resync overwrites the base image and removes all the snapshots and wdiffs. */
+        verifyActionNotRunning(volSt.ac, aDenyForResyncServer, FUNC);
         doAutoResizeIfNecessary(volSt, volInfo, sizeLb);
         verifyVolumeSize(volSt, volInfo, sizeLb, logger);
     } catch (std::exception &e) {
@@ -1184,11 +1384,16 @@ bool runResyncReplServer(
     }
     volSt.progressLb = 0;
     ZeroResetter resetter(volSt.progressLb);
+    ChunkHashIndex index;
+    hashSeed = archive_local::openChunkHashIndexForSync(index, volInfo, hashSeed, hashAlgo);
     pkt.write(msgOk);
+    pkt.write(regionLb);
+    pkt.write(hashSeed);
+    pkt.write(hashAlgo);
     pkt.flush();
 
     logger.info() << "resync-repl-server started" << volId << sizeLb
-                  << bulkLb << cmprOpt << metaSt;
+                  << bulkLb << cmprOpt << metaSt << regionLb << hashAlgoToStr(hashAlgo);
     cybozu::Stopwatch stopwatch;
 
     if (volSt.sm.get() == aArchived) {
@@ -1204,17 +1409,25 @@ bool runResyncReplServer(
     volInfo.clearAllSnapLv();
     volInfo.clearAllWdiffs();
     {
-        cybozu::util::File reader;
-        prepareRawFullScanner(reader, volSt, sizeLb);
+        cybozu::util::File fileR;
+        prepareRawFullScanner(fileR, volSt, sizeLb);
+        IndexedVirtualReader reader;
+        reader.virt().init(std::move(fileR), sizeLb, {}, 0);
+        if (index.isOpen()) {
+            reader.setIndex(&index);
+            index.beginUpdate();
+        }
         cybozu::util::File writer(volSt.lvCache.getLv().path().str(), O_RDWR);
         /* Reader and writer indicates the same block device.
            We must have independent file descriptors for them. */
-        if (!dirtyHashSyncServer(pkt, reader, sizeLb, bulkLb, uuid, hashSeed, false, writer.fd(),
+        if (!dirtyHashSyncServer(pkt, reader, sizeLb, bulkLb, uuid, hashSeed, hashAlgo, false, writer.fd(),
                                  ga.discardType, volSt.stopState, ga.ps, volSt.progressLb,
-                                 ga.fsyncIntervalSize)) {
+                                 ga.fsyncIntervalSize, cmprOpt.numCpu, regionLb)) {
             logger.warn() << "resync-repl-server force-stopped" << volId;
             return false;
         }
+        if (index.isOpen()) index.endUpdate();
+        logger.info() << "resync-repl-server-index" << volId << reader.nrHit() << reader.nrPut();
     }
     volInfo.setMetaState(metaSt);
     volSt.setLatestMetaState(metaSt);
@@ -1672,9 +1885,10 @@ void getBaseAll(protocol::GetCommandParams &p)
 /**
  * Get block hash to verify block devices.
  * sizeLb: 0 means whole device size.
+ * hashAlgo: hash algorithm (HASH_ALGO_XXX).
  */
 bool getBlockHash(
-    const std::string &volId, uint64_t gid, uint64_t bulkLb, uint64_t sizeLb,
+    const std::string &volId, uint64_t gid, uint64_t bulkLb, uint64_t sizeLb, uint8_t hashAlgo,
     packet::Packet &pkt, Logger &, cybozu::murmurhash3::Hash &hash)
 {
     const char *const FUNC = __func__;
@@ -1692,7 +1906,7 @@ bool getBlockHash(
 
     AlignedArray buf;
     packet::StreamControl ctrl(pkt.sock());
-    cybozu::murmurhash3::StreamHasher hasher(0); // seed is 0.
+    SyncStreamHasher hasher(0, hashAlgo); // seed is 0.
     uint64_t remaining = sizeLb;
     double t0 = cybozu::util::getTime();
     double tx0 = t0;
@@ -1912,6 +2126,13 @@ void getHandlerStat(protocol::GetCommandParams &p)
     p.logger.debug() << "get handler-stat succeeded";
 }
 
+void getIoSched(protocol::GetCommandParams &p)
+{
+    const StrVec ret = ga.ioSched.getStatus();
+    protocol::sendValueAndFin(p, ret);
+    p.logger.debug() << "get io-sched succeeded";
+}
+
 } // archive_local
 
 
@@ -2070,6 +2291,7 @@ void c2aClearVolServer(protocol::ServerParams &p)
         ArchiveVolInfo volInfo = getArchiveVolInfo(volId);
         volInfo.clear();
         getArchiveGlobal().remoteSnapshotManager.remove(volId);
+        getArchiveGlobal().ioSched.removeVolume(volId);
         tran.commit(aClear);
         pkt.writeFin(msgOk);
         logger.info() << "clearVol succeeded" << volId;
@@ -2217,6 +2439,94 @@ void c2aRestoreServer(protocol::ServerParams &p)
 }
 
 
+/**
+ * Export a snapshot as a read-only NBD device without restoring it.
+ * Read requests are served from the base image (or a cold snapshot) and wdiff files.
+ * The command returns after listening, and the server accepts only one client.
+ * The export finishes when the client disconnects or the volume is force-stopped.
+ */
+void c2aNbdExportServer(protocol::ServerParams &p)
+{
+    const char *const FUNC = __func__;
+    ProtocolLogger logger(ga.nodeId, p.clientId);
+    packet::Packet pkt(p.sock);
+
+    NbdExportParam param;
+    try {
+        param = parseNbdExportParam(protocol::recvStrVec(p.sock, 0, FUNC));
+    } catch (std::exception &e) {
+        logger.error() << e.what();
+        pkt.write(e.what());
+        return;
+    }
+    const std::string &volId = param.volId;
+    const uint64_t gid = param.gid;
+
+    ForegroundCounterTransaction foregroundTasksTran;
+    ArchiveVolState &volSt = getArchiveVolState(volId);
+    UniqueLock ul(volSt.mu);
+    VirtualSnapshotReader virt;
+    NbdListener listener;
+    try {
+        verifyMaxForegroundTasks(ga.maxForegroundTasks, FUNC);
+        verifyNotStopping(volSt.stopState, volId, FUNC);
+        /* The base image must not be changed by hash/repl sync during export.
+           Resync is denied by the resync server while the export is running.
+           Restore (which may remove cold snapshots), merge and del-cold
+           are also denied while the export is running. */
+        verifyStateIn(volSt.sm.get(), {aArchived, atWdiffRecv}, FUNC);
+        verifyActionNotRunning(volSt.ac, aDenyForNbdExport, FUNC);
+        ArchiveVolInfo volInfo = getArchiveVolInfo(volId);
+        const uint64_t sizeLb = volSt.lvCache.getLv().sizeLb();
+        archive_local::prepareVirtualSnapshotReader(virt, volSt, volInfo, sizeLb, gid);
+        listener.listen(param.addr);
+    } catch (std::exception &e) {
+        logger.error() << e.what();
+        pkt.write(e.what());
+        return;
+    }
+    pkt.writeFin(msgAccept);
+
+    ActionCounterTransaction tran(volSt.ac, aaNbdExport);
+    ul.unlock();
+    try {
+        logger.info() << "nbd-export started" << volId << gid << param.addr << virt.nrRecords();
+        auto shouldStop = [&]() {
+            return volSt.stopState == ForceStopping || ga.ps.isForceShutdown();
+        };
+        cybozu::util::File client;
+        if (!listener.accept(client, param.acceptTimeoutSec * 1000, shouldStop)) {
+            logger.warn() << FUNC << "no client connected" << volId << gid << param.addr;
+            return;
+        }
+        listener.close();
+        NbdServer server(volId, virt.sizeLb() * LOGICAL_BLOCK_SIZE,
+                         [&](uint64_t offset, size_t size, void *data) {
+            const uint64_t addr = offset / LOGICAL_BLOCK_SIZE;
+            const uint64_t endAddr = (offset + size + LOGICAL_BLOCK_SIZE - 1) / LOGICAL_BLOCK_SIZE;
+            if (offset % LOGICAL_BLOCK_SIZE == 0 && size % LOGICAL_BLOCK_SIZE == 0) {
+                virt.read(addr, endAddr - addr, data);
+                return;
+            }
+            AlignedArray buf((endAddr - addr) * LOGICAL_BLOCK_SIZE, false);
+            virt.read(addr, endAddr - addr, buf.data());
+            ::memcpy(data, buf.data() + offset % LOGICAL_BLOCK_SIZE, size);
+        });
+        cybozu::Stopwatch stopwatch;
+        const bool isFinished = server.serve(client, shouldStop);
+        const std::string elapsed = util::getElapsedTimeStr(stopwatch.get());
+        if (!isFinished) {
+            logger.warn() << FUNC << "force stopped" << volId << gid;
+            return;
+        }
+        logger.info() << "nbd-export finished" << volId << gid
+                      << server.nrReads() << server.readBytes() << elapsed;
+    } catch (std::exception &e) {
+        logger.error() << FUNC << volId << gid << e.what();
+    }
+}
+
+
 /**
  * !!!CAUSION!!!
  * This is for test and debug.
@@ -2729,7 +3039,8 @@ void c2aBlockHashServer(protocol::ServerParams &p)
     bool sendErr = true;
 
     try {
-        const VirtualFullScanParam param = parseVirtualFullScanParam(protocol::recvStrVec(p.sock, 0, FUNC));
+        const BlockHashParam bhParam = parseBlockHashParam(protocol::recvStrVec(p.sock, 0, FUNC));
+        const VirtualFullScanParam &param = bhParam.param;
         const std::string &volId = param.volId;
         const uint64_t gid = param.gid;
         const uint64_t bulkLb = param.bulkLb;
@@ -2742,7 +3053,7 @@ void c2aBlockHashServer(protocol::ServerParams &p)
         pkt.flush();
 
         cybozu::murmurhash3::Hash hash;
-        if (!archive_local::getBlockHash(volId, gid, bulkLb, sizeLb, pkt, logger, hash)) {
+        if (!archive_local::getBlockHash(volId, gid, bulkLb, sizeLb, bhParam.hashAlgo, pkt, logger, hash)) {
             throw cybozu::Exception(FUNC) << "force stopped" << volId;
         }
         pkt.write(msgOk);
@@ -2870,6 +3181,41 @@ void c2aGarbageCollectDiffServer(protocol::ServerParams &p)
 }
 
 
+void c2aSetIoSchedServer(protocol::ServerParams &p)
+{
+    const char *const FUNC = __func__;
+    ProtocolLogger logger(ga.nodeId, p.clientId);
+    packet::Packet pkt(p.sock);
+
+    try {
+        const IoSchedParam param = parseIoSchedParam(protocol::recvStrVec(p.sock, 0, FUNC));
+        IoScheduler &ioSched = getArchiveGlobal().ioSched;
+        if (param.name == "weight") {
+            ioSched.setWeight(param.volId, param.value);
+        } else if (param.name == "prio") {
+            ioSched.setPriority(param.volId, param.value);
+        } else if (param.name == "backlog-first") {
+            ioSched.setBacklogFirst(param.value != 0);
+        } else {
+            /* bps or iops. */
+            uint64_t bps, iops;
+            ioSched.getLimit(bps, iops);
+            if (param.name == "bps") {
+                bps = param.value;
+            } else {
+                iops = param.value;
+            }
+            ioSched.setLimit(bps, iops);
+        }
+        pkt.writeFin(msgOk);
+        logger.info() << "set-io-sched" << param.name << param.volId << param.value;
+    } catch (std::exception &e) {
+        logger.error() << e.what();
+        pkt.write(e.what());
+    }
+}
+
+
 void s2aGatherLatestSnapServer(protocol::ServerParams &p)
 {
     const char *const FUNC = __func__;
@@ -19,6 +19,9 @@
 #include "walb_diff_io.hpp"
 #include "snap_info.hpp"
 #include "ts_delta.hpp"
+#include "io_scheduler.hpp"
+#include "nbd_server.hpp"
+#include "chunk_hash_index.hpp"
 
 namespace walb {
 
@@ -156,8 +159,14 @@ struct ArchiveSingleton
     bool keepOneColdSnapshot;
     size_t maxOpenDiffs; // 0 means unlimited.
     size_t pctApplySleep; // 0 to 100. 0 means no sleep.
+    size_t mergeConcurrency; // number of threads to merge/apply wdiffs.
+    size_t applyIoDepthMb; // in-flight IO size of each writer queue.
+    size_t applyMaxIoKb; // max size of a merged write IO in diff application.
+    size_t applyPrefetchConcurrency; // number of threads to uncompress IOs ahead of each writer queue.
+    size_t hashTreeMb; // region size of the tree mode in hash-repl/resync-repl. 0 means the flat mode.
     bool allowExec;
     CompressOpt cmprOptForSync;
+    uint8_t hashAlgoForSync; // hash algorithm proposed in hash-repl/resync-repl.
 
     /**
      * Writable and must be thread-safe.
@@ -166,6 +175,7 @@ struct ArchiveSingleton
     AtomicMap<ArchiveVolState> stMap;
     archive_local::RemoteSnapshotManager remoteSnapshotManager;
     protocol::HandlerStatMgr handlerStatMgr;
+    IoScheduler ioSched; // shared by apply, restore, and merge of all the volumes.
 
     void setSocketParams(cybozu::Socket& sock) const {
         util::setSocketParams(sock, keepAliveParams, socketTimeout);
@@ -241,10 +251,18 @@ void prepareRawFullScanner(
 void prepareVirtualFullScanner(
     VirtualFullScanner &virt, ArchiveVolState &volSt,
     ArchiveVolInfo &volInfo, uint64_t sizeLb, const MetaSnap &snap);
+void prepareVirtualSnapshotReader(
+    VirtualSnapshotReader &virt, ArchiveVolState &volSt,
+    ArchiveVolInfo &volInfo, uint64_t sizeLb, uint64_t gid);
+void prepareIndexedVirtualReader(
+    IndexedVirtualReader &reader, ArchiveVolState &volSt,
+    ArchiveVolInfo &volInfo, uint64_t sizeLb, const MetaSnap &snap, ChunkHashIndex &index);
+uint32_t openChunkHashIndexForSync(ChunkHashIndex &index, ArchiveVolInfo &volInfo, uint32_t hashSeed, uint8_t hashAlgo);
 void verifyApplicable(const std::string& volId, uint64_t gid);
-bool applyOpenedDiffs(std::vector<cybozu::util::File>&& fileV, cybozu::lvm::Lv& lv,
+bool applyOpenedDiffs(const std::string& volId, std::vector<cybozu::util::File>&& fileV, cybozu::lvm::Lv& lv,
                       const std::atomic<int>& stopState,
-                      DiffStatistics& statIn, DiffStatistics& statOut, std::string& memUsageStr);
+                      DiffStatistics& statIn, DiffStatistics& statOut, std::string& memUsageStr,
+                      ChunkHashIndex *index = nullptr);
 bool applyDiffsToVolume(const std::string& volId, uint64_t gid);
 void verifyNotApplying(const std::string &volId);
 void verifyMergeable(const std::string &volId, uint64_t gid);
@@ -458,7 +476,7 @@ inline void getArchiveUuid(protocol::GetCommandParams &p)
 void getBase(protocol::GetCommandParams &p);
 void getBaseAll(protocol::GetCommandParams &p);
 bool getBlockHash(
-    const std::string &volId, uint64_t gid, uint64_t bulkLb, uint64_t sizeLb,
+    const std::string &volId, uint64_t gid, uint64_t bulkLb, uint64_t sizeLb, uint8_t hashAlgo,
     packet::Packet &pkt, Logger &, cybozu::murmurhash3::Hash &hash);
 bool virtualFullScanServer(
     const std::string &volId, uint64_t gid, uint64_t bulkLb, uint64_t sizeLb,
@@ -515,6 +533,7 @@ std::string getLatestSnapForVolume(const std::string& volId);
 void getLatestSnap(protocol::GetCommandParams &p);
 void getTsDelta(protocol::GetCommandParams &p);
 void getHandlerStat(protocol::GetCommandParams &p);
+void getIoSched(protocol::GetCommandParams &p);
 
 } // namespace archive_local
 
@@ -585,6 +604,8 @@ void c2aSetUuidServer(protocol::ServerParams &p);
 void c2aSetStateServer(protocol::ServerParams &p);
 void c2aSetBaseServer(protocol::ServerParams &p);
 void c2aGarbageCollectDiffServer(protocol::ServerParams &p);
+void c2aSetIoSchedServer(protocol::ServerParams &p);
+void c2aNbdExportServer(protocol::ServerParams &p);
 void s2aGatherLatestSnapServer(protocol::ServerParams &p);
 #ifndef NDEBUG
 void c2aDebugServer(protocol::ServerParams &p);
@@ -619,6 +640,7 @@ const protocol::GetCommandHandlerMap archiveGetHandlerMap = {
     { getLatestSnapTN, archive_local::getLatestSnap },
     { getTsDeltaTN, archive_local::getTsDelta },
     { getHandlerStatTN, archive_local::getHandlerStat },
+    { getIoSchedTN, archive_local::getIoSched },
 };
 
 inline void c2aGetServer(protocol::ServerParams &p)
@@ -658,6 +680,8 @@ const protocol::Str2ServerHandler archiveHandlerMap = {
     { enableSnapshotCN, c2aEnableSnapshot },
     { virtualFullScanCN, c2aVirtualFullScan },
     { gcDiffCN, c2aGarbageCollectDiffServer },
+    { setIoSchedCN, c2aSetIoSchedServer },
+    { nbdExportCN, c2aNbdExportServer },
 #ifndef NDEBUG
     { debugCN, c2aDebugServer },
 #endif
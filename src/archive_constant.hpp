@@ -67,17 +67,21 @@ const char *const aaApply = "Apply";
 const char *const aaRestore = "Restore";
 const char *const aaReplSync = "ReplSyncAsClient";
 const char *const aaResize = "Resize";
+const char *const aaNbdExport = "NbdExport";
 
-const StrVec allActionVec = {aaMerge, aaApply, aaRestore, aaReplSync, aaResize};
+const StrVec allActionVec = {aaMerge, aaApply, aaRestore, aaReplSync, aaResize, aaNbdExport};
 
-const StrVec aDenyForRestore = {aaRestore, aaResize};
+const StrVec aDenyForRestore = {aaRestore, aaResize, aaNbdExport};
 const StrVec aDenyForReplSyncClient = {aaRestore, aaReplSync, aaApply, aaMerge, aaResize};
-const StrVec aDenyForApply = {aaRestore, aaReplSync, aaApply, aaMerge, aaResize};
-const StrVec aDenyForMerge = {aaApply, aaMerge, aaResize};
-const StrVec aDenyForResize = {aaRestore, aaReplSync, aaApply, aaResize};
+const StrVec aDenyForApply = {aaRestore, aaReplSync, aaApply, aaMerge, aaResize, aaNbdExport};
+const StrVec aDenyForMerge = {aaApply, aaMerge, aaResize, aaNbdExport};
+const StrVec aDenyForResize = {aaRestore, aaReplSync, aaApply, aaResize, aaNbdExport};
+const StrVec aDenyForNbdExport = {aaRestore, aaApply, aaMerge, aaResize};
+const StrVec aDenyForResyncServer = {aaRestore, aaReplSync, aaApply, aaMerge, aaResize, aaNbdExport};
 const StrVec aDenyForChangeSnapshot = {aaApply, aaMerge};
 
 const StrVec aActionOnLvm = {aaRestore, aaResize};
+const StrVec aDenyForDelCold = {aaRestore, aaResize, aaNbdExport};
 
 const std::string BASE_VOLUME_PREFIX = "wb_";
 const std::string RESTORED_VOLUME_PREFIX = "wr_";
@@ -310,8 +310,9 @@ MetaState ArchiveVolInfo::getMetaStateForDetail(uint64_t gid, bool &useCold, boo
 {
     MetaState st = getMetaState();
     useCold = false;
+    if (!isApply) return getCheapestMetaStateForRestore(st, gid, useCold);
     uint64_t coldGid = 0;
-    if (isApply && st.isApplying) return st;
+    if (st.isApplying) return st;
     if (!lvC_.searchColdNoGreaterThanGid(gid, coldGid)) return st;
     if (coldGid <= st.snapB.gidB) return st;
     useCold = true;
@@ -319,6 +320,30 @@ MetaState ArchiveVolInfo::getMetaStateForDetail(uint64_t gid, bool &useCold, boo
 }
 
 
+MetaState ArchiveVolInfo::getCheapestMetaStateForRestore(const MetaState &baseSt, uint64_t gid, bool &useCold) const
+{
+    const MetaDiffManager &mgr = wdiffs_.getMgr();
+    uint64_t minCost = UINT64_MAX;
+    bool found = mgr.getRestoreCost(baseSt, gid, minCost);
+    uint64_t minColdGid = 0;
+    useCold = false;
+    for (const VolLvCache::LvMap::value_type &p : lvC_.getColdMap()) {
+        const uint64_t coldGid = p.first;
+        if (coldGid > gid) break;
+        uint64_t cost;
+        if (!mgr.getRestoreCost(MetaState(MetaSnap(coldGid), 0), gid, cost)) continue;
+        /* Prefer the newer one if their costs are the same. */
+        if (found && cost > minCost) continue;
+        found = true;
+        minCost = cost;
+        minColdGid = coldGid;
+        useCold = true;
+    }
+    if (!useCold) return baseSt;
+    return MetaState(MetaSnap(minColdGid), getColdTimestamp(minColdGid));
+}
+
+
 void ArchiveVolInfo::setState(const std::string& newState)
 {
     const char *tbl[] = {
@@ -358,6 +383,7 @@ void ArchiveVolInfo::createLv(uint64_t sizeLb)
     if (sizeLb == 0) {
         throw cybozu::Exception("ArchiveVolInfo::createLv:sizeLb is zero");
     }
+    removeChunkHashIndex();
     if (lvExists()) {
         cybozu::lvm::Lv lv = getLv();
         const bool zeroClear = true;
@@ -411,6 +437,7 @@ void ArchiveVolInfo::growLv(uint64_t newSizeLb, bool doZeroClear)
 void ArchiveVolInfo::prepareBaseImageForFullRepl(uint64_t sizeLb, uint64_t startLb)
 {
     assert(startLb < sizeLb);
+    removeChunkHashIndex();
     if (startLb == 0) {
         createLv(sizeLb);
         return;
@@ -552,6 +579,7 @@ void ArchiveVolInfo::makeColdToBase(uint64_t gid)
     if (cybozu::lvm::existsFile(vgName, tmpLvName)) {
         cybozu::lvm::remove(cybozu::lvm::getLvStr(vgName, tmpLvName));
     }
+    removeChunkHashIndex();
     cybozu::lvm::Lv tmpLv = cybozu::lvm::renameLv(vgName, coldLv.name(), tmpLvName);
     lvC_.removeCold(gid);
     lvC_.setTmpColdToBaseLv(tmpLv);
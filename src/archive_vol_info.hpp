@@ -26,6 +26,8 @@
 #include "archive_constant.hpp"
 #include "random.hpp"
 #include "full_repl_state.hpp"
+#include "chunk_hash_index.hpp"
+#include "constant.hpp"
 
 namespace walb {
 
@@ -329,6 +331,12 @@ public:
         return getMetaStateForDetail(gid, useCold, true);
     }
     MetaState getMetaStateForDetail(uint64_t gid, bool &useCold, bool isApply) const;
+    /**
+     * Choose the base image or a cold snapshot as the starting point to restore a snapshot
+     * where total data size of the diffs to apply is the smallest.
+     * The base state will be returned if the snapshot can not be restored from any of them.
+     */
+    MetaState getCheapestMetaStateForRestore(const MetaState &baseSt, uint64_t gid, bool &useCold) const;
     void setState(const std::string& newState);
     std::string getState() const {
         std::string st;
@@ -361,6 +369,26 @@ public:
     }
     uint64_t initFullReplResume(uint64_t sizeLb, const cybozu::Uuid& archiveUuid,
                                 const MetaState& metaSt, FullReplState& fullReplSt);
+    cybozu::FilePath getChunkHashIndexPath() const {
+        return volDir + "chunk_hash_index";
+    }
+    /**
+     * Open the chunk hash index of the base image.
+     */
+    void openChunkHashIndex(ChunkHashIndex &index) const {
+        index.open(getChunkHashIndexPath().str(), lvC_.getLv().sizeLb(), DEFAULT_BULK_LB);
+    }
+    /**
+     * Call this before the base image is replaced.
+     * This throws an exception if the index remains, because a stale index breaks hash sync.
+     */
+    void removeChunkHashIndex() {
+        const cybozu::FilePath path = getChunkHashIndexPath();
+        removeFile(path);
+        if (path.stat().exists()) {
+            throw cybozu::Exception(__func__) << "could not remove chunk hash index" << path.str();
+        }
+    }
     bool existsVolDir() const {
         return volDir.stat().isDirectory();
     }
@@ -50,6 +50,18 @@ void AsyncBdevReader::read(void *data, size_t size)
     }
 }
 
+void AsyncBdevReader::seek(uint64_t offsetLb)
+{
+    const uint64_t offset = offsetLb * LOGICAL_BLOCK_SIZE;
+    if (offset % pbs_ != 0 || offset > devTotal_) {
+        throw cybozu::Exception(NAME()) << "bad seek offset" << offsetLb << pbs_ << devTotal_;
+    }
+    while (!ioQ_.empty()) waitForIo();
+    ringBuf_.reset();
+    devOffset_ = offset;
+    readAhead();
+}
+
 bool AsyncBdevReader::prepareAheadIo()
 {
     if (aio_.isQueueFull()) return false;
@@ -100,4 +112,75 @@ size_t AsyncBdevReader::decideIoSize() const
     return size_t(s);
 }
 
+void ReadAheadTuner::init(size_t pbs, size_t maxWindowSize, size_t maxIoSize, const ReadAheadParams &init)
+{
+    if (pbs == 0 || maxWindowSize < pbs || maxIoSize < pbs) {
+        throw cybozu::Exception(NAME()) << "bad parameters" << pbs << maxWindowSize << maxIoSize;
+    }
+    pbs_ = pbs;
+    maxWindowSize_ = alignDown(maxWindowSize);
+    maxIoSize_ = alignDown(std::min(maxIoSize, maxWindowSize_));
+    minIoSize_ = alignDown(std::min(size_t(MIN_IO_SIZE), maxIoSize_));
+    minWindowSize_ = std::min(minIoSize_ * 4, maxWindowSize_);
+    cur_.ioSize = alignDown(std::min(std::max(init.ioSize, minIoSize_), maxIoSize_));
+    const size_t minWindowSize = std::max(minWindowSize_, cur_.ioSize * 2);
+    cur_.windowSize = alignDown(std::min(std::max(init.windowSize, minWindowSize), maxWindowSize_));
+    trial_ = Trial::NONE;
+    isIoSizeSaturated_ = false;
+    isWindowSaturated_ = false;
+    prevThroughput_ = 0;
+    throughput_ = 0;
+    waitSec_ = 0;
+    clearEpoch();
+}
+
+void ReadAheadTuner::update(double elapsedSec)
+{
+    elapsedSec = std::max(elapsedSec, 0.000001);
+    throughput_ = epochBytes_ / elapsedSec;
+    waitSec_ = epochIos_ == 0 ? 0 : epochWaitSec_ / epochIos_;
+    const double waitRatio = epochWaitSec_ / elapsedSec;
+    clearEpoch();
+
+    if (trial_ != Trial::NONE) {
+        if (throughput_ < prevThroughput_ * (1.0 + MIN_GAIN)) {
+            /* No gain so revert it. */
+            if (trial_ == Trial::IO_SIZE) {
+                isIoSizeSaturated_ = true;
+            } else {
+                isWindowSaturated_ = true;
+            }
+            cur_ = beforeTrial_;
+        } else {
+            prevThroughput_ = throughput_;
+        }
+        trial_ = Trial::NONE;
+        return;
+    }
+    prevThroughput_ = throughput_;
+
+    if (waitRatio < IDLE_WAIT_RATIO) {
+        /* The consumer is the bottleneck. */
+        const size_t s = std::max(std::max(cur_.windowSize / 2, cur_.ioSize * 2), minWindowSize_);
+        if (s < cur_.windowSize) {
+            cur_.windowSize = alignDown(s);
+            isWindowSaturated_ = false;
+        }
+        return;
+    }
+    if (waitRatio < STARVED_WAIT_RATIO) return;
+
+    /* The consumer is starved. */
+    beforeTrial_ = cur_;
+    const size_t ioSize = std::min(cur_.ioSize * 2, maxIoSize_);
+    if (!isIoSizeSaturated_ && cur_.ioSize < ioSize && ioSize * 2 <= cur_.windowSize) {
+        /* Keep at least two IOs in flight. */
+        cur_.ioSize = ioSize;
+        trial_ = Trial::IO_SIZE;
+    } else if (!isWindowSaturated_ && cur_.windowSize < maxWindowSize_) {
+        cur_.windowSize = std::min(cur_.windowSize * 2, maxWindowSize_);
+        trial_ = Trial::WINDOW;
+    }
+}
+
 } // namespace walb
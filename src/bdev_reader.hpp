@@ -3,6 +3,7 @@
 #include "fileio.hpp"
 #include "walb_types.hpp"
 #include "bdev_util.hpp"
+#include "time.hpp"
 #include "cybozu/exception.hpp"
 
 namespace walb {
@@ -64,6 +65,8 @@ public:
         readableSize_ = 0;
     }
     size_t getFreeSize() const;
+    char *data() { return buf_.data(); }
+    size_t capacity() const { return buf_.size(); }
 
     /**
      * Max size of the next contiguous memory.
@@ -93,6 +96,101 @@ private:
     size_t consume(void *data, size_t size, bool doCopy);
 };
 
+/**
+ * Read-ahead parameters of a sequential reader.
+ */
+struct ReadAheadParams
+{
+    size_t windowSize; /* max total size of submitted and unread data [byte]. */
+    size_t ioSize; /* size of each read IO [byte]. */
+};
+
+struct ReadAheadStat
+{
+    ReadAheadParams params;
+    double throughput; /* [byte/sec] in the last epoch. */
+    double waitSec; /* blocking time per IO in the last epoch. */
+
+    std::string str() const {
+        return cybozu::util::formatString(
+            "window %zu ioSize %zu throughput %.0f waitUs %.0f"
+            , params.windowSize, params.ioSize, throughput, waitSec * 1000000);
+    }
+};
+
+/**
+ * Tune read-ahead window size and IO size from measured throughput and latency.
+ *
+ * The reader calls addCompleted() for each completed IO with the time it was
+ * blocked to wait for the completion, and update() when isEpochEnd() is true.
+ *
+ * While the consumer is starved, the tuner tries doubling IO size or
+ * window size, and keeps the change only if the throughput improves.
+ * While the consumer is the bottleneck, the window shrinks
+ * not to put extra IO pressure on the device.
+ */
+class ReadAheadTuner
+{
+private:
+    size_t pbs_;
+    size_t minIoSize_;
+    size_t maxIoSize_;
+    size_t minWindowSize_;
+    size_t maxWindowSize_;
+    ReadAheadParams cur_;
+
+    enum class Trial { NONE, IO_SIZE, WINDOW };
+    Trial trial_;
+    ReadAheadParams beforeTrial_;
+    bool isIoSizeSaturated_;
+    bool isWindowSaturated_;
+    double prevThroughput_;
+
+    /* Measurement in the current epoch. */
+    uint64_t epochBytes_;
+    size_t epochIos_;
+    double epochWaitSec_;
+
+    double throughput_;
+    double waitSec_;
+
+    static constexpr size_t MIN_IO_SIZE = 64U << 10; /* 64KiB. */
+    static constexpr double MIN_GAIN = 0.05;
+    static constexpr double STARVED_WAIT_RATIO = 0.25;
+    static constexpr double IDLE_WAIT_RATIO = 0.02;
+public:
+    static constexpr const char *NAME() { return "ReadAheadTuner"; }
+    /**
+     * @maxWindowSize memory cap [byte].
+     * @maxIoSize max IO size [byte].
+     * @init initial parameters. They will be clamped.
+     */
+    void init(size_t pbs, size_t maxWindowSize, size_t maxIoSize, const ReadAheadParams &init);
+    const ReadAheadParams &params() const { return cur_; }
+    ReadAheadStat getStat() const { return {cur_, throughput_, waitSec_}; }
+    void addCompleted(size_t size, double waitSec) {
+        epochBytes_ += size;
+        epochIos_++;
+        epochWaitSec_ += waitSec;
+    }
+    bool isEpochEnd() const {
+        return epochBytes_ >= cur_.windowSize * 2;
+    }
+    /**
+     * @elapsedSec elapsed time of the epoch.
+     */
+    void update(double elapsedSec);
+    void clearEpoch() {
+        epochBytes_ = 0;
+        epochIos_ = 0;
+        epochWaitSec_ = 0;
+    }
+private:
+    size_t alignDown(size_t size) const {
+        return std::max(size / pbs_ * pbs_, pbs_);
+    }
+};
+
 /**
  * Asynchronous sequential reader of block device using O_DIRECT.
  * Minimum IO size is physical block size.
@@ -144,6 +242,7 @@ public:
         verifyMultiple(maxIoSize_, pbs_, "bad maxIoSize");
         verifyMultiple(bufferSize, pbs_, "bad bufferSize");
         ringBuf_.init(bufferSize);
+        aio_.registerBuffer(ringBuf_.data(), ringBuf_.capacity());
         readAhead();
     }
     ~AsyncBdevReader() noexcept {
@@ -159,6 +258,12 @@ public:
      * @size read size [byte].
      */
     void read(void *data, size_t size);
+    /**
+     * Change the position to read next.
+     * Data already read ahead will be discarded.
+     * @offsetLb [logical block]. It must be aligned to the physical block size.
+     */
+    void seek(uint64_t offsetLb);
 private:
     void verifyMultiple(uint64_t size, size_t pbs, const char *msg) const {
         assert(pbs != 0);
@@ -20,6 +20,24 @@ void Io::print(::FILE *p) const
 }
 
 
+std::vector<struct iovec> Io::getIovec() const
+{
+    std::vector<struct iovec> iovV;
+    for (const AlignedArrayOrPtr &b : blocks_) {
+        char *p = const_cast<char *>(b.data());
+        if (!iovV.empty()) {
+            struct iovec &last = iovV.back();
+            if (static_cast<char *>(last.iov_base) + last.iov_len == p) {
+                last.iov_len += b.size;
+                continue;
+            }
+        }
+        iovV.push_back({p, b.size});
+    }
+    return iovV;
+}
+
+
 bool Io::canMerge(const Io& rhs) const
 {
     /* They must have data buffers. */
@@ -27,16 +45,14 @@ bool Io::canMerge(const Io& rhs) const
         return false;
     }
 
-    /* Check Io targets and buffers are adjacent. */
+    /* Check Io targets are adjacent. */
     if (offset_ + size_ != rhs.offset_) {
         //::fprintf(::stderr, "offset mismatch\n"); //debug
         return false;
     }
 
-    /* Check buffers are contiguous. */
-    const char *p0 = blocks_.front().data();
-    const char *p1 = rhs.blocks_.front().data();
-    return p0 + size_ == p1;
+    /* Buffers need not be contiguous since the IO will be vectored. */
+    return blocks_.size() + rhs.blocks_.size() <= MAX_IOV_NR;
 }
 
 
@@ -54,17 +70,19 @@ bool Io::tryMerge(Io& rhs)
 }
 
 
-void IoQueue::add(Io &&io)
+bool IoQueue::add(Io &&io)
 {
     assert(io.size() > 0);
     fetchedSize_ += io.size();
-    if (hasFetched() && tryMerge(*fetchedBegin_, io)) {
-        return;
+    /* Only the last IO can be merged not to change the order of overlapped IOs. */
+    if (hasFetched() && tryMerge(list_.back(), io)) {
+        return true;
     }
     list_.push_back(std::move(io));
     if (fetchedBegin_ == list_.end()) {
         --fetchedBegin_;
     }
+    return false;
 }
 
 
@@ -106,8 +124,12 @@ void ReadyQueue::submit(cybozu::aio::Aio &aio)
 
         /* Prepare aio. */
         assert(iop->nOverlapped == 0);
-        iop->aioKey = aio.prepareWrite(
-            iop->offset(), iop->size(), iop->data());
+        if (iop->nrBlocks() == 1) {
+            iop->aioKey = aio.prepareWrite(
+                iop->offset(), iop->size(), iop->data());
+        } else {
+            iop->aioKey = aio.prepareWritev(iop->offset(), iop->getIovec());
+        }
         assert(iop->aioKey > 0);
         nBulk++;
     }
@@ -254,11 +276,13 @@ void WriteIoStatistics::clear()
     writtenNr = 0;
     overwrittenNr = 0;
     clippedNr = 0;
+    mergedNr = 0;
     normalLb = 0;
     discardLb = 0;
     writtenLb = 0;
     overwrittenLb = 0;
     clippedLb = 0;
+    mergedLb = 0;
 }
 
 
@@ -270,11 +294,13 @@ void WriteIoStatistics::print(::FILE *fp) const
               "written:     %10zu ( %10" PRIu64 " LB)\n"
               "overwritten: %10zu ( %10" PRIu64 " LB)\n"
               "clipped:     %10zu ( %10" PRIu64 " LB)\n"
+              "merged:      %10zu ( %10" PRIu64 " LB)\n"
               , normalNr, normalLb
               , discardNr, discardLb
               , writtenNr, writtenLb
               , overwrittenNr, overwrittenLb
-              , clippedNr, clippedLb);
+              , clippedNr, clippedLb
+              , mergedNr, mergedLb);
 }
 
 
@@ -285,12 +311,14 @@ std::ostream& operator<<(std::ostream& os, const WriteIoStatistics& stat)
        << " nrW " << stat.writtenNr
        << " nrO " << stat.overwrittenNr
        << " nrC " << stat.clippedNr
+       << " nrM " << stat.mergedNr
        << "  "
        << "lbN " << stat.normalLb
        << " lbD " << stat.discardLb
        << " lbW " << stat.writtenLb
        << " lbO " << stat.overwrittenLb
-       << " lbC " << stat.clippedLb;
+       << " lbC " << stat.clippedLb
+       << " lbM " << stat.mergedLb;
     return os;
 }
 
@@ -298,15 +326,31 @@ std::ostream& operator<<(std::ostream& os, const WriteIoStatistics& stat)
 bool AsyncBdevWriter::discard(uint64_t offLb, uint32_t sizeLb)
 {
     if (isClipped(offLb, sizeLb)) return false;
-    // This is not clever method to serialize IOs.
-    waitForAll();
-    cybozu::util::issueDiscard(bdevFile_.fd(), offLb, sizeLb);
     stat_.addDiscard(sizeLb);
-    stat_.addWritten(sizeLb);
+    if (discardSizeLb_ > 0 && discardOffLb_ + discardSizeLb_ == offLb) {
+        discardSizeLb_ += sizeLb;
+        stat_.addMerged(sizeLb);
+        return true;
+    }
+    issuePendingDiscard();
+    discardOffLb_ = offLb;
+    discardSizeLb_ = sizeLb;
     return true;
 }
 
 
+void AsyncBdevWriter::issuePendingDiscard()
+{
+    if (discardSizeLb_ == 0) return;
+    // This is not clever method to serialize IOs.
+    processIos(true);
+    waitForAllProcessingIos();
+    cybozu::util::issueDiscard(bdevFile_.fd(), discardOffLb_, discardSizeLb_);
+    stat_.addWritten(discardSizeLb_);
+    discardSizeLb_ = 0;
+}
+
+
 void AsyncBdevWriter::waitForAllProcessingIos()
 {
     while (ioQ_.hasProcessing()) {
@@ -337,7 +381,7 @@ void AsyncBdevWriter::processIos(bool force)
         while (hasManyProcessingIos()) {
             waitForAnIoCompletion();
         }
-        while (ioQ_.hasFetched()) {
+        while (force ? ioQ_.hasFetched() : ioQ_.hasFetchedNotGrowing()) {
             bdev_writer_local::Io& io = ioQ_.nextFetched();
             overlapped_.add(io);
             if (io.nOverlapped == 0) {
@@ -1,12 +1,15 @@
 #pragma once
 #include <list>
+#include <vector>
 #include <cassert>
 #include <cstdio>
+#include <sys/uio.h>
 #include "walb_types.hpp"
 #include "aio_util.hpp"
 #include "range_util.hpp"
 #include "constant.hpp"
 #include "bdev_util.hpp"
+#include "thread_util.hpp"
 
 //#define USE_DEBUG_TRACE
 
@@ -19,6 +22,7 @@ struct AlignedArrayOrPtr
 {
     AlignedArray buf;
     const char *ptr;
+    size_t size; // [bytes].
 
     const char *data() const {
         if (ptr == nullptr) {
@@ -30,8 +34,16 @@ struct AlignedArrayOrPtr
 };
 
 
+/**
+ * Max number of buffers of a vectored IO (UIO_MAXIOV).
+ */
+const size_t MAX_IOV_NR = 1024;
+
+
 /**
  * Io data.
+ * Adjacent IOs can be merged into one IO with multiple buffers,
+ * which will be submitted as a vectored IO.
  */
 class Io
 {
@@ -66,14 +78,19 @@ public:
     size_t size() const { return size_; }
     const char *data() const { return blocks_.front().data(); }
     bool empty() const { return blocks_.empty(); }
+    size_t nrBlocks() const { return blocks_.size(); }
+    /**
+     * Buffers whose memory areas are contiguous are put into one iovec.
+     */
+    std::vector<struct iovec> getIovec() const;
 
     void setBlock(AlignedArray &&b) {
         assert(blocks_.empty());
-        blocks_.push_back({std::move(b), nullptr});
+        blocks_.push_back({std::move(b), nullptr, size_});
     }
     void setPtr(const char *ptr) {
         assert(blocks_.empty());
-        blocks_.push_back({AlignedArray(), ptr});
+        blocks_.push_back({AlignedArray(), ptr, size_});
     }
     void print(::FILE *p = ::stdout) const;
 
@@ -224,7 +241,7 @@ class IoQueue
     typedef std::list<Io> List;
     List list_;
     List::iterator fetchedBegin_;
-    static const size_t maxIoSize_ = MEBI; // 1 MiB.
+    size_t maxIoSize_; // max size of merged IOs [byte].
     /**
      * Try to merge src to dst.
      */
@@ -235,14 +252,27 @@ class IoQueue
         return dst.tryMerge(src);
     }
 public:
-    explicit IoQueue()
+    explicit IoQueue(size_t maxIoSize = MEBI)
         : processingSize_(0)
         , fetchedSize_(0)
         , fetchedBegin_(list_.end())
+        , maxIoSize_(maxIoSize)
     {
     }
-    void add(Io &&io);
+    /**
+     * An IO adjacent to the last fetched IO will be merged to it.
+     * RETURN:
+     *   true if merged.
+     */
+    bool add(Io &&io);
     bool hasFetched() const { return fetchedBegin_ != list_.end(); }
+    /**
+     * The last fetched IO is excluded if the next IO may be merged to it.
+     */
+    bool hasFetchedNotGrowing() const {
+        if (!hasFetched()) return false;
+        return &*fetchedBegin_ != &list_.back() || list_.back().size() >= maxIoSize_;
+    }
     bool hasProcessing() const { return list_.begin() != fetchedBegin_; }
     size_t getProcessingSize() const { return processingSize_; }
     Io& nextFetched();
@@ -373,12 +403,14 @@ struct WriteIoStatistics
     size_t writtenNr;
     size_t overwrittenNr;
     size_t clippedNr;
+    size_t mergedNr; // IOs merged to their previous adjacent IOs.
 
     uint64_t normalLb;
     uint64_t discardLb;
     uint64_t writtenLb;
     uint64_t overwrittenLb;
     uint64_t clippedLb;
+    uint64_t mergedLb;
 
     WriteIoStatistics() {
         clear();
@@ -404,6 +436,10 @@ struct WriteIoStatistics
         clippedNr++;
         clippedLb += sizeLb;
     }
+    void addMerged(size_t sizeLb) {
+        mergedNr++;
+        mergedLb += sizeLb;
+    }
     void print(::FILE *fp = ::stdout) const;
     void printOneline(::FILE *fp = ::stdout) const {
         std::stringstream ss;
@@ -433,7 +469,7 @@ private:
 public:
     explicit SimpleBdevWriter(int fd)
         : bdevFile_(fd)
-        , bdevSizeLb_(cybozu::util::getBlockDeviceSize(fd) << 9)
+        , bdevSizeLb_(cybozu::util::getBlockDeviceSize(fd) >> 9)
         , ioQ_(), stat_() {
     }
     bool prepare(uint64_t offLb, size_t sizeLb, AlignedArray &&block) {
@@ -488,6 +524,11 @@ private:
 };
 
 
+/**
+ * Asynchronous block device writer.
+ * Address-contiguous IOs prepared in a row are merged into a vectored IO
+ * up to maxIoSize, and contiguous discards are merged into one discard.
+ */
 class AsyncBdevWriter
 {
 private:
@@ -500,16 +541,26 @@ private:
     bdev_writer_local::ReadyQueue readyQ_; /* ready to submit. */
     bdev_writer_local::OverlappedSerializer overlapped_;
 
+    /* Discard not issued yet. */
+    uint64_t discardOffLb_;
+    uint64_t discardSizeLb_;
+
     WriteIoStatistics stat_;
 public:
-    explicit AsyncBdevWriter(int fd, size_t bufferSize = 4 * MEBI)
+    /**
+     * @bufferSize max total size of IOs in flight [byte].
+     * @maxIoSize max size of a merged IO [byte].
+     */
+    explicit AsyncBdevWriter(int fd, size_t bufferSize = 4 * MEBI, size_t maxIoSize = MEBI)
         : bdevFile_(fd)
-        , bdevSizeLb_(cybozu::util::getBlockDeviceSize(fd) << 9)
+        , bdevSizeLb_(cybozu::util::getBlockDeviceSize(fd) >> 9)
         , bufferSize_(bufferSize)
         , aio_(fd, bufferSize >> 9)
-        , ioQ_()
+        , ioQ_(maxIoSize)
         , readyQ_()
         , overlapped_()
+        , discardOffLb_(0)
+        , discardSizeLb_(0)
         , stat_() {
     }
     ~AsyncBdevWriter() noexcept {
@@ -517,7 +568,10 @@ public:
     }
     bool prepare(uint64_t offLb, size_t sizeLb, AlignedArray &&block) {
         if (isClippedWithStat(offLb, sizeLb)) return false;
-        ioQ_.add(bdev_writer_local::Io(offLb << 9, sizeLb << 9, std::move(block)));
+        issuePendingDiscard();
+        if (ioQ_.add(bdev_writer_local::Io(offLb << 9, sizeLb << 9, std::move(block)))) {
+            stat_.addMerged(sizeLb);
+        }
         stat_.addNormal(sizeLb);
         return true;
     }
@@ -526,7 +580,10 @@ public:
      */
     bool prepare(uint64_t offLb, size_t sizeLb, const char *ptr) {
         if (isClippedWithStat(offLb, sizeLb)) return false;
-        ioQ_.add(bdev_writer_local::Io(offLb << 9, sizeLb << 9, ptr));
+        issuePendingDiscard();
+        if (ioQ_.add(bdev_writer_local::Io(offLb << 9, sizeLb << 9, ptr))) {
+            stat_.addMerged(sizeLb);
+        }
         stat_.addNormal(sizeLb);
         return true;
     }
@@ -538,14 +595,33 @@ public:
     void submit() {
         processIos(false);
     }
+    /**
+     * The discard will be issued when a write is prepared, a non-contiguous discard comes,
+     * or waitForAll() is called.
+     */
     bool discard(uint64_t offLb, uint32_t sizeLb);
     void waitForAll() {
+        issuePendingDiscard();
         processIos(true);
         waitForAllProcessingIos();
     }
     const WriteIoStatistics &getStat() const {
         return stat_;
     }
+    /**
+     * Total size of prepared IOs and discards [logical block].
+     */
+    uint64_t getPreparedLb() const {
+        return stat_.normalLb + stat_.discardLb;
+    }
+    /**
+     * Total size of completed IOs and discards [logical block].
+     * They complete in the order of preparation, so the IOs prepared
+     * when getPreparedLb() returned x have completed if this is x or more.
+     */
+    uint64_t getCompletedLb() const {
+        return stat_.writtenLb + stat_.overwrittenLb;
+    }
     bool isClipped(uint64_t offLb, size_t sizeLb) const {
         return offLb + sizeLb > bdevSizeLb_;
     }
@@ -561,6 +637,7 @@ private:
             || aio_.queueUsage() >= aio_.queueSize() / 2;
     }
     void processIos(bool force);
+    void issuePendingDiscard();
     bool isClippedWithStat(uint64_t offLb, size_t sizeLb) {
         if (!isClipped(offLb, sizeLb)) return false;
         stat_.addClipped(sizeLb);
@@ -568,4 +645,71 @@ private:
     }
 };
 
+
+/**
+ * fdatasync() running in a background thread.
+ * IOs can be submitted to the file while it is running,
+ * so a periodic sync does not need to drain in-flight IOs.
+ * It makes IOs completed before start() durable.
+ * request() and update() start it when the IOs submitted before request() complete.
+ * Call wait() then fdatasync() at the end to make all the IOs durable.
+ */
+class BackgroundSyncer
+{
+private:
+    int fd_;
+    cybozu::thread::ThreadRunner th_;
+    bool isRunning_;
+    bool isRequested_;
+    uint64_t target_;
+public:
+    explicit BackgroundSyncer(int fd)
+        : fd_(fd), th_(), isRunning_(false), isRequested_(false), target_(0) {
+    }
+    ~BackgroundSyncer() noexcept {
+        th_.joinNoThrow();
+    }
+    /**
+     * The previous fdatasync() will be waited for if running.
+     * Its error will be thrown then.
+     */
+    void start() {
+        wait();
+        const int fd = fd_;
+        th_.set([fd]() {
+            if (::fdatasync(fd) < 0) throwLibcError("BackgroundSyncer: fdatasync failed.");
+        });
+        th_.start();
+        isRunning_ = true;
+    }
+    /**
+     * Request a sync of the IOs to be completed when the completion counter reaches target.
+     * A former request not started yet is kept since it will be reached earlier.
+     */
+    void request(uint64_t target) {
+        if (isRequested_) return;
+        isRequested_ = true;
+        target_ = target;
+    }
+    /**
+     * Start the requested sync if the completion counter reached the target.
+     * @completed completion counter such as AsyncBdevWriter::getCompletedLb().
+     */
+    void update(uint64_t completed) {
+        if (!isRequested_ || completed < target_) return;
+        isRequested_ = false;
+        start();
+    }
+    bool isRequested() const { return isRequested_; }
+    bool isRunning() const { return isRunning_; }
+    /**
+     * An error of the running fdatasync() will be thrown.
+     */
+    void wait() {
+        if (!isRunning_) return;
+        isRunning_ = false;
+        th_.join();
+    }
+};
+
 } // namespace walb
@@ -0,0 +1,107 @@
+#include "chunk_hash_index.hpp"
+#include "random.hpp"
+#include "walb_logger.hpp"
+#include <algorithm>
+#include <cstring>
+
+namespace walb {
+
+void ChunkHashIndex::open(const std::string &path, uint64_t sizeLb, uint32_t chunkLb)
+{
+    using namespace chunk_hash_index_local;
+    if (chunkLb == 0) throw cybozu::Exception(NAME) << "chunkLb must not be 0" << path;
+    close();
+    const uint64_t nrChunks = sizeLb / chunkLb;
+
+    cybozu::util::File file(path, O_RDWR | O_CREAT, 0644);
+    const uint64_t fileSize = file.lseek(0, SEEK_END);
+    bool isValid = false;
+    if (fileSize >= sizeof(Header)) {
+        Header h;
+        file.pread(&h, sizeof(h), 0);
+        isValid = h.magic == CHUNK_HASH_INDEX_MAGIC && h.version == CHUNK_HASH_INDEX_VERSION &&
+            h.chunkLb == chunkLb && h.isUpdating == 0 && h.nrChunks <= nrChunks &&
+            calcFileSize(h.nrChunks) <= fileSize;
+        if (!isValid) LOGs.info() << NAME << "reset" << path;
+    }
+
+    /* Appended entries are filled with zero, that is invalid. */
+    UniqueLock lk(mu_);
+    file_.reset(std::move(file), std::max(fileSize, calcFileSize(nrChunks)));
+    Header &h = header();
+    if (!isValid) {
+        ::memset(&h, 0, file_.size());
+        h.magic = CHUNK_HASH_INDEX_MAGIC;
+        h.version = CHUNK_HASH_INDEX_VERSION;
+        h.seed = cybozu::util::Random<uint32_t>()();
+        h.chunkLb = chunkLb;
+        h.hashAlgo = HASH_ALGO_MURMUR3;
+    }
+    h.nrChunks = nrChunks;
+    nrChunks_ = nrChunks;
+}
+
+void ChunkHashIndex::reset(uint8_t hashAlgo)
+{
+    UniqueLock lk(mu_);
+    for (uint64_t i = 0; i < nrChunks(); i++) entries()[i].isValid = 0;
+    Header &h = header();
+    h.seed = cybozu::util::Random<uint32_t>()();
+    h.hashAlgo = hashAlgo;
+}
+
+bool ChunkHashIndex::get(uint64_t chunkIdx, cybozu::murmurhash3::Hash &hash) const
+{
+    UniqueLock lk(mu_);
+    if (chunkIdx >= nrChunks()) return false;
+    const Entry &ent = entries()[chunkIdx];
+    if (!ent.isValid) return false;
+    hash = ent.hash;
+    return true;
+}
+
+void ChunkHashIndex::set(uint64_t chunkIdx, const cybozu::murmurhash3::Hash &hash)
+{
+    UniqueLock lk(mu_);
+    if (chunkIdx >= nrChunks()) return;
+    Entry &ent = entries()[chunkIdx];
+    ent.hash = hash;
+    ent.isValid = 1;
+}
+
+void ChunkHashIndex::invalidate(uint64_t addr, uint64_t blks)
+{
+    if (blks == 0) return;
+    UniqueLock lk(mu_);
+    const uint64_t chunkLb = header().chunkLb;
+    const uint64_t bgn = addr / chunkLb;
+    const uint64_t end = std::min((addr + blks + chunkLb - 1) / chunkLb, nrChunks());
+    for (uint64_t i = bgn; i < end; i++) entries()[i].isValid = 0;
+}
+
+void ChunkHashIndex::beginUpdate()
+{
+    UniqueLock lk(mu_);
+    header().isUpdating = 1;
+    file_.sync();
+}
+
+void ChunkHashIndex::endUpdate()
+{
+    UniqueLock lk(mu_);
+    file_.sync(); // invalidation must be persisted before clearing the flag.
+    header().isUpdating = 0;
+    file_.sync();
+}
+
+uint64_t ChunkHashIndex::getNrValid() const
+{
+    UniqueLock lk(mu_);
+    uint64_t nr = 0;
+    for (uint64_t i = 0; i < nrChunks(); i++) {
+        if (entries()[i].isValid) nr++;
+    }
+    return nr;
+}
+
+} // namespace walb
@@ -0,0 +1,204 @@
+#pragma once
+/**
+ * @file
+ * @brief Persistent chunk hash index of an archive base image.
+ */
+#include <string>
+#include <mutex>
+#include <cstdint>
+#include "mmap_file.hpp"
+#include "sync_hash.hpp"
+#include "walb_diff_virt.hpp"
+#include "cybozu/exception.hpp"
+
+namespace walb {
+
+namespace chunk_hash_index_local {
+
+const uint32_t CHUNK_HASH_INDEX_MAGIC = 0x78646968; // "hidx"
+const uint32_t CHUNK_HASH_INDEX_VERSION = 1;
+
+struct Header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t seed; /* hash seed of all the entries. */
+    uint32_t chunkLb; /* [logical block] */
+    uint64_t nrChunks;
+    uint8_t isUpdating; /* not 0 between beginUpdate() and endUpdate(). */
+    uint8_t hashAlgo; /* hash algorithm of all the entries. */
+    uint8_t reserved[6];
+} __attribute__((packed));
+
+struct Entry
+{
+    cybozu::murmurhash3::Hash hash;
+    uint8_t isValid;
+} __attribute__((packed));
+
+} // namespace chunk_hash_index_local
+
+/**
+ * Persistent index of the hashes of fixed-size chunks of an image.
+ *
+ * File format: Header, then Entry * nrChunks. The file is memory-mapped.
+ * Only the chunks fully inside the image are indexed.
+ *
+ * Writers of the image must invalidate the chunks they touch
+ * between beginUpdate() and endUpdate().
+ * If endUpdate() has not been called, the whole index will be reset at the next open().
+ * This is thread-safe class.
+ */
+class ChunkHashIndex /* final */
+{
+private:
+    using Header = chunk_hash_index_local::Header;
+    using Entry = chunk_hash_index_local::Entry;
+    using UniqueLock = std::unique_lock<std::mutex>;
+
+    cybozu::util::MmappedFile file_;
+    mutable std::mutex mu_;
+    uint64_t nrChunks_; /* the header may be grown by another opener. */
+
+public:
+    static constexpr const char *NAME = "ChunkHashIndex";
+    ChunkHashIndex() : file_(), mu_(), nrChunks_(0) {}
+    /**
+     * Open an index file. It will be created if it does not exist.
+     * A new index with a random seed will be made if the file is broken,
+     * the chunk size is different, or the last update has not been finished.
+     * The index will be extended when the image has been grown.
+     * The file will never be shrunk because another process may map it.
+     * @sizeLb image size [logical block].
+     * @chunkLb chunk size [logical block].
+     */
+    void open(const std::string &path, uint64_t sizeLb, uint32_t chunkLb);
+    void close() {
+        file_.reset();
+        nrChunks_ = 0;
+    }
+    bool isOpen() const { return file_.ptr<char>() != nullptr; }
+    uint32_t seed() const { return header().seed; }
+    uint32_t chunkLb() const { return header().chunkLb; }
+    uint8_t hashAlgo() const { return header().hashAlgo; }
+    /**
+     * Invalidate all the entries and change the seed and the hash algorithm.
+     */
+    void reset(uint8_t hashAlgo);
+    uint64_t nrChunks() const { return nrChunks_; }
+    /**
+     * RETURN:
+     *   false if the hash of the chunk is not valid.
+     */
+    bool get(uint64_t chunkIdx, cybozu::murmurhash3::Hash &hash) const;
+    void set(uint64_t chunkIdx, const cybozu::murmurhash3::Hash &hash);
+    /**
+     * Invalidate the chunks overlapped with [addr, addr + blks).
+     * @addr [logical block]
+     * @blks [logical block]
+     */
+    void invalidate(uint64_t addr, uint64_t blks);
+    /**
+     * Call it before writing the image.
+     */
+    void beginUpdate();
+    /**
+     * Call it after the written data of the image have been persisted.
+     */
+    void endUpdate();
+    uint64_t getNrValid() const;
+private:
+    const Header& header() const { return *file_.ptr<Header>(); }
+    Header& header() { return *file_.ptr<Header>(); }
+    const Entry *entries() const { return reinterpret_cast<const Entry *>(&header() + 1); }
+    Entry *entries() { return reinterpret_cast<Entry *>(&header() + 1); }
+    static uint64_t calcFileSize(uint64_t nrChunks) {
+        return sizeof(Header) + sizeof(Entry) * nrChunks;
+    }
+};
+
+
+/**
+ * Sequential reader of a virtual full image for hash sync servers.
+ *
+ * The hash of a chunk not touched by the wdiffs is taken from the chunk hash index
+ * of the base image instead of reading the chunk,
+ * and the hashes calculated from the base image are stored to the index.
+ * See getIndexedHash() and its friends in dirty_hash_sync.hpp.
+ * invalidate() may be called by another thread than the reading one.
+ */
+class IndexedVirtualReader /* final */
+{
+private:
+    VirtualSnapshotReader virt_;
+    ChunkHashIndex *index_; /* nullptr means the index is not used. */
+    uint64_t addr_; /* [logical block] */
+    uint64_t nrHit_;
+    uint64_t nrPut_;
+
+public:
+    static constexpr const char *NAME = "IndexedVirtualReader";
+    IndexedVirtualReader()
+        : virt_(), index_(nullptr), addr_(0), nrHit_(0), nrPut_(0) {
+    }
+    VirtualSnapshotReader& virt() { return virt_; }
+    const VirtualSnapshotReader& virt() const { return virt_; }
+    /**
+     * @index its seed and hash algorithm must be the ones of the sync.
+     *   It must be the index of the base image of virt().
+     *   nullptr means not using the index.
+     */
+    void setIndex(ChunkHashIndex *index) { index_ = index; }
+    /**
+     * @size must be multiples of LOGICAL_BLOCK_SIZE.
+     */
+    void read(void *data, size_t size) {
+        assert(size % LOGICAL_BLOCK_SIZE == 0);
+        const uint64_t blks = size / LOGICAL_BLOCK_SIZE;
+        virt_.read(addr_, blks, data);
+        addr_ += blks;
+    }
+    /**
+     * Get the hash of the next blks blocks and skip them.
+     * RETURN:
+     *   false if the hash is not in the index. Nothing is skipped then.
+     */
+    bool getHash(uint64_t blks, cybozu::murmurhash3::Hash &hash) {
+        if (!isIndexable(addr_, blks) || !index_->get(addr_ / blks, hash)) return false;
+        addr_ += blks;
+        nrHit_++;
+        return true;
+    }
+    void putHash(uint64_t addr, uint64_t blks, const cybozu::murmurhash3::Hash &hash) {
+        if (!isIndexable(addr, blks)) return;
+        index_->set(addr / blks, hash);
+        nrPut_++;
+    }
+    void invalidate(uint64_t addr, uint64_t blks) {
+        if (index_) index_->invalidate(addr, blks);
+    }
+    uint64_t nrHit() const { return nrHit_; }
+    uint64_t nrPut() const { return nrPut_; }
+private:
+    bool isIndexable(uint64_t addr, uint64_t blks) const {
+        return index_ && blks == index_->chunkLb() && addr % blks == 0 &&
+            virt_.isBaseOnly(addr, blks);
+    }
+};
+
+inline bool getIndexedHash(IndexedVirtualReader &reader, uint64_t lb, cybozu::murmurhash3::Hash &hash)
+{
+    return reader.getHash(lb, hash);
+}
+
+inline void putIndexedHash(IndexedVirtualReader &reader, uint64_t addr, uint64_t lb, const cybozu::murmurhash3::Hash &hash)
+{
+    reader.putHash(addr, lb, hash);
+}
+
+inline void invalidateIndexedHash(IndexedVirtualReader &reader, uint64_t addr, uint64_t lb)
+{
+    reader.invalidate(addr, lb);
+}
+
+} // namespace walb
@@ -1,4 +1,5 @@
 #include "command_param_parser.hpp"
+#include "sync_hash.hpp"
 
 namespace walb {
 
@@ -226,6 +227,21 @@ VirtualFullScanCmdParam parseVirtualFullScanCmdParam(const StrVec &args)
 }
 
 
+BlockHashParam parseBlockHashParam(const StrVec &args)
+{
+    BlockHashParam param;
+    param.param = parseVirtualFullScanParam(args);
+    std::string hashAlgoStr;
+    cybozu::util::parseStrVec(args, 4, 0, {&hashAlgoStr});
+    if (hashAlgoStr.empty()) {
+        param.hashAlgo = HASH_ALGO_MURMUR3;
+    } else {
+        param.hashAlgo = parseHashAlgo(hashAlgoStr);
+    }
+    return param;
+}
+
+
 SetUuidParam parseSetUuidParam(const StrVec &args)
 {
     SetUuidParam param;
@@ -308,6 +324,56 @@ uint64_t parseSetFullScanBps(const StrVec &args)
 }
 
 
+IoSchedParam parseIoSchedParam(const StrVec &args)
+{
+    const char *const FUNC = __func__;
+    IoSchedParam param;
+    std::string s1, s2;
+    cybozu::util::parseStrVec(args, 0, 2, {&param.name, &s1, &s2});
+    if (param.name == "weight" || param.name == "prio") {
+        param.volId = s1;
+        verifyVolIdFormat(param.volId);
+        if (s2.empty()) throw cybozu::Exception(FUNC) << "value not specified" << param.name;
+        param.value = cybozu::atoi(s2);
+        if (param.name == "weight" && param.value == 0) {
+            throw cybozu::Exception(FUNC) << "weight must not be 0";
+        }
+        return param;
+    }
+    if (!s2.empty()) throw cybozu::Exception(FUNC) << "too many parameters" << param.name;
+    if (param.name == "bps") {
+        param.value = cybozu::util::fromUnitIntString(s1);
+    } else if (param.name == "iops") {
+        param.value = cybozu::atoi(s1);
+    } else if (param.name == "backlog-first") {
+        if (s1 != "0" && s1 != "1") throw cybozu::Exception(FUNC) << "must be 0 or 1" << s1;
+        param.value = cybozu::atoi(s1);
+    } else {
+        throw cybozu::Exception(FUNC) << "bad name" << param.name;
+    }
+    return param;
+}
+
+
+NbdExportParam parseNbdExportParam(const StrVec &args)
+{
+    NbdExportParam param;
+    std::string gidStr, timeoutStr;
+    cybozu::util::parseStrVec(args, 0, 3, {&param.volId, &gidStr, &param.addr, &timeoutStr});
+    verifyVolIdFormat(param.volId);
+    param.gid = cybozu::atoi(gidStr);
+    if (param.addr.empty()) {
+        throw cybozu::Exception(__func__) << "empty address";
+    }
+    if (timeoutStr.empty()) {
+        param.acceptTimeoutSec = DEFAULT_NBD_ACCEPT_TIMEOUT_SEC;
+    } else {
+        param.acceptTimeoutSec = cybozu::atoi(timeoutStr);
+    }
+    return param;
+}
+
+
 BackupParam parseBackupParam(const StrVec &args)
 {
     BackupParam param;
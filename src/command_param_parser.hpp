@@ -153,6 +153,16 @@ struct VirtualFullScanCmdParam
 VirtualFullScanCmdParam parseVirtualFullScanCmdParam(const StrVec &args);
 
 
+struct BlockHashParam
+{
+    VirtualFullScanParam param;
+    uint8_t hashAlgo; // HASH_ALGO_MURMUR3 by default.
+};
+
+
+BlockHashParam parseBlockHashParam(const StrVec &args);
+
+
 struct SetUuidParam
 {
     std::string volId;
@@ -215,6 +225,29 @@ KickParam parseVolIdAndArchiveNameParamForGet(const StrVec &args);
 uint64_t parseSetFullScanBps(const StrVec &args);
 
 
+struct IoSchedParam
+{
+    std::string name; // "bps", "iops", "backlog-first", "weight", or "prio".
+    std::string volId; // for "weight" and "prio" only.
+    uint64_t value;
+};
+
+
+IoSchedParam parseIoSchedParam(const StrVec &args);
+
+
+struct NbdExportParam
+{
+    std::string volId;
+    uint64_t gid;
+    std::string addr; // "HOST:PORT" or "unix:PATH".
+    size_t acceptTimeoutSec;
+};
+
+
+NbdExportParam parseNbdExportParam(const StrVec &args);
+
+
 struct BackupParam
 {
     std::string volId;
@@ -244,6 +277,7 @@ inline void verifyMergeParam(const StrVec &args) { parseMergeParam(args); }
 inline void verifyResizeParam(const StrVec &args) { parseResizeParam(args, true, true); }
 inline void verifyVirtualFullScanParam(const StrVec &args) { parseVirtualFullScanParam(args); }
 inline void verifyVirtualFullScanCmdParam(const StrVec &args) { parseVirtualFullScanCmdParam(args); }
+inline void verifyBlockHashParam(const StrVec &args) { parseBlockHashParam(args); }
 inline void verifySetUuidParam(const StrVec &args) { parseSetUuidParam(args); }
 inline void verifySetStateParam(const StrVec &args) { parseSetStateParam(args); }
 inline void verifySetBaseParam(const StrVec &args) { parseSetBaseParam(args); }
@@ -251,6 +285,8 @@ inline void verifyChangeSnapshotParam(const StrVec &args) { parseChangeSnapshotP
 inline void verifyArchiveInfoParam(const StrVec &args) { parseArchiveInfoParam(args); }
 inline void verifyKickParam(const StrVec &args) { parseKickParam(args); }
 inline void verifySetFullScanBps(const StrVec &args) { parseSetFullScanBps(args); }
+inline void verifyIoSchedParam(const StrVec &args) { parseIoSchedParam(args); }
+inline void verifyNbdExportParam(const StrVec &args) { parseNbdExportParam(args); }
 inline void verifyBackupParam(const StrVec &args) { parseBackupParam(args); }
 inline void verifyShutdownParam(const StrVec &args) { parseShutdownParam(args); }
 inline void verifySleepParam(const StrVec &args) { parseSleepParam(args); }
@@ -4,18 +4,26 @@ namespace walb {
 
 namespace cmpr_local {
 
-bool compressToVec(const void *data, size_t size, AlignedArray &outV)
+bool tryCompressToVec(const void *data, size_t size, AlignedArray &outV)
 {
-    outV.resize(size * 2); // margin to encode
+    /* Each thread reuses its own buffer to compress into. */
+    thread_local AlignedArray buf;
+    buf.resize(size * 2); // margin to encode
     size_t outSize;
-    if (getSnappyCompressor().run(outV.data(), &outSize, outV.size(), data, size) && outSize < size) {
-        outV.resize(outSize);
-        return true;
-    } else {
-        ::memcpy(outV.data(), data, size);
-        outV.resize(size);
+    if (!getSnappyCompressor().run(buf.data(), &outSize, buf.size(), data, size) || outSize >= size) {
         return false;
     }
+    outV.resize(outSize);
+    ::memcpy(outV.data(), buf.data(), outSize);
+    return true;
+}
+
+bool compressToVec(const void *data, size_t size, AlignedArray &outV)
+{
+    if (tryCompressToVec(data, size, outV)) return true;
+    outV.resize(size);
+    ::memcpy(outV.data(), data, size);
+    return false;
 }
 
 void uncompressToVec(const void *data, size_t size, AlignedArray &outV, size_t outSize)
@@ -27,4 +35,16 @@ void uncompressToVec(const void *data, size_t size, AlignedArray &outV, size_t o
 
 } // namespace cmpr_local
 
+void CompressedData::send(packet::Packet &packet, bool withNext) const
+{
+    verify();
+    char header[16];
+    cybozu::MemoryOutputStream os(header, sizeof(header));
+    if (withNext) packet::StreamControl::saveNext(os);
+    cybozu::save(os, cmpSize_);
+    cybozu::save(os, orgSize_);
+    packet.write(header, os.pos);
+    packet.write(data_.data(), data_.size());
+}
+
 } //namespace walb
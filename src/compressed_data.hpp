@@ -35,6 +35,14 @@ inline Uncompressor &getSnappyUncompressor() {
  */
 bool compressToVec(const void *data, size_t size, AlignedArray &outV);
 
+/**
+ * outV is allocated with the compressed size only.
+ * RETURN:
+ *   true when successfully compressed, false when not compressible.
+ *   outV is not changed in the latter case.
+ */
+bool tryCompressToVec(const void *data, size_t size, AlignedArray &outV);
+
 /**
  * Assume uncompressed size must be outSize.
  */
@@ -65,13 +73,10 @@ public:
     }
     /**
      * Send data to the remote host.
+     * The sizes and data are written in turn without copying data into one buffer.
+     * If withNext is true, a stream control next message precedes them.
      */
-    void send(packet::Packet &packet) const {
-        verify();
-        packet.write(cmpSize_);
-        packet.write(orgSize_);
-        packet.write(&data_[0], data_.size());
-    }
+    void send(packet::Packet &packet, bool withNext = false) const;
     /**
      * Receive data from the remote host.
      */
@@ -103,6 +108,20 @@ public:
         }
         verify();
     }
+    /**
+     * data will be moved in when it is not compressible, which avoids copy.
+     */
+    void compressFrom(AlignedArray &&data) {
+        if (data.empty()) throw cybozu::Exception(__func__) << "empty";
+        AlignedArray cmp;
+        if (cmpr_local::tryCompressToVec(data.data(), data.size(), cmp)) {
+            setSizes(cmp.size(), data.size());
+            data_ = std::move(cmp);
+            verify();
+        } else {
+            setUncompressed(std::move(data));
+        }
+    }
     void getUncompressed(AlignedArray &outV) const {
         if (isCompressed()) {
             cmpr_local::uncompressToVec(&data_[0], data_.size(), outV, orgSize_);
@@ -25,13 +25,29 @@ const size_t DEFAULT_MAX_WDIFF_SEND_MB = 128;
 const size_t DEFAULT_MAX_WDIFF_SEND_NR = 1000;
 const size_t DEFAULT_MAX_WDIFF_MERGE_MB = 1024;
 const size_t DEFAULT_MAX_WLOG_SEND_MB = 128;
+const size_t DEFAULT_WLOG_SEND_CONCURRENCY = 2;
+const size_t DEFAULT_WLOG_COALESCE_MB = 32;
+const size_t DEFAULT_WLOG_RECV_CONCURRENCY = 2;
+const size_t DEFAULT_WLOG_READ_AHEAD_MB = 16;
+const size_t DEFAULT_WLOG_READ_IO_KB = 1024;
 const size_t DEFAULT_MAX_CONVERSION_MB = 1024;
 const size_t DEFAULT_MIN_DELAY_SEC_FOR_RETRY = 1;
 const size_t DEFAULT_MAX_DELAY_SEC_FOR_RETRY = 300;
 const size_t DEFAULT_RETRY_TIMEOUT_SEC = 1800;
 const size_t DEFAULT_MAX_OPEN_DIFFS = 0; // 0 means unlimited.
 const size_t DEFAULT_PCT_APPLY_SLEEP = 0; // 0 means no sleep.
+const size_t DEFAULT_MERGE_CONCURRENCY = 1;
+const size_t DEFAULT_APPLY_IO_DEPTH_MB = 32;
+const size_t DEFAULT_APPLY_MAX_IO_KB = 1024;
+const size_t DEFAULT_APPLY_PREFETCH_CONCURRENCY = 1; // 0 means no prefetch.
+const uint64_t DEFAULT_IO_SCHED_MB_PER_SEC = 0; // 0 means unlimited.
+const uint64_t DEFAULT_IO_SCHED_IOPS = 0; // 0 means unlimited.
+const size_t DEFAULT_NBD_ACCEPT_TIMEOUT_SEC = 60;
+const size_t DEFAULT_NBD_IO_TIMEOUT_SEC = 60;
+const size_t DEFAULT_HASH_TREE_MB = 0; // 0 means the flat mode.
 const char DEFAULT_CMPR_OPT_FOR_SYNC[] = "snappy:0:1";
+const char DEFAULT_HASH_ALGO_FOR_SYNC[] = "murmur3";
+const char DEFAULT_AIO_ENGINE[] = "libaio";
 
 const size_t PROXY_HEARTBEAT_INTERVAL_SEC = 10;
 const size_t PROXY_HEARTBEAT_SOCKET_TIMEOUT_SEC = 3; // seconds.
@@ -41,12 +57,16 @@ const size_t DEFAULT_SOCKET_TIMEOUT_SEC = 10;
 const uint64_t DEFAULT_FULL_SCAN_BYTES_PER_SEC = 0; // unlimited.
 
 const uint64_t DEFAULT_FSYNC_INTERVAL_SIZE = 1 * GIBI;
-const size_t DEFAULT_MERGE_BUFFER_LB = 4 * MEBI / LBS;
 
 const char DEFAULT_DISCARD_TYPE_STR[] = "ignore";
 
 const uint64_t DIRTY_HASH_SYNC_READ_AHEAD_LB = 256 * MEBI / LBS;
 const uint64_t DIRTY_HASH_SYNC_MAX_PACK_AREA_LB = 256 * MEBI / LBS;
+const uint64_t DIRTY_HASH_SYNC_MAX_REGION_LB = 64 * MEBI / LBS;
+const size_t DIRTY_HASH_SYNC_TREE_WINDOW = 16; // regions whose hashes are sent ahead.
+const size_t DIRTY_HASH_SYNC_TREE_MAX_PENDING = 4; // dirty regions kept in memory by a client.
+
+const uint64_t DIRTY_FULL_SYNC_MIN_SKIP_LB = 32 * MEBI / LBS; // shorter unallocated ranges are read.
 
 const int DEFAULT_TCP_KEEPIDLE = 60 * 30;
 const int DEFAULT_TCP_KEEPINTVL = 60;
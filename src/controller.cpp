@@ -203,6 +203,7 @@ const protocol::GetCommandInfoMap &getGetCommandInfoMap()
         {getLatestSnapTN, {protocol::StringVecType, verifyVolIdOrAllParamForGet, "[(volId)] get latest snapshot information for volume(s)."}},
         {getTsDeltaTN, {protocol::StringVecType, verifyNoneParam, "get timestamp delta information."}},
         {getHandlerStatTN, {protocol::StringVecType, verifyNoneParam, "get handler statistics."}},
+        {getIoSchedTN, {protocol::StringVecType, verifyNoneParam, "get IO scheduler status (archive only)."}},
     };
     return m;
 }
@@ -246,6 +246,27 @@ inline void c2sSetFullScanBpsClient(protocol::ClientParams &p)
     protocol::sendStrVec(p.sock, p.params, 0, __func__, msgOk);
 }
 
+/**
+ * params[0]: name
+ * params[1]: value, or volId for weight and prio.
+ * params[2]: value for weight and prio.
+ */
+inline void c2aSetIoSchedClient(protocol::ClientParams &p)
+{
+    protocol::sendStrVec(p.sock, p.params, 0, __func__, msgOk);
+}
+
+/**
+ * params[0]: volId
+ * params[1]: gidStr
+ * params[2]: address to listen: "HOST:PORT" or "unix:PATH".
+ * params[3]: accept timeout [sec] (optional, 0 means no timeout)
+ */
+inline void c2aNbdExportClient(protocol::ClientParams &p)
+{
+    protocol::sendStrVec(p.sock, p.params, 0, __func__, msgAccept);
+}
+
 /**
  * params[0]: volId
  * params[1]: gidStr
@@ -1,5 +1,6 @@
 #include "dirty_full_sync.hpp"
 #include "thread_util.hpp"
+#include "constant.hpp"
 
 
 #define USE_AIO_FOR_DIRTY_FULL_SYNC
@@ -12,6 +13,20 @@ namespace dirty_full_sync_local {
 
 const size_t ASYNC_IO_BUFFER_SIZE = (32U << 20);  // bytes
 
+/*
+ * encSize value meaning an unallocated range.
+ * The size of the range [logical block] follows as uint64_t.
+ */
+const size_t UNALLOCATED_MARK = SIZE_MAX;
+
+/*
+ * Unallocated ranges shorter than this are read and sent as zero bulks
+ * because seeking wastes the data read ahead.
+ * The last range of the device is always skipped.
+ */
+const uint64_t MIN_SKIP_LB = DIRTY_FULL_SYNC_MIN_SKIP_LB;
+static_assert(MIN_SKIP_LB * LOGICAL_BLOCK_SIZE == ASYNC_IO_BUFFER_SIZE, "MIN_SKIP_LB must be the read-ahead size");
+
 using Buffer = AlignedArray;
 
 struct DualBuffer
@@ -19,11 +34,12 @@ struct DualBuffer
     Buffer src;
     Buffer dst;
 
-    // used by server only.
+    // used by server, and lenLb is also used by client for unallocated ranges.
     uint64_t offLb;
     size_t lenLb;
+    bool isUnallocated;
 
-    DualBuffer() = default;
+    DualBuffer() : src(), dst(), offLb(0), lenLb(0), isUnallocated(false) {}
     DualBuffer(const DualBuffer&) = delete;
     DualBuffer(DualBuffer&& rhs) : DualBuffer() { swap(rhs); }
     DualBuffer& operator=(const DualBuffer&) = delete;
@@ -32,12 +48,14 @@ struct DualBuffer
     void clear() {
         src.clear();
         dst.clear();
+        isUnallocated = false;
     }
     void swap(DualBuffer& rhs) {
         std::swap(src, rhs.src);
         std::swap(dst, rhs.dst);
         std::swap(offLb, rhs.offLb);
         std::swap(lenLb, rhs.lenLb);
+        std::swap(isUnallocated, rhs.isUnallocated);
     }
 };
 
@@ -66,9 +84,13 @@ public:
 };
 
 
-void sendIoData(packet::Packet& pkt, const Buffer& dst)
+void sendIoData(packet::Packet& pkt, const DualBuffer& dbuf)
 {
-    if (dst.empty()) {
+    const Buffer& dst = dbuf.dst;
+    if (dbuf.isUnallocated) {
+        pkt.write(UNALLOCATED_MARK);
+        pkt.write(uint64_t(dbuf.lenLb));
+    } else if (dst.empty()) {
         pkt.write(0);
     } else {
         pkt.write(dst.size());
@@ -92,6 +114,29 @@ void writeIoData(AsyncBdevWriter& writer, Buffer& dst, uint64_t offLb, size_t le
         dst.clear();
     }
 }
+
+/**
+ * Unallocated range in the source will be discarded if possible.
+ * Otherwise it will be filled with zero unless skipZero is true.
+ */
+void writeUnallocated(AsyncBdevWriter& writer, uint64_t offLb, size_t lenLb,
+                      bool skipZero, bool doDiscard, const Buffer& zeroBuf)
+{
+    const size_t bulkLb = zeroBuf.size() / LOGICAL_BLOCK_SIZE;
+    while (lenLb > 0) {
+        const size_t lb = std::min(lenLb, doDiscard ? size_t(UINT32_MAX) / bulkLb * bulkLb : bulkLb);
+        if (doDiscard) {
+            writer.discard(offLb, lb); // contiguous ones will be merged.
+        } else if (!skipZero) {
+            writer.prepare(offLb, lb, zeroBuf.data());
+            writer.submit();
+        } else {
+            return;
+        }
+        offLb += lb;
+        lenLb -= lb;
+    }
+}
 #else
 void writeIoData(cybozu::util::File& file, Buffer& dst, size_t lenLb,
                  bool skipZero, const Buffer& zeroBuf)
@@ -108,8 +153,38 @@ void writeIoData(cybozu::util::File& file, Buffer& dst, size_t lenLb,
         file.write(dst.data(), lenBytes);
     }
 }
+
+void writeUnallocated(cybozu::util::File& file, uint64_t offLb, size_t lenLb,
+                      bool skipZero, bool doDiscard, const Buffer& zeroBuf)
+{
+    if (doDiscard) {
+        cybozu::util::issueDiscard(file.fd(), offLb, lenLb);
+    }
+    if (doDiscard || skipZero) {
+        file.lseek(lenLb * LOGICAL_BLOCK_SIZE, SEEK_CUR);
+        return;
+    }
+    while (lenLb > 0) {
+        const size_t lb = std::min(lenLb, zeroBuf.size() / LOGICAL_BLOCK_SIZE);
+        file.write(zeroBuf.data(), lb * LOGICAL_BLOCK_SIZE);
+        lenLb -= lb;
+    }
+}
 #endif
 
+/**
+ * RETURN:
+ *   size of the unallocated range from addr to skip [logical block].
+ *   0 if it should be read.
+ */
+uint64_t getSkipLb(const AllocMap& allocMap, uint64_t addr, uint64_t sizeLb, uint64_t bulkLb)
+{
+    const uint64_t nextLb = std::min(allocMap.getNextAllocated(addr), sizeLb);
+    if (nextLb == sizeLb) return sizeLb - addr;
+    const uint64_t lb = (nextLb - addr) / bulkLb * bulkLb;
+    return lb < MIN_SKIP_LB ? 0 : lb;
+}
+
 
 } // namespace dirty_full_sync_local
 
@@ -119,7 +194,7 @@ bool dirtyFullSyncClient(
     packet::Packet &pkt, const std::string &bdevPath,
     uint64_t startLb, uint64_t sizeLb, uint64_t bulkLb, const CompressOpt& cmprOpt,
     const std::atomic<int> &stopState, const ProcessStatus &ps,
-    const std::atomic<uint64_t>& maxLbPerSec)
+    const std::atomic<uint64_t>& maxLbPerSec, const AllocMap& allocMap)
 {
     assert(startLb <= sizeLb);
     AsyncBdevReader reader(bdevPath, startLb,
@@ -135,6 +210,9 @@ bool dirtyFullSyncClient(
     cybozu::thread::ParallelConverter<DualBuffer, DualBuffer> pconv([&](DualBuffer&& dbuf) {
         const Buffer& src = dbuf.src;
         Buffer& dst = dbuf.dst;
+        if (dbuf.isUnallocated) {
+            return std::move(dbuf);
+        }
         if (cybozu::util::isAllZero(src.data(), src.size())) {
             dst.resize(0);
         } else {
@@ -157,27 +235,38 @@ bool dirtyFullSyncClient(
         if (!pconv.pop(dbuf)) {
             throw cybozu::Exception(__func__) << "parallel converter failed";
         }
-        dirty_full_sync_local::sendIoData(pkt, dbuf.dst);
+        dirty_full_sync_local::sendIoData(pkt, dbuf);
         dbufCache.add(std::move(dbuf));
     };
 
     size_t pushedNum = 0;
     size_t c = 0;
-    uint64_t remainingLb = sizeLb - startLb;
-    while (0 < remainingLb) {
+    uint64_t skippedLb = 0;
+    uint64_t addr = startLb;
+    while (addr < sizeLb) {
         if (stopState == ForceStopping || ps.isForceShutdown()) {
             return false;
         }
-        const uint32_t lb = std::min<uint64_t>(bulkLb, remainingLb);
         DualBuffer dbuf = dbufCache.get();
-        Buffer& src = dbuf.src;
-        src.resize(lb * LOGICAL_BLOCK_SIZE);
-        reader.read(src.data(), src.size());
-        pconv.push(std::move(dbuf));
-        remainingLb -= lb;
+        const uint64_t skipLb = dirty_full_sync_local::getSkipLb(allocMap, addr, sizeLb, bulkLb);
+        if (skipLb > 0) {
+            dbuf.isUnallocated = true;
+            dbuf.lenLb = skipLb;
+            pconv.push(std::move(dbuf));
+            addr += skipLb;
+            skippedLb += skipLb;
+            if (addr < sizeLb) reader.seek(addr);
+        } else {
+            const uint32_t lb = std::min<uint64_t>(bulkLb, sizeLb - addr);
+            Buffer& src = dbuf.src;
+            src.resize(lb * LOGICAL_BLOCK_SIZE);
+            reader.read(src.data(), src.size());
+            pconv.push(std::move(dbuf));
+            addr += lb;
+            thStab.setMaxLbPerSec(maxLbPerSec.load());
+            thStab.addAndSleepIfNecessary(lb, 10, 100);
+        }
         c++;
-        thStab.setMaxLbPerSec(maxLbPerSec.load());
-        thStab.addAndSleepIfNecessary(lb, 10, 100);
         if (++pushedNum < maxPushedNum) continue;
         popAndSendIoData();
         pushedNum--;
@@ -189,7 +278,7 @@ bool dirtyFullSyncClient(
     }
     pkt.flush();
     packet::Ack(pkt.sock()).recv();
-    LOGs.debug() << "number of sent packets" << c;
+    LOGs.debug() << "number of sent packets" << c << "skippedLb" << skippedLb;
     return true;
 }
 
@@ -223,6 +312,7 @@ bool dirtyFullSyncServer(
 #endif
 
     const AlignedArray zeroBuf(bulkLb * LOGICAL_BLOCK_SIZE, true);
+    const bool doDiscard = skipZero && cybozu::util::isDiscardEnabled(file.fd());
     const size_t maxPushedNum = cmprOpt.numCpu * 2 + 1;
 
     Uncompressor uncmpr(cmprOpt.type); // shared by all worker threads.
@@ -253,9 +343,17 @@ bool dirtyFullSyncServer(
         const uint64_t offLb = dbuf.offLb;
         const size_t lenLb = dbuf.lenLb;
 #ifdef USE_AIO_FOR_DIRTY_FULL_SYNC
-        dirty_full_sync_local::writeIoData(writer, dbuf.dst, offLb, lenLb, skipZero, zeroBuf);
+        if (dbuf.isUnallocated) {
+            dirty_full_sync_local::writeUnallocated(writer, offLb, lenLb, skipZero, doDiscard, zeroBuf);
+        } else {
+            dirty_full_sync_local::writeIoData(writer, dbuf.dst, offLb, lenLb, skipZero, zeroBuf);
+        }
 #else
-        dirty_full_sync_local::writeIoData(file, dbuf.dst, lenLb, skipZero, zeroBuf);
+        if (dbuf.isUnallocated) {
+            dirty_full_sync_local::writeUnallocated(file, offLb, lenLb, skipZero, doDiscard, zeroBuf);
+        } else {
+            dirty_full_sync_local::writeIoData(file, dbuf.dst, lenLb, skipZero, zeroBuf);
+        }
 #endif
         dbufCache.add(std::move(dbuf));
         return std::make_pair(offLb, lenLb);
@@ -302,12 +400,19 @@ bool dirtyFullSyncServer(
         if (stopState == ForceStopping || ps.isForceShutdown()) {
             return false;
         }
-        const uint32_t lb = std::min<uint64_t>(bulkLb, remainingLb);
+        uint64_t lb = std::min<uint64_t>(bulkLb, remainingLb);
         size_t encSize;
         pkt.read(encSize);
         DualBuffer dbuf = dbufCache.get();
         Buffer& src = dbuf.src;
-        if (encSize == 0) {
+        if (encSize == dirty_full_sync_local::UNALLOCATED_MARK) {
+            pkt.read(lb);
+            if (lb == 0 || lb > remainingLb) {
+                throw cybozu::Exception(FUNC) << "bad unallocated size" << lb << remainingLb;
+            }
+            dbuf.isUnallocated = true;
+            src.resize(0);
+        } else if (encSize == 0) {
             src.resize(0);
         } else {
             src.resize(encSize);
@@ -9,6 +9,7 @@
 #include "walb_logger.hpp"
 #include "bdev_reader.hpp"
 #include "bdev_writer.hpp"
+#include "alloc_map.hpp"
 #include "full_repl_state.hpp"
 #include "snappy_util.hpp"
 #include "cybozu/exception.hpp"
@@ -19,6 +20,7 @@ namespace walb {
 
 /**
  * sizeLb is total size.
+ * Unallocated ranges in allocMap are sent without reading them.
  *
  * RETURN:
  *   false if force stopped.
@@ -27,11 +29,13 @@ bool dirtyFullSyncClient(
     packet::Packet &pkt, const std::string &bdevPath,
     uint64_t startLb, uint64_t sizeLb, uint64_t bulkLb, const CompressOpt& cmprOpt,
     const std::atomic<int> &stopState, const ProcessStatus &ps,
-    const std::atomic<uint64_t>& maxLbPerSec);
+    const std::atomic<uint64_t>& maxLbPerSec, const AllocMap& allocMap);
 
 /**
  * sizeLb is total size.
  * fullReplSt, fullReplStDir, and fullREplStFileName must be specified together.
+ * If skipZero is true, zero data are not written and unallocated ranges are discarded
+ * if the device supports discard.
  *
  * fsyncIntervalSize [bytes]
  *
@@ -3,6 +3,8 @@
 #include <cassert>
 #include <mutex>
 #include <condition_variable>
+#include <deque>
+#include <vector>
 #include "packet.hpp"
 #include "walb_diff_virt.hpp"
 #include "walb_diff_file.hpp"
@@ -11,23 +13,65 @@
 #include "discard_type.hpp"
 #include "fileio.hpp"
 #include "uuid.hpp"
-#include "murmurhash3.hpp"
+#include "sync_hash.hpp"
 #include "server_util.hpp"
 #include "thread_util.hpp"
 #include "throughput_util.hpp"
 
 namespace walb {
 
+/*
+ * Hooks for a Reader of the servers which has a hash index of the image.
+ * Overload them for the Reader type. They will be found by ADL.
+ */
+
+/**
+ * Get the hash of the next lb blocks from the index and skip them.
+ * RETURN:
+ *   false if the index does not have it. Nothing is skipped then.
+ */
+template <typename Reader>
+bool getIndexedHash(Reader &, uint64_t /* lb */, cybozu::murmurhash3::Hash &)
+{
+    return false;
+}
+
+/**
+ * Store the hash of the blocks read by the reader to the index.
+ */
+template <typename Reader>
+void putIndexedHash(Reader &, uint64_t /* addr */, uint64_t /* lb */, const cybozu::murmurhash3::Hash &)
+{
+}
+
+/**
+ * Invalidate the index for the blocks written to the image.
+ */
+template <typename Reader>
+void invalidateIndexedHash(Reader &, uint64_t /* addr */, uint64_t /* lb */)
+{
+}
+
 namespace dirty_hash_sync_local {
 
-inline void compressAndSend(
-    packet::Packet &pkt, DiffPacker &packer, PackCompressor &compr)
+inline void sendCompressedPack(packet::Packet &pkt, const compressor::Buffer &compBuf)
 {
-    compressor::Buffer compBuf = compr.convert(packer.getPackAsArray().data());
     pkt.write<size_t>(compBuf.size());
     pkt.write(compBuf.data(), compBuf.size());
 }
 
+/**
+ * A bulk compared with the hash received from the server.
+ */
+struct HashTask
+{
+    uint64_t addr;
+    uint32_t lb;
+    cybozu::murmurhash3::Hash recvHash;
+    AlignedArray buf;
+    bool isDirty;
+};
+
 /**
  * func must send/receive just one byte.
  */
@@ -60,19 +104,28 @@ void readAndSendHash(
     uint64_t& hashLb,
     packet::Packet& pkt, packet::StreamControl2& ctrl, Reader &reader,
     uint64_t sizeLb, size_t bulkLb,
-    cybozu::murmurhash3::Hasher& hasher, AlignedArray& buf)
+    const SyncHasher& hasher, AlignedArray& buf)
 {
     const uint64_t lb = std::min<uint64_t>(sizeLb - hashLb, bulkLb);
-    buf.resize(lb * LOGICAL_BLOCK_SIZE);
-    reader.read(buf.data(), buf.size());
-    const cybozu::murmurhash3::Hash hash = hasher(buf.data(), buf.size());
+    cybozu::murmurhash3::Hash hash;
+    if (!getIndexedHash(reader, lb, hash)) {
+        buf.resize(lb * LOGICAL_BLOCK_SIZE);
+        reader.read(buf.data(), buf.size());
+        hash = hasher(buf.data(), buf.size());
+        putIndexedHash(reader, hashLb, lb, hash);
+    }
     doRetrySockIo(2, "ctrl.send.next", [&]() { ctrl.sendNext(); });
     pkt.write(hash);
     hashLb += lb;
 }
 
-inline void readPackAndWrite(
-    uint64_t& writeSize, uint64_t& fadvOffset, packet::Packet& pkt,
+/**
+ * The index of the reader will be invalidated for the written blocks
+ * if doWriteDiff is false.
+ */
+template <typename Reader>
+void readPackAndWrite(
+    uint64_t& writeSize, uint64_t& fadvOffset, packet::Packet& pkt, Reader &reader,
     cybozu::util::File& fileW, bool doWriteDiff, DiscardType discardType,
     uint64_t fsyncIntervalSize,
     AlignedArray& zero, AlignedArray& buf)
@@ -90,6 +143,10 @@ inline void readPackAndWrite(
         fileW.write(buf.data(), buf.size());
     } else {
         MemoryDiffPack pack(buf.data(), buf.size());
+        const DiffPackHeader &head = pack.header();
+        for (size_t i = 0; i < head.n_records; i++) {
+            invalidateIndexedHash(reader, head[i].io_address, head[i].io_blocks);
+        }
         nextOffLb = issueDiffPack(fileW, discardType, pack, zero);
     }
     writeSize += buf.size();
@@ -106,31 +163,436 @@ inline void readPackAndWrite(
     }
 }
 
+/*
+ * Message types following ctrl.sendNext() in the tree mode.
+ */
+const uint8_t TREE_MSG_REGION_HASH = 0; // server to client: hash of a region.
+const uint8_t TREE_MSG_BULK_HASHES = 1; // server to client: hashes of the bulks in a region.
+const uint8_t TREE_MSG_REQUEST = 2; // client to server: request bulk hashes of the oldest uncompared region.
+const uint8_t TREE_MSG_PACK = 3; // client to server: a compressed diff pack.
+
+struct HashedBulk
+{
+    AlignedArray buf; /* empty if the hash has been got from the index. */
+    cybozu::murmurhash3::Hash hash;
+
+    HashedBulk() : buf() { hash.zeroClear(); }
+};
+
+using HashConverter = cybozu::thread::ParallelConverter<HashedBulk, HashedBulk>;
+
+/**
+ * Read a region and calculate hashes of its bulks with worker threads.
+ * The hashes of the bulks are got from and put to the index of the reader if available.
+ * @addr region address [logical block].
+ * @lb region size [logical block].
+ * @bulkV will be filled with the bulks.
+ * RETURN:
+ *   hash of the region, that is the hash of the bulk hashes.
+ */
+template <typename Reader>
+cybozu::murmurhash3::Hash readAndHashRegion(
+    Reader &reader, uint64_t addr, uint64_t lb, uint64_t bulkLb,
+    HashConverter &hconv, size_t maxPushedNum,
+    const SyncHasher &hasher, std::vector<HashedBulk> &bulkV)
+{
+    bulkV.clear();
+    size_t pushedNum = 0;
+    uint64_t popOff = 0;
+    auto popBulk = [&]() {
+        HashedBulk bulk;
+        if (!hconv.pop(bulk)) {
+            throw cybozu::Exception(__func__) << "parallel converter failed";
+        }
+        const uint64_t bulkLb0 = std::min<uint64_t>(lb - popOff, bulkLb);
+        if (!bulk.buf.empty()) putIndexedHash(reader, addr + popOff, bulkLb0, bulk.hash);
+        popOff += bulkLb0;
+        bulkV.push_back(std::move(bulk));
+        pushedNum--;
+    };
+    uint64_t off = 0;
+    while (off < lb) {
+        const uint64_t bulkLb0 = std::min<uint64_t>(lb - off, bulkLb);
+        HashedBulk bulk;
+        if (!getIndexedHash(reader, bulkLb0, bulk.hash)) {
+            bulk.buf.resize(bulkLb0 * LOGICAL_BLOCK_SIZE);
+            reader.read(bulk.buf.data(), bulk.buf.size());
+        }
+        hconv.push(std::move(bulk));
+        off += bulkLb0;
+        if (++pushedNum >= maxPushedNum) popBulk();
+    }
+    while (pushedNum > 0) popBulk();
+
+    std::vector<cybozu::murmurhash3::Hash> hashV;
+    hashV.reserve(bulkV.size());
+    for (const HashedBulk &bulk : bulkV) hashV.push_back(bulk.hash);
+    return hasher(hashV.data(), hashV.size() * sizeof(cybozu::murmurhash3::Hash));
+}
+
 } // namespace dirty_hash_sync_local
 
+/**
+ * Region size of the tree mode.
+ * RETURN:
+ *   true if regionLb is a multiple of bulkLb, contains two or more bulks,
+ *   and is not greater than DIRTY_HASH_SYNC_MAX_REGION_LB.
+ */
+inline bool isValidHashTreeRegionLb(uint64_t regionLb, uint64_t bulkLb)
+{
+    return bulkLb > 0 && regionLb % bulkLb == 0 && regionLb >= bulkLb * 2
+        && regionLb <= DIRTY_HASH_SYNC_MAX_REGION_LB;
+}
+
+/**
+ * @regionMb region size of the tree mode [MiB]. 0 means the flat mode.
+ * RETURN:
+ *   region size rounded down to a multiple of bulkLb [logical block].
+ *   0 means the flat mode.
+ */
+inline uint64_t getHashTreeRegionLb(uint64_t regionMb, uint64_t bulkLb)
+{
+    if (regionMb == 0 || bulkLb == 0) return 0;
+    uint64_t regionLb = std::min(regionMb * MEBI / LOGICAL_BLOCK_SIZE, DIRTY_HASH_SYNC_MAX_REGION_LB);
+    regionLb -= regionLb % bulkLb;
+    return isValidHashTreeRegionLb(regionLb, bulkLb) ? regionLb : 0;
+}
+
+/**
+ * Tree mode of dirtyHashSyncClient().
+ *
+ * The server sends a hash of each region (regionLb) calculated from its bulk hashes.
+ * The client replies a dummy if the region is the same,
+ * or requests the bulk hashes of the region and sends the dirty bulks as diff packs.
+ * Each side reads the whole image just once.
+ */
+template <typename Reader>
+bool dirtyHashTreeSyncClient(
+    packet::Packet &pkt, Reader &reader,
+    uint64_t sizeLb, uint64_t bulkLb, uint64_t regionLb, const CompressOpt& cmprOpt,
+    uint32_t hashSeed, uint8_t hashAlgo, const std::atomic<int> &stopState, const ProcessStatus &ps,
+    const std::atomic<uint64_t>& maxLbPerSec)
+{
+    const char *const FUNC = __func__;
+    using Hash = cybozu::murmurhash3::Hash;
+    using HashedBulk = dirty_hash_sync_local::HashedBulk;
+    struct Region {
+        uint64_t addr;
+        std::vector<HashedBulk> bulkV;
+    };
+    packet::StreamControl2 recvCtl(pkt.sock());
+    packet::StreamControl2 sendCtl(pkt.sock());
+    DiffPacker packer;
+    ThroughputStabilizer thStab;
+    const size_t maxPushedNum = cmprOpt.numCpu * 2 + 1;
+
+    const SyncHasher hasher(hashSeed, hashAlgo); // shared by all worker threads.
+    dirty_hash_sync_local::HashConverter hconv([&](HashedBulk&& bulk) {
+        bulk.hash = hasher(bulk.buf.data(), bulk.buf.size());
+        return std::move(bulk);
+    });
+    hconv.start(cmprOpt.numCpu);
+    ConverterQueue cconv(maxPushedNum, cmprOpt.numCpu, true, cmprOpt.type, cmprOpt.level);
+
+    const uint64_t nrRegions = (sizeLb + regionLb - 1) / regionLb;
+    uint64_t nrRecvRegions = 0;
+    std::deque<Hash> regionHashQ; // received but not compared yet.
+    std::deque<Region> pendingQ; // dirty regions waiting for their bulk hashes.
+    uint64_t addr = 0;
+    size_t cPushedNum = 0;
+    size_t cRegion = 0, cReq = 0, cPack = 0;
+
+    auto popAndSendPack = [&]() {
+        compressor::Buffer compBuf = cconv.pop();
+        if (compBuf.empty()) throw cybozu::Exception(FUNC) << "converter queue failed";
+        dirty_hash_sync_local::doRetrySockIo(4, "ctrl.send.next", [&]() { sendCtl.sendNext(); });
+        pkt.write(dirty_hash_sync_local::TREE_MSG_PACK);
+        dirty_hash_sync_local::sendCompressedPack(pkt, compBuf);
+        cPack++;
+        cPushedNum--;
+    };
+    auto pushPack = [&]() {
+        cconv.push(packer.getPackAsArray());
+        packer.clear();
+        if (++cPushedNum < maxPushedNum) return;
+        popAndSendPack();
+    };
+    auto addDirtyBulk = [&](uint64_t bulkAddr, const HashedBulk &bulk) {
+        const uint32_t lb = bulk.buf.size() / LOGICAL_BLOCK_SIZE;
+        const uint64_t bgnAddr = packer.empty() ? bulkAddr : packer.header()[0].io_address;
+        if (bulkAddr - bgnAddr >= DIRTY_HASH_SYNC_MAX_PACK_AREA_LB && !packer.empty()) {
+            pushPack();
+        }
+        if (!packer.add(bulkAddr, lb, bulk.buf.data())) {
+            pushPack();
+            packer.add(bulkAddr, lb, bulk.buf.data());
+        }
+    };
+
+    try {
+    for (;;) {
+        if (stopState == ForceStopping || ps.isForceShutdown()) {
+            return false;
+        }
+        while (!regionHashQ.empty() && pendingQ.size() < DIRTY_HASH_SYNC_TREE_MAX_PENDING) {
+            const uint64_t lb = std::min(sizeLb - addr, regionLb);
+            Region region;
+            region.addr = addr;
+            const Hash hash = dirty_hash_sync_local::readAndHashRegion(
+                reader, addr, lb, bulkLb, hconv, maxPushedNum, hasher, region.bulkV);
+            if (hash == regionHashQ.front()) {
+                dirty_hash_sync_local::doRetrySockIo(4, "ctrl.send.dummy", [&]() { sendCtl.sendDummy(); });
+            } else {
+                dirty_hash_sync_local::doRetrySockIo(4, "ctrl.send.next", [&]() { sendCtl.sendNext(); });
+                pkt.write(dirty_hash_sync_local::TREE_MSG_REQUEST);
+                pendingQ.push_back(std::move(region));
+                cReq++;
+            }
+            pkt.flush();
+            regionHashQ.pop_front();
+            addr += lb;
+            thStab.setMaxLbPerSec(maxLbPerSec.load());
+            thStab.addAndSleepIfNecessary(lb, 10, 100);
+        }
+        if (addr == sizeLb && pendingQ.empty()) break;
+
+        dirty_hash_sync_local::doRetrySockIo(4, "ctrl.recv", [&]() { recvCtl.recv(); });
+        if (!recvCtl.isNext()) {
+            throw cybozu::Exception(FUNC) << "no next but not completed" << addr << pendingQ.size();
+        }
+        uint8_t type;
+        pkt.read(type);
+        if (type == dirty_hash_sync_local::TREE_MSG_REGION_HASH) {
+            if (nrRecvRegions == nrRegions) throw cybozu::Exception(FUNC) << "too many regions" << nrRegions;
+            Hash hash;
+            pkt.read(hash);
+            regionHashQ.push_back(hash);
+            nrRecvRegions++;
+            cRegion++;
+        } else if (type == dirty_hash_sync_local::TREE_MSG_BULK_HASHES) {
+            if (pendingQ.empty()) throw cybozu::Exception(FUNC) << "no region requested";
+            const Region &region = pendingQ.front();
+            uint64_t bulkAddr = region.addr;
+            for (const HashedBulk &bulk : region.bulkV) {
+                Hash hash;
+                pkt.read(hash);
+                if (hash != bulk.hash) addDirtyBulk(bulkAddr, bulk);
+                bulkAddr += bulk.buf.size() / LOGICAL_BLOCK_SIZE;
+            }
+            pendingQ.pop_front();
+            pkt.flush();
+        } else {
+            throw cybozu::Exception(FUNC) << "bad message type" << int(type);
+        }
+    }
+    dirty_hash_sync_local::doRetrySockIo(4, "ctrl.recv", [&]() { recvCtl.recv(); });
+    if (recvCtl.isError()) {
+        throw cybozu::Exception(FUNC) << "recvCtl";
+    }
+    if (!recvCtl.isEnd()) throw cybozu::Exception(FUNC) << "end not received";
+    if (!packer.empty()) pushPack();
+    cconv.quit();
+    while (cPushedNum > 0) popAndSendPack();
+    } catch (...) {
+        LOGs.warn() << "SEND_CTL" << cRegion << cReq << cPack;
+        throw;
+    }
+    dirty_hash_sync_local::doRetrySockIo(4, "ctrl.send.end", [&]() { sendCtl.sendEnd(); });
+    pkt.flush();
+
+    LOGs.debug() << "SEND_CTL" << cRegion << cReq << cPack;
+    return true;
+}
+
+/**
+ * Tree mode of dirtyHashSyncServer().
+ * See dirtyHashTreeSyncClient() for the protocol.
+ * The region hashes are sent ahead up to DIRTY_HASH_SYNC_TREE_WINDOW regions.
+ */
+template <typename Reader>
+bool dirtyHashTreeSyncServer(
+    packet::Packet &pkt, Reader &reader,
+    uint64_t sizeLb, uint64_t bulkLb, uint64_t regionLb, const cybozu::Uuid& uuid,
+    uint32_t hashSeed, uint8_t hashAlgo, bool doWriteDiff, int outFd, DiscardType discardType,
+    const std::atomic<int> &stopState, const ProcessStatus &ps, std::atomic<uint64_t> &progressLb,
+    uint64_t fsyncIntervalSize, size_t numCpu = 1)
+{
+    const char *const FUNC = __func__;
+    using Hash = cybozu::murmurhash3::Hash;
+    using HashedBulk = dirty_hash_sync_local::HashedBulk;
+    cybozu::util::File fileW(outFd);
+
+    if (doWriteDiff) {
+        DiffFileHeader wdiffH;
+        wdiffH.setUuid(uuid);
+        wdiffH.writeTo(fileW);
+    }
+
+    const SyncHasher hasher(hashSeed, hashAlgo); // shared by all worker threads.
+    dirty_hash_sync_local::HashConverter hconv([&](HashedBulk&& bulk) {
+        if (!bulk.buf.empty()) bulk.hash = hasher(bulk.buf.data(), bulk.buf.size());
+        return std::move(bulk);
+    });
+    hconv.start(numCpu);
+    const size_t maxPushedNum = numCpu * 2 + 1;
+
+    std::deque<std::vector<Hash> > bulkHashQ; // regions not compared by the client yet.
+    std::vector<HashedBulk> bulkV;
+    uint64_t hashLb = 0, cmpLb = 0;
+    bool sentEnd = false;
+    packet::StreamControl2 ctrl(pkt.sock());
+    AlignedArray zero, buf;
+    uint64_t writeSize = 0;
+    uint64_t fadvOffset = 0;
+    size_t sRegion = 0, sBulks = 0, sDummy = 0, sRecv = 0;
+
+    auto popRegion = [&]() {
+        if (bulkHashQ.empty()) throw cybozu::Exception(FUNC) << "no region to compare";
+        bulkHashQ.pop_front();
+        cmpLb = std::min(cmpLb + regionLb, sizeLb);
+        progressLb = cmpLb;
+    };
+
+    try {
+    for (;;) {
+        if (stopState == ForceStopping || ps.isForceShutdown()) return false;
+
+        bool sent = false;
+        while (hashLb < sizeLb && bulkHashQ.size() < DIRTY_HASH_SYNC_TREE_WINDOW) {
+            const uint64_t lb = std::min(sizeLb - hashLb, regionLb);
+            const Hash hash = dirty_hash_sync_local::readAndHashRegion(
+                reader, hashLb, lb, bulkLb, hconv, maxPushedNum, hasher, bulkV);
+            std::vector<Hash> hashV;
+            hashV.reserve(bulkV.size());
+            for (const HashedBulk &bulk : bulkV) hashV.push_back(bulk.hash);
+            bulkHashQ.push_back(std::move(hashV));
+            dirty_hash_sync_local::doRetrySockIo(2, "ctrl.send.next", [&]() { ctrl.sendNext(); });
+            pkt.write(dirty_hash_sync_local::TREE_MSG_REGION_HASH);
+            pkt.write(hash);
+            hashLb += lb;
+            sRegion++;
+            sent = true;
+        }
+        if (hashLb == sizeLb && bulkHashQ.empty() && !sentEnd) {
+            ctrl.sendEnd();
+            sentEnd = true;
+            sent = true;
+        }
+        if (sent) pkt.flush();
+
+        dirty_hash_sync_local::doRetrySockIo(4, "ctrl.recv", [&]() { ctrl.recv(); });
+        sRecv++;
+        if (ctrl.isDummy()) {
+            popRegion();
+            sDummy++;
+            continue;
+        }
+        if (!ctrl.isNext()) break;
+        uint8_t type;
+        pkt.read(type);
+        if (type == dirty_hash_sync_local::TREE_MSG_REQUEST) {
+            if (bulkHashQ.empty()) throw cybozu::Exception(FUNC) << "no region to compare";
+            dirty_hash_sync_local::doRetrySockIo(2, "ctrl.send.next", [&]() { ctrl.sendNext(); });
+            pkt.write(dirty_hash_sync_local::TREE_MSG_BULK_HASHES);
+            for (const Hash &hash : bulkHashQ.front()) pkt.write(hash);
+            pkt.flush();
+            popRegion();
+            sBulks++;
+        } else if (type == dirty_hash_sync_local::TREE_MSG_PACK) {
+            dirty_hash_sync_local::readPackAndWrite(
+                writeSize, fadvOffset, pkt, reader, fileW, doWriteDiff,
+                discardType, fsyncIntervalSize, zero, buf);
+        } else {
+            throw cybozu::Exception(FUNC) << "bad message type" << int(type);
+        }
+    }
+    } catch (...) {
+        LOGs.warn() << "RECV_CTL" << sRegion << sBulks << sRecv << sDummy;
+        throw;
+    }
+
+    if (ctrl.isError()) {
+        throw cybozu::Exception(FUNC) << "client sent an error";
+    }
+    assert(ctrl.isEnd());
+    if (!sentEnd) throw cybozu::Exception(FUNC) << "client finished before comparing all the regions" << cmpLb;
+    if (doWriteDiff) {
+        writeDiffEofPack(fileW);
+    } else {
+        fileW.fdatasync();
+    }
+
+    LOGs.debug() << "RECV_CTL" << sRegion << sBulks << sRecv << sDummy;
+    return true;
+}
+
 /**
  * Reader must have the member function: void read(void *data, size_t size).
+ * @hashAlgo hash algorithm (HASH_ALGO_XXX).
+ * @regionLb region size of the tree mode. 0 means the flat mode.
  */
 template <typename Reader>
 bool dirtyHashSyncClient(
     packet::Packet &pkt, Reader &reader,
-    uint64_t sizeLb, uint64_t bulkLb, const CompressOpt& cmprOpt, uint32_t hashSeed,
-    const std::atomic<int> &stopState, const ProcessStatus &ps,
-    const std::atomic<uint64_t>& maxLbPerSec)
+    uint64_t sizeLb, uint64_t bulkLb, const CompressOpt& cmprOpt,
+    uint32_t hashSeed, uint8_t hashAlgo, const std::atomic<int> &stopState, const ProcessStatus &ps,
+    const std::atomic<uint64_t>& maxLbPerSec, uint64_t regionLb = 0)
 {
+    if (regionLb > 0) {
+        return dirtyHashTreeSyncClient(
+            pkt, reader, sizeLb, bulkLb, regionLb, cmprOpt, hashSeed, hashAlgo, stopState, ps, maxLbPerSec);
+    }
     const char *const FUNC = __func__;
+    using HashTask = dirty_hash_sync_local::HashTask;
     packet::StreamControl2 recvCtl(pkt.sock());
     packet::StreamControl2 sendCtl(pkt.sock());
     DiffPacker packer;
-    // TODO: parallel compression.
-    walb::PackCompressor compr(cmprOpt.type, cmprOpt.level);
-    cybozu::murmurhash3::Hasher hasher(hashSeed);
     ThroughputStabilizer thStab;
+    const size_t maxPushedNum = cmprOpt.numCpu * 2 + 1;
+
+    const SyncHasher hasher(hashSeed, hashAlgo); // shared by all worker threads.
+    cybozu::thread::ParallelConverter<HashTask, HashTask> hconv([&](HashTask&& task) {
+        task.isDirty = task.recvHash != hasher(task.buf.data(), task.buf.size());
+        return std::move(task);
+    });
+    hconv.start(cmprOpt.numCpu);
+    ConverterQueue cconv(maxPushedNum, cmprOpt.numCpu, true, cmprOpt.type, cmprOpt.level);
 
     uint64_t addr = 0;
     uint64_t remainingLb = sizeLb;
-    AlignedArray buf;
+    size_t hPushedNum = 0, cPushedNum = 0;
     size_t cHash = 0, cSend = 0, cDummy = 0;
+
+    auto popAndSendPack = [&]() {
+        compressor::Buffer compBuf = cconv.pop();
+        if (compBuf.empty()) throw cybozu::Exception(FUNC) << "converter queue failed";
+        dirty_hash_sync_local::doRetrySockIo(4, "ctrl.send.next", [&]() { sendCtl.sendNext(); });
+        cSend++;
+        dirty_hash_sync_local::sendCompressedPack(pkt, compBuf);
+        cPushedNum--;
+    };
+    auto pushPack = [&]() {
+        cconv.push(packer.getPackAsArray());
+        packer.clear();
+        if (++cPushedNum < maxPushedNum) return;
+        popAndSendPack();
+    };
+    auto popAndPackHashTask = [&]() {
+        HashTask task;
+        if (!hconv.pop(task)) {
+            throw cybozu::Exception(FUNC) << "parallel converter failed";
+        }
+        hPushedNum--;
+        const uint64_t bgnAddr = packer.empty() ? task.addr : packer.header()[0].io_address;
+        if (task.addr - bgnAddr >= DIRTY_HASH_SYNC_MAX_PACK_AREA_LB && !packer.empty()) {
+            pushPack();
+        }
+        if (task.isDirty && !packer.add(task.addr, task.lb, task.buf.data())) {
+            pushPack();
+            packer.add(task.addr, task.lb, task.buf.data());
+        }
+    };
+
     try {
     for (;;) {
         if (stopState == ForceStopping || ps.isForceShutdown()) {
@@ -143,50 +605,41 @@ bool dirtyHashSyncClient(
             if (remainingLb == 0) break;
             throw cybozu::Exception(FUNC) << "no next but remainingLb is not zero" << remainingLb;
         }
-        cybozu::murmurhash3::Hash recvHash;
-        pkt.read(recvHash);
+        HashTask task;
+        pkt.read(task.recvHash);
         cHash++;
 
         const uint32_t lb = std::min<uint64_t>(remainingLb, bulkLb);
-        buf.resize(lb * LOGICAL_BLOCK_SIZE);
-        reader.read(buf.data(), buf.size());
+        task.addr = addr;
+        task.lb = lb;
+        task.buf.resize(lb * LOGICAL_BLOCK_SIZE);
+        reader.read(task.buf.data(), task.buf.size());
 
         // to avoid socket timeout.
         dirty_hash_sync_local::doRetrySockIo(4, "ctrl.send.dummy", [&]() { sendCtl.sendDummy(); });
         cDummy++; cSend++;
 
-        const cybozu::murmurhash3::Hash bdHash = hasher(buf.data(), buf.size());
-        const uint64_t bgnAddr = packer.empty() ? addr : packer.header()[0].io_address;
-        if (addr - bgnAddr >= DIRTY_HASH_SYNC_MAX_PACK_AREA_LB && !packer.empty()) {
-            dirty_hash_sync_local::doRetrySockIo(4, "ctrl.send.next0", [&]() { sendCtl.sendNext(); });
-            cSend++;
-            dirty_hash_sync_local::compressAndSend(pkt, packer, compr);
-        }
-        if (recvHash != bdHash && !packer.add(addr, lb, buf.data())) {
-            dirty_hash_sync_local::doRetrySockIo(4, "ctrl.send.next1", [&]() { sendCtl.sendNext(); });
-            cSend++;
-            dirty_hash_sync_local::compressAndSend(pkt, packer, compr);
-            packer.add(addr, lb, buf.data());
-        }
+        hconv.push(std::move(task));
+        if (++hPushedNum >= maxPushedNum) popAndPackHashTask();
         pkt.flush();
         remainingLb -= lb;
         addr += lb;
         thStab.setMaxLbPerSec(maxLbPerSec.load());
         thStab.addAndSleepIfNecessary(lb, 10, 100);
     }
+    hconv.sync();
+    while (hPushedNum > 0) popAndPackHashTask();
+    if (!packer.empty()) pushPack();
+    cconv.quit();
+    while (cPushedNum > 0) popAndSendPack();
     } catch (...) {
         LOGs.warn() << "SEND_CTL" << cHash << cSend << cDummy;
         throw;
     }
-    if (!packer.empty()) {
-        dirty_hash_sync_local::doRetrySockIo(4, "ctrl.send.next2", [&]() { sendCtl.sendNext(); });
-        cSend++;
-        dirty_hash_sync_local::compressAndSend(pkt, packer, compr);
-    }
     if (recvCtl.isError()) {
         throw cybozu::Exception(FUNC) << "recvCtl";
     }
-    dirty_hash_sync_local::doRetrySockIo(4, "ctrl.send.next2", [&]() { sendCtl.sendEnd(); });
+    dirty_hash_sync_local::doRetrySockIo(4, "ctrl.send.end", [&]() { sendCtl.sendEnd(); });
     pkt.flush();
 
     LOGs.debug() << "SEND_CTL" << cHash << cSend << cDummy;
@@ -198,15 +651,22 @@ bool dirtyHashSyncClient(
  * otherwise, outFd means block device fd of full image store.
  *
  * fsyncIntervalSize [bytes].
+ * hashAlgo is the hash algorithm (HASH_ALGO_XXX).
+ * regionLb is the region size of the tree mode. 0 means the flat mode.
  */
 template <typename Reader>
 bool dirtyHashSyncServer(
     packet::Packet &pkt, Reader &reader,
-    uint64_t sizeLb, uint64_t bulkLb, const cybozu::Uuid& uuid, uint32_t hashSeed,
-    bool doWriteDiff, int outFd, DiscardType discardType,
+    uint64_t sizeLb, uint64_t bulkLb, const cybozu::Uuid& uuid,
+    uint32_t hashSeed, uint8_t hashAlgo, bool doWriteDiff, int outFd, DiscardType discardType,
     const std::atomic<int> &stopState, const ProcessStatus &ps, std::atomic<uint64_t> &progressLb,
-    uint64_t fsyncIntervalSize)
+    uint64_t fsyncIntervalSize, size_t numCpu = 1, uint64_t regionLb = 0)
 {
+    if (regionLb > 0) {
+        return dirtyHashTreeSyncServer(
+            pkt, reader, sizeLb, bulkLb, regionLb, uuid, hashSeed, hashAlgo, doWriteDiff, outFd, discardType,
+            stopState, ps, progressLb, fsyncIntervalSize, numCpu);
+    }
     const char *const FUNC = __func__;
 
     std::atomic<bool> quit(false);
@@ -217,22 +677,49 @@ bool dirtyHashSyncServer(
     };
 
     auto readVirtualFullImageAndSendHash = [&]() {
-        cybozu::murmurhash3::Hasher hasher(hashSeed);
+        using HashedBulk = dirty_hash_sync_local::HashedBulk;
+        const SyncHasher hasher(hashSeed, hashAlgo); // shared by all worker threads.
+        dirty_hash_sync_local::HashConverter hconv([&](HashedBulk&& bulk) {
+            if (!bulk.buf.empty()) bulk.hash = hasher(bulk.buf.data(), bulk.buf.size());
+            return std::move(bulk);
+        });
+        hconv.start(numCpu);
+        const size_t maxPushedNum = numCpu * 2 + 1;
         packet::StreamControl2 ctrl(pkt.sock());
-        AlignedArray buf;
-        uint64_t hashLb = 0;
-        size_t sHash = 0;
+        uint64_t readLb = 0, hashLb = 0;
+        size_t pushedNum = 0, sHash = 0;
+        auto popAndSendHash = [&]() {
+            HashedBulk bulk;
+            if (!hconv.pop(bulk)) {
+                throw cybozu::Exception(FUNC) << "parallel converter failed";
+            }
+            pushedNum--;
+            const uint64_t lb = std::min<uint64_t>(sizeLb - hashLb, bulkLb);
+            if (!bulk.buf.empty()) putIndexedHash(reader, hashLb, lb, bulk.hash);
+            dirty_hash_sync_local::doRetrySockIo(2, "ctrl.send.next", [&]() { ctrl.sendNext(); });
+            pkt.write(bulk.hash);
+            sHash++;
+            hashLb += lb;
+            progressLb = hashLb;
+        };
         try {
-            while (hashLb < sizeLb) {
+            while (readLb < sizeLb) {
                 if (abortCondition()) {
                     quit = true;
                     return;
                 }
-                dirty_hash_sync_local::readAndSendHash(
-                    hashLb, pkt, ctrl, reader, sizeLb, bulkLb, hasher, buf);
-                sHash++;
-                progressLb = hashLb;
+                const uint64_t lb = std::min<uint64_t>(sizeLb - readLb, bulkLb);
+                HashedBulk bulk;
+                if (!getIndexedHash(reader, lb, bulk.hash)) {
+                    bulk.buf.resize(lb * LOGICAL_BLOCK_SIZE);
+                    reader.read(bulk.buf.data(), bulk.buf.size());
+                }
+                hconv.push(std::move(bulk));
+                readLb += lb;
+                if (++pushedNum >= maxPushedNum) popAndSendHash();
             }
+            hconv.sync();
+            while (pushedNum > 0) popAndSendHash();
             ctrl.sendEnd();
             pkt.flush();
             LOGs.debug() << "SEND_CTL" << sHash;
@@ -275,7 +762,7 @@ bool dirtyHashSyncServer(
             continue;
         }
         dirty_hash_sync_local::readPackAndWrite(
-            writeSize, fadvOffset, pkt, fileW, doWriteDiff,
+            writeSize, fadvOffset, pkt, reader, fileW, doWriteDiff,
             discardType, fsyncIntervalSize, zero, buf);
     }
     } catch (...) {
@@ -304,8 +791,8 @@ bool dirtyHashSyncServer(
 template <typename Reader>
 bool dirtyHashSyncServer2(
     packet::Packet &pkt, Reader &reader,
-    uint64_t sizeLb, uint64_t bulkLb, const cybozu::Uuid& uuid, uint32_t hashSeed,
-    bool doWriteDiff, int outFd, DiscardType discardType,
+    uint64_t sizeLb, uint64_t bulkLb, const cybozu::Uuid& uuid,
+    uint32_t hashSeed, uint8_t hashAlgo, bool doWriteDiff, int outFd, DiscardType discardType,
     const std::atomic<int> &stopState, const ProcessStatus &ps, std::atomic<uint64_t> &progressLb,
     uint64_t fsyncIntervalSize)
 {
@@ -324,7 +811,7 @@ bool dirtyHashSyncServer2(
     AlignedArray zero;
     uint64_t writeSize = 0;
     uint64_t fadvOffset = 0;
-    cybozu::murmurhash3::Hasher hasher(hashSeed);
+    const SyncHasher hasher(hashSeed, hashAlgo);
     size_t sHash = 0, sDummy = 0, sRecv = 0;
 
     try {
@@ -356,7 +843,7 @@ bool dirtyHashSyncServer2(
             continue;
         }
         dirty_hash_sync_local::readPackAndWrite(
-            writeSize, fadvOffset, pkt, fileW, doWriteDiff,
+            writeSize, fadvOffset, pkt, reader, fileW, doWriteDiff,
             discardType, fsyncIntervalSize, zero, buf1);
     }
     } catch (...) {
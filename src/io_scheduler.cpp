@@ -0,0 +1,157 @@
+#include "io_scheduler.hpp"
+#include "constant.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <cinttypes>
+
+namespace walb {
+
+namespace io_scheduler_local {
+
+/* Max waiting period at once to check shouldStop() [ms]. */
+const size_t MAX_WAIT_MS = 100;
+
+/* Capacity of token buckets [sec]. */
+const double BURST_SEC = 0.1;
+
+} // namespace io_scheduler_local
+
+void IoScheduler::setLimit(uint64_t maxBytesPerSec, uint64_t maxIops)
+{
+    UniqueLock lk(mu_);
+    maxBytesPerSec_ = maxBytesPerSec;
+    maxIops_ = maxIops;
+    /* Start with full buckets. */
+    bytesToken_ = maxBytesPerSec_ * io_scheduler_local::BURST_SEC;
+    iosToken_ = maxIops_ * io_scheduler_local::BURST_SEC;
+    ts_ = nowFunc_();
+    cv_.notify_all();
+}
+
+void IoScheduler::setBacklogFirst(bool isBacklogFirst)
+{
+    UniqueLock lk(mu_);
+    isBacklogFirst_ = isBacklogFirst;
+}
+
+void IoScheduler::setWeight(const std::string &volId, uint64_t weight)
+{
+    if (weight == 0) throw cybozu::Exception(NAME) << "weight must not be 0" << volId;
+    UniqueLock lk(mu_);
+    getVol(volId).weight = weight;
+}
+
+void IoScheduler::setPriority(const std::string &volId, uint64_t priority)
+{
+    UniqueLock lk(mu_);
+    getVol(volId).priority = priority;
+}
+
+void IoScheduler::setBacklog(const std::string &volId, uint64_t backlog)
+{
+    UniqueLock lk(mu_);
+    getVol(volId).backlog = backlog;
+}
+
+void IoScheduler::removeVolume(const std::string &volId)
+{
+    UniqueLock lk(mu_);
+    std::map<std::string, Vol>::iterator it = volMap_.find(volId);
+    if (it == volMap_.end() || it->second.nrWaiting > 0) return;
+    volMap_.erase(it);
+}
+
+bool IoScheduler::acquire(const std::string &volId, uint64_t bytes,
+                          const std::function<bool()> &shouldStop)
+{
+    UniqueLock lk(mu_);
+    Vol &vol = getVol(volId);
+    if (isUnlimited()) {
+        vol.totalBytes += bytes;
+        vol.totalIos++;
+        return true;
+    }
+    const double vtime = std::max(vol.vtime, vtime_);
+    const Key key(UINT64_MAX - vol.priority, vtime, seqId_++);
+    waitS_.insert(key);
+    vol.nrWaiting++;
+    bool ret = true;
+    for (;;) {
+        if (isUnlimited()) break;
+        refill(nowFunc_());
+        const double waitSec = getWaitSec();
+        if (*waitS_.begin() == key && waitSec == 0) break;
+        if (shouldStop && shouldStop()) {
+            ret = false;
+            break;
+        }
+        size_t ms = io_scheduler_local::MAX_WAIT_MS;
+        if (*waitS_.begin() == key) {
+            ms = std::min<size_t>(ms, waitSec * 1000 + 1);
+        }
+        cv_.wait_for(lk, std::chrono::milliseconds(ms));
+    }
+    waitS_.erase(key);
+    vol.nrWaiting--;
+    if (ret) {
+        bytesToken_ -= bytes;
+        iosToken_ -= 1;
+        vtime_ = vtime;
+        vol.vtime = std::max(vol.vtime, vtime + double(bytes) / getWeight(vol));
+        vol.totalBytes += bytes;
+        vol.totalIos++;
+    }
+    cv_.notify_all();
+    return ret;
+}
+
+std::vector<std::string> IoScheduler::getStatus() const
+{
+    UniqueLock lk(mu_);
+    std::vector<std::string> v;
+    v.push_back(cybozu::util::formatString(
+                    "maxBytesPerSec %" PRIu64 " maxIops %" PRIu64 " backlogFirst %d waiting %zu"
+                    , maxBytesPerSec_, maxIops_, isBacklogFirst_, waitS_.size()));
+    for (const std::map<std::string, Vol>::value_type &p : volMap_) {
+        const Vol &vol = p.second;
+        v.push_back(cybozu::util::formatString(
+                        "volId %s weight %" PRIu64 " priority %" PRIu64 " backlog %" PRIu64 " "
+                        "totalBytes %" PRIu64 " totalIos %" PRIu64 " waiting %zu"
+                        , p.first.c_str(), vol.weight, vol.priority, vol.backlog
+                        , vol.totalBytes, vol.totalIos, vol.nrWaiting));
+    }
+    return v;
+}
+
+void IoScheduler::refill(const Clock::time_point &now)
+{
+    const double sec = std::chrono::duration<double>(now - ts_).count();
+    ts_ = now;
+    const double burst = io_scheduler_local::BURST_SEC;
+    if (maxBytesPerSec_ > 0) {
+        bytesToken_ = std::min(bytesToken_ + maxBytesPerSec_ * sec, maxBytesPerSec_ * burst);
+    }
+    if (maxIops_ > 0) {
+        iosToken_ = std::min(iosToken_ + maxIops_ * sec, maxIops_ * burst);
+    }
+}
+
+double IoScheduler::getWaitSec() const
+{
+    double sec = 0;
+    if (maxBytesPerSec_ > 0 && bytesToken_ < 0) {
+        sec = std::max(sec, -bytesToken_ / maxBytesPerSec_);
+    }
+    if (maxIops_ > 0 && iosToken_ < 0) {
+        sec = std::max(sec, -iosToken_ / maxIops_);
+    }
+    return sec;
+}
+
+double IoScheduler::getWeight(const Vol &vol) const
+{
+    if (!isBacklogFirst_) return vol.weight;
+    return double(vol.weight) * std::max<uint64_t>(vol.backlog / GIBI, 1);
+}
+
+} // namespace walb
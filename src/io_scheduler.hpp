@@ -0,0 +1,155 @@
+#pragma once
+/**
+ * @file
+ * @brief IO scheduler to share an IO budget among volumes.
+ */
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <tuple>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+#include <cstdint>
+#include "cybozu/exception.hpp"
+
+namespace walb {
+
+/**
+ * IO scheduler shared by background IOs of all the volumes in a server.
+ *
+ * Each IO calls acquire() before it is issued,
+ * which blocks until the global budget (bytes per second and IOs per second) allows it.
+ * Waiting IOs are served in order of priority (larger first),
+ * then in order of virtual start time (start-time fair queueing).
+ * The virtual time of a volume advances by IO size / weight,
+ * so volumes with the same priority share the budget in proportion to their weights.
+ * With backlog-first, the weight is also multiplied by the backlog of the volume in GiB (at least 1).
+ *
+ * Each budget is a token bucket which can hold the budget of 100 milliseconds.
+ * An IO is allowed when the bucket is not in debt, and it may make a debt.
+ * This is thread-safe class.
+ */
+class IoScheduler /* final */
+{
+public:
+    using Clock = std::chrono::steady_clock;
+    using NowFunc = std::function<Clock::time_point()>;
+private:
+    using Mutex = std::mutex;
+    using UniqueLock = std::unique_lock<Mutex>;
+
+    struct Vol {
+        uint64_t weight;
+        uint64_t priority;
+        uint64_t backlog; // [byte]
+        double vtime; // virtual start time of the next IO.
+        uint64_t totalBytes;
+        uint64_t totalIos;
+        size_t nrWaiting;
+
+        Vol() : weight(1), priority(0), backlog(0), vtime(0)
+              , totalBytes(0), totalIos(0), nrWaiting(0) {
+        }
+    };
+    /* (reverse priority, virtual start time, sequence id). */
+    using Key = std::tuple<uint64_t, double, uint64_t>;
+
+    mutable Mutex mu_;
+    std::condition_variable cv_;
+    uint64_t maxBytesPerSec_; // 0 means unlimited.
+    uint64_t maxIops_; // 0 means unlimited.
+    bool isBacklogFirst_;
+
+    const NowFunc nowFunc_;
+    double bytesToken_;
+    double iosToken_;
+    Clock::time_point ts_; // last refill time.
+
+    std::map<std::string, Vol> volMap_;
+    std::set<Key> waitS_;
+    uint64_t seqId_;
+    double vtime_; // virtual start time of the IO served last.
+
+public:
+    static constexpr const char *NAME = "IoScheduler";
+    /**
+     * @nowFunc clock to refill the buckets. Tests can replace it.
+     */
+    explicit IoScheduler(const NowFunc &nowFunc = Clock::now)
+        : mu_(), cv_(), maxBytesPerSec_(0), maxIops_(0), isBacklogFirst_(false)
+        , nowFunc_(nowFunc), bytesToken_(0), iosToken_(0), ts_(nowFunc_())
+        , volMap_(), waitS_(), seqId_(0), vtime_(0) {
+    }
+    /**
+     * @maxBytesPerSec 0 means unlimited.
+     * @maxIops 0 means unlimited.
+     */
+    void setLimit(uint64_t maxBytesPerSec, uint64_t maxIops);
+    void getLimit(uint64_t &maxBytesPerSec, uint64_t &maxIops) const {
+        UniqueLock lk(mu_);
+        maxBytesPerSec = maxBytesPerSec_;
+        maxIops = maxIops_;
+    }
+    void setBacklogFirst(bool isBacklogFirst);
+    /**
+     * @weight must not be 0. Default is 1.
+     */
+    void setWeight(const std::string &volId, uint64_t weight);
+    /**
+     * @priority larger one is served first. Default is 0.
+     */
+    void setPriority(const std::string &volId, uint64_t priority);
+    /**
+     * @backlog size of data waiting to be processed [byte].
+     */
+    void setBacklog(const std::string &volId, uint64_t backlog);
+    /**
+     * Forget the settings and statistics of a volume.
+     * It is not removed while its IOs are waiting.
+     */
+    void removeVolume(const std::string &volId);
+    /**
+     * Wait until an IO is allowed.
+     * The virtual time of the volume advances only when the IO is allowed.
+     * @bytes IO size [byte].
+     * @shouldStop it will be checked while waiting.
+     * RETURN:
+     *   false if shouldStop() returned true.
+     */
+    bool acquire(const std::string &volId, uint64_t bytes,
+                 const std::function<bool()> &shouldStop = nullptr);
+    /**
+     * Human-readable status lines.
+     */
+    std::vector<std::string> getStatus() const;
+    size_t getNrWaiting() const {
+        UniqueLock lk(mu_);
+        return waitS_.size();
+    }
+    uint64_t getTotalIos(const std::string &volId) const {
+        UniqueLock lk(mu_);
+        std::map<std::string, Vol>::const_iterator it = volMap_.find(volId);
+        return it == volMap_.end() ? 0 : it->second.totalIos;
+    }
+    size_t getNrVolumes() const {
+        UniqueLock lk(mu_);
+        return volMap_.size();
+    }
+private:
+    Vol& getVol(const std::string &volId) {
+        return volMap_[volId];
+    }
+    bool isUnlimited() const { return maxBytesPerSec_ == 0 && maxIops_ == 0; }
+    void refill(const Clock::time_point &now);
+    /**
+     * RETURN:
+     *   time until the buckets are not in debt [sec].
+     */
+    double getWaitSec() const;
+    double getWeight(const Vol &vol) const;
+};
+
+} // namespace walb
@@ -927,6 +927,20 @@ public:
         if (maxNr > 0 && v.size() > maxNr) v.resize(maxNr);
         return v;
     }
+    /**
+     * Estimate cost to restore a clean snapshot specified by a gid from a state.
+     * @cost total data size of the diffs to apply [byte].
+     * RETURN:
+     *   false if the clean snapshot can not be restored from the state.
+     */
+    bool getRestoreCost(const MetaState& st, uint64_t gid, uint64_t &cost) const {
+        cost = 0;
+        if (!st.isApplying && st.snapB == MetaSnap(gid)) return true;
+        const MetaDiffVec v = getDiffListToRestore(st, gid);
+        if (v.empty()) return false;
+        for (const MetaDiff &d : v) cost += d.dataSize;
+        return true;
+    }
     /**
      * Get diff list to apply all diffs before a specified gid.
      *
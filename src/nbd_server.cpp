@@ -0,0 +1,444 @@
+#include "nbd_server.hpp"
+#include "walb_types.hpp"
+#include "constant.hpp"
+#include "walb_logger.hpp"
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include <cstring>
+#include <cerrno>
+#include <endian.h>
+#include <poll.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+namespace walb {
+
+namespace nbd_server_local {
+
+const uint64_t NBD_MAGIC = 0x4e42444d41474943ULL; // "NBDMAGIC"
+const uint64_t NBD_OPTS_MAGIC = 0x49484156454f5054ULL; // "IHAVEOPT"
+const uint64_t NBD_REP_MAGIC = 0x3e889045565a9ULL;
+const uint32_t NBD_REQUEST_MAGIC = 0x25609513;
+const uint32_t NBD_SIMPLE_REPLY_MAGIC = 0x67446698;
+
+/* Handshake flags. */
+const uint16_t NBD_FLAG_FIXED_NEWSTYLE = 1 << 0;
+const uint16_t NBD_FLAG_NO_ZEROES = 1 << 1;
+/* Client flags. */
+const uint32_t NBD_FLAG_C_FIXED_NEWSTYLE = 1 << 0;
+const uint32_t NBD_FLAG_C_NO_ZEROES = 1 << 1;
+/* Transmission flags. */
+const uint16_t NBD_FLAG_HAS_FLAGS = 1 << 0;
+const uint16_t NBD_FLAG_READ_ONLY = 1 << 1;
+const uint16_t NBD_FLAG_SEND_FLUSH = 1 << 2;
+
+/* Options. */
+const uint32_t NBD_OPT_EXPORT_NAME = 1;
+const uint32_t NBD_OPT_ABORT = 2;
+const uint32_t NBD_OPT_LIST = 3;
+const uint32_t NBD_OPT_INFO = 6;
+const uint32_t NBD_OPT_GO = 7;
+
+/* Option replies. */
+const uint32_t NBD_REP_ACK = 1;
+const uint32_t NBD_REP_SERVER = 2;
+const uint32_t NBD_REP_INFO = 3;
+const uint32_t NBD_REP_ERR_UNSUP = (1U << 31) + 1;
+const uint32_t NBD_REP_ERR_INVALID = (1U << 31) + 3;
+const uint32_t NBD_REP_ERR_UNKNOWN = (1U << 31) + 6;
+const uint16_t NBD_INFO_EXPORT = 0;
+
+/* Commands. */
+const uint16_t NBD_CMD_READ = 0;
+const uint16_t NBD_CMD_WRITE = 1;
+const uint16_t NBD_CMD_DISC = 2;
+const uint16_t NBD_CMD_FLUSH = 3;
+
+const uint32_t NBD_EPERM = 1;
+const uint32_t NBD_EIO = 5;
+const uint32_t NBD_EINVAL = 22;
+
+const size_t MAX_OPTION_SIZE = 4096;
+const size_t MAX_READ_SIZE = 32 * MEBI;
+const int POLL_INTERVAL_MS = 1000;
+
+/**
+ * Big-endian serializer.
+ */
+class Buffer
+{
+    std::vector<char> v_;
+public:
+    Buffer &put64(uint64_t x) { x = htobe64(x); return put(&x, sizeof(x)); }
+    Buffer &put32(uint32_t x) { x = htobe32(x); return put(&x, sizeof(x)); }
+    Buffer &put16(uint16_t x) { x = htobe16(x); return put(&x, sizeof(x)); }
+    Buffer &put(const void *data, size_t size) {
+        const char *p = (const char *)data;
+        v_.insert(v_.end(), p, p + size);
+        return *this;
+    }
+    void writeTo(cybozu::util::File &file) const {
+        file.write(v_.data(), v_.size());
+    }
+};
+
+inline uint64_t get64(const char *p) { uint64_t x; ::memcpy(&x, p, sizeof(x)); return be64toh(x); }
+inline uint32_t get32(const char *p) { uint32_t x; ::memcpy(&x, p, sizeof(x)); return be32toh(x); }
+inline uint16_t get16(const char *p) { uint16_t x; ::memcpy(&x, p, sizeof(x)); return be16toh(x); }
+
+/**
+ * RETURN:
+ *   true if the fd is readable, false if timeout.
+ */
+inline bool waitForReadable(int fd, int timeoutMs)
+{
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    const int ret = ::poll(&pfd, 1, timeoutMs);
+    if (ret < 0) {
+        if (errno == EINTR) return false;
+        throw cybozu::Exception("waitForReadable:poll failed") << cybozu::ErrorNo();
+    }
+    return ret > 0;
+}
+
+using Clock = std::chrono::steady_clock;
+
+inline Clock::time_point getDeadline(size_t timeoutMs)
+{
+    return Clock::now() + std::chrono::milliseconds(timeoutMs);
+}
+
+/**
+ * Read data from a socket until the deadline.
+ * RETURN:
+ *   false if shouldStop() returned true.
+ */
+inline bool readUntil(cybozu::util::File &file, void *data, size_t size, const Clock::time_point &deadline,
+                      const std::function<bool()> &shouldStop)
+{
+    char *p = (char *)data;
+    size_t s = 0;
+    while (s < size) {
+        if (shouldStop && shouldStop()) return false;
+        const int64_t remainingMs =
+            std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now()).count();
+        if (remainingMs <= 0) {
+            throw cybozu::Exception("readUntil:timeout") << s << size;
+        }
+        if (!waitForReadable(file.fd(), std::min<int64_t>(POLL_INTERVAL_MS, remainingMs))) continue;
+        const size_t r = file.readsome(p + s, size - s);
+        if (r == 0) throw cybozu::util::EofError();
+        s += r;
+    }
+    return true;
+}
+
+inline void sendOptReply(cybozu::util::File &file, uint32_t opt, uint32_t type,
+                         const Buffer &data = Buffer(), uint32_t size = 0)
+{
+    Buffer buf;
+    buf.put64(NBD_REP_MAGIC).put32(opt).put32(type).put32(size);
+    buf.writeTo(file);
+    if (size > 0) data.writeTo(file);
+}
+
+inline void sendSimpleReply(cybozu::util::File &file, uint32_t error, uint64_t handle)
+{
+    Buffer buf;
+    buf.put32(NBD_SIMPLE_REPLY_MAGIC).put32(error).put64(handle);
+    buf.writeTo(file);
+}
+
+} // namespace nbd_server_local
+
+
+void NbdListener::listen(const std::string &addrStr)
+{
+    close();
+    const std::string unixPrefix = "unix:";
+    if (addrStr.compare(0, unixPrefix.size(), unixPrefix) == 0) {
+        const std::string path = addrStr.substr(unixPrefix.size());
+        struct sockaddr_un addr;
+        ::memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+            throw cybozu::Exception(NAME) << "bad unix socket path" << path;
+        }
+        ::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+        const int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) throw cybozu::Exception(NAME) << "socket failed" << cybozu::ErrorNo();
+        file_ = cybozu::util::File(fd, true);
+        if (::bind(fd, (const struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            throw cybozu::Exception(NAME) << "bind failed" << path << cybozu::ErrorNo();
+        }
+        unixPath_ = path;
+    } else {
+        const size_t pos = addrStr.rfind(':');
+        if (pos == std::string::npos) {
+            throw cybozu::Exception(NAME) << "bad address" << addrStr;
+        }
+        const std::string host = addrStr.substr(0, pos);
+        const std::string port = addrStr.substr(pos + 1);
+        struct addrinfo hints, *res;
+        ::memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        const int err = ::getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &res);
+        if (err != 0) {
+            throw cybozu::Exception(NAME) << "getaddrinfo failed" << addrStr << ::gai_strerror(err);
+        }
+        std::unique_ptr<struct addrinfo, void (*)(struct addrinfo *)> resPtr(res, ::freeaddrinfo);
+        const int fd = ::socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+        if (fd < 0) throw cybozu::Exception(NAME) << "socket failed" << cybozu::ErrorNo();
+        file_ = cybozu::util::File(fd, true);
+        const int on = 1;
+        ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (::bind(fd, res->ai_addr, res->ai_addrlen) < 0) {
+            throw cybozu::Exception(NAME) << "bind failed" << addrStr << cybozu::ErrorNo();
+        }
+    }
+    if (::listen(file_.fd(), 1) < 0) {
+        throw cybozu::Exception(NAME) << "listen failed" << addrStr << cybozu::ErrorNo();
+    }
+}
+
+bool NbdListener::accept(cybozu::util::File &client, size_t timeoutMs,
+                         const std::function<bool()> &shouldStop)
+{
+    using namespace nbd_server_local;
+    size_t waitedMs = 0;
+    for (;;) {
+        if (shouldStop && shouldStop()) return false;
+        if (timeoutMs > 0 && waitedMs >= timeoutMs) return false;
+        const int ms = timeoutMs > 0
+            ? std::min<int>(POLL_INTERVAL_MS, timeoutMs - waitedMs) : POLL_INTERVAL_MS;
+        if (waitForReadable(file_.fd(), ms)) break;
+        waitedMs += ms;
+    }
+    const int fd = ::accept(file_.fd(), nullptr, nullptr);
+    if (fd < 0) throw cybozu::Exception(NAME) << "accept failed" << cybozu::ErrorNo();
+    client = cybozu::util::File(fd, true);
+    if (unixPath_.empty()) {
+        const int on = 1;
+        ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+    return true;
+}
+
+void NbdListener::close() noexcept
+{
+    try {
+        file_.close();
+    } catch (...) {
+    }
+    if (!unixPath_.empty()) {
+        ::unlink(unixPath_.c_str());
+        unixPath_.clear();
+    }
+}
+
+
+bool NbdServer::serve(cybozu::util::File &file, const std::function<bool()> &shouldStop)
+{
+    /* A client that does not read replies must not block the server forever. */
+    struct timeval tv;
+    tv.tv_sec = timeoutMs_ / 1000;
+    tv.tv_usec = timeoutMs_ % 1000 * 1000;
+    if (::setsockopt(file.fd(), SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0) {
+        throw cybozu::Exception(NAME) << "setsockopt SO_SNDTIMEO failed" << cybozu::ErrorNo();
+    }
+    bool isStopped = false;
+    if (negotiate(file, shouldStop, isStopped)) {
+        transmit(file, shouldStop, isStopped);
+    }
+    return !isStopped;
+}
+
+bool NbdServer::negotiate(cybozu::util::File &file, const std::function<bool()> &shouldStop, bool &isStopped)
+{
+    using namespace nbd_server_local;
+    const Clock::time_point deadline = getDeadline(timeoutMs_);
+    auto readData = [&](void *data, size_t size) {
+        if (readUntil(file, data, size, deadline, shouldStop)) return true;
+        isStopped = true;
+        return false;
+    };
+    Buffer buf;
+    buf.put64(NBD_MAGIC).put64(NBD_OPTS_MAGIC).put16(NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+    buf.writeTo(file);
+    char head[16];
+    if (!readData(head, 4)) return false;
+    const uint32_t clientFlags = get32(head);
+    if ((clientFlags & NBD_FLAG_C_FIXED_NEWSTYLE) == 0) {
+        throw cybozu::Exception(NAME) << "client does not support fixed newstyle" << clientFlags;
+    }
+    const bool noZeroes = (clientFlags & NBD_FLAG_C_NO_ZEROES) != 0;
+    const uint16_t transFlags =
+        NBD_FLAG_HAS_FLAGS | NBD_FLAG_READ_ONLY | NBD_FLAG_SEND_FLUSH;
+
+    std::vector<char> data;
+    for (;;) {
+        /* magic (8), option (4), and data size (4). */
+        if (!readData(head, 16)) return false;
+        const uint64_t magic = get64(&head[0]);
+        if (magic != NBD_OPTS_MAGIC) {
+            throw cybozu::Exception(NAME) << "bad option magic" << magic;
+        }
+        const uint32_t opt = get32(&head[8]);
+        const uint32_t size = get32(&head[12]);
+        if (size > MAX_OPTION_SIZE) {
+            throw cybozu::Exception(NAME) << "too large option" << opt << size;
+        }
+        data.resize(size);
+        if (size > 0 && !readData(data.data(), size)) return false;
+
+        switch (opt) {
+        case NBD_OPT_EXPORT_NAME: {
+            const std::string name(data.begin(), data.end());
+            if (!name.empty() && name != exportName_) {
+                throw cybozu::Exception(NAME) << "unknown export" << name;
+            }
+            Buffer reply;
+            reply.put64(size_).put16(transFlags);
+            if (!noZeroes) {
+                const char zero[124] = {0};
+                reply.put(zero, sizeof(zero));
+            }
+            reply.writeTo(file);
+            return true;
+        }
+        case NBD_OPT_ABORT:
+            sendOptReply(file, opt, NBD_REP_ACK);
+            return false;
+        case NBD_OPT_LIST: {
+            Buffer reply;
+            reply.put32(exportName_.size()).put(exportName_.data(), exportName_.size());
+            sendOptReply(file, opt, NBD_REP_SERVER, reply, 4 + exportName_.size());
+            sendOptReply(file, opt, NBD_REP_ACK);
+            break;
+        }
+        case NBD_OPT_INFO:
+        case NBD_OPT_GO: {
+            /* name length (4), name, number of information requests (2), and the requests. */
+            if (size < 6) {
+                sendOptReply(file, opt, NBD_REP_ERR_INVALID);
+                break;
+            }
+            const uint32_t nameLen = get32(&data[0]);
+            if (nameLen > size - 6) {
+                sendOptReply(file, opt, NBD_REP_ERR_INVALID);
+                break;
+            }
+            const uint16_t nrInfos = get16(&data[4 + nameLen]);
+            if (uint64_t(nrInfos) * 2 != size - 6 - nameLen) {
+                sendOptReply(file, opt, NBD_REP_ERR_INVALID);
+                break;
+            }
+            const std::string name(&data[4], nameLen);
+            if (!name.empty() && name != exportName_) {
+                sendOptReply(file, opt, NBD_REP_ERR_UNKNOWN);
+                break;
+            }
+            Buffer reply;
+            reply.put16(NBD_INFO_EXPORT).put64(size_).put16(transFlags);
+            sendOptReply(file, opt, NBD_REP_INFO, reply, 12);
+            sendOptReply(file, opt, NBD_REP_ACK);
+            if (opt == NBD_OPT_GO) return true;
+            break;
+        }
+        default:
+            sendOptReply(file, opt, NBD_REP_ERR_UNSUP);
+            break;
+        }
+    }
+}
+
+void NbdServer::transmit(cybozu::util::File &file, const std::function<bool()> &shouldStop, bool &isStopped)
+{
+    using namespace nbd_server_local;
+    AlignedArray buf;
+    char req[28];
+    for (;;) {
+        while (!waitForReadable(file.fd(), POLL_INTERVAL_MS)) {
+            if (shouldStop && shouldStop()) {
+                isStopped = true;
+                return;
+            }
+        }
+        const Clock::time_point deadline = getDeadline(timeoutMs_);
+        try {
+            if (!readUntil(file, req, sizeof(req), deadline, shouldStop)) {
+                isStopped = true;
+                return;
+            }
+        } catch (cybozu::util::EofError &) {
+            return; // disconnected without NBD_CMD_DISC.
+        }
+        const uint32_t magic = get32(&req[0]);
+        const uint16_t type = get16(&req[6]);
+        const uint64_t handle = get64(&req[8]);
+        const uint64_t offset = get64(&req[16]);
+        const uint32_t length = get32(&req[24]);
+        if (magic != NBD_REQUEST_MAGIC) {
+            throw cybozu::Exception(NAME) << "bad request magic" << magic;
+        }
+
+        switch (type) {
+        case NBD_CMD_READ: {
+            if (length > MAX_READ_SIZE || offset > size_ || length > size_ - offset) {
+                sendSimpleReply(file, NBD_EINVAL, handle);
+                break;
+            }
+            buf.resize(length, false);
+            uint32_t error = 0;
+            try {
+                readFunc_(offset, length, buf.data());
+            } catch (std::exception &e) {
+                LOGs.error() << __func__ << "read failed" << exportName_ << offset << length << e.what();
+                error = NBD_EIO;
+            }
+            sendSimpleReply(file, error, handle);
+            if (error == 0) {
+                file.write(buf.data(), length);
+                nrReads_++;
+                readBytes_ += length;
+            }
+            break;
+        }
+        case NBD_CMD_WRITE: {
+            buf.resize(std::min<size_t>(length, MAX_READ_SIZE), false);
+            uint32_t remaining = length;
+            while (remaining > 0) {
+                const size_t s = std::min<size_t>(remaining, buf.size());
+                if (!readUntil(file, buf.data(), s, deadline, shouldStop)) {
+                    isStopped = true;
+                    return;
+                }
+                remaining -= s;
+            }
+            sendSimpleReply(file, NBD_EPERM, handle);
+            break;
+        }
+        case NBD_CMD_DISC:
+            return;
+        case NBD_CMD_FLUSH:
+            sendSimpleReply(file, 0, handle);
+            break;
+        default:
+            sendSimpleReply(file, NBD_EINVAL, handle);
+            break;
+        }
+    }
+}
+
+} // namespace walb
@@ -0,0 +1,100 @@
+#pragma once
+/**
+ * @file
+ * @brief Minimal read-only NBD (network block device) server.
+ */
+#include <string>
+#include <functional>
+#include <cstdint>
+#include "fileio.hpp"
+#include "constant.hpp"
+#include "cybozu/exception.hpp"
+
+namespace walb {
+
+/**
+ * Listening socket for NBD clients.
+ * The address is "unix:PATH" for a UNIX domain socket or "HOST:PORT" for TCP.
+ * The UNIX socket file is removed by the destructor.
+ */
+class NbdListener /* final */
+{
+private:
+    cybozu::util::File file_;
+    std::string unixPath_;
+
+public:
+    static constexpr const char *NAME = "NbdListener";
+    NbdListener() : file_(), unixPath_() {}
+    ~NbdListener() noexcept {
+        close();
+    }
+    void listen(const std::string &addrStr);
+    /**
+     * Wait for a client.
+     * @timeoutMs 0 means no timeout.
+     * @shouldStop it will be checked periodically.
+     * RETURN:
+     *   false if timeout or shouldStop() returned true.
+     */
+    bool accept(cybozu::util::File &client, size_t timeoutMs,
+                const std::function<bool()> &shouldStop = nullptr);
+    void close() noexcept;
+};
+
+
+/**
+ * Serve a read-only export through a connected socket.
+ *
+ * Handshake: fixed newstyle with NBD_OPT_EXPORT_NAME, NBD_OPT_GO, NBD_OPT_INFO,
+ * NBD_OPT_LIST, and NBD_OPT_ABORT. Other options are replied with NBD_REP_ERR_UNSUP.
+ * Transmission: simple replies for NBD_CMD_READ, NBD_CMD_FLUSH (no-op), and NBD_CMD_DISC.
+ * Write requests are rejected with EPERM.
+ * The whole handshake, each request, and each reply must be done within the timeout,
+ * otherwise serve() throws an error. The client may be idle between requests.
+ */
+class NbdServer /* final */
+{
+public:
+    /**
+     * Read data of the export.
+     * @offset [byte]
+     * @size [byte]
+     */
+    using ReadFunc = std::function<void(uint64_t offset, size_t size, void *data)>;
+
+private:
+    std::string exportName_;
+    uint64_t size_; // [byte]
+    ReadFunc readFunc_;
+    size_t timeoutMs_;
+    uint64_t nrReads_;
+    uint64_t readBytes_;
+
+public:
+    static constexpr const char *NAME = "NbdServer";
+    NbdServer(const std::string &exportName, uint64_t size, const ReadFunc &readFunc,
+              size_t timeoutMs = DEFAULT_NBD_IO_TIMEOUT_SEC * 1000)
+        : exportName_(exportName), size_(size), readFunc_(readFunc)
+        , timeoutMs_(timeoutMs), nrReads_(0), readBytes_(0) {
+    }
+    /**
+     * Serve until the client disconnects.
+     * The file must be a connected socket.
+     * RETURN:
+     *   false if shouldStop() returned true.
+     */
+    bool serve(cybozu::util::File &file, const std::function<bool()> &shouldStop = nullptr);
+
+    uint64_t nrReads() const { return nrReads_; }
+    uint64_t readBytes() const { return readBytes_; }
+private:
+    /**
+     * RETURN:
+     *   false if the client aborted or shouldStop() returned true.
+     */
+    bool negotiate(cybozu::util::File &file, const std::function<bool()> &shouldStop, bool &isStopped);
+    void transmit(cybozu::util::File &file, const std::function<bool()> &shouldStop, bool &isStopped);
+};
+
+} // namespace walb
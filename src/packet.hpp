@@ -158,6 +158,12 @@ public:
     void end() { write(toInt(Msg::End)); }
     void error() { write(toInt(Msg::Error)); }
     void dummy() { write(toInt(Msg::Dummy)); }
+    /**
+     * For sender that gathers the next message and the following data
+     * to send them at once.
+     */
+    template <typename OutputStream>
+    static void saveNext(OutputStream &os) { cybozu::save(os, toInt(Msg::Next)); }
 
     /**
      * For receiver.
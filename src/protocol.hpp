@@ -77,6 +77,8 @@ const char *const disableSnapshotCN = "disable-snapshot";
 const char *const enableSnapshotCN = "enable-snapshot";
 const char *const dbgDumpLogpackHeaderCN = "dbg-dump-logpack-header";
 const char *const setFullScanBpsCN = "set-full-scan-bps";
+const char *const setIoSchedCN = "set-io-sched";
+const char *const nbdExportCN = "nbd-export";
 const char *const gcDiffCN = "gc-diff";
 const char *const debugCN = "debug";
 const char *const sleepCN = "sleep";
@@ -116,15 +118,16 @@ const char *const getMetaStateTN = "meta-state";
 const char *const getLatestSnapTN = "latest-snap";
 const char *const getTsDeltaTN = "ts-delta";
 const char *const getHandlerStatTN = "handler-stat";
+const char *const getIoSchedTN = "io-sched";
 
 /**
  * Internal protocol name.
  */
-const char *const dirtyFullSyncPN = "dirty-full-sync2";
-const char *const dirtyHashSyncPN = "dirty-hash-sync2";
-const char *const wlogTransferPN = "wlog-transfer";
+const char *const dirtyFullSyncPN = "dirty-full-sync3";
+const char *const dirtyHashSyncPN = "dirty-hash-sync3";
+const char *const wlogTransferPN = "wlog-transfer2";
 const char *const wdiffTransferPN = "wdiff-transfer";
-const char *const replSyncPN = "repl-sync2";
+const char *const replSyncPN = "repl-sync3";
 const char *const gatherLatestSnapPN = "gather-latest-snap";
 
 
@@ -239,8 +239,12 @@ void c2pClearVolServer(protocol::ServerParams &p)
  *     pbs (uint32_t)
  *     salt (uint32_t)
  *     sizeLb (uint64_t)
+ *     maxLogSizePb (uint64_t)
+ *     lsidB (uint64_t)
+ *     isDiff (bool)
  *   send "ok" or error message.
- *   recv wlog data
+ *   send lsid to resume from (uint64_t)
+ *   recv wlog data, or wdiff data if isDiff is true.
  *   recv diff (walb::MetaDiff)
  *   send ack.
  *
@@ -253,7 +257,8 @@ void s2pWlogTransferServer(protocol::ServerParams &p)
     std::string volId;
     cybozu::Uuid uuid;
     uint32_t pbs, salt;
-    uint64_t volSizeLb, maxLogSizePb;
+    uint64_t volSizeLb, maxLogSizePb, lsidB;
+    bool isDiff;
 
     packet::Packet pkt(p.sock);
     pkt.read(volId);
@@ -262,7 +267,9 @@ void s2pWlogTransferServer(protocol::ServerParams &p)
     pkt.read(salt);
     pkt.read(volSizeLb);
     pkt.read(maxLogSizePb);
-    LOGs.debug() << "recv" << volId << uuid << pbs << salt << volSizeLb << maxLogSizePb;
+    pkt.read(lsidB);
+    pkt.read(isDiff);
+    LOGs.debug() << "recv" << volId << uuid << pbs << salt << volSizeLb << maxLogSizePb << lsidB << isDiff;
 
     /* Decide to receive ok or not. */
     ProxyVolState &volSt = getProxyVolState(volId);
@@ -270,7 +277,8 @@ void s2pWlogTransferServer(protocol::ServerParams &p)
 
     ForegroundCounterTransaction foregroundTasksTran;
     const uint64_t maxLogSizeMb = maxLogSizePb * pbs / MEBI + 1;
-    proxy_local::ConversionMemoryTransaction convTran(maxLogSizeMb);
+    /* A coalesced diff is written to a file as it is received, so no conversion memory is required. */
+    proxy_local::ConversionMemoryTransaction convTran(isDiff ? 0 : maxLogSizeMb);
     try {
         verifyMaxForegroundTasks(gp.maxForegroundTasks, FUNC);
         proxy_local::verifyMaxConversionMemory(FUNC);
@@ -290,17 +298,30 @@ void s2pWlogTransferServer(protocol::ServerParams &p)
 
     cybozu::Stopwatch stopwatch;
     ProxyVolInfo volInfo = getProxyVolInfo(volId);
-    cybozu::TmpFile tmpFile(volInfo.getReceivedDir().str());
-    cybozu::TmpFile wlogTmpFile;
-    const bool savesWlog = false; // for DEBUG.
-    if (savesWlog) wlogTmpFile.prepare(volInfo.getReceivedDir().str());
-#if 0 /* deprecated */
-    const bool ret = proxy_local::recvWlogAndWriteDiff(
-        p.sock, tmpFile.fd(), uuid, pbs, salt, volSt.stopState, gp.ps, wlogTmpFile.fd());
-#else /* use indexed diff. */
-    const bool ret = proxy_local::recvWlogAndWriteDiff2(
-        p.sock, tmpFile.fd(), uuid, pbs, salt, volSt.stopState, gp.ps, wlogTmpFile.fd());
-#endif
+    cybozu::TmpFile tmpFile;
+    bool ret;
+    if (isDiff) {
+        /* The storage has coalesced the wlogs so resuming is not supported. */
+        volInfo.removePartialWdiff();
+        pkt.write(lsidB);
+        pkt.flush();
+        tmpFile.prepare(volInfo.getReceivedDir().str());
+        cybozu::util::File fileW(tmpFile.fd());
+        writeDiffFileHeader(fileW, uuid);
+        ret = wdiffTransferServer(pkt, tmpFile.fd(), volSt.stopState, gp.ps, DEFAULT_FSYNC_INTERVAL_SIZE);
+    } else {
+        IndexedDiffWriter writer;
+        const PartialWdiffInfo info = {uuid, pbs, salt, lsidB};
+        const uint64_t lsidR = proxy_local::prepareWdiffWriterForWlogTransfer(
+            volInfo, writer, info, lsidB + maxLogSizePb);
+        if (lsidR != lsidB) {
+            logger.info() << "resume wlog-transfer" << volId << lsidB << lsidR;
+        }
+        pkt.write(lsidR);
+        pkt.flush();
+        ret = proxy_local::recvWlogAndWriteDiff2(
+            p.sock, writer, pbs, salt, volSt.stopState, gp.ps, gp.wlogRecvConcurrency);
+    }
     if (!ret) {
         logger.warn() << FUNC << "force stopped wlog receiving" << volId;
         return;
@@ -310,12 +331,11 @@ void s2pWlogTransferServer(protocol::ServerParams &p)
     if (!diff.isClean()) {
         throw cybozu::Exception(FUNC) << "diff is not clean" << diff;
     }
-    diff.dataSize = cybozu::FileStat(tmpFile.fd()).size();
-    tmpFile.save(volInfo.getDiffPath(diff).str());
-    if (savesWlog) {
-        const std::string fname =
-            cybozu::util::removeSuffix(createDiffFileName(diff), ".wdiff") + ".wlog";
-        wlogTmpFile.save((volInfo.volDir + fname).str());
+    if (isDiff) {
+        diff.dataSize = cybozu::FileStat(tmpFile.fd()).size();
+        tmpFile.save(volInfo.getDiffPath(diff).str());
+    } else {
+        volInfo.settlePartialWdiff(diff);
     }
     // You must register the diff before trying to send ack.
     // When ack failed, next wlog-transfer will do the remaining procedures.
@@ -418,48 +438,36 @@ ProxyWorker::TransferState ProxyWorker::transferWdiffIfNecessary(PushOpt &pushOp
 
     ProxyVolInfo volInfo = getProxyVolInfo(volId);
 
+    const HostInfoForBkp hi = volInfo.getArchiveInfo(archiveName);
     MetaDiffVec diffV;
     DiffMerger merger;
+    merger.setPassThroughCmprType(hi.cmpr.type);
     MetaDiff mergedDiff;
     setupMerger(merger, diffV, mergedDiff, volInfo, archiveName);
     if (diffV.empty()) {
         LOGs.debug() << FUNC << "no need to send wdiffs" << volId << archiveName;
         return TransferState::DONT_SEND;
     }
-    const HostInfoForBkp hi = volInfo.getArchiveInfo(archiveName);
     ActionCounterTransaction trans(volSt.ac, archiveName);
     if (trans.count() > 0) {
         LOGs.debug() << FUNC << "another task is running" << volId << archiveName;
         return TransferState::DONT_SEND;
     }
+    std::vector<CompanionPtr> compV = findCompanions(volSt, volInfo, hi, diffV);
 
     ul.unlock();
     cybozu::Socket sock;
-    util::connectWithTimeout(sock, hi.addrPort.getSocketAddr(), gp.socketTimeout);
-    gp.setSocketParams(sock);
-    const std::string serverId = protocol::run1stNegotiateAsClient(sock, gp.nodeId, wdiffTransferPN);
+    std::string serverId;
+    const cybozu::Uuid uuid = merger.header().getUuid();
+    const std::string res = negotiateWdiffTransfer(sock, serverId, hi, volInfo, uuid, mergedDiff);
     ProtocolLogger logger(gp.nodeId, serverId);
-
-    const DiffFileHeader& fileH = merger.header();
-
-    /* wdiff-send negotiation */
     packet::Packet pkt(sock);
-    pkt.write(volId);
-    pkt.write(proxyHT);
-    pkt.write(fileH.getUuid());
-    uint32_t maxIoBlocks = 0; // unused
-    pkt.write(maxIoBlocks);
-    pkt.write(volInfo.getSizeLb());
-    pkt.write(mergedDiff);
-    pkt.flush();
-    logger.debug() << "send" << volId << proxyHT << fileH.getUuid()
-                   << volInfo.getSizeLb() << mergedDiff;
-
-    std::string res;
-    pkt.read(res);
     if (res == msgAccept) {
         DiffStatistics statOut;
-        if (!wdiffTransferClient(pkt, merger, hi.cmpr, volSt.stopState, gp.ps, statOut)) {
+        const bool sent = compV.empty()
+            ? wdiffTransferClient(pkt, merger, hi.cmpr, volSt.stopState, gp.ps, statOut)
+            : sendWdiffToCompanions(pkt, compV, merger, hi.cmpr, volInfo, uuid, mergedDiff, diffV, statOut);
+        if (!sent) {
             logger.warn() << FUNC << "force stopped wdiff sending" << volId;
             return TransferState::DONT_SEND;
         }
@@ -517,6 +525,166 @@ ProxyWorker::TransferState ProxyWorker::transferWdiffIfNecessary(PushOpt &pushOp
 }
 
 
+/**
+ * Find the other archives waiting for the same diffs with the same compression.
+ * volSt.mu must be held.
+ */
+std::vector<ProxyWorker::CompanionPtr> ProxyWorker::findCompanions(
+    ProxyVolState &volSt, const ProxyVolInfo &volInfo,
+    const HostInfoForBkp &hi, const MetaDiffVec &diffV) const
+{
+    std::vector<CompanionPtr> compV;
+    for (const std::string &archiveName : volSt.archiveSet) {
+        if (archiveName == task_.archiveName) continue;
+        if (volSt.actionState.get(archiveName)) continue; // stopped due to send error.
+        const HostInfoForBkp hi1 = volInfo.getArchiveInfo(archiveName);
+        if (hi1.cmpr.type != hi.cmpr.type || hi1.cmpr.level != hi.cmpr.level ||
+            hi1.wdiffSendDelaySec != hi.wdiffSendDelaySec) continue;
+        const MetaDiffVec diffV1 = volInfo.getDiffListToSend(
+            archiveName, gp.maxWdiffSendMb * MEBI, gp.maxWdiffSendNr);
+        if (diffV1.size() < diffV.size() ||
+            !std::equal(diffV.begin(), diffV.end(), diffV1.begin())) continue;
+        CompanionPtr comp(new Companion());
+        comp->trans.reset(new ActionCounterTransaction(volSt.ac, archiveName));
+        if (comp->trans->count() > 0) {
+            comp->trans.reset(); // the running task is not dropped.
+            continue;
+        }
+        comp->volId = task_.volId;
+        comp->archiveName = archiveName;
+        compV.push_back(std::move(comp));
+    }
+    return compV;
+}
+
+
+/**
+ * Close the transaction and push the task of the archive again.
+ * @isError retry with the delay if true.
+ */
+void ProxyWorker::Companion::release(size_t delayMs, bool isError)
+{
+    if (!trans) return;
+    trans.reset();
+    const ProxyTask task(volId, archiveName);
+    if (isError) {
+        pushTaskForce(task, delayMs, true);
+    } else {
+        pushTask(task, delayMs);
+    }
+}
+
+
+ProxyWorker::Companion::~Companion() noexcept
+{
+    try {
+        release();
+    } catch (std::exception &e) {
+        LOGs.error() << __func__ << e.what() << volId << archiveName;
+    } catch (...) {
+        LOGs.error() << __func__ << "unknown error" << volId << archiveName;
+    }
+}
+
+
+/**
+ * Connect to an archive and send the wdiff-transfer parameters.
+ * RETURN:
+ *   response of the archive.
+ */
+std::string ProxyWorker::negotiateWdiffTransfer(
+    cybozu::Socket &sock, std::string &serverId, const HostInfoForBkp &hi,
+    const ProxyVolInfo &volInfo, const cybozu::Uuid &uuid, const MetaDiff &mergedDiff) const
+{
+    const std::string& volId = task_.volId;
+    util::connectWithTimeout(sock, hi.addrPort.getSocketAddr(), gp.socketTimeout);
+    gp.setSocketParams(sock);
+    serverId = protocol::run1stNegotiateAsClient(sock, gp.nodeId, wdiffTransferPN);
+    ProtocolLogger logger(gp.nodeId, serverId);
+
+    /* wdiff-send negotiation */
+    packet::Packet pkt(sock);
+    pkt.write(volId);
+    pkt.write(proxyHT);
+    pkt.write(uuid);
+    uint32_t maxIoBlocks = 0; // unused
+    pkt.write(maxIoBlocks);
+    pkt.write(volInfo.getSizeLb());
+    pkt.write(mergedDiff);
+    pkt.flush();
+    logger.debug() << "send" << volId << proxyHT << uuid
+                   << volInfo.getSizeLb() << mergedDiff;
+
+    std::string res;
+    pkt.read(res);
+    return res;
+}
+
+
+/**
+ * Send the merged diff to the archive of the task and the companions at once.
+ * The companions that failed will retry by their own tasks.
+ * The tasks of the companions are pushed again on any exit including errors.
+ *
+ * RETURN:
+ *   false if force stopped.
+ */
+bool ProxyWorker::sendWdiffToCompanions(
+    packet::Packet &pkt, std::vector<CompanionPtr> &compV, DiffMerger &merger,
+    const CompressOpt &cmpr, ProxyVolInfo &volInfo, const cybozu::Uuid &uuid,
+    const MetaDiff &mergedDiff, const MetaDiffVec &diffV, DiffStatistics &statOut)
+{
+    const char *const FUNC = __func__;
+    const std::string& volId = task_.volId;
+    ProxyVolState& volSt = getProxyVolState(volId);
+
+    std::vector<packet::Packet *> pktV = {&pkt};
+    std::vector<Companion *> accepted;
+    for (CompanionPtr &comp : compV) {
+        try {
+            const HostInfoForBkp hi = volInfo.getArchiveInfo(comp->archiveName);
+            std::string serverId;
+            const std::string res = negotiateWdiffTransfer(comp->sock, serverId, hi, volInfo, uuid, mergedDiff);
+            if (res == msgAccept) {
+                comp->pkt.reset(new packet::Packet(comp->sock));
+                pktV.push_back(comp->pkt.get());
+                accepted.push_back(comp.get());
+                continue;
+            }
+            LOGs.info() << FUNC << res << volId << comp->archiveName;
+        } catch (std::exception &e) {
+            LOGs.warn() << FUNC << e.what() << volId << comp->archiveName;
+        }
+        comp->sock.close();
+        comp->release();
+    }
+
+    std::vector<std::exception_ptr> epV;
+    if (!wdiffTransferMultiClient(pktV, merger, cmpr, volSt.stopState, gp.ps, statOut, epV)) {
+        return false;
+    }
+    for (size_t i = 0; i < accepted.size(); i++) {
+        Companion &comp = *accepted[i];
+        try {
+            if (epV[i + 1]) std::rethrow_exception(epV[i + 1]);
+            packet::Ack(comp.sock).recv();
+            {
+                UniqueLock ul(volSt.mu);
+                volSt.lastWdiffSentTimeMap[comp.archiveName] = ::time(0);
+            }
+            volInfo.deleteDiffs(diffV, comp.archiveName);
+            LOGs.debug() << FUNC << "sent" << volId << comp.archiveName << mergedDiff;
+            comp.release();
+        } catch (std::exception &e) {
+            LOGs.warn() << FUNC << e.what() << volId << comp.archiveName;
+            comp.release(1000, true);
+        }
+    }
+    if (epV[0]) std::rethrow_exception(epV[0]);
+    return true;
+}
+
+
 void ProxyWorker::operator()()
 {
     const char *const FUNC = __func__;
@@ -972,76 +1140,51 @@ void deleteArchiveInfo(const std::string &volId, const std::string &archiveName)
 }
 
 
-/**
- * Use DiffMemory (SortedDiffWriter).
- *
- * RETURN:
- *   false if force stopped.
- */
-bool recvWlogAndWriteDiff(
-    cybozu::Socket &sock, int fd, const cybozu::Uuid &uuid, uint32_t pbs, uint32_t salt,
-    const std::atomic<int> &stopState, const ProcessStatus &ps, int wlogFd)
+uint64_t prepareWdiffWriterForWlogTransfer(
+    ProxyVolInfo &volInfo, IndexedDiffWriter &writer, const PartialWdiffInfo &info, uint64_t lsidLimit)
 {
-    DiffMemory diffMem;
-    diffMem.header().setUuid(uuid);
-
-    LogPackHeader packH(pbs, salt);
-    WlogReceiver receiver(sock, pbs, salt);
-
-    bool isWlogHeaderWritten = false;
-    std::unique_ptr<WlogWriter> wlogW;
-    if (wlogFd >= 0) wlogW.reset(new WlogWriter(wlogFd));
-
-    while (receiver.popHeader(packH)) {
-        if (stopState == ForceStopping || ps.isForceShutdown()) {
-            return false;
-        }
-        if (wlogW) {
-            if (!isWlogHeaderWritten) {
-                WlogFileHeader wh;
-                wh.init(pbs, salt, uuid, packH.logpackLsid(), MAX_LSID);
-                wlogW->writeHeader(wh);
-                isWlogHeaderWritten = true;
+    const std::string path = volInfo.getPartialWdiffPath().str();
+    const std::string ckptPath = volInfo.getPartialWdiffCkptPath().str();
+
+    PartialWdiffInfo prevInfo;
+    if (volInfo.loadPartialWdiffInfo(prevInfo) && prevInfo == info) {
+        uint64_t lsidR;
+        try {
+            if (writer.resume(cybozu::util::File(path, O_RDWR),
+                              cybozu::util::File(ckptPath, O_RDWR), lsidR)
+                && info.lsidB <= lsidR && lsidR <= lsidLimit) {
+                return lsidR;
             }
-            wlogW->writePackHeader(packH.header());
-        }
-        AlignedArray buf;
-        for (size_t i = 0; i < packH.header().n_records; i++) {
-            WlogRecord &lrec = packH.record(i);
-            receiver.popIo(lrec, buf);
-            if (wlogW) wlogW->writePackIo(buf);
-            DiffRecord drec;
-            if (convertLogToDiff(lrec, buf.data(), drec)) {
-                if (!drec.isNormal()) buf.clear();
-                diffMem.add(drec, std::move(buf));
-            }
-            buf.clear();
+        } catch (std::exception &e) {
+            LOGs.warn() << __func__ << "failed to resume" << volInfo.volId << e.what();
         }
     }
-    if (wlogW) wlogW->close();
-    diffMem.writeTo(fd);
-    return true;
+
+    /* Start a new partial wdiff. */
+    volInfo.removePartialWdiff();
+    writer.setFile(cybozu::util::File(path, O_CREAT | O_TRUNC | O_RDWR, 0644));
+    DiffFileHeader header;
+    header.setUuid(info.uuid);
+    header.type = WALB_DIFF_TYPE_INDEXED;
+    writer.writeHeader(header);
+    writer.setCheckpointFile(cybozu::util::File(ckptPath, O_CREAT | O_TRUNC | O_RDWR, 0644));
+    writer.checkpoint(info.lsidB);
+    volInfo.savePartialWdiffInfo(info);
+    return info.lsidB;
 }
 
 /**
  * Use IndexedDiffWriter
+ * A checkpoint will be made at every logpack boundary
+ * if the writer has a checkpoint file.
  */
 bool recvWlogAndWriteDiff2(
-    cybozu::Socket &sock, int fd, const cybozu::Uuid &uuid, uint32_t pbs, uint32_t salt,
-    const std::atomic<int> &stopState, const ProcessStatus &ps, int wlogFd)
+    cybozu::Socket &sock, IndexedDiffWriter &writer, uint32_t pbs, uint32_t salt,
+    const std::atomic<int> &stopState, const ProcessStatus &ps, size_t concurrency)
 {
-    unusedVar(wlogFd);
-
-    IndexedDiffWriter writer;
-    writer.setFd(fd);
-
-    DiffFileHeader header;
-    header.setUuid(uuid);
-    header.type = WALB_DIFF_TYPE_INDEXED;
-    writer.writeHeader(header);
-
     LogPackHeader packH(pbs, salt);
     WlogReceiver receiver(sock, pbs, salt);
+    writer.startParallel(concurrency);
 
     while (receiver.popHeader(packH)) {
         if (stopState == ForceStopping || ps.isForceShutdown()) {
@@ -1053,9 +1196,10 @@ bool recvWlogAndWriteDiff2(
             receiver.popIo(lrec, data);
             IndexedDiffRecord drec;
             if (convertLogToDiff(lrec, data.data(), drec)) {
-                writer.compressAndWriteDiff(drec, data.data());
+                writer.compressAndWriteDiff(drec, std::move(data));
             }
         }
+        if (writer.hasCheckpointFile()) writer.checkpoint(packH.nextLogpackLsid());
     }
     writer.finalize();
     return true;
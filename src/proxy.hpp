@@ -162,6 +162,34 @@ private:
         SEND_ERROR,
     };
     TransferState transferWdiffIfNecessary(PushOpt &);
+
+    /**
+     * Another archive that will receive the same merged diff.
+     * The task of the archive is dropped while the transaction is held,
+     * so the task is pushed again when the companion is released or destroyed.
+     */
+    struct Companion
+    {
+        std::string volId;
+        std::string archiveName;
+        std::unique_ptr<ActionCounterTransaction> trans;
+        cybozu::Socket sock;
+        std::unique_ptr<packet::Packet> pkt;
+
+        void release(size_t delayMs = 0, bool isError = false);
+        ~Companion() noexcept;
+    };
+    using CompanionPtr = std::unique_ptr<Companion>;
+    std::vector<CompanionPtr> findCompanions(
+        ProxyVolState &volSt, const ProxyVolInfo &volInfo,
+        const HostInfoForBkp &hi, const MetaDiffVec &diffV) const;
+    std::string negotiateWdiffTransfer(
+        cybozu::Socket &sock, std::string &serverId, const HostInfoForBkp &hi,
+        const ProxyVolInfo &volInfo, const cybozu::Uuid &uuid, const MetaDiff &mergedDiff) const;
+    bool sendWdiffToCompanions(
+        packet::Packet &pkt, std::vector<CompanionPtr> &compV, DiffMerger &merger,
+        const CompressOpt &cmpr, ProxyVolInfo &volInfo, const cybozu::Uuid &uuid,
+        const MetaDiff &mergedDiff, const MetaDiffVec &diffV, DiffStatistics &statOut);
 };
 
 struct ProxySingleton
@@ -185,6 +213,7 @@ struct ProxySingleton
     size_t maxForegroundTasks;
     size_t maxBackgroundTasks;
     size_t maxConversionMb;
+    size_t wlogRecvConcurrency;
     size_t socketTimeout;
     KeepAliveParams keepAliveParams;
     bool allowExec;
@@ -309,12 +338,16 @@ void addArchiveInfo(const std::string &volId, const std::string &archiveName, co
                     bool ensureNotExistance);
 void deleteArchiveInfo(const std::string &volId, const std::string &archiveName);
 
-bool recvWlogAndWriteDiff(
-    cybozu::Socket &sock, int fd, const cybozu::Uuid &uuid, uint32_t pbs, uint32_t salt,
-    const std::atomic<int> &stopState, const ProcessStatus &ps, int wlogFd);
+/**
+ * Resume the partial wdiff file if it matches info, or create a new one.
+ * RETURN:
+ *   lsid from which wlogs must be received.
+ */
+uint64_t prepareWdiffWriterForWlogTransfer(
+    ProxyVolInfo &volInfo, IndexedDiffWriter &writer, const PartialWdiffInfo &info, uint64_t lsidLimit);
 bool recvWlogAndWriteDiff2(
-    cybozu::Socket &sock, int fd, const cybozu::Uuid &uuid, uint32_t pbs, uint32_t salt,
-    const std::atomic<int> &stopState, const ProcessStatus &ps, int wlogFd);
+    cybozu::Socket &sock, IndexedDiffWriter &writer, uint32_t pbs, uint32_t salt,
+    const std::atomic<int> &stopState, const ProcessStatus &ps, size_t concurrency);
 
 
 inline void getState(protocol::GetCommandParams &p)
@@ -51,6 +51,10 @@ const struct StateMachine::Pair statePairTbl[] = {
 const char *const ArchiveSuffix = ".archive";
 const char *const ArchiveExtension = "archive";
 
+const char *const PartialWdiffName = "partial-wdiff";
+const char *const PartialWdiffInfoName = "partial-wdiff.info";
+const char *const CkptSuffix = ".ckpt";
+
 const StrVec pAcceptForWdiffSend = { pStarted, ptWlogRecv, ptWaitForEmpty };
 
 
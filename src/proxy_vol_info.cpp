@@ -31,6 +31,34 @@ void ProxyVolInfo::clear()
 }
 
 
+void ProxyVolInfo::removePartialWdiff()
+{
+    for (const cybozu::FilePath &path : {
+            getPartialWdiffPath(), getPartialWdiffCkptPath(), volDir + PartialWdiffInfoName}) {
+        if (path.stat().exists() && !path.remove()) {
+            throw cybozu::Exception("ProxyVolInfo::removePartialWdiff:remove failed") << path;
+        }
+    }
+}
+
+
+void ProxyVolInfo::settlePartialWdiff(MetaDiff &diff)
+{
+    const cybozu::FilePath path = getPartialWdiffPath();
+    {
+        cybozu::util::File file(path.str(), O_RDWR);
+        diff.dataSize = cybozu::FileStat(file.fd()).size();
+        file.fsync();
+    }
+    const cybozu::FilePath diffPath = getDiffPath(diff);
+    if (!path.rename(diffPath)) {
+        throw cybozu::Exception("ProxyVolInfo::settlePartialWdiff:rename failed") << path << diffPath;
+    }
+    cybozu::util::File(getReceivedDir().str(), O_RDONLY | O_DIRECTORY).fdatasync();
+    removePartialWdiff();
+}
+
+
 MetaDiffVec ProxyVolInfo::tryToMakeHardlinkInSendtoDir()
 {
     MetaDiffVec diffV = getAllDiffsInReceivedDir();
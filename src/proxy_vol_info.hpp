@@ -9,9 +9,43 @@
 #include "atomic_map.hpp"
 #include "wdiff_data.hpp"
 #include "proxy_constant.hpp"
+#include "uuid.hpp"
 
 namespace walb {
 
+/**
+ * Identity of the wlogs being received into the partial wdiff file.
+ * The partial wdiff file can be resumed only when all of them match.
+ */
+struct PartialWdiffInfo
+{
+    cybozu::Uuid uuid;
+    uint32_t pbs;
+    uint32_t salt;
+    uint64_t lsidB;
+
+    bool operator==(const PartialWdiffInfo &rhs) const {
+        return uuid == rhs.uuid && pbs == rhs.pbs && salt == rhs.salt && lsidB == rhs.lsidB;
+    }
+    bool operator!=(const PartialWdiffInfo &rhs) const {
+        return !(*this == rhs);
+    }
+    template <typename OutputStream>
+    void save(OutputStream &os) const {
+        cybozu::save(os, uuid);
+        cybozu::save(os, pbs);
+        cybozu::save(os, salt);
+        cybozu::save(os, lsidB);
+    }
+    template <typename InputStream>
+    void load(InputStream &is) {
+        cybozu::load(uuid, is);
+        cybozu::load(pbs, is);
+        cybozu::load(salt, is);
+        cybozu::load(lsidB, is);
+    }
+};
+
 /**
  * Data manager for a volume in a proxy daemon.
  * This is not thread-safe.
@@ -185,6 +219,31 @@ public:
      */
     uint64_t getTotalDiffFileSize(const std::string &archiveName = "") const;
     cybozu::FilePath getDiffPath(const MetaDiff &diff, const std::string &archiveName = "") const;
+    /**
+     * Partial wdiff file is the wdiff file being received by resumable wlog-transfer.
+     * It is kept in the volume directory with its checkpoint file and info file
+     * until the transfer completes.
+     */
+    cybozu::FilePath getPartialWdiffPath() const {
+        return volDir + PartialWdiffName;
+    }
+    cybozu::FilePath getPartialWdiffCkptPath() const {
+        return volDir + (std::string(PartialWdiffName) + CkptSuffix);
+    }
+    bool loadPartialWdiffInfo(PartialWdiffInfo &info) const {
+        if (!(volDir + PartialWdiffInfoName).stat().isFile()) return false;
+        util::loadFile(volDir, PartialWdiffInfoName, info);
+        return true;
+    }
+    void savePartialWdiffInfo(const PartialWdiffInfo &info) {
+        util::saveFile(volDir, PartialWdiffInfoName, info);
+    }
+    void removePartialWdiff();
+    /**
+     * Move the finalized partial wdiff file into the received directory.
+     * diff.dataSize will be set.
+     */
+    void settlePartialWdiff(MetaDiff &diff);
 private:
     cybozu::FilePath getArchiveInfoPath(const std::string &name) const {
         return volDir + cybozu::FilePath(name + ArchiveSuffix);
@@ -650,6 +650,7 @@ StrVec getVolStatusAsStrVec(const std::string &volId, bool isVerbose)
     v.push_back(fmt("stopState %s", stopStateToStr(StopState(volSt.stopState.load()))));
     StorageVolInfo volInfo(gs.baseDirStr, volId);
     v.push_back(fmt("isUnderMonitoring %d", isUnderMonitoring(volInfo.getWdevPath())));
+    v.push_back(fmt("wlogReadAhead %s", volSt.wlogReadAhead.str().c_str()));
     for (std::string& s : volInfo.getStatusAsStrVec(isVerbose)) {
         v.push_back(std::move(s));
     }
@@ -709,9 +710,15 @@ void backupClient(protocol::ServerParams &p, bool isFull)
         aPkt.write(curTime);
         aPkt.write(bulkLb);
         aPkt.write(gs.cmprOptForSync);
+        uint64_t regionLb = isFull ? 0 : getHashTreeRegionLb(gs.hashTreeMb, bulkLb);
+        uint8_t hashAlgo = gs.hashAlgoForSync;
+        if (!isFull) {
+            aPkt.write(regionLb);
+            aPkt.write(hashAlgo);
+        }
         aPkt.flush();
         logger.debug() << "send" << storageHT << volId << sizeLb << curTime
-                       << bulkLb << gs.cmprOptForSync;
+                       << bulkLb << gs.cmprOptForSync << regionLb << int(hashAlgo);
         {
             std::string res;
             aPkt.read(res);
@@ -726,7 +733,13 @@ void backupClient(protocol::ServerParams &p, bool isFull)
             }
         }
         MetaSnap snap;
-        if (!isFull) aPkt.read(snap);
+        uint32_t hashSeed = 0;
+        if (!isFull) {
+            aPkt.read(snap);
+            aPkt.read(regionLb);
+            aPkt.read(hashSeed);
+            aPkt.read(hashAlgo);
+        }
         const uint64_t gidB = isFull ? 0 : snap.gidE + 1;
         volInfo.resetWlog(gidB);
         const cybozu::Uuid uuid = volInfo.getUuid();
@@ -737,19 +750,23 @@ void backupClient(protocol::ServerParams &p, bool isFull)
 
         // (7) in storage-daemon.txt
         logger.info() << (isFull ? dirtyFullSyncPN : dirtyHashSyncPN)
-                      << "started" << volId << archiveId << sizeLb << bulkLb;
+                      << "started" << volId << archiveId << sizeLb << bulkLb << regionLb;
         if (isFull) {
             const std::string bdevPath = volInfo.getWdevPath();
-            if (!dirtyFullSyncClient(aPkt, bdevPath, 0, sizeLb, bulkLb, gs.cmprOptForSync, volSt.stopState, gs.ps, gs.fullScanLbPerSec)) {
+            const AllocMap allocMap = getAllocMap(device::getUnderlyingDataDevPath(volInfo.getWdevName()));
+            if (allocMap.isAvailable()) {
+                logger.info() << FUNC << "allocation map" << volId
+                              << allocMap.getAllocatedLb() << allocMap.getNrRanges();
+            }
+            if (!dirtyFullSyncClient(aPkt, bdevPath, 0, sizeLb, bulkLb, gs.cmprOptForSync, volSt.stopState, gs.ps, gs.fullScanLbPerSec, allocMap)) {
                 logger.warn() << FUNC << "force stopped" << volId;
                 return;
             }
         } else {
-            const uint32_t hashSeed = curTime;
             AsyncBdevReader reader(volInfo.getWdevPath());
             if (!dirtyHashSyncClient(aPkt, reader, sizeLb, bulkLb,
-                                     gs.cmprOptForSync, hashSeed,
-                                     volSt.stopState, gs.ps, gs.fullScanLbPerSec)) {
+                                     gs.cmprOptForSync, hashSeed, hashAlgo,
+                                     volSt.stopState, gs.ps, gs.fullScanLbPerSec, regionLb)) {
                 logger.warn() << FUNC << "force stopped" << volId;
                 return;
             }
@@ -820,6 +837,35 @@ void dumpLogPackHeader(const std::string &volId, uint64_t lsid, const LogPackHea
 }
 
 
+/**
+ * Read logpacks from lsid until lsidLimit and call onPack() for each of them.
+ * onPack must read all the IOs of the logpack in packH from the reader.
+ * lsid will be the lsid of the next logpack to read.
+ */
+template <typename OnPack>
+void forEachLogPack(
+    const std::string &volId, const StorageVolState &volSt, device::AsyncWldevReader &reader,
+    LogPackHeader &packH, uint64_t &lsid, uint64_t lsidLimit, uint64_t maxWlogSendPb, OnPack onPack)
+{
+    const char *const FUNC = __func__;
+    for (;;) {
+        if (volSt.stopState == ForceStopping || gs.ps.isForceShutdown()) {
+            throw cybozu::Exception(FUNC) << "force stopped" << volId;
+        }
+        if (lsid == lsidLimit) break;
+        if (!readLogPackHeader(reader, packH, lsid)) {
+            dumpLogPackHeader(volId, lsid, packH); // for analysis.
+            throw cybozu::Exception(FUNC) << "invalid logpack header" << volId << lsid;
+        }
+        verifyMaxWlogSendPbIsNotTooSmall(maxWlogSendPb, packH.header().total_io_size + 1, FUNC);
+        const uint64_t nextLsid =  packH.nextLogpackLsid();
+        if (lsidLimit < nextLsid) break;
+        onPack();
+        lsid = nextLsid;
+    }
+}
+
+
 /**
  * RETURN:
  *   true if there is remaining to send or delete.
@@ -848,7 +894,15 @@ bool extractAndSendAndDeleteWlog(const std::string &volId)
     const std::string wdevPath = volInfo.getWdevPath();
     const std::string wdevName = device::getWdevNameFromWdevPath(wdevPath);
     const std::string wldevPath = device::getWldevPathFromWdevName(wdevName);
-    device::AsyncWldevReader reader(wldevPath);
+    device::AsyncWldevReader reader(wldevPath, gs.wlogReadAheadMb * MEBI, gs.wlogReadIoKb * KIBI);
+    {
+        UniqueLock ul(volSt.mu);
+        reader.enableReadAheadTuning(volSt.wlogReadAhead.params);
+    }
+    auto saveReadAheadStat = [&]() {
+        UniqueLock ul(volSt.mu);
+        volSt.wlogReadAhead = reader.getReadAheadStat();
+    };
     const uint32_t pbs = reader.super().getPhysicalBlockSize();
     const uint32_t salt = reader.super().getLogChecksumSalt();
     const uint64_t maxWlogSendPb = gs.maxWlogSendMb * MEBI / pbs;
@@ -871,8 +925,10 @@ bool extractAndSendAndDeleteWlog(const std::string &volId)
             pkt.write(salt);
             pkt.write(volSizeLb);
             pkt.write(maxLogSizePb);
+            pkt.write(lsidB);
+            pkt.write(gs.coalescesWlog);
             pkt.flush();
-            LOGs.debug() << "send" << volId << uuid << pbs << salt << volSizeLb << maxLogSizePb;
+            LOGs.debug() << "send" << volId << uuid << pbs << salt << volSizeLb << maxLogSizePb << lsidB;
             std::string res;
             pkt.read(res);
             if (res == msgAccept) break;
@@ -886,43 +942,65 @@ bool extractAndSendAndDeleteWlog(const std::string &volId)
         throw cybozu::Exception(FUNC) << "There is no available proxy" << volId;
     }
 
-    ProtocolLogger logger(gs.nodeId, serverId);
-    WlogSender sender(sock, logger, pbs, salt);
+    /* The proxy may have received a part of the wlogs already. */
+    uint64_t lsidR;
+    pkt.read(lsidR);
+    if (lsidR < lsidB || lsidLimit < lsidR || (gs.coalescesWlog && lsidR != lsidB)) {
+        throw cybozu::Exception(FUNC) << "bad resume lsid" << volId << lsidB << lsidR << lsidLimit;
+    }
+    if (lsidR != lsidB) {
+        LOGs.info() << FUNC << "resume" << volId << lsidB << lsidR << lsidLimit;
+    }
 
     LogPackHeader packH(pbs, salt);
-    reader.reset(lsidB, maxLogSizePb);
+    reader.reset(lsidR, lsidLimit - lsidR);
 
-    LOGs.debug() << FUNC << "start" << volId << lsidB << lsidLimit;
-    AlignedArray buf;
-    uint64_t lsid = lsidB;
+    LOGs.debug() << FUNC << "start" << volId << lsidB << lsidR << lsidLimit;
+    uint64_t lsid = lsidR;
     try {
-        for (;;) {
-            if (volSt.stopState == ForceStopping || gs.ps.isForceShutdown()) {
+        if (gs.coalescesWlog) {
+            /* Overwritten blocks will not be sent. */
+            BoundedDiffMemory diffMem(gs.maxWlogCoalesceMb * MEBI, gs.baseDirStr);
+            forEachLogPack(volId, volSt, reader, packH, lsid, lsidLimit, maxWlogSendPb, [&]() {
+                for (size_t i = 0; i < packH.header().n_records; i++) {
+                    AlignedArray buf;
+                    if (!readLogIo(reader, packH, i, buf)) {
+                        throw cybozu::Exception(FUNC) << "invalid logpack IO" << volId << packH.logpackLsid() << i;
+                    }
+                    DiffRecord drec;
+                    if (convertLogToDiff(packH.record(i), buf.data(), drec)) {
+                        if (!drec.isNormal()) buf.clear();
+                        diffMem.add(drec, std::move(buf));
+                    }
+                }
+            });
+            const CompressOpt cmpr(::WALB_DIFF_CMPR_SNAPPY, 0, std::min<size_t>(gs.wlogSendConcurrency, UINT8_MAX));
+            DiffStatistics statOut;
+            if (!wdiffTransferClient(pkt, diffMem, cmpr, volSt.stopState, gs.ps, statOut)) {
                 throw cybozu::Exception(FUNC) << "force stopped" << volId;
             }
-            if (lsid == lsidLimit) break;
-            if (!readLogPackHeader(reader, packH, lsid)) {
-                dumpLogPackHeader(volId, lsid, packH); // for analysis.
-                throw cybozu::Exception(FUNC) << "invalid logpack header" << volId << lsid;
-            }
-            verifyMaxWlogSendPbIsNotTooSmall(maxWlogSendPb, packH.header().total_io_size + 1, FUNC);
-            const uint64_t nextLsid =  packH.nextLogpackLsid();
-            if (lsidLimit < nextLsid) break;
-            sender.pushHeader(packH);
-            for (size_t i = 0; i < packH.header().n_records; i++) {
-                if (!readLogIo(reader, packH, i, buf)) {
-                    throw cybozu::Exception(FUNC) << "invalid logpack IO" << volId << lsid << i;
+            LOGs.debug() << FUNC << "coalesced" << volId << (lsid - lsidR) * pbs << diffMem.nrRuns() << statOut;
+        } else {
+            ProtocolLogger logger(gs.nodeId, serverId);
+            WlogPipelineSender sender(sock, logger, pbs, salt);
+            sender.start(gs.wlogSendConcurrency);
+            forEachLogPack(volId, volSt, reader, packH, lsid, lsidLimit, maxWlogSendPb, [&]() {
+                sender.pushHeader(packH);
+                for (size_t i = 0; i < packH.header().n_records; i++) {
+                    // checksum will be verified by the sender's worker threads.
+                    AlignedArray buf;
+                    readLogIoData(reader, packH, i, buf);
+                    sender.pushIo(packH, i, std::move(buf));
                 }
-                sender.pushIo(packH, i, buf.data());
-                buf.clear();
-            }
-            lsid = nextLsid;
+            });
+            sender.sync();
         }
     } catch (...) {
         LOGs.info() << FUNC << volId << lsidB << lsid << lsidLimit;
+        saveReadAheadStat();
         throw;
     }
-    sender.sync();
+    saveReadAheadStat();
     const uint64_t lsidE = lsid;
     const MetaDiff diff = volInfo.getTransferDiff(rec0, rec1, lsidE);
     pkt.write(diff);
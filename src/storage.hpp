@@ -11,6 +11,9 @@
 #include "action_counter.hpp"
 #include "walb_diff_pack.hpp"
 #include "walb_diff_compressor.hpp"
+#include "walb_diff_converter.hpp"
+#include "walb_diff_mem.hpp"
+#include "wdiff_transfer.hpp"
 #include "murmurhash3.hpp"
 #include "dirty_full_sync.hpp"
 #include "dirty_hash_sync.hpp"
@@ -27,9 +30,10 @@ struct StorageVolState {
     std::atomic<int> stopState;
     StateMachine sm;
     ActionCounters ac; // key is action identifier.
+    ReadAheadStat wlogReadAhead; // last tuned read-ahead for the log device.
 
     explicit StorageVolState(const std::string& volId)
-        : stopState(NotStopping), sm(mu), ac(mu) {
+        : stopState(NotStopping), sm(mu), ac(mu), wlogReadAhead() {
         sm.init(statePairTbl);
         initInner(volId);
     }
@@ -213,6 +217,12 @@ struct StorageSingleton
     std::string nodeId;
     std::string baseDirStr;
     uint64_t maxWlogSendMb;
+    size_t wlogSendConcurrency;
+    bool coalescesWlog;
+    size_t maxWlogCoalesceMb;
+    size_t wlogReadAheadMb;
+    size_t wlogReadIoKb;
+    size_t hashTreeMb; // region size of the tree mode in hash-bkp. 0 means the flat mode.
     size_t implicitSnapshotIntervalSec;
     size_t minDelaySecForRetry;
     size_t maxDelaySecForRetry;
@@ -224,6 +234,7 @@ struct StorageSingleton
     size_t tsDeltaGetterIntervalSec;
     bool allowExec;
     CompressOpt cmprOptForSync;
+    uint8_t hashAlgoForSync; // hash algorithm proposed in hash-bkp.
 
     /**
      * Writable and must be thread-safe.
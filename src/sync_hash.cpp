@@ -0,0 +1,21 @@
+#include "sync_hash.hpp"
+
+/* xxhash is inlined only in this translation unit. */
+#define XXH_INLINE_ALL
+#include "xxhash.h"
+
+namespace walb {
+namespace sync_hash_local {
+
+cybozu::murmurhash3::Hash calcXxh128(const void *key, size_t len, uint32_t seed)
+{
+    const XXH128_hash_t h0 = XXH3_128bits_withSeed(key, len, seed);
+    cybozu::murmurhash3::Hash h;
+    static_assert(sizeof(h0.low64) + sizeof(h0.high64) == cybozu::murmurhash3::HASH_SIZE, "bad hash size");
+    ::memcpy(&h.data[0], &h0.low64, sizeof(h0.low64));
+    ::memcpy(&h.data[sizeof(h0.low64)], &h0.high64, sizeof(h0.high64));
+    return h;
+}
+
+} // namespace sync_hash_local
+} // namespace walb
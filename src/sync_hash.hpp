@@ -0,0 +1,127 @@
+#pragma once
+/**
+ * @file
+ * @brief Hash functions selectable in hash sync and block hash.
+ */
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include "cybozu/exception.hpp"
+#include "murmurhash3.hpp"
+
+namespace walb {
+
+/*
+ * Hash algorithms. Their values are used in protocols.
+ * All of them produce cybozu::murmurhash3::Hash (128 bits).
+ */
+const uint8_t HASH_ALGO_MURMUR3 = 0; // MurmurHash3_x64_128.
+const uint8_t HASH_ALGO_XXH128 = 1; // XXH3_128bits.
+
+namespace sync_hash_local {
+
+struct Pair
+{
+    std::string algoStr;
+    uint8_t algo;
+};
+
+static const Pair hashAlgoTable[] = {
+    { "murmur3", HASH_ALGO_MURMUR3 },
+    { "xxh128", HASH_ALGO_XXH128 },
+};
+
+/**
+ * XXH3_128bits with the seed.
+ * The low and high 64 bits are stored in this order like MurmurHash3_x64_128.
+ */
+cybozu::murmurhash3::Hash calcXxh128(const void *key, size_t len, uint32_t seed);
+
+} // namespace sync_hash_local
+
+inline bool isValidHashAlgo(uint8_t algo)
+{
+    namespace lo = sync_hash_local;
+    for (const lo::Pair &p : lo::hashAlgoTable) {
+        if (p.algo == algo) return true;
+    }
+    return false;
+}
+
+inline uint8_t parseHashAlgo(const std::string &algoStr)
+{
+    namespace lo = sync_hash_local;
+    for (const lo::Pair &p : lo::hashAlgoTable) {
+        if (p.algoStr == algoStr) return p.algo;
+    }
+    throw cybozu::Exception("parseHashAlgo:wrong algorithm") << algoStr;
+}
+
+inline const std::string &hashAlgoToStr(uint8_t algo)
+{
+    namespace lo = sync_hash_local;
+    for (const lo::Pair &p : lo::hashAlgoTable) {
+        if (p.algo == algo) return p.algoStr;
+    }
+    throw cybozu::Exception("hashAlgoToStr:wrong algorithm") << int(algo);
+}
+
+/**
+ * Hash calculator with a selected algorithm.
+ * This is thread-safe.
+ */
+class SyncHasher
+{
+private:
+    uint32_t seed_;
+    uint8_t algo_;
+public:
+    explicit SyncHasher(uint32_t seed = 0, uint8_t algo = HASH_ALGO_MURMUR3)
+        : seed_(seed), algo_(algo) {
+        if (!isValidHashAlgo(algo)) {
+            throw cybozu::Exception("SyncHasher:wrong algorithm") << int(algo);
+        }
+    }
+    cybozu::murmurhash3::Hash operator()(const void *key, size_t len) const {
+        if (algo_ == HASH_ALGO_XXH128) {
+            return sync_hash_local::calcXxh128(key, len, seed_);
+        }
+        cybozu::murmurhash3::Hash h;
+        ::MurmurHash3_x64_128(key, len, seed_, &h.data[0]);
+        return h;
+    }
+};
+
+/**
+ * Stream hasher with a selected algorithm.
+ * The result with HASH_ALGO_MURMUR3 is the same as cybozu::murmurhash3::StreamHasher.
+ */
+class SyncStreamHasher
+{
+private:
+    uint32_t initSeed_;
+    uint32_t seed_;
+    uint8_t algo_;
+    cybozu::murmurhash3::Hash hash_;
+public:
+    explicit SyncStreamHasher(uint32_t initSeed = 0, uint8_t algo = HASH_ALGO_MURMUR3)
+        : initSeed_(initSeed), algo_(algo) {
+        if (!isValidHashAlgo(algo)) {
+            throw cybozu::Exception("SyncStreamHasher:wrong algorithm") << int(algo);
+        }
+        reset();
+    }
+    void reset() {
+        seed_ = initSeed_;
+        hash_.zeroClear();
+    }
+    void push(const void *key, size_t len) {
+        hash_.doXor(SyncHasher(seed_, algo_)(key, len));
+        seed_++;
+    }
+    const cybozu::murmurhash3::Hash& get() const {
+        return hash_;
+    }
+};
+
+} // namespace walb
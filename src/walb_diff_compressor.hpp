@@ -97,6 +97,12 @@ public:
     {
         outRecord = inRecord;
         const size_t inSize = inRecord.data_size;
+        if (inRecord.compression_type != WALB_DIFF_CMPR_NONE) {
+            // already compressed (passed through by DiffMerger).
+            if (inSize > maxOutSize) throw cybozu::Exception("PackCompressor:convertRecord:small maxOutSize") << inSize << maxOutSize;
+            ::memcpy(out, in, inSize);
+            return;
+        }
         size_t encSize;
         if (c_.run(out, &encSize, maxOutSize, in, inSize) && encSize < inSize) {
             outRecord.compression_type = type_;
@@ -263,6 +263,26 @@ bool SortedDiffReader::readPackHeader()
     return true;
 }
 
+std::vector<DiffPackPos> SortedDiffReader::scanPacks()
+{
+    std::vector<DiffPackPos> v;
+    for (;;) {
+        const uint64_t offset = fileR_.lseek(0, SEEK_CUR);
+        if (!readPackHeader()) break;
+        if (pack_.n_records > 0) v.push_back({pack_[0].io_address, offset});
+        fileR_.lseek(pack_.total_size, SEEK_CUR);
+        recIdx_ = pack_.n_records;
+        totalSize_ = pack_.total_size;
+    }
+    return v;
+}
+
+void SortedDiffReader::seekToPack(uint64_t offset)
+{
+    fileR_.lseek(offset);
+    readPackHeader();
+}
+
 void SortedDiffReader::init()
 {
     pack_.clear();
@@ -292,6 +312,22 @@ void DiffIndexMem::checkNoOverlappedAndSorted() const
     }
 }
 
+std::vector<IndexedDiffRecord> DiffIndexMem::getOverlapped(uint64_t addr, uint64_t endAddr) const
+{
+    std::vector<IndexedDiffRecord> v;
+    auto it = index_.lower_bound(addr);
+    if (it != index_.begin()) {
+        auto prev = it;
+        --prev;
+        if (prev->second.endIoAddress() > addr) it = prev;
+    }
+    while (it != index_.end() && it->first < endAddr) {
+        v.push_back(it->second);
+        ++it;
+    }
+    return v;
+}
+
 std::vector<IndexedDiffRecord> DiffIndexMem::getAsVec() const
 {
     std::vector<IndexedDiffRecord> ret;
@@ -346,9 +382,39 @@ void DiffIndexMem::addDetail(const IndexedDiffRecord &rec)
     index_.emplace(rec.io_address, rec);
 }
 
+namespace walb_diff_file_local {
+
+/**
+ * Checkpoint entry of IndexedDiffWriter.
+ * The entry is followed by n_records IndexedDiffRecord data.
+ * checksum covers both the entry and the records.
+ */
+struct DiffCheckpointEntry
+{
+    uint32_t checksum;
+    uint32_t n_records;
+    uint64_t tag;
+    uint64_t offset;
+    uint64_t n_data;
+
+    void init() {
+        ::memset(this, 0, sizeof(*this));
+    }
+    uint32_t calcChecksum(const IndexedDiffRecord *recs) const {
+        DiffCheckpointEntry e = *this;
+        e.checksum = 0;
+        uint32_t csum = cybozu::util::checksumPartial(&e, sizeof(e), 0);
+        csum = cybozu::util::checksumPartial(recs, sizeof(IndexedDiffRecord) * n_records, csum);
+        return cybozu::util::checksumFinish(csum);
+    }
+};
+
+} // namespace walb_diff_file_local
+
 void IndexedDiffWriter::finalize()
 {
     if (isClosed_) return;
+    if (pconv_) syncParallel();
 
     /* Insert padding data for index records to be aligned to 8 bytes. */
     const size_t delta = offset_ % 8;
@@ -363,6 +429,10 @@ void IndexedDiffWriter::finalize()
     writeSuper();
 
     fileW_.close();
+    if (hasCkpt_) {
+        ckptW_.close();
+        hasCkpt_ = false;
+    }
     isClosed_ = true;
 }
 
@@ -394,6 +464,7 @@ void IndexedDiffWriter::writeDiff(const IndexedDiffRecord &rec, const char *data
     }
     indexMem_.add(r);
     n_data_++;
+    if (hasCkpt_) ckptRecV_.push_back(r);
 }
 
 void IndexedDiffWriter::compressAndWriteDiff(
@@ -417,6 +488,191 @@ void IndexedDiffWriter::compressAndWriteDiff(
     writeDiff(r, buf_.data());
 }
 
+void IndexedDiffWriter::compressAndWriteDiff(
+    const IndexedDiffRecord &rec, AlignedArray &&data, int type, int level)
+{
+    if (!pconv_) {
+        compressAndWriteDiff(rec, data.data(), type, level);
+        return;
+    }
+    Task task;
+    task.rec = rec;
+    task.data = std::move(data);
+    task.type = type;
+    task.level = level;
+    task.isCkpt = false;
+    pushTask(std::move(task));
+}
+
+void IndexedDiffWriter::startParallel(size_t concurrency)
+{
+    checkWrittenHeader();
+    if (pconv_) {
+        throw cybozu::Exception(NAME) << "startParallel: already started.";
+    }
+    pconv_.reset(new cybozu::thread::ParallelConverter<Task, Task>(
+                     [this](Task &&task) { return compressTask(std::move(task)); }));
+    pconv_->start(concurrency);
+    writeTh_.set([this]() { runWriter(); });
+    writeTh_.start();
+}
+
+void IndexedDiffWriter::checkpoint(uint64_t tag)
+{
+    if (!hasCkpt_) {
+        throw cybozu::Exception(NAME) << "checkpoint: checkpoint file is not set.";
+    }
+    if (pconv_) {
+        Task task;
+        task.tag = tag;
+        task.isCkpt = true;
+        pushTask(std::move(task));
+        return;
+    }
+    checkpointDetail(tag);
+}
+
+void IndexedDiffWriter::checkpointDetail(uint64_t tag)
+{
+    walb_diff_file_local::DiffCheckpointEntry entry;
+    entry.init();
+    entry.n_records = ckptRecV_.size();
+    entry.tag = tag;
+    entry.offset = offset_;
+    entry.n_data = n_data_;
+    entry.checksum = entry.calcChecksum(ckptRecV_.data());
+
+    const size_t recSize = sizeof(IndexedDiffRecord) * ckptRecV_.size();
+    buf_.resize(sizeof(entry) + recSize, false);
+    ::memcpy(buf_.data(), &entry, sizeof(entry));
+    ::memcpy(buf_.data() + sizeof(entry), ckptRecV_.data(), recSize);
+    ckptW_.write(buf_.data(), buf_.size());
+    ckptRecV_.clear();
+}
+
+bool IndexedDiffWriter::resume(cybozu::util::File&& file, cybozu::util::File&& ckptFile, uint64_t& tag)
+{
+    init();
+    fileW_ = std::move(file);
+    isClosed_ = false;
+
+    DiffFileHeader header;
+    fileW_.lseek(0);
+    if (fileW_.readsome(&header, header.getSize()) != header.getSize()
+        || !header.isValid() || !header.isIndexed()) {
+        return false;
+    }
+    offset_ = header.getSize();
+    isWrittenHeader_ = true;
+
+    walb_diff_file_local::DiffCheckpointEntry entry;
+    std::vector<IndexedDiffRecord> recV;
+    AlignedArray data;
+    uint64_t ckptOffset = 0;
+    bool found = false;
+    ckptFile.lseek(0);
+    for (;;) {
+        if (ckptFile.readsome(&entry, sizeof(entry)) != sizeof(entry)) break;
+        if (entry.n_data != n_data_ + entry.n_records) break;
+        recV.resize(entry.n_records);
+        const size_t recSize = sizeof(IndexedDiffRecord) * recV.size();
+        if (ckptFile.readsome(recV.data(), recSize) != recSize) break;
+        if (entry.calcChecksum(recV.data()) != entry.checksum) break;
+
+        /* Verify the written data because it may not be persistent. */
+        uint64_t off = offset_;
+        bool isValid = true;
+        for (const IndexedDiffRecord &rec : recV) {
+            if (!rec.isValid()) { isValid = false; break; }
+            if (!rec.isNormal()) continue;
+            if (rec.data_offset != off) { isValid = false; break; }
+            data.resize(rec.data_size, false);
+            if (::pread(fileW_.fd(), data.data(), data.size(), off) != ssize_t(data.size())
+                || calcDiffIoChecksum(data) != rec.io_checksum) {
+                isValid = false;
+                break;
+            }
+            off += rec.data_size;
+        }
+        if (!isValid || off != entry.offset) break;
+
+        for (const IndexedDiffRecord &rec : recV) {
+            indexMem_.add(rec);
+            if (rec.isNormal()) stat_.dataSize += rec.data_size;
+        }
+        n_data_ = entry.n_data;
+        offset_ = entry.offset;
+        tag = entry.tag;
+        ckptOffset += sizeof(entry) + recSize;
+        found = true;
+    }
+    if (!found) return false;
+
+    ckptFile.ftruncate(ckptOffset);
+    ckptFile.lseek(ckptOffset);
+    fileW_.ftruncate(offset_);
+    fileW_.lseek(offset_);
+    ckptW_ = std::move(ckptFile);
+    hasCkpt_ = true;
+    return true;
+}
+
+void IndexedDiffWriter::pushTask(Task &&task)
+{
+    try {
+        pconv_->push(std::move(task));
+    } catch (...) {
+        pconv_->fail();
+        writeTh_.join(); // throw the error of the writer thread if exists.
+        throw;
+    }
+}
+
+/**
+ * Called by worker threads.
+ */
+IndexedDiffWriter::Task IndexedDiffWriter::compressTask(Task &&task)
+{
+    if (task.isCkpt || !task.rec.isNormal() || task.rec.isCompressed()) return std::move(task);
+    AlignedArray buf;
+    size_t outSize = 0;
+    task.rec.compression_type = compressData(
+        task.data.data(), task.rec.io_blocks * LOGICAL_BLOCK_SIZE,
+        buf, outSize, task.type, task.level);
+    task.rec.data_size = outSize;
+    task.rec.io_checksum = calcDiffIoChecksum(buf);
+    task.data = std::move(buf);
+    return std::move(task);
+}
+
+void IndexedDiffWriter::runWriter() try
+{
+    Task task;
+    while (pconv_->pop(task)) {
+        if (task.isCkpt) {
+            checkpointDetail(task.tag);
+        } else {
+            writeDiff(task.rec, task.data.data());
+        }
+    }
+} catch (...) {
+    pconv_->fail();
+    throw;
+}
+
+void IndexedDiffWriter::syncParallel()
+{
+    try {
+        pconv_->sync();
+    } catch (...) {
+        pconv_->fail();
+        writeTh_.join(); // throw the error of the writer thread if exists.
+        throw;
+    }
+    writeTh_.join();
+    pconv_.reset();
+}
+
 void IndexedDiffWriter::init()
 {
     indexMem_.clear();
@@ -426,6 +682,9 @@ void IndexedDiffWriter::init()
     isClosed_ = true;
     stat_.clear();
     stat_.wdiffNr = 1;
+    ckptW_ = cybozu::util::File();
+    hasCkpt_ = false;
+    ckptRecV_.clear();
 }
 
 void IndexedDiffWriter::writeSuper()
@@ -525,6 +784,23 @@ bool IndexedDiffReader::readDiffRecord(IndexedDiffRecord &rec, bool doVerify)
     return true;
 }
 
+void IndexedDiffReader::seekToAddress(uint64_t ioAddr)
+{
+    const size_t recSize = sizeof(IndexedDiffRecord);
+    size_t lo = 0, hi = (idxEndOffset_ - idxBgnOffset_) / recSize;
+    while (lo < hi) {
+        const size_t mid = (lo + hi) / 2;
+        IndexedDiffRecord rec;
+        ::memcpy(&rec, &memFile_[idxBgnOffset_ + mid * recSize], recSize);
+        if (rec.endIoAddress() <= ioAddr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    idxOffset_ = idxBgnOffset_ + lo * recSize;
+}
+
 bool IndexedDiffReader::isOnCache(const IndexedDiffRecord &rec) const
 {
     const IndexedDiffCache::Key key{this, rec.data_offset};
@@ -568,6 +844,18 @@ void IndexedDiffReader::readDiffIo(const IndexedDiffRecord &rec, AlignedArray &d
     ::memcpy(data.data(), &(*aryPtr)[offset], size);
 }
 
+void IndexedDiffReader::readCompressedDiffIo(const IndexedDiffRecord &rec, AlignedArray &data)
+{
+    assert(rec.isNormal());
+    if (rec.io_offset != 0 || rec.io_blocks != rec.orig_blocks) {
+        throw cybozu::Exception(NAME) << "BUG: the record is a part of the IO"
+                                      << rec.io_offset << rec.io_blocks << rec.orig_blocks;
+    }
+    verifyIoData(rec.data_offset, rec.data_size, rec.io_checksum, true);
+    data.resize(rec.data_size, false);
+    ::memcpy(data.data(), &memFile_[rec.data_offset], rec.data_size);
+}
+
 bool IndexedDiffReader::getNextRec(IndexedDiffRecord& rec)
 {
     if (idxOffset_ >= idxEndOffset_) return false;
@@ -8,6 +8,8 @@
 #include "walb_diff_stat.hpp"
 #include "uuid.hpp"
 #include "mmap_file.hpp"
+#include "thread_util.hpp"
+#include "chunked_map.hpp"
 #include "cybozu/exception.hpp"
 
 namespace walb {
@@ -191,6 +193,16 @@ private:
     }
 };
 
+/**
+ * First IO address and file offset of a pack in a sorted wdiff file.
+ */
+struct DiffPackPos
+{
+    uint64_t ioAddr;
+    uint64_t offset;
+};
+
+
 /**
  * Read walb diff data from an input stream.
  * usage1
@@ -294,6 +306,20 @@ public:
      */
     void readDiffIo(const DiffRecord &rec, AlignedArray &buf, bool verifyChecksum = true);
 
+    /**
+     * Read all the pack headers skipping IO data.
+     * Call this instead of readDiff() just after readHeader(head, false).
+     * The statistics will be the same as reading all the IOs.
+     * RETURN:
+     *   positions of the packs.
+     */
+    std::vector<DiffPackPos> scanPacks();
+    /**
+     * Move to a pack got by scanPacks() of the same file.
+     * Call this before readDiff().
+     */
+    void seekToPack(uint64_t offset);
+
     const DiffStatistics& getStat() const {
         return stat_;
     }
@@ -306,7 +332,7 @@ private:
 class DiffIndexMem
 {
 private:
-    using Map = std::map<uint64_t, IndexedDiffRecord>;
+    using Map = cybozu::ChunkedMap<uint64_t, IndexedDiffRecord>;
     Map index_; // key: io_address.
     uint32_t maxIoBlocks_;
 
@@ -331,6 +357,10 @@ public:
         }
     }
     size_t size() const { return index_.size(); }
+    /**
+     * Get records overlapped with [addr, endAddr) sorted by address.
+     */
+    std::vector<IndexedDiffRecord> getOverlapped(uint64_t addr, uint64_t endAddr) const;
 
     /**
      * for debug and test.
@@ -359,6 +389,23 @@ private:
     DiffStatistics stat_;
     AlignedArray buf_;
 
+    /* for checkpoint/resume. */
+    cybozu::util::File ckptW_;
+    bool hasCkpt_;
+    std::vector<IndexedDiffRecord> ckptRecV_;
+
+    /* for parallel compression. */
+    struct Task {
+        IndexedDiffRecord rec;
+        AlignedArray data;
+        int type;
+        int level;
+        uint64_t tag;
+        bool isCkpt;
+    };
+    std::unique_ptr<cybozu::thread::ParallelConverter<Task, Task> > pconv_;
+    cybozu::thread::ThreadRunner writeTh_;
+
 public:
     IndexedDiffWriter() {
         init();
@@ -394,6 +441,56 @@ public:
      */
     void compressAndWriteDiff(const IndexedDiffRecord &rec, const char *data,
                               int type = ::WALB_DIFF_CMPR_SNAPPY, int level = 0);
+    /**
+     * In the parallel mode, the data will be compressed by a worker thread.
+     * Otherwise, this is the same as the above one.
+     */
+    void compressAndWriteDiff(const IndexedDiffRecord &rec, AlignedArray &&data,
+                              int type = ::WALB_DIFF_CMPR_SNAPPY, int level = 0);
+    /**
+     * Start the parallel mode.
+     * Worker threads compress IOs given by compressAndWriteDiff() with AlignedArray
+     * and a writer thread writes them and checkpoints in the given order.
+     * finalize() waits for all of them to be written.
+     * Call this after writeHeader(), setCheckpointFile() or resume(),
+     * and do not call the other member functions than compressAndWriteDiff(),
+     * checkpoint() and finalize() in the parallel mode.
+     *
+     * @concurrency number of worker threads. 0 means the number of cpu cores.
+     */
+    void startParallel(size_t concurrency);
+
+    /**
+     * Checkpoint file records the records written so far
+     * so that writing can be resumed after the writer was discarded
+     * before finalize() was called.
+     * Call setCheckpointFile() after writeHeader().
+     */
+    void setCheckpointFile(cybozu::util::File&& ckptFile) {
+        checkWrittenHeader();
+        ckptW_ = std::move(ckptFile);
+        hasCkpt_ = true;
+        ckptRecV_.clear();
+    }
+    bool hasCheckpointFile() const { return hasCkpt_; }
+    /**
+     * Append a checkpoint entry.
+     * @tag arbitrary value restored by resume().
+     */
+    void checkpoint(uint64_t tag);
+    /**
+     * Restore the state at the last valid checkpoint.
+     * Written data of every record will be verified with its checksum.
+     * The diff file and the checkpoint file will be truncated to the checkpoint
+     * and you can continue calling writeDiff() and checkpoint().
+     *
+     * @file diff file opened with O_RDWR.
+     * @ckptFile checkpoint file opened with O_RDWR.
+     * @tag tag of the restored checkpoint will be set.
+     * RETURN:
+     *   false if there is no valid checkpoint.
+     */
+    bool resume(cybozu::util::File&& file, cybozu::util::File&& ckptFile, uint64_t& tag);
 
     const DiffStatistics& getStat() const {
         return stat_;
@@ -413,6 +510,11 @@ public:
 private:
     void init();
     void writeSuper();
+    void checkpointDetail(uint64_t tag);
+    void pushTask(Task &&task);
+    Task compressTask(Task &&task);
+    void runWriter();
+    void syncParallel();
     void checkWrittenHeader() const {
         if (!isWrittenHeader_) {
             throw cybozu::Exception(NAME) <<
@@ -497,10 +599,21 @@ public:
     const DiffFileHeader& header() const { return header_; }
 
     bool readDiffRecord(IndexedDiffRecord &rec, bool doVerify = true);
+    /**
+     * Move to the first record which end address is larger than ioAddr.
+     * Records in the index are sorted and not overlapped each other.
+     */
+    void seekToAddress(uint64_t ioAddr);
     /**
      * data will be uncompressed data.
      */
     void readDiffIo(const IndexedDiffRecord &rec, AlignedArray &data);
+    /**
+     * data will be compressed data as stored in the file.
+     * The record must cover the whole compressed image.
+     * The cache is not used.
+     */
+    void readCompressedDiffIo(const IndexedDiffRecord &rec, AlignedArray &data);
     bool readDiff(IndexedDiffRecord &rec, AlignedArray &data) {
         if (!readDiffRecord(rec)) return false;
         readDiffIo(rec, data);
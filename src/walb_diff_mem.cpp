@@ -48,180 +48,135 @@ std::vector<DiffRecIo> DiffRecIo::splitAll(uint32_t ioBlocks) const
     return v;
 }
 
-std::vector<DiffRecIo> DiffRecIo::minus(const DiffRecIo &rhs) const
+void DiffRecIo::uncompress()
 {
-    assert(isValid());
-    assert(rhs.isValid());
-    if (!rec_.isOverlapped(rhs.rec_)) {
-        throw RT_ERR("Non-overlapped.");
-    }
-    std::vector<DiffRecIo> v;
-    /*
-     * Pattern 1:
-     * __oo__ + xxxxxx = xxxxxx
-     */
-    if (rec_.isOverwrittenBy(rhs.rec_)) {
-        /* Empty */
-        return v;
-    }
-    /*
-     * Pattern 2:
-     * oooooo + __xx__ = ooxxoo
-     */
-    if (rhs.rec_.isOverwrittenBy(rec_)) {
-        uint32_t blks0 = rhs.rec_.io_address - rec_.io_address;
-        uint32_t blks1 = rec_.endIoAddress() - rhs.rec_.endIoAddress();
-        uint64_t addr0 = rec_.io_address;
-        uint64_t addr1 = rec_.endIoAddress() - blks1;
-
-        DiffRecord rec0 = rec_;
-        DiffRecord rec1 = rec_;
-        rec0.io_address = addr0;
-        rec0.io_blocks = blks0;
-        rec1.io_address = addr1;
-        rec1.io_blocks = blks1;
-
-        size_t size0 = 0;
-        size_t size1 = 0;
-        const bool recIsNormal = rec_.isNormal();
-        if (recIsNormal) {
-            size0 = blks0 * LOGICAL_BLOCK_SIZE;
-            size1 = blks1 * LOGICAL_BLOCK_SIZE;
-        }
-        rec0.data_size = size0;
-        rec1.data_size = size1;
-
-        AlignedArray data0, data1;
-        if (recIsNormal) {
-            size_t off1 = (addr1 - rec_.io_address) * LOGICAL_BLOCK_SIZE;
-            assert(size0 + rhs.rec_.io_blocks * LOGICAL_BLOCK_SIZE + size1 == rec_.data_size);
-            const char *p = io_.data();
-            util::assignAlignedArray(data0, p, size0);
-            p += off1;
-            util::assignAlignedArray(data1, p, size1);
-        }
+    if (!isCompressed()) return;
+    DiffRecord rec;
+    AlignedArray buf;
+    uncompressDiffIo(rec_, io_.data(), rec, buf, false);
+    rec_ = rec;
+    io_ = std::move(buf);
+}
 
-        if (0 < blks0) {
-            v.emplace_back(rec0, std::move(data0));
-        }
-        if (0 < blks1) {
-            v.emplace_back(rec1, std::move(data1));
-        }
-        return v;
+void DiffRecIo::trimFront(uint32_t ioBlocks)
+{
+    assert(ioBlocks < rec_.io_blocks);
+    uncompress();
+    rec_.io_address += ioBlocks;
+    rec_.io_blocks -= ioBlocks;
+    if (rec_.isNormal()) {
+        const size_t off = ioBlocks * LOGICAL_BLOCK_SIZE;
+        const size_t size = rec_.io_blocks * LOGICAL_BLOCK_SIZE;
+        ::memmove(io_.data(), io_.data() + off, size);
+        io_.resize(size);
+        rec_.data_size = size;
     }
-    /*
-     * Pattern 3:
-     * oooo__ + __xxxx = ooxxxx
-     */
-    if (rec_.io_address < rhs.rec_.io_address) {
-        const uint64_t endIoAddr = rec_.endIoAddress();
-        assert(rhs.rec_.io_address < endIoAddr);
-        uint32_t rblks = endIoAddr - rhs.rec_.io_address;
-        assert(rhs.rec_.io_address + rblks == endIoAddr);
-
-        DiffRecord rec = rec_;
-        /* rec.io_address does not change. */
-        rec.io_blocks = rec_.io_blocks - rblks;
-        assert(rec.endIoAddress() == rhs.rec_.io_address);
-
-        size_t size = 0;
-        if (rec_.isNormal()) {
-            size = io_.size() - rblks * LOGICAL_BLOCK_SIZE;
-        }
-        AlignedArray data;
-        if (rec_.isNormal()) {
-            assert(rec_.data_size == io_.size());
-            rec.data_size = size;
-            util::assignAlignedArray(data, io_.data(), size);
-        }
+}
 
-        v.emplace_back(rec, std::move(data));
-        return v;
+void DiffRecIo::trimBack(uint32_t ioBlocks)
+{
+    assert(ioBlocks < rec_.io_blocks);
+    uncompress();
+    rec_.io_blocks -= ioBlocks;
+    if (rec_.isNormal()) {
+        const size_t size = rec_.io_blocks * LOGICAL_BLOCK_SIZE;
+        io_.resize(size);
+        rec_.data_size = size;
     }
-    /*
-     * Pattern 4:
-     * __oooo + xxxx__ = xxxxoo
-     */
-    const uint64_t rhsEndIoAddr = rhs.rec_.endIoAddress();
-    assert(rec_.io_address < rhsEndIoAddr);
-    uint32_t rblks = rhsEndIoAddr - rec_.io_address;
-    assert(rec_.io_address + rblks == rhsEndIoAddr);
-    size_t off = rblks * LOGICAL_BLOCK_SIZE;
+}
 
+DiffRecIo DiffRecIo::splitBack(uint32_t ioBlocks)
+{
+    assert(ioBlocks < rec_.io_blocks);
+    uncompress();
     DiffRecord rec = rec_;
-    rec.io_address = rec_.io_address + rblks;
-    rec.io_blocks = rec_.io_blocks - rblks;
-
-    size_t size = 0;
-    const bool isNormal = rec_.isNormal();
-    if (isNormal) {
-        size = io_.size() - off;
-    }
+    rec.io_address = rec_.endIoAddress() - ioBlocks;
+    rec.io_blocks = ioBlocks;
     AlignedArray data;
-    if (isNormal) {
-        assert(rec_.data_size == io_.size());
+    if (rec_.isNormal()) {
+        const size_t size = ioBlocks * LOGICAL_BLOCK_SIZE;
         rec.data_size = size;
-        util::assignAlignedArray(data, io_.data() + off, size);
+        util::assignAlignedArray(data, io_.data() + io_.size() - size, size);
     }
-    assert(rhsEndIoAddr == rec.io_address);
-    v.emplace_back(rec, std::move(data));
-    return v;
+    trimBack(ioBlocks);
+    return DiffRecIo(rec, std::move(data));
 }
 
 void DiffMemory::add(const DiffRecord& rec, AlignedArray &&buf)
 {
-    /* Decide key range to search overlapped items.
-     * We must start from the item which have max address
-     * in all the items that address is less than the addr0. */
     const uint64_t addr0 = rec.io_address;
-    auto it = map_.lower_bound(addr0);
-    if (it == map_.end()) {
-        if (!map_.empty()) --it;
-    } else {
-        if (addr0 < it->first && it != map_.begin()) --it;
-    }
-
-    /* Search overlapped items. */
     const uint64_t addr1 = rec.endIoAddress();
-    std::queue<DiffRecIo> q;
-    while (it != map_.end() && it->first < addr1) {
+
+    /*
+     * Items are sorted and not overlapped each other,
+     * so the items overlapped with rec are contiguous in the map.
+     * Only the first one may start before addr0 and only the last one may end after addr1.
+     * Their remaining portions are trimmed in place.
+     */
+    Map::iterator it = map_.lower_bound(addr0);
+    if (it != map_.begin()) {
+        Map::iterator prev = it;
+        --prev;
+        if (addr0 < prev->second.record().endIoAddress()) it = prev;
+    }
+    DiffRecIo tail;
+    if (it != map_.end() && it->first < addr0) {
         DiffRecIo &r = it->second;
-        if (r.record().isOverlapped(rec)) {
-            nIos_--;
-            nBlocks_ -= r.record().io_blocks;
-            q.push(std::move(r));
-            it = map_.erase(it);
-        } else {
-            ++it;
+        const uint64_t endAddr = r.record().endIoAddress();
+        nBlocks_ -= r.record().io_blocks;
+        nBytes_ -= r.io().size();
+        if (addr1 < endAddr) {
+            /* oooooo + __xx__ = ooxxoo */
+            tail = r.splitBack(endAddr - addr1);
         }
+        r.trimBack(std::min(endAddr, addr1) - addr0);
+        nBlocks_ += r.record().io_blocks;
+        nBytes_ += r.io().size();
+        ++it;
+    }
+    Map::iterator last = it;
+    while (last != map_.end() && last->second.record().endIoAddress() <= addr1) {
+        /* __oo__ + xxxxxx = xxxxxx */
+        ++last;
+    }
+    eraseFromMap(it, last);
+    if (it != map_.end() && it->first < addr1) {
+        /* __oooo + xxxx__ = xxxxoo */
+        const uint32_t blks = addr1 - it->first;
+        nBytes_ -= it->second.io().size();
+        it->second.trimFront(blks);
+        nBlocks_ -= blks;
+        nBytes_ += it->second.io().size();
+        map_.rekey(it, addr1);
+    }
+    if (tail.record().io_blocks > 0) {
+        nIos_++;
+        nBlocks_ += tail.record().io_blocks;
+        nBytes_ += tail.io().size();
+        map_.emplace(addr1, std::move(tail));
     }
 
-    /* Eliminate overlaps. */
+    /*
+     * Insert the item. A large IO is split into smaller IOs.
+     * Splitting uncompresses a compressed IO, so the size of each piece is counted.
+     */
     DiffRecIo r0(rec, std::move(buf));
-    while (!q.empty()) {
-        std::vector<DiffRecIo> v = q.front().minus(r0);
-        for (DiffRecIo &r : v) {
-            const DiffRecord& dr = r.record();
+    nBlocks_ += rec.io_blocks;
+    if (maxIoBlocks_ > 0 && maxIoBlocks_ < rec.io_blocks) {
+        uint32_t blks = rec.io_blocks % maxIoBlocks_;
+        if (blks == 0) blks = maxIoBlocks_;
+        while (r0.record().io_blocks > blks) {
+            DiffRecIo r = r0.splitBack(blks);
+            const uint64_t addr = r.record().io_address;
             nIos_++;
-            nBlocks_ += dr.io_blocks;
-            map_.emplace(dr.io_address, std::move(r));
+            nBytes_ += r.io().size();
+            map_.emplace(addr, std::move(r));
+            blks = maxIoBlocks_;
         }
-        q.pop();
     }
-    /* Insert the item. */
     nIos_++;
-    nBlocks_ += r0.record().io_blocks;
-    std::vector<DiffRecIo> rv;
-    if (maxIoBlocks_ > 0 && maxIoBlocks_ < rec.io_blocks) {
-        // split a large IO into smaller IOs.
-        rv = r0.splitAll(maxIoBlocks_);
-    } else {
-        rv.push_back(std::move(r0));
-    }
-    for (DiffRecIo &r : rv) {
-        uint64_t addr = r.record().io_address;
-        map_.emplace(addr, std::move(r));
-    }
+    nBytes_ += r0.io().size();
+    map_.emplace(addr0, std::move(r0));
 }
 
 void DiffMemory::print(::FILE *fp) const
@@ -238,11 +193,13 @@ void DiffMemory::checkStatistics() const
 {
     uint64_t nBlocks = 0;
     uint64_t nIos = 0;
+    uint64_t nBytes = 0;
     auto it = map_.cbegin();
     while (it != map_.cend()) {
         const DiffRecord &rec = it->second.record();
         nBlocks += rec.io_blocks;
         nIos++;
+        nBytes += it->second.io().size();
         ++it;
     }
     if (nBlocks_ != nBlocks) {
@@ -251,6 +208,9 @@ void DiffMemory::checkStatistics() const
     if (nIos_ != nIos) {
         throw cybozu::Exception("DiffMemory:getNIos:bad ios") << nIos_ << nIos;
     }
+    if (nBytes_ != nBytes) {
+        throw cybozu::Exception("DiffMemory:getDataSize:bad bytes") << nBytes_ << nBytes;
+    }
 }
 
 void DiffMemory::writeTo(int outFd, int cmprType)
@@ -311,7 +271,18 @@ void DiffMemory::eraseFromMap(Map::iterator& i)
 {
     nIos_--;
     nBlocks_ -= i->second.record().io_blocks;
+    nBytes_ -= i->second.io().size();
     i = map_.erase(i);
 }
 
+void DiffMemory::eraseFromMap(Map::iterator& first, Map::iterator last)
+{
+    for (Map::iterator i = first; i != last; ++i) {
+        nIos_--;
+        nBlocks_ -= i->second.record().io_blocks;
+        nBytes_ -= i->second.io().size();
+    }
+    first = map_.erase(first, last);
+}
+
 } //namespace walb
@@ -8,15 +8,15 @@
  */
 #include <vector>
 #include <cassert>
-#include <map>
 #include "walb_diff_base.hpp"
 #include "walb_diff_file.hpp"
+#include "chunked_map.hpp"
 
 namespace walb {
 
 /**
  * Diff record and its IO data.
- * Data compression is not supported.
+ * IO data may be compressed. It will be uncompressed before split or trimmed.
  * Checksum is not calculated.
  */
 class DiffRecIo /* final */
@@ -40,6 +40,8 @@ public:
         assert(isValid());
     }
     bool isValid(bool isChecksum = false) const;
+    bool isCompressed() const { return rec_.isNormal() && rec_.isCompressed(); }
+    void uncompress();
 
     void print(::FILE *fp = ::stdout) const {
         rec_.printOneline(fp);
@@ -53,23 +55,31 @@ public:
     std::vector<DiffRecIo> splitAll(uint32_t ioBlocks) const;
 
     /**
-     * Create (IO portions of rhs) - (that of *this).
-     * If non-overlapped, throw runtime error.
-     * The overlapped data of rhs will be used.
-     * *this will not be changed.
+     * Remove the first ioBlocks blocks.
+     * The remaining IO data are moved inside the buffer without reallocation.
      */
-    std::vector<DiffRecIo> minus(const DiffRecIo &rhs) const;
+    void trimFront(uint32_t ioBlocks);
+    /**
+     * Remove the last ioBlocks blocks.
+     * The buffer is just shrunk.
+     */
+    void trimBack(uint32_t ioBlocks);
+    /**
+     * Split the last ioBlocks blocks off as a new DiffRecIo.
+     * Only the IO data of the returned one are copied.
+     */
+    DiffRecIo splitBack(uint32_t ioBlocks);
 };
 
 /**
  * Simpler implementation of in-memory walb diff data.
- * IO data compression is not supported.
+ * Compressed IOs are kept as they are unless they are split or partially overwritten.
  * IO checksum is not calculated.
  */
 class DiffMemory
 {
 public:
-    using Map = std::map<uint64_t, DiffRecIo>;
+    using Map = cybozu::ChunkedMap<uint64_t, DiffRecIo>;
 private:
     /*
      * This parameter is in order not to exist too large IOs.
@@ -81,11 +91,12 @@ private:
     DiffFileHeader fileH_;
     uint64_t nIos_; /* Number of IOs in the diff. */
     uint64_t nBlocks_; /* Number of logical blocks in the diff. */
+    uint64_t nBytes_; /* Size of IO data in the diff [byte]. */
 
 public:
     DiffMemory()
         : maxIoBlocks_(DEFAULT_MAX_IO_LB)
-        , map_(), fileH_(), nIos_(0), nBlocks_(0) {
+        , map_(), fileH_(), nIos_(0), nBlocks_(0), nBytes_(0) {
         fileH_.init();
     }
     ~DiffMemory() noexcept = default;
@@ -95,6 +106,7 @@ public:
     void print(::FILE *fp = ::stdout) const;
     uint64_t getNBlocks() const { return nBlocks_; }
     uint64_t getNIos() const { return nIos_; }
+    uint64_t getDataSize() const { return nBytes_; }
     void checkStatistics() const;
     DiffFileHeader& header() { return fileH_; }
     void writeTo(int outFd, int cmprType = ::WALB_DIFF_CMPR_SNAPPY);
@@ -106,12 +118,14 @@ public:
         map_.clear();
         nIos_ = 0;
         nBlocks_ = 0;
+        nBytes_ = 0;
         fileH_.init();
     }
     void checkNoOverlappedAndSorted() const;
     const Map& getMap() const { return map_; }
     Map& getMap() { return map_; }
     void eraseFromMap(Map::iterator& i);
+    void eraseFromMap(Map::iterator& first, Map::iterator last);
 };
 
 } //namespace walb
@@ -1,4 +1,5 @@
 #include "walb_diff_merge.hpp"
+#include "tmp_file.hpp"
 
 namespace walb {
 
@@ -18,6 +19,19 @@ void DiffMerger::Wdiff::setFile(cybozu::util::File &&file, IndexedDiffCache *cac
     }
 }
 
+void DiffMerger::Wdiff::setAddressRange(uint64_t bgnAddr, uint64_t endAddr, uint64_t packOffset)
+{
+    assert(!isFilled_);
+    bgnAddr_ = bgnAddr;
+    endAddr_ = endAddr;
+    if (bgnAddr_ == 0) return;
+    if (isIndexed_) {
+        iReader_.seekToAddress(bgnAddr_);
+    } else if (packOffset > 0) {
+        sReader_.seekToPack(packOffset);
+    }
+}
+
 void DiffMerger::Wdiff::getAndRemoveIo(AlignedArray &buf)
 {
     verifyNotEnd(__func__);
@@ -44,7 +58,7 @@ void DiffMerger::Wdiff::fill() const
     if (isIndexed_) {
         success = readIndexedDiff();
     } else {
-        success = sReader_.readAndUncompressDiff(rec_, buf_, false);
+        success = readSortedDiff();
     }
     if (success) {
         isFilled_ = true;
@@ -53,10 +67,50 @@ void DiffMerger::Wdiff::fill() const
     }
 }
 
+bool DiffMerger::Wdiff::readSortedDiff() const
+{
+    do {
+        if (!sReader_.readDiff(rec_, buf_)) return false;
+    } while (rec_.endIoAddress() <= bgnAddr_);
+    if (rec_.io_address >= endAddr_) return false;
+
+    if (rec_.isNormal() && rec_.isCompressed() && !shouldPassThrough(rec_.compression_type)) {
+        DiffRecord rec;
+        AlignedArray buf;
+        uncompressDiffIo(rec_, buf_.data(), rec, buf, false);
+        rec_ = rec;
+        buf_ = std::move(buf);
+    }
+    if (rec_.io_address < bgnAddr_ || rec_.endIoAddress() > endAddr_) {
+        DiffRecIo recIo(rec_, std::move(buf_));
+        if (rec_.endIoAddress() > endAddr_) {
+            recIo.trimBack(rec_.endIoAddress() - endAddr_);
+        }
+        if (rec_.io_address < bgnAddr_) {
+            recIo.trimFront(bgnAddr_ - rec_.io_address);
+        }
+        rec_ = recIo.record();
+        buf_ = recIo.moveIoFrom();
+    }
+    return true;
+}
+
 bool DiffMerger::Wdiff::readIndexedDiff() const
 {
     IndexedDiffRecord irec;
-    if (!iReader_.readDiff(irec, buf_)) return false;
+    do {
+        if (!iReader_.readDiffRecord(irec)) return false;
+    } while (irec.endIoAddress() <= bgnAddr_);
+    if (irec.io_address >= endAddr_) return false;
+    if (irec.endIoAddress() > endAddr_) {
+        irec.io_blocks = endAddr_ - irec.io_address;
+    }
+    if (irec.io_address < bgnAddr_) {
+        const uint64_t blks = bgnAddr_ - irec.io_address;
+        irec.io_address = bgnAddr_;
+        irec.io_blocks -= blks;
+        if (irec.isNormal()) irec.io_offset += blks;
+    }
 
     // Convert IndexedDiffRecord to DiffRecord.
     rec_.init();
@@ -65,13 +119,21 @@ bool DiffMerger::Wdiff::readIndexedDiff() const
     rec_.flags = irec.flags;
     if (!irec.isNormal()) return true;
 
-    rec_.compression_type = ::WALB_DIFF_CMPR_NONE;
     rec_.data_offset = 0; // updated later.
-    rec_.data_size = irec.io_blocks * LOGICAL_BLOCK_SIZE;
-    rec_.checksum = irec.io_checksum; // not set.
-
+    if (shouldPassThrough(irec.compression_type)
+        && irec.io_offset == 0 && irec.io_blocks == irec.orig_blocks) {
+        // The record covers the whole compressed image.
+        iReader_.readCompressedDiffIo(irec, buf_);
+        rec_.compression_type = irec.compression_type;
+        rec_.data_size = irec.data_size;
+        rec_.checksum = irec.io_checksum;
+    } else {
+        iReader_.readDiffIo(irec, buf_);
+        rec_.compression_type = ::WALB_DIFF_CMPR_NONE;
+        rec_.data_size = irec.io_blocks * LOGICAL_BLOCK_SIZE;
+        rec_.checksum = irec.io_checksum; // not set.
+    }
     assert(buf_.size() == rec_.data_size);
-
     return true;
 }
 
@@ -145,8 +207,15 @@ void DiffMerger::prepare()
         wdiffH_.init();
         wdiffH_.setUuid(uuid);
 
-        removeEndedWdiffs();
-        doneAddr_ = getMinimumAddr();
+        tree_.init(wdiffs_.size());
+        for (size_t i = 0; i < wdiffs_.size(); i++) {
+            wdiffs_[i]->setPassThroughCmprType(passThroughType_);
+            wdiffs_[i]->setAddressRange(bgnAddr_, endAddr_, packOffsetV_[i]);
+            updateTree(i);
+        }
+        size_t idx;
+        doneAddr_ = tree_.min(idx);
+        if (doneAddr_ == UINT64_MAX) wdiffs_.clear();
         isHeaderPrepared_ = true;
     }
 }
@@ -166,172 +235,373 @@ bool DiffMerger::getAndRemove(DiffRecIo &recIo)
     return true;
 }
 
-uint64_t DiffMerger::getMinimumAddr() const
+void DiffMerger::moveToDiffMemory()
 {
-    uint64_t addr = UINT64_MAX;
-    WdiffPtrList::const_iterator it = wdiffs_.begin();
-    while (it != wdiffs_.end()) {
-        Wdiff &wdiff = **it;
-        DiffRecord rec = wdiff.getFrontRec();
-        addr = std::min(addr, rec.io_address);
-        ++it;
-    }
-    return addr;
+    if (wdiffs_.empty()) return;
+
+    size_t idx;
+    tree_.min(idx);
+    assert(blockedV_.empty());
+    for (;;) {
+        const DiffRecord rec = wdiffs_[idx]->getFrontRec();
+        size_t olderIdx;
+        if (tree_.prefixMin(idx, olderIdx) < rec.endIoAddress()) {
+            /* An older wdiff has an unread IO overlapping rec.
+               It must be added to diffMem_ before rec. */
+            blockedV_.push_back(idx);
+            idx = olderIdx;
+            continue;
+        }
+        moveFrontIo(idx);
+        if (blockedV_.empty()) break;
+        idx = blockedV_.back();
+        blockedV_.pop_back();
+    }
+    maxMemBlocks_ = std::max(maxMemBlocks_, diffMem_.getNBlocks());
+    doneAddr_ = tree_.min(idx);
+    if (doneAddr_ == UINT64_MAX) wdiffs_.clear();
 }
 
-void DiffMerger::moveToDiffMemory()
+void DiffMerger::moveFrontIo(size_t idx)
 {
-    size_t nr = tryMoveToDiffMemory();
-    if (nr == 0 && !wdiffs_.empty()) {
-        // Retry with enlarged searchLen_.
-        nr = tryMoveToDiffMemory();
+    Wdiff &wdiff = *wdiffs_[idx];
+    const DiffRecord rec = wdiff.getFrontRec();
+    AlignedArray buf;
+    wdiff.getAndRemoveIo(buf);
+    mergeIo(rec, std::move(buf));
+    updateTree(idx);
+}
+
+void DiffMerger::updateTree(size_t idx)
+{
+    const Wdiff &wdiff = *wdiffs_[idx];
+    if (wdiff.isEnd()) {
+        statIn_.update(wdiff.getStat());
+        wdiffs_[idx].reset();
+        tree_.update(idx, UINT64_MAX);
+    } else {
+        tree_.update(idx, wdiff.currentAddress());
     }
-    if (!wdiffs_.empty()) {
-        // It must progress.
-        (void)nr;
-        assert(nr > 0);
+}
+
+bool DiffMerger::moveToMergedQueue()
+{
+    if (diffMem_.empty()) return false;
+    DiffMemory::Map& map = diffMem_.getMap();
+    DiffMemory::Map::iterator i = map.begin();
+    while (i != map.end()) {
+        DiffRecIo& recIo = i->second;
+        if (recIo.record().endIoAddress() > doneAddr_) break;
+        mergedQ_.push(std::move(recIo));
+        ++i;
     }
+    DiffMemory::Map::iterator bgn = map.begin();
+    diffMem_.eraseFromMap(bgn, i);
+    return true;
 }
 
 namespace walb_diff_merge_local {
 
-struct Range
+/**
+ * RETURN:
+ *   offset of the last pack whose first address is <= ioAddr, or 0 if there is no such pack.
+ */
+inline uint64_t getPackOffset(const std::vector<DiffPackPos> &posV, uint64_t ioAddr)
 {
-    uint64_t bgn;
-    uint64_t end;
+    std::vector<DiffPackPos>::const_iterator it = std::upper_bound(
+        posV.begin(), posV.end(), ioAddr,
+        [](uint64_t addr, const DiffPackPos &pos) { return addr < pos.ioAddr; });
+    if (it == posV.begin()) return 0;
+    --it;
+    return it->offset;
+}
 
-    Range() : bgn(0), end(0) {
-    }
-    Range(uint64_t bgn, uint64_t end)
-        : bgn(bgn), end(end) {
+inline void copyFileData(cybozu::util::File &src, cybozu::util::File &dst)
+{
+    const uint64_t size = src.lseek(0, SEEK_END);
+    src.lseek(0);
+    AlignedArray buf(std::min<uint64_t>(size, 4 * MEBI), false);
+    uint64_t off = 0;
+    while (off < size) {
+        const size_t s = std::min<uint64_t>(buf.size(), size - off);
+        src.read(buf.data(), s);
+        dst.write(buf.data(), s);
+        off += s;
     }
-    explicit Range(const DiffRecord &rec) {
-        set(rec);
+}
+
+/* Number of IOs read ahead is at least this. */
+const size_t MIN_PREFETCH_IO_NR = 64;
+
+} // namespace walb_diff_merge_local
+
+void DiffRecIoPrefetcher::start(size_t nrThreads)
+{
+    assert(!isStarted_);
+    isStarted_ = true;
+    if (nrThreads == 0) return;
+    pconv_.start(nrThreads, std::max(nrThreads * 2, walb_diff_merge_local::MIN_PREFETCH_IO_NR));
+    reader_.set([this]() {
+        try {
+            DiffRecIo recIo;
+            while (merger_.getAndRemove(recIo)) {
+                pconv_.push(std::move(recIo));
+            }
+            pconv_.sync();
+        } catch (...) {
+            pconv_.fail();
+            throw;
+        }
+    });
+    reader_.start();
+}
+
+bool DiffRecIoPrefetcher::getAndRemove(DiffRecIo &recIo)
+{
+    assert(isStarted_);
+    if (!reader_.isAlive()) {
+        if (!merger_.getAndRemove(recIo)) return false;
+        recIo.uncompress();
+        return true;
     }
-    void set(const DiffRecord &rec) {
-        bgn = rec.io_address;
-        end = rec.endIoAddress();
+    bool ret;
+    try {
+        ret = pconv_.pop(recIo);
+    } catch (std::exception &e) {
+        reader_.join(); // an error in the reader thread will be thrown.
+        /* ParallelConverter does not pass errors of its workers to pop(). */
+        throw cybozu::Exception(NAME) << "uncompression failed" << getWorkerError() << e.what();
     }
-    bool isOverlapped(const Range &rhs) const {
-        return bgn < rhs.end && rhs.bgn < end;
+    if (!ret) reader_.join();
+    return ret;
+}
+
+void DiffMerger::verifyUuid(const cybozu::Uuid &uuid) const
+{
+    for (const WdiffPtr &wdiffP : wdiffs_) {
+        const cybozu::Uuid uuid1 = wdiffP->header().getUuid();
+        if (uuid1 != uuid) {
+            throw cybozu::Exception(__func__) << "uuid differ" << uuid1 << uuid;
+        }
     }
-    bool isLeftRight(const Range &rhs) const {
-        return end <= rhs.bgn;
+}
+
+void ParallelDiffMerger::prepare()
+{
+    if (isPrepared_) return;
+    if (pathV_.empty()) {
+        throw cybozu::Exception(__func__) << "Wdiffs are not set.";
     }
-    void merge(const Range &rhs) {
-        bgn = std::min(bgn, rhs.bgn);
-        end = std::max(end, rhs.end);
+    statIn_.clear();
+    packPosVV_.resize(pathV_.size());
+    std::vector<cybozu::Uuid> uuidV;
+    std::vector<uint64_t> sampleV;
+    for (size_t i = 0; i < pathV_.size(); i++) {
+        uuidV.push_back(scanWdiff(i, sampleV));
     }
-    size_t size() const {
-        assert(end - bgn <= SIZE_MAX);
-        return end - bgn;
+    const cybozu::Uuid &uuid = uuidV.back();
+    if (shouldValidateUuid_) {
+        for (const cybozu::Uuid &uuid1 : uuidV) {
+            if (uuid1 != uuid) {
+                throw cybozu::Exception(__func__) << "uuid differ" << uuid1 << uuid;
+            }
+        }
     }
-    friend inline std::ostream &operator<<(std::ostream &os, const Range &range) {
-        os << "(" << range.bgn << ", " << range.end << ")";
-        return os;
+    wdiffH_.init();
+    wdiffH_.setUuid(uuid);
+
+    /* Each range will have similar number of the samples. */
+    addrV_.assign(1, 0);
+    if (!sampleV.empty()) {
+        std::sort(sampleV.begin(), sampleV.end());
+        const size_t nr = std::min(nrThreads_, sampleV.size());
+        for (size_t i = 1; i < nr; i++) {
+            const uint64_t addr = sampleV[i * sampleV.size() / nr];
+            if (addr > addrV_.back()) addrV_.push_back(addr);
+        }
     }
-};
-
-} // namespace walb_diff_merge_local
+    addrV_.push_back(UINT64_MAX);
+    isPrepared_ = true;
+}
 
-size_t DiffMerger::tryMoveToDiffMemory()
+bool ParallelDiffMerger::mergeToFd(int outFd, const CompressOpt &cmpr, const std::string &tmpDir,
+                                   const std::function<bool()> &shouldStop,
+                                   const std::function<bool(size_t)> &throttle)
 {
-    using Range = walb_diff_merge_local::Range;
-
-    size_t nr = 0;
-    uint64_t nextDoneAddr = UINT64_MAX;
-    uint64_t minAddr = UINT64_MAX;
-    if (wdiffs_.empty()) {
-        doneAddr_ = nextDoneAddr;
-        return 0;
-    }
-    WdiffPtrList::iterator it = wdiffs_.begin();
-    Range range(wdiffs_.front()->getFrontRec());
-    while (it != wdiffs_.end()) {
-        bool goNext = true;
-        Wdiff &wdiff = **it;
-        DiffRecord rec = wdiff.getFrontRec();
-        minAddr = std::min(minAddr, rec.io_address);
-        Range curRange(rec);
-        while (shouldMerge(rec, nextDoneAddr)) {
-            nr++;
-            curRange.merge(Range(rec));
-            AlignedArray buf;
-            wdiff.getAndRemoveIo(buf);
-            mergeIo(rec, std::move(buf));
-            if (wdiff.isEnd()) {
-                statIn_.update(wdiff.getStat());
-                it = wdiffs_.erase(it);
-                goNext = false;
-                break;
+    prepare();
+    cybozu::util::File outFile(outFd);
+    wdiffH_.type = ::WALB_DIFF_TYPE_SORTED;
+    wdiffH_.writeTo(outFile);
+
+    const size_t nr = nrRanges();
+    std::vector<std::unique_ptr<cybozu::TmpFile> > tmpFileV(nr);
+    for (size_t i = 1; i < nr; i++) {
+        tmpFileV[i].reset(new cybozu::TmpFile(tmpDir));
+    }
+    std::vector<DiffStatistics> statV(nr);
+    std::atomic<bool> isStopped(false);
+    run([&](size_t idx, DiffMerger &merger) {
+        cybozu::util::File file(idx == 0 ? outFd : tmpFileV[idx]->fd());
+        PackCompressor conv(cmpr.type, cmpr.level);
+        DiffPacker packer;
+        auto writePack = [&]() {
+            const AlignedArray pack = conv.convert(packer.getPackAsArray().data());
+            if (throttle && !throttle(pack.size())) {
+                isStopped = true;
+                return false;
+            }
+            statV[idx].update(*reinterpret_cast<const DiffPackHeader *>(pack.data()));
+            file.write(pack.data(), pack.size());
+            return true;
+        };
+        DiffRecIo recIo;
+        while (merger.getAndRemove(recIo)) {
+            if (isStopped || isFailed()) return;
+            if (shouldStop && shouldStop()) {
+                isStopped = true;
+                return;
             }
-            rec = wdiff.getFrontRec();
+            const DiffRecord &rec = recIo.record();
+            if (packer.add(rec, recIo.io().data())) continue;
+            if (!writePack()) return;
+            packer.add(rec, recIo.io().data());
         }
-        if (range.isOverlapped(curRange)) {
-            range.merge(curRange);
-        } else if (curRange.isLeftRight(range)) {
-            range = curRange;
-        } else {
-            assert(range.isLeftRight(curRange));
-            // do nothing
+        if (!packer.empty()) writePack();
+    });
+    if (isStopped) return false;
+
+    for (size_t i = 1; i < nr; i++) {
+        cybozu::util::File file(tmpFileV[i]->fd());
+        walb_diff_merge_local::copyFileData(file, outFile);
+        tmpFileV[i].reset();
+    }
+    writeDiffEofPack(outFile);
+
+    statOut_.clear();
+    for (const DiffStatistics &stat : statV) statOut_.update(stat);
+    statOut_.wdiffNr = 1;
+    return true;
+}
+
+DiffStatistics ParallelDiffMerger::statIn() const
+{
+    if (mergerV_.size() == 1) return mergerV_[0]->statIn();
+    return statIn_;
+}
+
+std::string ParallelDiffMerger::memUsageStr() const
+{
+    uint64_t blks = 0;
+    for (const std::unique_ptr<DiffMerger> &merger : mergerV_) {
+        if (merger) blks += merger->maxMemBlocks();
+    }
+    return cybozu::itoa(blks * LBS / KIBI) + "KiB";
+}
+
+cybozu::Uuid ParallelDiffMerger::scanWdiff(size_t idx, std::vector<uint64_t> &sampleV)
+{
+    cybozu::util::File file(pathV_[idx], O_RDONLY);
+    DiffFileHeader header;
+    header.readFrom(file);
+    if (nrThreads_ == 1) return header.getUuid();
+
+    if (header.isIndexed()) {
+        IndexedDiffCache cache;
+        IndexedDiffReader reader;
+        reader.setFile(std::move(file), cache);
+        IndexedDiffRecord rec;
+        size_t i = 0;
+        while (reader.readDiffRecord(rec, false)) {
+            /* As dense as one sample per pack of sorted wdiffs. */
+            if (i % MAX_N_RECORDS_IN_WALB_DIFF_PACK == 0) sampleV.push_back(rec.io_address);
+            i++;
         }
-        if (goNext) {
-            nextDoneAddr = std::min(nextDoneAddr, wdiff.currentAddress());
-            ++it;
+        statIn_.update(reader.getStat());
+    } else {
+        SortedDiffReader reader(std::move(file));
+        reader.dontReadHeader(false);
+        packPosVV_[idx] = reader.scanPacks();
+        for (const DiffPackPos &pos : packPosVV_[idx]) {
+            sampleV.push_back(pos.ioAddr);
         }
+        statIn_.update(reader.getStat());
     }
-    if (minAddr != UINT64_MAX) {
-        assert(minAddr == range.bgn);
-    }
-    searchLen_ = std::max(searchLen_, range.size());
-#if 0 // debug code
-    std::cout << "nr " << nr << " "
-              << "doneAddr_ " << doneAddr_ << " "
-              << "nextDoneAddr " << (nextDoneAddr == UINT64_MAX ? "-" : cybozu::itoa(nextDoneAddr)) << " "
-              << "searchLen_ " << searchLen_ << " "
-              << "minAddr " << minAddr << " "
-              << "range " << range << std::endl;
-#endif
-    doneAddr_ = nextDoneAddr;
-    return nr;
+    return header.getUuid();
 }
 
-bool DiffMerger::moveToMergedQueue()
+std::unique_ptr<DiffMerger> ParallelDiffMerger::createMerger(size_t idx) const
 {
-    if (diffMem_.empty()) return false;
-    DiffMemory::Map& map = diffMem_.getMap();
-    DiffMemory::Map::iterator i = map.begin();
-    while (i != map.end()) {
-        DiffRecIo& recIo = i->second;
-        if (recIo.record().endIoAddress() > doneAddr_) break;
-        mergedQ_.push(std::move(recIo));
-        diffMem_.eraseFromMap(i);
+    const uint64_t bgnAddr = addrV_[idx];
+    std::unique_ptr<DiffMerger> merger(new DiffMerger());
+    merger->setMaxIoBlocks(maxIoBlocks_);
+    merger->setShouldValidateUuid(shouldValidateUuid_);
+    merger->setPassThroughCmprType(passThroughType_);
+    merger->setAddressRange(bgnAddr, addrV_[idx + 1]);
+    for (size_t i = 0; i < pathV_.size(); i++) {
+        merger->addWdiff(pathV_[i], walb_diff_merge_local::getPackOffset(packPosVV_[i], bgnAddr));
     }
+    merger->prepare();
+    return merger;
+}
+
+void BoundedDiffMemory::prepare(int cmprType)
+{
+    if (isPrepared_) return;
+    isPrepared_ = true;
+    if (runV_.empty()) return;
+    if (!diffMem_.empty()) spill();
+    merger_.reset(new DiffMerger());
+    merger_->setPassThroughCmprType(cmprType);
+    for (const std::unique_ptr<cybozu::TmpFile> &run : runV_) {
+        merger_->addWdiff(run->path());
+    }
+    merger_->prepare();
+}
+
+bool BoundedDiffMemory::getAndRemove(DiffRecIo &recIo)
+{
+    assert(isPrepared_);
+    if (merger_) return merger_->getAndRemove(recIo);
+
+    DiffMemory::Map::iterator it = diffMem_.getMap().begin();
+    if (it == diffMem_.getMap().end()) return false;
+    recIo = std::move(it->second);
+    diffMem_.eraseFromMap(it);
     return true;
 }
 
-void DiffMerger::removeEndedWdiffs()
+void BoundedDiffMemory::writeTo(int outFd, int cmprType)
 {
-    WdiffPtrList::iterator it = wdiffs_.begin();
-    while (it != wdiffs_.end()) {
-        const Wdiff &wdiff = **it;
-        if (wdiff.isEnd()) {
-            statIn_.update(wdiff.getStat());
-            it = wdiffs_.erase(it);
+    if (runV_.empty()) {
+        diffMem_.writeTo(outFd, cmprType);
+        return;
+    }
+    prepare(cmprType);
+    SortedDiffWriter writer;
+    writer.setFd(outFd);
+    writer.writeHeader(diffMem_.header());
+    DiffRecIo d;
+    while (getAndRemove(d)) {
+        assert(d.isValid());
+        if (cmprType != ::WALB_DIFF_CMPR_NONE) {
+            writer.compressAndWriteDiff(d.record(), d.io().data(), cmprType);
         } else {
-            ++it;
+            DiffRecord rec = d.record();
+            rec.checksum = calcDiffIoChecksum(d.io());
+            writer.writeDiff(rec, d.io().data());
         }
     }
+    writer.close();
 }
 
-void DiffMerger::verifyUuid(const cybozu::Uuid &uuid) const
+void BoundedDiffMemory::spill()
 {
-    for (const WdiffPtr &wdiffP : wdiffs_) {
-        const cybozu::Uuid uuid1 = wdiffP->header().getUuid();
-        if (uuid1 != uuid) {
-            throw cybozu::Exception(__func__) << "uuid differ" << uuid1 << uuid;
-        }
-    }
+    std::unique_ptr<cybozu::TmpFile> run(new cybozu::TmpFile(tmpDir_));
+    diffMem_.writeTo(run->fd(), runCmprType_);
+    const DiffFileHeader header = diffMem_.header();
+    diffMem_.clear();
+    diffMem_.header() = header;
+    runV_.push_back(std::move(run));
 }
 
 } //namespace walb
@@ -10,7 +10,10 @@
 #include <string>
 #include <vector>
 #include <queue>
-#include <list>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <functional>
 #include <cassert>
 #include <cstring>
 
@@ -21,9 +24,91 @@
 #include "walb_diff_compressor.hpp"
 #include "host_info.hpp"
 #include "fileio.hpp"
+#include "tmp_file.hpp"
+#include "thread_util.hpp"
 
 namespace walb {
 
+/**
+ * Pass-through compression type to pass all the compressed IOs through DiffMerger.
+ */
+const int PASS_THROUGH_ALL_CMPR = -1;
+
+/**
+ * Tournament tree for k-way merge.
+ * Each leaf has the current address of an input stream (UINT64_MAX if ended).
+ * Each inner node has the index of the winner of its subtree,
+ * which has the smallest address (the smaller index on a tie).
+ * update(), min() and prefixMin() cost O(log k).
+ */
+class MergeTournamentTree
+{
+private:
+    size_t nr_; // number of leaves in use.
+    size_t width_; // number of leaves (power of 2).
+    std::vector<uint64_t> addrV_; // addrV_[i] is the key of leaf i.
+    std::vector<size_t> nodeV_; // nodeV_[1] is the root and nodeV_[width_ + i] is leaf i.
+
+public:
+    MergeTournamentTree() : nr_(0), width_(1), addrV_(), nodeV_() {
+    }
+    void init(size_t nr) {
+        nr_ = nr;
+        width_ = 1;
+        while (width_ < nr) width_ *= 2;
+        addrV_.assign(width_, UINT64_MAX);
+        nodeV_.resize(width_ * 2);
+        for (size_t i = 0; i < width_; i++) nodeV_[width_ + i] = i;
+        for (size_t i = width_ - 1; i > 0; i--) {
+            nodeV_[i] = winner(nodeV_[i * 2], nodeV_[i * 2 + 1]);
+        }
+    }
+    size_t size() const { return nr_; }
+    uint64_t addr(size_t idx) const { return addrV_[idx]; }
+    void update(size_t idx, uint64_t addr) {
+        assert(idx < nr_);
+        addrV_[idx] = addr;
+        size_t i = (width_ + idx) / 2;
+        while (i > 0) {
+            nodeV_[i] = winner(nodeV_[i * 2], nodeV_[i * 2 + 1]);
+            i /= 2;
+        }
+    }
+    /**
+     * RETURN:
+     *   the minimum address in all the leaves. idx will be set to its index.
+     */
+    uint64_t min(size_t &idx) const {
+        idx = nodeV_[1];
+        return addrV_[idx];
+    }
+    /**
+     * RETURN:
+     *   the minimum address in the leaves [0, end).
+     *   idx will be set to its index.
+     *   UINT64_MAX if end is 0.
+     */
+    uint64_t prefixMin(size_t end, size_t &idx) const {
+        assert(end <= nr_);
+        idx = SIZE_MAX;
+        size_t l = width_, r = width_ + end;
+        while (l < r) {
+            if (l & 1) idx = winner(idx, nodeV_[l++]);
+            if (r & 1) idx = winner(idx, nodeV_[--r]);
+            l /= 2;
+            r /= 2;
+        }
+        return idx == SIZE_MAX ? UINT64_MAX : addrV_[idx];
+    }
+private:
+    size_t winner(size_t i, size_t j) const {
+        if (i == SIZE_MAX) return j;
+        if (j == SIZE_MAX) return i;
+        if (addrV_[j] < addrV_[i] || (addrV_[j] == addrV_[i] && j < i)) return j;
+        return i;
+    }
+};
+
 /**
  * To merge walb diff files.
  *
@@ -46,11 +131,16 @@ private:
         mutable AlignedArray buf_;
         mutable bool isFilled_;
         mutable bool isEnd_;
+        int passThroughType_;
+        uint64_t bgnAddr_;
+        uint64_t endAddr_;
 
     public:
         constexpr static const char *NAME = "DiffMerger::Wdiff";
         Wdiff() : sReader_(), iReader_(), isIndexed_(false)
-                , header_(), rec_(), buf_(), isFilled_(false), isEnd_(false) {
+                , header_(), rec_(), buf_(), isFilled_(false), isEnd_(false)
+                , passThroughType_(::WALB_DIFF_CMPR_NONE)
+                , bgnAddr_(0), endAddr_(UINT64_MAX) {
         }
         void open(const std::string &wdiffPath, IndexedDiffCache *cache) {
             setFile(cybozu::util::File(wdiffPath, O_RDONLY), cache);
@@ -62,6 +152,22 @@ private:
         void setFile(cybozu::util::File &&file, IndexedDiffCache *cache);
 
         const DiffFileHeader &header() const { return header_; }
+        /**
+         * IOs compressed with the type will not be uncompressed.
+         * PASS_THROUGH_ALL_CMPR means any compression type.
+         * Call this before reading IOs.
+         */
+        void setPassThroughCmprType(int type) { passThroughType_ = type; }
+        bool shouldPassThrough(int type) const {
+            if (type == ::WALB_DIFF_CMPR_NONE) return false;
+            return passThroughType_ == PASS_THROUGH_ALL_CMPR || type == passThroughType_;
+        }
+        /**
+         * IOs out of [bgnAddr, endAddr) will be skipped and IOs crossing them will be clipped.
+         * @packOffset pack position to start for sorted wdiffs (0 means the first pack).
+         * Call this before reading IOs.
+         */
+        void setAddressRange(uint64_t bgnAddr, uint64_t endAddr, uint64_t packOffset);
         DiffRecord getFrontRec() const {
             verifyNotEnd(__func__);
             fill();
@@ -92,6 +198,7 @@ private:
         }
     private:
         void fill() const;
+        bool readSortedDiff() const;
         bool readIndexedDiff() const;
 #ifdef DEBUG
         void verifyNotEnd(const char *msg) const {
@@ -108,17 +215,23 @@ private:
 #endif
     };
     bool shouldValidateUuid_;
+    int passThroughType_;
+    uint64_t bgnAddr_;
+    uint64_t endAddr_;
 
     DiffFileHeader wdiffH_;
     bool isHeaderPrepared_;
 
     using WdiffPtr = std::unique_ptr<Wdiff>;
-    using WdiffPtrList = std::list<WdiffPtr>;
-    WdiffPtrList wdiffs_;
+    using WdiffPtrVec = std::vector<WdiffPtr>;
+    WdiffPtrVec wdiffs_; // older wdiff has smaller index. ended wdiffs are reset.
+    std::vector<uint64_t> packOffsetV_; // packOffsetV_[i] is for wdiffs_[i].
+    MergeTournamentTree tree_;
+    std::vector<size_t> blockedV_;
     DiffMemory diffMem_;
     std::queue<DiffRecIo> mergedQ_;
     uint64_t doneAddr_;
-    size_t searchLen_;
+    uint64_t maxMemBlocks_;
     IndexedDiffCache cache_; // shared by indexed diff files.
 
     /**
@@ -126,20 +239,19 @@ private:
      * then added to diffMem_ (and merged inside it),
      * then pushed to mergedQ_ finally.
      *
-     * The point of the algorithm is which wdiff will be chosen to get recIos.
+     * tree_ keeps the current address of each wdiff stream.
+     * The stream with the minimum address is chosen first,
+     * but its front IO can be added to diffMem_ only if
+     * no older stream has an unread IO overlapping it,
+     * that is, the minimum current address among older streams is >= its end address.
+     * Otherwise the older stream that blocks it is processed first.
      * See moveToDiffMemory() for detail.
      *
      * doneAddr_ is the minimum address in all the input wdiff streams.
      * There is no overlapped IOs which endAddr is <= doneAddr in all the streams.
      * so such IOs in diffMem_ can be put out safely.
      *
-     * searchLen_ is required length [block size] as a buffer to merge wdiffs.
-     * Ex. with the following diffs, we need to merge them at once.
-     *
-     * diff2     XXXXX
-     * diff1        XXXXX
-     * diff0          XXXXX
-     * required  <-------->
+     * maxMemBlocks_ is the peak size of diffMem_ [logical block].
      */
 
     /**
@@ -150,15 +262,21 @@ private:
     mutable DiffStatistics statIn_, statOut_;
 
 public:
-    explicit DiffMerger(size_t initSearchLen = DEFAULT_MERGE_BUFFER_LB)
+    DiffMerger()
         : shouldValidateUuid_(false)
+        , passThroughType_(::WALB_DIFF_CMPR_NONE)
+        , bgnAddr_(0)
+        , endAddr_(UINT64_MAX)
         , wdiffH_()
         , isHeaderPrepared_(false)
         , wdiffs_()
+        , packOffsetV_()
+        , tree_()
+        , blockedV_()
         , diffMem_()
         , mergedQ_()
         , doneAddr_(0)
-        , searchLen_(initSearchLen)
+        , maxMemBlocks_(0)
         , statIn_(), statOut_() {
     }
     void setMaxIoBlocks(uint32_t maxIoBlocks) {
@@ -173,13 +291,38 @@ public:
     void setMaxCacheSize(size_t bytes) {
         cache_.setMaxSize(bytes);
     }
+    /**
+     * IOs compressed with the type in the input wdiffs will be got by getAndRemove()
+     * as they are, unless they must be split or are partially overwritten.
+     * Their checksums are of the compressed data.
+     * ::WALB_DIFF_CMPR_NONE (default) means all IOs are uncompressed,
+     * and PASS_THROUGH_ALL_CMPR means IOs compressed with any type are passed through.
+     * Call this before prepare().
+     */
+    void setPassThroughCmprType(int type) {
+        assert(!isHeaderPrepared_);
+        passThroughType_ = type;
+    }
+    /**
+     * Get only IOs in [bgnLb, endLb). IOs crossing the boundaries will be clipped.
+     * Call this before prepare().
+     */
+    void setAddressRange(uint64_t bgnLb, uint64_t endLb) {
+        assert(!isHeaderPrepared_);
+        assert(bgnLb < endLb);
+        bgnAddr_ = bgnLb;
+        endAddr_ = endLb;
+    }
     /**
      * Add a diff file.
      * Newer wdiff file must be added later.
+     * @packOffset for a sorted wdiff, position of the pack to start reading got by
+     *   SortedDiffReader::scanPacks(). It must not be after IOs in the address range.
      */
-    void addWdiff(const std::string& wdiffPath) {
+    void addWdiff(const std::string& wdiffPath, uint64_t packOffset = 0) {
         wdiffs_.emplace_back(new Wdiff());
         wdiffs_.back()->open(wdiffPath, &cache_);
+        packOffsetV_.push_back(packOffset);
     }
     /**
      * Add diff files.
@@ -193,6 +336,7 @@ public:
         for (cybozu::util::File &file : fileV) {
             wdiffs_.emplace_back(new Wdiff());
             wdiffs_.back()->setFile(std::move(file), &cache_);
+            packOffsetV_.push_back(0);
         }
         fileV.clear();
     }
@@ -234,27 +378,21 @@ public:
         return statOut_;
     }
     std::string memUsageStr() const {
-        return cybozu::itoa(searchLen_ * LBS / KIBI) + "KiB";
+        return cybozu::itoa(maxMemBlocks_ * LBS / KIBI) + "KiB";
     }
+    uint64_t maxMemBlocks() const { return maxMemBlocks_; }
 private:
-    uint64_t getMinimumAddr() const;
-    void moveToDiffMemory();
-
     /**
-     * Try to get Ios from wdiffs and add to wdiffMem_.
-     *
+     * Move at least one IO from wdiffs to diffMem_ if exists.
      * minimum current address among wdiffs will be set to doneAddr_.
      * UINT64_MAX if there is no wdiffs.
-     *
-     * RETURN:
-     *   the number of merged IOs.
      */
-    size_t tryMoveToDiffMemory();
-
-    bool shouldMerge(const DiffRecord& rec, uint64_t minAddr) const {
-        return (rec.io_address < doneAddr_ + searchLen_)
-            && (rec.endIoAddress() <= minAddr);
-    }
+    void moveToDiffMemory();
+    /**
+     * Move the front IO of wdiffs_[idx] to diffMem_ and update tree_.
+     */
+    void moveFrontIo(size_t idx);
+    void updateTree(size_t idx);
     /**
      * Move all IOs which ioAddress + ioBlocks <= doneAddr
      * from diffMem_ to the mergedQ_.
@@ -263,14 +401,290 @@ private:
      *   false if there is no Io to move.
      */
     bool moveToMergedQueue();
-    void removeEndedWdiffs();
 
     void mergeIo(const DiffRecord &rec, AlignedArray &&buf) {
-        assert(!rec.isCompressed());
         diffMem_.add(rec, std::move(buf));
     }
 
     void verifyUuid(const cybozu::Uuid &uuid) const;
 };
 
+/**
+ * Read merged IOs ahead and uncompress them with worker threads.
+ *
+ * A reader thread gets IOs from a prepared merger and worker threads uncompress them,
+ * so the consumer thread gets uncompressed IOs in the same order as the merger
+ * without reading or uncompressing them by itself.
+ * The merger should pass compressed IOs through (PASS_THROUGH_ALL_CMPR),
+ * otherwise the reader thread uncompresses them.
+ * With no worker thread, IOs are got from the merger and uncompressed in the consumer thread.
+ */
+class DiffRecIoPrefetcher /* final */
+{
+private:
+    DiffMerger &merger_;
+    std::mutex mu_;
+    std::string workerErr_; // the first error in the worker threads.
+    cybozu::thread::ParallelConverter<DiffRecIo, DiffRecIo> pconv_;
+    cybozu::thread::ThreadRunner reader_;
+    bool isStarted_;
+
+public:
+    constexpr static const char *NAME = "DiffRecIoPrefetcher";
+    explicit DiffRecIoPrefetcher(DiffMerger &merger)
+        : merger_(merger)
+        , mu_(), workerErr_()
+        , pconv_([this](DiffRecIo &&recIo) {
+                try {
+                    recIo.uncompress();
+                } catch (std::exception &e) {
+                    setWorkerError(recIo.record().toStr() + " " + e.what());
+                    throw;
+                }
+                return std::move(recIo);
+            })
+        , reader_(), isStarted_(false) {
+    }
+    ~DiffRecIoPrefetcher() noexcept {
+        pconv_.fail();
+        reader_.joinNoThrow();
+    }
+    /**
+     * @nrThreads number of threads to uncompress IOs. 0 means no prefetch.
+     */
+    void start(size_t nrThreads);
+    /**
+     * Get an uncompressed DiffRecIo.
+     * An error in the reader or worker threads will be thrown.
+     * RETURN:
+     *   false if there is no diffIo anymore.
+     */
+    bool getAndRemove(DiffRecIo &recIo);
+private:
+    void setWorkerError(const std::string &err) {
+        std::lock_guard<std::mutex> lk(mu_);
+        if (workerErr_.empty()) workerErr_ = err;
+    }
+    std::string getWorkerError() {
+        std::lock_guard<std::mutex> lk(mu_);
+        return workerErr_;
+    }
+};
+
+/**
+ * To merge walb diff files with multiple threads.
+ *
+ * The address space is split into ranges with similar number of IOs,
+ * and each range is merged by its own DiffMerger in its own thread.
+ * Merged IOs are sorted by address in each range and ranges are in address order,
+ * so outputs of the ranges can be concatenated in order.
+ * With one thread, there is only one range and no thread is created.
+ *
+ * Usage:
+ *   (1) call setters if necessary.
+ *   (2) add wdiffs by calling addWdiff() or addWdiffs().
+ *   (3a) call mergeToFd() to write out the merged diff data.
+ *   (3b) call prepare(), then call run() to consume IOs of each range for other purpose.
+ */
+class ParallelDiffMerger /* final */
+{
+private:
+    size_t nrThreads_;
+    uint32_t maxIoBlocks_;
+    bool shouldValidateUuid_;
+    int passThroughType_;
+
+    std::vector<cybozu::util::File> fileV_; // to keep them opened.
+    StrVec pathV_;
+    std::vector<std::vector<DiffPackPos> > packPosVV_; // empty for indexed wdiffs.
+    std::vector<uint64_t> addrV_; // range i is [addrV_[i], addrV_[i + 1]).
+
+    DiffFileHeader wdiffH_;
+    bool isPrepared_;
+    std::vector<std::unique_ptr<DiffMerger> > mergerV_;
+    std::atomic<bool> isFailed_;
+
+    /**
+     * statIn_ is got by scanning input wdiffs when there are multiple ranges.
+     */
+    DiffStatistics statIn_, statOut_;
+
+public:
+    explicit ParallelDiffMerger(size_t nrThreads = 1)
+        : nrThreads_(std::max<size_t>(nrThreads, 1))
+        , maxIoBlocks_(DEFAULT_MAX_IO_LB)
+        , shouldValidateUuid_(false)
+        , passThroughType_(::WALB_DIFF_CMPR_NONE)
+        , fileV_(), pathV_(), packPosVV_(), addrV_()
+        , wdiffH_(), isPrepared_(false), mergerV_(), isFailed_(false)
+        , statIn_(), statOut_() {
+    }
+    void setMaxIoBlocks(uint32_t maxIoBlocks) { maxIoBlocks_ = maxIoBlocks; }
+    void setShouldValidateUuid(bool shouldValidateUuid) { shouldValidateUuid_ = shouldValidateUuid; }
+    void setPassThroughCmprType(int type) { passThroughType_ = type; }
+    /**
+     * Newer wdiff file must be added later.
+     */
+    void addWdiff(const std::string& wdiffPath) {
+        pathV_.push_back(wdiffPath);
+    }
+    void addWdiffs(const StrVec &wdiffPaths) {
+        for (const std::string &s : wdiffPaths) {
+            addWdiff(s);
+        }
+    }
+    /**
+     * Each thread opens the files again through /proc/self/fd.
+     */
+    void addWdiffs(std::vector<cybozu::util::File> &&fileV) {
+        for (cybozu::util::File &file : fileV) {
+            pathV_.push_back("/proc/self/fd/" + cybozu::itoa(file.fd()));
+            fileV_.push_back(std::move(file));
+        }
+        fileV.clear();
+    }
+    /**
+     * Read headers and decide the address ranges.
+     */
+    void prepare();
+    size_t nrRanges() const {
+        assert(isPrepared_);
+        return addrV_.size() - 1;
+    }
+    const DiffFileHeader &header() const {
+        assert(isPrepared_);
+        return wdiffH_;
+    }
+    /**
+     * Call func(idx, merger) for each range in parallel.
+     * merger is prepared and gives IOs in the range idx.
+     * The first exception thrown by func will be rethrown after all the threads end.
+     * func should check isFailed() periodically to stop early.
+     */
+    template <typename Func>
+    void run(Func&& func) {
+        prepare();
+        const size_t nr = nrRanges();
+        mergerV_.clear();
+        mergerV_.resize(nr);
+        auto worker = [&](size_t idx) {
+            try {
+                mergerV_[idx] = createMerger(idx);
+                func(idx, *mergerV_[idx]);
+            } catch (...) {
+                isFailed_ = true;
+                throw;
+            }
+        };
+        if (nr == 1) {
+            worker(0);
+            return;
+        }
+        cybozu::thread::ThreadRunnerSet thS;
+        for (size_t i = 0; i < nr; i++) {
+            thS.add([&worker, i]() { worker(i); });
+        }
+        thS.start();
+        std::vector<std::exception_ptr> epV = thS.join();
+        if (!epV.empty()) std::rethrow_exception(epV.front());
+    }
+    bool isFailed() const { return isFailed_; }
+    /**
+     * Merge input wdiff files and put them into output fd.
+     * Outputs of the ranges except the first one are written to
+     * temporary files in tmpDir, then copied to the output fd.
+     * IOs are compressed by the thread of each range, so cmpr.numCpu is not used.
+     * throttle, if given, is called with the size of each pack before it is written,
+     * and it may block to limit the write rate.
+     *
+     * RETURN:
+     *   false if shouldStop() returned true or throttle() returned false.
+     */
+    bool mergeToFd(int outFd, const CompressOpt &cmpr, const std::string &tmpDir,
+                   const std::function<bool()> &shouldStop = nullptr,
+                   const std::function<bool(size_t)> &throttle = nullptr);
+
+    /**
+     * Call these after all the IOs are got.
+     */
+    DiffStatistics statIn() const;
+    const DiffStatistics& statOut() const { return statOut_; }
+    std::string memUsageStr() const;
+private:
+    /**
+     * Read the header of a wdiff.
+     * With multiple threads, get addresses of IOs (sampled) and pack positions, and update statIn_.
+     */
+    cybozu::Uuid scanWdiff(size_t idx, std::vector<uint64_t> &sampleV);
+    std::unique_ptr<DiffMerger> createMerger(size_t idx) const;
+};
+
+/**
+ * In-memory walb diff with a memory budget.
+ *
+ * When IO data in memory exceed the budget, all the IOs are written to
+ * a temporary file as a sorted run and the memory is cleared.
+ * At the end, the runs are merged by DiffMerger where newer runs overwrite older ones,
+ * so the peak memory usage is about the budget plus the merge buffer.
+ * Without any run, IOs are got from the memory directly.
+ * This is for wlog coalescing only. DiffMerger does not spill
+ * because diffMem_ of it holds only unsettled IOs.
+ *
+ * Usage:
+ *   (1) call setMaxIoBlocks() if necessary, and set header().
+ *   (2) call add() multiple times.
+ *   (3a) call writeTo() to write out the diff.
+ *   (3b) call prepare(), then call getAndRemove() multiple times for other purpose.
+ */
+class BoundedDiffMemory /* final */
+{
+private:
+    DiffMemory diffMem_;
+    uint64_t maxBytes_;
+    std::string tmpDir_;
+    int runCmprType_;
+    std::vector<std::unique_ptr<cybozu::TmpFile> > runV_; // older run has smaller index.
+    std::unique_ptr<DiffMerger> merger_;
+    bool isPrepared_;
+
+public:
+    /**
+     * @maxBytes budget of IO data in memory [byte]. 0 means unlimited.
+     * @tmpDir directory to put runs. It is required if maxBytes is not 0.
+     * @runCmprType IOs in runs are compressed with the type.
+     *   They will be got by getAndRemove() as they are unless they are split or partially overwritten.
+     */
+    explicit BoundedDiffMemory(uint64_t maxBytes = 0, const std::string &tmpDir = "",
+                               int runCmprType = ::WALB_DIFF_CMPR_SNAPPY)
+        : diffMem_(), maxBytes_(maxBytes), tmpDir_(tmpDir), runCmprType_(runCmprType)
+        , runV_(), merger_(), isPrepared_(false) {
+        if (maxBytes_ > 0 && tmpDir_.empty()) {
+            throw cybozu::Exception("BoundedDiffMemory") << "tmpDir is required";
+        }
+    }
+    void setMaxIoBlocks(uint32_t maxIoBlocks) { diffMem_.setMaxIoBlocks(maxIoBlocks); }
+    DiffFileHeader& header() { return diffMem_.header(); }
+    void add(const DiffRecord& rec, AlignedArray &&buf) {
+        assert(!isPrepared_);
+        diffMem_.add(rec, std::move(buf));
+        if (maxBytes_ > 0 && diffMem_.getDataSize() > maxBytes_) spill();
+    }
+    bool empty() const { return diffMem_.empty() && runV_.empty(); }
+    size_t nrRuns() const { return runV_.size(); }
+    /**
+     * Spill the remaining IOs if there are runs, and prepare the merger.
+     * @cmprType IOs compressed with the type in runs will be got as they are.
+     */
+    void prepare(int cmprType = ::WALB_DIFF_CMPR_NONE);
+    /**
+     * Get a DiffRecIo in address order and remove it.
+     * RETURN:
+     *   false if there is no diffIo anymore.
+     */
+    bool getAndRemove(DiffRecIo &recIo);
+    void writeTo(int outFd, int cmprType = ::WALB_DIFF_CMPR_SNAPPY);
+private:
+    void spill();
+};
+
 } //namespace walb
@@ -146,4 +146,162 @@ void VirtualFullScanner::fillDiffIo()
     }
 }
 
+
+void VirtualSnapshotReader::init(
+    cybozu::util::File&& baseFile, uint64_t sizeLb,
+    std::vector<cybozu::util::File> &&fileV, size_t cacheSize)
+{
+    baseFile_ = std::move(baseFile);
+    baseSizeLb_ = baseFile_.lseek(0, SEEK_END) / LOGICAL_BLOCK_SIZE;
+    sizeLb_ = sizeLb;
+    fileV_ = std::move(fileV);
+    index_.clear();
+    cache_.clear();
+    cache_.setMaxSize(cacheSize);
+    statIn_.clear();
+
+    for (size_t i = 0; i < fileV_.size(); i++) {
+        cybozu::util::File &file = fileV_[i];
+        DiffFileHeader head;
+        file.lseek(0);
+        head.readFrom(file);
+        if (head.isIndexed()) {
+            addIndexedDiff(i);
+        } else {
+            addSortedDiff(i);
+        }
+        statIn_.wdiffNr++;
+    }
+}
+
+void VirtualSnapshotReader::read(uint64_t addr, uint64_t blks, void *data)
+{
+    if (addr + blks > sizeLb_) {
+        throw cybozu::Exception(NAME) << "out of range" << addr << blks << sizeLb_;
+    }
+    char *p = (char *)data;
+    const uint64_t endAddr = addr + blks;
+    for (const IndexedDiffRecord &rec : index_.getOverlapped(addr, endAddr)) {
+        const uint64_t bgn = std::max(addr, rec.io_address);
+        const uint64_t end = std::min(endAddr, rec.endIoAddress());
+        if (addr < bgn) readBase(addr, bgn - addr, p);
+        char *q = p + (bgn - addr) * LOGICAL_BLOCK_SIZE;
+        const size_t size = (end - bgn) * LOGICAL_BLOCK_SIZE;
+        if (rec.isNormal()) {
+            IndexedDiffRecord r = rec;
+            r.io_offset += bgn - rec.io_address;
+            r.io_address = bgn;
+            r.io_blocks = end - bgn;
+            readDiffIo(r, q);
+        } else {
+            /* Read zero image for both ALL_ZERO and DISCARD. */
+            ::memset(q, 0, size);
+        }
+        p = q + size;
+        addr = end;
+    }
+    if (addr < endAddr) readBase(addr, endAddr - addr, p);
+}
+
+void VirtualSnapshotReader::addIndexedDiff(uint32_t fileIdx)
+{
+    cybozu::util::File &file = fileV_[fileIdx];
+    DiffIndexSuper super;
+    const uint64_t superOffset = file.lseek(0, SEEK_END) - sizeof(super);
+    file.pread(&super, sizeof(super), superOffset);
+    super.verify();
+    if (superOffset < super.index_offset ||
+        (superOffset - super.index_offset) % sizeof(IndexedDiffRecord) != 0) {
+        throw cybozu::Exception(NAME) << "invalid index" << fileIdx << super.index_offset << superOffset;
+    }
+    statIn_.dataSize += super.index_offset - sizeof(DiffFileHeader);
+
+    const size_t nrRecs = (superOffset - super.index_offset) / sizeof(IndexedDiffRecord);
+    const size_t maxRecs = 4096;
+    std::vector<IndexedDiffRecord> recV;
+    file.lseek(super.index_offset);
+    for (size_t i = 0; i < nrRecs; i += maxRecs) {
+        recV.resize(std::min(maxRecs, nrRecs - i));
+        file.read(recV.data(), recV.size() * sizeof(IndexedDiffRecord));
+        for (IndexedDiffRecord &rec : recV) {
+            rec.verify();
+            statIn_.update(rec);
+            addRecord(rec, fileIdx);
+        }
+    }
+}
+
+void VirtualSnapshotReader::addSortedDiff(uint32_t fileIdx)
+{
+    cybozu::util::File &file = fileV_[fileIdx];
+    AlignedArray packBuf(WALB_DIFF_PACK_SIZE, false);
+    DiffPackHeader &pack = *reinterpret_cast<DiffPackHeader *>(packBuf.data());
+    for (;;) {
+        const uint64_t packOffset = file.lseek(0, SEEK_CUR);
+        try {
+            pack.readFrom(file);
+        } catch (cybozu::util::EofError &) {
+            break;
+        }
+        if (pack.isEnd()) break;
+        statIn_.update(pack);
+        for (size_t i = 0; i < pack.n_records; i++) {
+            const DiffRecord &dRec = pack[i];
+            IndexedDiffRecord rec;
+            rec.init();
+            rec.io_address = dRec.io_address;
+            rec.io_blocks = dRec.io_blocks;
+            rec.flags = dRec.flags;
+            if (dRec.isNormal()) {
+                rec.compression_type = dRec.compression_type;
+                rec.data_offset = packOffset + WALB_DIFF_PACK_SIZE + dRec.data_offset;
+                rec.data_size = dRec.data_size;
+                rec.orig_blocks = dRec.io_blocks;
+                rec.io_checksum = dRec.checksum;
+            }
+            addRecord(rec, fileIdx);
+        }
+        file.lseek(pack.total_size, SEEK_CUR);
+    }
+}
+
+void VirtualSnapshotReader::addRecord(IndexedDiffRecord &rec, uint32_t fileIdx)
+{
+    if (rec.endIoAddress() > sizeLb_) {
+        throw cybozu::Exception(NAME) << "IO out of range" << rec << sizeLb_;
+    }
+    rec.reserved2 = fileIdx;
+    rec.updateRecChecksum();
+    index_.add(rec);
+}
+
+void VirtualSnapshotReader::readBase(uint64_t addr, uint64_t blks, char *data)
+{
+    uint64_t blks0 = 0;
+    if (addr < baseSizeLb_) {
+        blks0 = std::min(blks, baseSizeLb_ - addr);
+        baseFile_.pread(data, blks0 * LOGICAL_BLOCK_SIZE, addr * LOGICAL_BLOCK_SIZE);
+    }
+    ::memset(data + blks0 * LOGICAL_BLOCK_SIZE, 0, (blks - blks0) * LOGICAL_BLOCK_SIZE);
+}
+
+void VirtualSnapshotReader::readDiffIo(const IndexedDiffRecord &rec, char *data)
+{
+    const IndexedDiffCache::Key key{&fileV_[rec.reserved2], rec.data_offset};
+    AlignedArray *aryPtr = cache_.find(key);
+    if (aryPtr == nullptr) {
+        AlignedArray buf(rec.data_size, false);
+        fileV_[rec.reserved2].pread(buf.data(), buf.size(), rec.data_offset);
+        if (cybozu::util::calcChecksum(buf.data(), buf.size(), 0) != rec.io_checksum) {
+            throw cybozu::Exception(NAME) << "IO data invalid" << rec;
+        }
+        std::unique_ptr<AlignedArray> p(new AlignedArray(rec.orig_blocks * LOGICAL_BLOCK_SIZE, false));
+        uncompressData(buf.data(), buf.size(), *p, rec.compression_type);
+        aryPtr = p.get();
+        cache_.add(key, std::move(p));
+    }
+    ::memcpy(data, aryPtr->data() + rec.io_offset * LOGICAL_BLOCK_SIZE,
+             rec.io_blocks * LOGICAL_BLOCK_SIZE);
+}
+
 } //namespace walb
@@ -140,4 +140,65 @@ private:
     }
 };
 
+
+/**
+ * Random access reader of a virtual full image.
+ *
+ * init() indexes all the diff records in memory without reading IO data.
+ * read() fills the data from the base image and the wdiff files,
+ * where uncompressed IO images are kept in a LRU cache.
+ * Both sorted and indexed wdiff files are supported.
+ */
+class VirtualSnapshotReader /* final */
+{
+private:
+    cybozu::util::File baseFile_;
+    uint64_t baseSizeLb_;
+    uint64_t sizeLb_;
+    std::vector<cybozu::util::File> fileV_;
+    DiffIndexMem index_; /* reserved2 of each record is the index of fileV_. */
+    IndexedDiffCache cache_;
+    DiffStatistics statIn_;
+
+public:
+    static constexpr const char *NAME = "VirtualSnapshotReader";
+    VirtualSnapshotReader()
+        : baseFile_(), baseSizeLb_(0), sizeLb_(0)
+        , fileV_(), index_(), cache_(), statIn_() {
+    }
+    /**
+     * @baseFile base image. It must be seekable.
+     * @sizeLb image size [logical block].
+     *   Blocks beyond the base image will be read as zero unless wdiffs have them.
+     * @fileV wdiff files sorted by time (the oldest first).
+     * @cacheSize max size of uncompressed IO images to keep [byte].
+     */
+    void init(cybozu::util::File&& baseFile, uint64_t sizeLb,
+              std::vector<cybozu::util::File> &&fileV, size_t cacheSize);
+    /**
+     * @addr [logical block]
+     * @blks [logical block]
+     * @data buffer to be filled. Its size must be blks * LOGICAL_BLOCK_SIZE.
+     */
+    void read(uint64_t addr, uint64_t blks, void *data);
+
+    /**
+     * RETURN:
+     *   true if the range is read from the base image only.
+     */
+    bool isBaseOnly(uint64_t addr, uint64_t blks) const {
+        return addr + blks <= baseSizeLb_ && index_.getOverlapped(addr, addr + blks).empty();
+    }
+
+    uint64_t sizeLb() const { return sizeLb_; }
+    size_t nrRecords() const { return index_.size(); }
+    const DiffStatistics& statIn() const { return statIn_; }
+private:
+    void addIndexedDiff(uint32_t fileIdx);
+    void addSortedDiff(uint32_t fileIdx);
+    void addRecord(IndexedDiffRecord &rec, uint32_t fileIdx);
+    void readBase(uint64_t addr, uint64_t blks, char *data);
+    void readDiffIo(const IndexedDiffRecord &rec, char *data);
+};
+
 } //namespace walb
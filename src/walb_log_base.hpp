@@ -367,32 +367,50 @@ inline bool readLogPackHeader(Reader &reader, LogPackHeader &packH, uint64_t lsi
 
 
 /**
+ * Read log IO data without verification.
  * data size will be multiples of physical blocks.
  * padding IO data will also be set.
  */
 template <typename Reader>
-inline bool readLogIo(Reader &reader, const LogPackHeader &packH, size_t idx, AlignedArray &data)
+inline void readLogIoData(Reader &reader, const LogPackHeader &packH, size_t idx, AlignedArray &data)
 {
     const WlogRecord &lrec = packH.record(idx);
-    if (!lrec.hasData()) return true;
+    if (!lrec.hasData()) return;
 
-    // Read.
     const uint32_t pbs = packH.pbs();
     const size_t ioSizePb = lrec.ioSizePb(pbs);
     data.resize(ioSizePb * pbs);
     reader.read(data.data(), data.size()); // physical blocks.
-    if (!lrec.hasDataForChecksum()) {
-        assert(lrec.isPadding());
-        // keep padding data.
-        return true;
-    }
+}
 
-    // checksum.
+/**
+ * RETURN:
+ *   true if the checksum of the log IO data is valid.
+ *   Records without checksum (discard/padding) are always valid.
+ */
+inline bool verifyLogIoChecksum(const WlogRecord &lrec, const char *data, uint32_t salt)
+{
+    if (!lrec.hasDataForChecksum()) return true;
     const size_t ioSizeB = lrec.ioSizeLb() * LOGICAL_BLOCK_SIZE;
-    const uint32_t csum = cybozu::util::calcChecksum(data.data(), ioSizeB, packH.salt());
+    const uint32_t csum = cybozu::util::calcChecksum(data, ioSizeB, salt);
     return lrec.checksum == csum;
 }
 
+/**
+ * data size will be multiples of physical blocks.
+ * padding IO data will also be set.
+ */
+template <typename Reader>
+inline bool readLogIo(Reader &reader, const LogPackHeader &packH, size_t idx, AlignedArray &data)
+{
+    const WlogRecord &lrec = packH.record(idx);
+    if (!lrec.hasData()) return true;
+
+    readLogIoData(reader, packH, idx, data);
+    // padding data is kept and not verified.
+    return verifyLogIoChecksum(lrec, data.data(), packH.salt());
+}
+
 /**
  * Read all lob IOs corresponding to a logpack.
  * PackH will be shrinked (and may be empty) if a read IO data is invalid.
@@ -5,8 +5,7 @@ namespace walb {
 void WlogSender::process(CompressedData& cd, bool doCompress) try
 {
     if (doCompress) cd.compress();
-    ctrl_.next();
-    cd.send(packet_);
+    cd.send(packet_, true); // with ctrl_.next().
 } catch (std::exception& e) {
     try {
         packet::StreamControl(packet_.sock()).error();
@@ -40,6 +39,96 @@ void WlogSender::verifyPbsAndSalt(const LogPackHeader &header) const
 }
 
 
+void WlogPipelineSender::start(size_t concurrency)
+{
+    pconv_.start(concurrency);
+    sendTh_.set([this]() { runSender(); });
+    sendTh_.start();
+}
+
+void WlogPipelineSender::pushHeader(const LogPackHeader &header)
+{
+    sender_.verifyPbsAndSalt(header);
+    Task task;
+    task.data.resize(pbs_, false);
+    ::memcpy(task.data.data(), header.rawData(), pbs_);
+    task.lsid = header.logpackLsid();
+    task.recIdx = 0;
+    task.isHeader = true;
+    push(std::move(task));
+}
+
+void WlogPipelineSender::pushIo(const LogPackHeader &header, uint16_t recIdx, AlignedArray &&data)
+{
+    sender_.verifyPbsAndSalt(header);
+    const WlogRecord &rec = header.record(recIdx);
+    if (!rec.hasData()) return;
+
+    const size_t size = rec.ioSizePb(pbs_) * pbs_;
+    if (data.size() != size) {
+        throw cybozu::Exception(NAME()) << "invalid IO data size" << rec << data.size() << size;
+    }
+    Task task;
+    task.data = std::move(data);
+    task.rec = rec;
+    task.lsid = header.logpackLsid();
+    task.recIdx = recIdx;
+    task.isHeader = false;
+    push(std::move(task));
+}
+
+void WlogPipelineSender::sync()
+{
+    try {
+        pconv_.sync();
+    } catch (...) {
+        pconv_.fail();
+        sendTh_.join(); // throw the error of the sender thread if exists.
+        throw;
+    }
+    sendTh_.join();
+}
+
+void WlogPipelineSender::push(Task &&task)
+{
+    try {
+        pconv_.push(std::move(task));
+    } catch (...) {
+        pconv_.fail();
+        sendTh_.join(); // throw the error of the sender thread if exists.
+        throw;
+    }
+}
+
+/**
+ * Called by worker threads.
+ */
+WlogPipelineSender::Result WlogPipelineSender::convert(Task &&task)
+{
+    Result res;
+    res.lsid = task.lsid;
+    res.recIdx = task.recIdx;
+    res.isValid = task.isHeader || verifyLogIoChecksum(task.rec, task.data.data(), salt_);
+    if (res.isValid) res.cd.compressFrom(std::move(task.data));
+    return res;
+}
+
+void WlogPipelineSender::runSender() try
+{
+    Result res;
+    while (pconv_.pop(res)) {
+        if (!res.isValid) {
+            throw cybozu::Exception(NAME()) << "invalid logpack IO" << res.lsid << res.recIdx;
+        }
+        sender_.process(res.cd, false);
+    }
+    sender_.sync();
+} catch (...) {
+    pconv_.fail();
+    throw;
+}
+
+
 bool WlogReceiver::process(CompressedData& cd)
 {
     if (ctrl_.isNext()) {
@@ -65,10 +65,80 @@ public:
     void sync() {
         ctrl_.end();
     }
-private:
     void verifyPbsAndSalt(const LogPackHeader &header) const;
 };
 
+/**
+ * Pipelined walb log sender via TCP/IP connection.
+ *
+ * This consists of three stages connected by bounded queues:
+ *   (1) the caller thread pushes logpack headers and IO data read from a log device.
+ *   (2) worker threads verify IO checksums and compress data.
+ *   (3) a sender thread sends them to the socket in the pushed (lsid) order.
+ *
+ * Usage:
+ *   (1) call start() to start worker threads.
+ *   (2) call pushHeader() and corresponding pushIo() multiple times.
+ *   (3) call sync() for normal finish.
+ *   The destructor cancels the pipeline when sync() has not been called.
+ *   pushHeader(), pushIo() and sync() throw the error occurred in the pipeline.
+ */
+class WlogPipelineSender
+{
+private:
+    struct Task {
+        AlignedArray data;
+        WlogRecord rec; // not used for a header.
+        uint64_t lsid;
+        uint16_t recIdx;
+        bool isHeader;
+    };
+    struct Result {
+        CompressedData cd;
+        uint64_t lsid;
+        uint16_t recIdx;
+        bool isValid;
+    };
+    WlogSender sender_;
+    uint32_t pbs_;
+    uint32_t salt_;
+    cybozu::thread::ParallelConverter<Task, Result> pconv_;
+    cybozu::thread::ThreadRunner sendTh_;
+public:
+    static constexpr const char *NAME() { return "WlogPipelineSender"; }
+    WlogPipelineSender(cybozu::Socket &sock, Logger &logger, uint32_t pbs, uint32_t salt)
+        : sender_(sock, logger, pbs, salt), pbs_(pbs), salt_(salt)
+        , pconv_([this](Task &&task) { return convert(std::move(task)); })
+        , sendTh_() {
+    }
+    ~WlogPipelineSender() noexcept {
+        pconv_.fail();
+        sendTh_.joinNoThrow();
+    }
+    /**
+     * @concurrency number of worker threads. 0 means the number of cpu cores.
+     */
+    void start(size_t concurrency);
+    /**
+     * You must call pushHeader(h) and n times of pushIo(),
+     * where n is h.nRecords().
+     */
+    void pushHeader(const LogPackHeader &header);
+    /**
+     * data must be read by readLogIoData(). It will be verified in the pipeline.
+     * You must call this for discard/padding record also.
+     */
+    void pushIo(const LogPackHeader &header, uint16_t recIdx, AlignedArray &&data);
+    /**
+     * Notify the end of input and wait for all the data to be sent.
+     */
+    void sync();
+private:
+    void push(Task &&task);
+    Result convert(Task &&task);
+    void runSender();
+};
+
 /**
  * Walb log receiver via TCP/IP connection.
  *
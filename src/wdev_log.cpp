@@ -135,6 +135,8 @@ void AsyncWldevReader::reset(uint64_t lsid, uint64_t maxSizePb)
     aheadLsid_ = lsid;
     ringBuf_.reset();
     readAheadPb_ = maxSizePb;
+    tuner_.clearEpoch();
+    epochStopwatch_.reset();
 }
 
 
@@ -191,11 +193,12 @@ bool AsyncWldevReader::prepareAheadIo()
 
 size_t AsyncWldevReader::decideIoSize() const
 {
-    if (ringBuf_.getFreeSize() < maxIoSize_) {
-        /* There is not enough free space. */
+    const ReadAheadParams &params = tuner_.params();
+    if (ringBuf_.capacity() - ringBuf_.getFreeSize() + params.ioSize > params.windowSize) {
+        /* There is not enough free space in the read-ahead window. */
         return 0;
     }
-    size_t ioSize = maxIoSize_;
+    size_t ioSize = params.ioSize;
     /* Log device ring buffer edge. */
     uint64_t s = super_.getRingBufferSize();
     s = s - aheadLsid_ % s;
@@ -277,6 +277,10 @@ private:
 
     uint64_t readAheadPb_; // read ahead size [physical block]
 
+    ReadAheadTuner tuner_;
+    bool isTuning_;
+    cybozu::AccurateStopwatch epochStopwatch_;
+
     static constexpr size_t DEFAULT_BUFFER_SIZE = 4U << 20; /* 4MiB */
     static constexpr size_t DEFAULT_MAX_IO_SIZE = 64U << 10; /* 64KiB. */
 public:
@@ -285,6 +289,7 @@ public:
      * @wldevPath walb log device path.
      * @bufferSize buffer size to read ahead [byte].
      * @maxIoSize max IO size [byte].
+     *   They are the upper limits when read-ahead tuning is enabled.
      */
     AsyncWldevReader(cybozu::util::File &&wldevFile,
                      size_t bufferSize = DEFAULT_BUFFER_SIZE,
@@ -297,12 +302,17 @@ public:
         , aheadLsid_(0)
         , ringBuf_()
         , ioQ_()
-        , readAheadPb_(UINT64_MAX) {
+        , readAheadPb_(UINT64_MAX)
+        , tuner_()
+        , isTuning_(false)
+        , epochStopwatch_() {
         assert(pbs_ != 0);
         verifyMultiple(bufferSize, pbs_, "bad bufferSize");
         verifyMultiple(maxIoSize_, pbs_, "bad maxIoSize");
+        tuner_.init(pbs_, bufferSize, maxIoSize_, {bufferSize, maxIoSize_});
         super_.read(file_.fd());
         ringBuf_.init(bufferSize);
+        aio_.registerBuffer(ringBuf_.data(), ringBuf_.capacity());
     }
     AsyncWldevReader(const std::string &wldevPath,
                      size_t bufferSize = DEFAULT_BUFFER_SIZE,
@@ -326,6 +336,16 @@ public:
     void reset(uint64_t lsid, uint64_t maxSizePb = UINT64_MAX);
     void read(void *data, size_t size);
     void skip(size_t size);
+    /**
+     * Tune read-ahead window size and IO size from measured throughput and latency.
+     * @init initial parameters. Zero values mean the minimum.
+     */
+    void enableReadAheadTuning(const ReadAheadParams &init) {
+        tuner_.init(pbs_, ringBuf_.capacity(), maxIoSize_, init);
+        isTuning_ = true;
+        epochStopwatch_.reset();
+    }
+    ReadAheadStat getReadAheadStat() const { return tuner_.getStat(); }
 private:
     void verifyMultiple(uint64_t size, size_t pbs, const char *msg) const {
         if (size == 0 || size % pbs != 0) {
@@ -347,7 +367,15 @@ private:
             throw cybozu::Exception(NAME()) << "reached max read size.";
         }
         assert(!ioQ_.empty());
-        ringBuf_.complete(waitForIo());
+        if (!isTuning_) {
+            ringBuf_.complete(waitForIo());
+            return;
+        }
+        cybozu::AccurateStopwatch stopwatch;
+        const size_t size = waitForIo();
+        ringBuf_.complete(size);
+        tuner_.addCompleted(size, stopwatch.get());
+        if (tuner_.isEpochEnd()) tuner_.update(epochStopwatch_.get());
     }
     void readAhead() {
         size_t n = 0;
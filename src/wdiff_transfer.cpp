@@ -2,21 +2,27 @@
 
 namespace walb {
 
-bool wdiffTransferClient(
-    packet::Packet &pkt, DiffMerger &merger, const CompressOpt &cmpr,
-    const std::atomic<int> &stopState, const ProcessStatus &ps,
-    DiffStatistics &statOut)
+/**
+ * getRecIo: bool getRecIo(DiffRecIo&)
+ *   it must return false at the end of the diff records.
+ * sendPack: bool sendPack(compressor::Buffer&&)
+ *   it must return false to stop sending.
+ *
+ * RETURN:
+ *   false if force stopped or sendPack() returned false.
+ */
+template <typename GetRecIo, typename SendPack>
+static bool packDiffRecIos(
+    GetRecIo getRecIo, SendPack sendPack, const CompressOpt &cmpr,
+    const std::atomic<int> &stopState, const ProcessStatus &ps)
 {
     const size_t maxPushedNum = cmpr.numCpu * 2 + 1;
     ConverterQueue conv(maxPushedNum, cmpr.numCpu, true, cmpr.type, cmpr.level);
-    statOut.clear();
-    statOut.wdiffNr = -1;
-    packet::StreamControl ctrl(pkt.sock());
 
     DiffRecIo recIo;
     DiffPacker packer;
     size_t pushedNum = 0;
-    while (merger.getAndRemove(recIo)) {
+    while (getRecIo(recIo)) {
         if (stopState == ForceStopping || ps.isForceShutdown()) {
             return false;
         }
@@ -28,7 +34,7 @@ bool wdiffTransferClient(
         packer.clear();
         packer.add(rec, buf.data());
         if (pushedNum < maxPushedNum) continue;
-        wdiff_transfer_local::sendPack(pkt, ctrl, statOut, conv.pop());
+        if (!sendPack(conv.pop())) return false;
         pushedNum--;
     }
     if (!packer.empty()) {
@@ -36,14 +42,149 @@ bool wdiffTransferClient(
     }
     conv.quit();
     for (compressor::Buffer pack = conv.pop(); !pack.empty(); pack = conv.pop()) {
-        wdiff_transfer_local::sendPack(pkt, ctrl, statOut, pack);
+        if (!sendPack(std::move(pack))) return false;
     }
+    return true;
+}
+
+
+template <typename GetRecIo>
+static bool sendDiffRecIos(
+    packet::Packet &pkt, GetRecIo getRecIo, const CompressOpt &cmpr,
+    const std::atomic<int> &stopState, const ProcessStatus &ps,
+    DiffStatistics &statOut)
+{
+    statOut.clear();
+    statOut.wdiffNr = -1;
+    packet::StreamControl ctrl(pkt.sock());
+    auto sendPack = [&](compressor::Buffer &&pack) {
+        wdiff_transfer_local::sendPack(pkt, ctrl, statOut, pack);
+        return true;
+    };
+    if (!packDiffRecIos(getRecIo, sendPack, cmpr, stopState, ps)) return false;
     ctrl.end();
     pkt.flush();
     return true;
 }
 
 
+bool wdiffTransferClient(
+    packet::Packet &pkt, DiffMerger &merger, const CompressOpt &cmpr,
+    const std::atomic<int> &stopState, const ProcessStatus &ps,
+    DiffStatistics &statOut)
+{
+    auto getRecIo = [&](DiffRecIo &recIo) { return merger.getAndRemove(recIo); };
+    return sendDiffRecIos(pkt, getRecIo, cmpr, stopState, ps, statOut);
+}
+
+
+bool wdiffTransferClient(
+    packet::Packet &pkt, BoundedDiffMemory &diffMem, const CompressOpt &cmpr,
+    const std::atomic<int> &stopState, const ProcessStatus &ps,
+    DiffStatistics &statOut)
+{
+    diffMem.prepare(cmpr.type);
+    auto getRecIo = [&](DiffRecIo &recIo) { return diffMem.getAndRemove(recIo); };
+    return sendDiffRecIos(pkt, getRecIo, cmpr, stopState, ps, statOut);
+}
+
+
+bool wdiffTransferMultiClient(
+    const std::vector<packet::Packet *> &pktV, DiffMerger &merger, const CompressOpt &cmpr,
+    const std::atomic<int> &stopState, const ProcessStatus &ps,
+    DiffStatistics &statOut, std::vector<std::exception_ptr> &epV)
+{
+    using PackPtr = std::shared_ptr<const compressor::Buffer>;
+    struct Dest {
+        packet::Packet *pkt;
+        cybozu::thread::BoundedQueue<PackPtr> q;
+        cybozu::thread::ThreadRunner th;
+        bool isRunning;
+    };
+    const size_t queueSize = cmpr.numCpu * 2 + 2;
+    std::vector<std::unique_ptr<Dest> > destV;
+    for (packet::Packet *pkt : pktV) {
+        destV.emplace_back(new Dest());
+        Dest &d = *destV.back();
+        d.pkt = pkt;
+        d.q.resize(queueSize);
+        d.th.set([&d]() {
+            try {
+                packet::StreamControl ctrl(d.pkt->sock());
+                DiffStatistics stat;
+                PackPtr pack;
+                while (d.q.pop(pack)) {
+                    wdiff_transfer_local::sendPack(*d.pkt, ctrl, stat, *pack);
+                }
+                ctrl.end();
+                d.pkt->flush();
+            } catch (...) {
+                d.q.fail();
+                throw;
+            }
+        });
+        d.th.start();
+        d.isRunning = true;
+    }
+    epV.clear();
+    epV.resize(destV.size());
+    auto stopDest = [&](size_t i) {
+        destV[i]->q.fail();
+        epV[i] = destV[i]->th.joinNoThrow();
+        destV[i]->isRunning = false;
+    };
+
+    statOut.clear();
+    statOut.wdiffNr = -1;
+    auto getRecIo = [&](DiffRecIo &recIo) { return merger.getAndRemove(recIo); };
+    auto sendPack = [&](compressor::Buffer &&buf) {
+        statOut.update(*reinterpret_cast<const DiffPackHeader*>(buf.data()));
+        const PackPtr pack = std::make_shared<const compressor::Buffer>(std::move(buf));
+        size_t nr = 0;
+        for (size_t i = 0; i < destV.size(); i++) {
+            if (!destV[i]->isRunning) continue;
+            try {
+                destV[i]->q.push(pack);
+                nr++;
+            } catch (...) {
+                /* The server failed. Continue sending to the others. */
+                stopDest(i);
+            }
+        }
+        return nr > 0;
+    };
+    bool ret = true;
+    try {
+        ret = packDiffRecIos(getRecIo, sendPack, cmpr, stopState, ps);
+    } catch (...) {
+        for (size_t i = 0; i < destV.size(); i++) {
+            if (destV[i]->isRunning) stopDest(i);
+        }
+        throw;
+    }
+    for (size_t i = 0; i < destV.size(); i++) {
+        if (!destV[i]->isRunning) continue;
+        if (ret) {
+            destV[i]->q.sync();
+            epV[i] = destV[i]->th.joinNoThrow();
+            destV[i]->isRunning = false;
+        } else {
+            stopDest(i);
+        }
+    }
+    const bool isForceStopped = stopState == ForceStopping || ps.isForceShutdown();
+    if (isForceStopped) return false;
+    if (!ret) {
+        /* All the servers failed. Each of them must have its error. */
+        for (std::exception_ptr &ep : epV) {
+            if (!ep) ep = std::make_exception_ptr(
+                cybozu::Exception(__func__) << "stopped since all the servers failed");
+        }
+    }
+    return true;
+}
+
+
 /**
  * This function supports only sorted wdiff files.
  */
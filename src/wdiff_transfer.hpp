@@ -4,6 +4,7 @@
 #include "walb_diff_merge.hpp"
 #include "walb_diff_compressor.hpp"
 #include "walb_diff_pack.hpp"
+#include "walb_diff_mem.hpp"
 #include "server_util.hpp"
 #include "host_info.hpp"
 
@@ -31,6 +32,36 @@ bool wdiffTransferClient(
     const std::atomic<int> &stopState, const ProcessStatus &ps,
     DiffStatistics &statOut);
 
+/**
+ * Send the same merged diff to multiple servers.
+ * The diff is merged and compressed once.
+ * Each server gets the packs by its own thread so a slow server does not block
+ * the others until its queue becomes full, and a failed server does not stop the others.
+ *
+ * @pktV packets of the servers that accepted the transfer.
+ * @epV the error of each server will be set, or nullptr if it succeeded.
+ *   The errors of all the servers are set if all of them failed.
+ * RETURN:
+ *   false if force stopped. The caller must check epV otherwise.
+ */
+bool wdiffTransferMultiClient(
+    const std::vector<packet::Packet *> &pktV, DiffMerger &merger, const CompressOpt &cmpr,
+    const std::atomic<int> &stopState, const ProcessStatus &ps,
+    DiffStatistics &statOut, std::vector<std::exception_ptr> &epV);
+
+/**
+ * Send all the records in diffMem in address order.
+ * The sent records will be removed from diffMem to release memory.
+ * Records in spilled runs compressed with cmpr.type are sent as they are.
+ *
+ * RETURN:
+ *   false if force stopped.
+ */
+bool wdiffTransferClient(
+    packet::Packet &pkt, BoundedDiffMemory &diffMem, const CompressOpt &cmpr,
+    const std::atomic<int> &stopState, const ProcessStatus &ps,
+    DiffStatistics &statOut);
+
 /**
  * fileH: the position must be the first pack header.
  */
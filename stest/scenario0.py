@@ -569,6 +569,36 @@ def test_m3():
         raise
 
 
+def test_m4():
+    """
+        nbd-export at a1 -> resync a0 to a1 fails -> resync after the export ends.
+    """
+    info = 'test_m4:resync-during-nbd-export count:%d' % g_count
+    try:
+        print_action_info('START', info)
+        walbc.replicate_once(a0, VOL, a1)
+        gid = walbc.get_latest_clean_snapshot(a1, VOL)
+        sockPath = tempfile.mktemp(suffix='.sock')
+        acceptTimeoutS = 10
+        walbc.nbd_export(a1, VOL, gid, 'unix:' + sockPath, acceptTimeoutS)
+        try:
+            walbc.replicate_once(a0, VOL, a1, doResync=True)
+            testFailed = True
+        except:
+            testFailed = False
+        if testFailed:
+            raise Exception('test_m4: resync must fail during nbd-export')
+        walbc._wait_for_no_action(a1, VOL, aaNbdExport, acceptTimeoutS * 2)
+        gid = walbc.replicate_once(a0, VOL, a1, doResync=True)
+        md0 = get_sha1_of_restorable(a0, VOL, gid)
+        md1 = get_sha1_of_restorable(a1, VOL, gid)
+        verify_equal_sha1('test_m4', md0, md1)
+        print_action_info('SUCCESS', info)
+    except Exception:
+        print_action_info('FAILURE', info)
+        raise
+
+
 ###############################################################################
 # Error scenario tests.
 ###############################################################################
@@ -1374,7 +1404,7 @@ def test_r4():
 
 allL = ['n1', 'n2', 'n3', 'n4b', 'n5', 'n6', 'n7', 'n8', 'n9',
         'n10', 'n11a', 'n11b', 'n12', 'n13', 'n14',
-        'm1', 'm2', 'm3',
+        'm1', 'm2', 'm3', 'm4',
         'e1', 'e2', 'e3', 'e4', 'e5', 'e6', 'e7', 'e8',
         'e9', 'e10', 'e11', 'e12', 'e13',
         'e14', 'e15', 'e16', 'e17',
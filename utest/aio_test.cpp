@@ -264,3 +264,94 @@ CYBOZU_TEST_AUTO(testAioWaitOne)
     std::sort(s1.begin(), s1.end());
     CYBOZU_TEST_ASSERT(s0 == s1);
 }
+
+#ifdef CYBOZU_AIO_IO_URING
+CYBOZU_TEST_AUTO(testIoUringSimple)
+{
+    cybozu::TmpFile tmpF = prepareTmpFile(128);
+    Aio aio(tmpF.fd(), 8, AioEngine::IO_URING);
+    CYBOZU_TEST_ASSERT(aio.engine() == AioEngine::IO_URING);
+
+    AArray v0(LBS * 128);
+    fillArray(v0);
+    writeArray(aio, v0);
+
+    AArray v1(LBS * 128);
+    readArray(aio, v1);
+    CYBOZU_TEST_EQUAL(::memcmp(v0.data(), v1.data(), v0.size()), 0);
+
+    const uint32_t key = aio.prepareFlush();
+    CYBOZU_TEST_ASSERT(key != 0);
+    aio.submit();
+    aio.waitFor(key);
+}
+
+CYBOZU_TEST_AUTO(testIoUringRegisteredBuffer)
+{
+    cybozu::TmpFile tmpF = prepareTmpFile(128);
+    Aio aio(tmpF.fd(), 8, AioEngine::IO_URING);
+
+    AArray v0(LBS * 128);
+    fillArray(v0);
+    aio.registerBuffer(v0.data(), v0.size());
+    writeArray(aio, v0);
+
+    AArray v1(LBS * 128);
+    aio.registerBuffer(v1.data(), v1.size());
+    readArray(aio, v1);
+    CYBOZU_TEST_EQUAL(::memcmp(v0.data(), v1.data(), v0.size()), 0);
+}
+
+CYBOZU_TEST_AUTO(testIoUringWaitOne)
+{
+    cybozu::TmpFile tmpF = prepareTmpFile(128);
+    Aio aio(tmpF.fd(), 8, AioEngine::IO_URING);
+
+    AArray v0(LBS * 128);
+    fillArray(v0);
+    writeArray(aio, v0);
+
+    AArray v1(LBS * 128);
+    std::vector<uint32_t> s0, s1;
+    for (size_t i = 0; i < 1024; i++) {
+        while (aio.isQueueFull()) {
+            s1.push_back(aio.waitOne());
+        }
+        const size_t off = (randx() % 128) * LBS;
+        const uint32_t key = aio.prepareRead(off, LBS, &v1[off]);
+        CYBOZU_TEST_ASSERT(key != 0);
+        s0.push_back(key);
+        aio.submit();
+    }
+    while (!aio.empty()) s1.push_back(aio.waitOne());
+    std::sort(s0.begin(), s0.end());
+    std::sort(s1.begin(), s1.end());
+    CYBOZU_TEST_ASSERT(s0 == s1);
+}
+
+CYBOZU_TEST_AUTO(testIoUringSqPoll)
+{
+    cybozu::TmpFile tmpF = prepareTmpFile(128);
+    std::unique_ptr<Aio> aio;
+    try {
+        aio.reset(new Aio(tmpF.fd(), 8, AioEngine::IO_URING_SQPOLL));
+    } catch (std::exception &e) {
+        ::printf("SQPOLL is not available: %s\n", e.what());
+        return;
+    }
+    AArray v0(LBS * 128);
+    fillArray(v0);
+    writeArray(*aio, v0);
+
+    /* Submit a full queue at once repeatedly. */
+    AArray v1(LBS * 128);
+    for (size_t i = 0; i < 128; i += 8) {
+        for (size_t j = i; j < i + 8; j++) {
+            CYBOZU_TEST_ASSERT(aio->prepareRead(j * LBS, LBS, &v1[j * LBS]) != 0);
+        }
+        aio->submit();
+        while (!aio->empty()) aio->waitOne();
+    }
+    CYBOZU_TEST_EQUAL(::memcmp(v0.data(), v1.data(), v0.size()), 0);
+}
+#endif
@@ -0,0 +1,89 @@
+#include "cybozu/test.hpp"
+#include "alloc_map.hpp"
+#include "fileio.hpp"
+#include "tmp_file.hpp"
+#include "walb_types.hpp"
+
+using namespace walb;
+
+CYBOZU_TEST_AUTO(allocMap)
+{
+    AllocMap map;
+    CYBOZU_TEST_ASSERT(!map.isAvailable());
+    CYBOZU_TEST_EQUAL(map.getNextAllocated(100), 100);
+
+    map.add(10, 10);
+    map.add(15, 10); // merged.
+    map.add(25, 5); // merged.
+    map.add(40, 0); // ignored.
+    map.add(50, 10);
+    CYBOZU_TEST_EXCEPTION(map.add(0, 1), cybozu::Exception);
+    map.setAvailable();
+    CYBOZU_TEST_EQUAL(map.getNrRanges(), 2);
+    CYBOZU_TEST_EQUAL(map.getAllocatedLb(), 30);
+
+    CYBOZU_TEST_EQUAL(map.getNextAllocated(0), 10);
+    CYBOZU_TEST_EQUAL(map.getNextAllocated(10), 10);
+    CYBOZU_TEST_EQUAL(map.getNextAllocated(29), 29);
+    CYBOZU_TEST_EQUAL(map.getNextAllocated(30), 50);
+    CYBOZU_TEST_EQUAL(map.getNextAllocated(59), 59);
+    CYBOZU_TEST_EQUAL(map.getNextAllocated(60), UINT64_MAX);
+
+    map.clear();
+    CYBOZU_TEST_ASSERT(!map.isAvailable());
+    CYBOZU_TEST_EQUAL(map.getNrRanges(), 0);
+}
+
+CYBOZU_TEST_AUTO(parseThinDump)
+{
+    const std::string xml =
+        "<superblock uuid=\"\" time=\"1\" transaction=\"2\" flags=\"0\" version=\"2\" data_block_size=\"128\" nr_data_blocks=\"1600\">\n"
+        "  <device dev_id=\"1\" mapped_blocks=\"6\" transaction=\"0\" creation_time=\"0\" snap_time=\"1\">\n"
+        "    <range_mapping origin_begin=\"4\" data_begin=\"0\" length=\"3\" time=\"0\"/>\n"
+        "    <single_mapping origin_block=\"0\" data_block=\"3\" time=\"0\"/>\n"
+        "    <single_mapping origin_block=\"7\" data_block=\"4\" time=\"1\"/>\n"
+        "    <single_mapping origin_block=\"20\" data_block=\"5\" time=\"1\"/>\n"
+        "  </device>\n"
+        "</superblock>\n";
+    AllocMap map;
+    alloc_map_local::parseThinDump(xml, map);
+    CYBOZU_TEST_ASSERT(map.isAvailable());
+    CYBOZU_TEST_EQUAL(map.getNrRanges(), 3); // [0, 1), [4, 8), [20, 21) in data blocks.
+    CYBOZU_TEST_EQUAL(map.getAllocatedLb(), 6 * 128);
+    CYBOZU_TEST_EQUAL(map.getNextAllocated(128), 4 * 128);
+    CYBOZU_TEST_EQUAL(map.getNextAllocated(8 * 128), 20 * 128);
+    CYBOZU_TEST_EQUAL(map.getNextAllocated(21 * 128), UINT64_MAX);
+
+    CYBOZU_TEST_EXCEPTION(alloc_map_local::parseThinDump("<device dev_id=\"1\">\n", map), cybozu::Exception);
+}
+
+CYBOZU_TEST_AUTO(fileAllocMap)
+{
+    const size_t unitSize = 1 << 20; /* larger than file system blocks. */
+    cybozu::TmpFile tmpFile(".");
+    cybozu::util::File file(tmpFile.fd());
+    const std::vector<char> buf(unitSize, 'a');
+    file.pwrite(buf.data(), buf.size(), unitSize * 2);
+    file.pwrite(buf.data(), buf.size(), unitSize * 4);
+    file.ftruncate(unitSize * 8);
+    file.fdatasync();
+
+    AllocMap map;
+    if (!getFileAllocMap(file.fd(), map)) {
+        ::printf("SEEK_DATA/SEEK_HOLE are not supported.\n");
+        return;
+    }
+    CYBOZU_TEST_ASSERT(map.isAvailable());
+    const uint64_t unitLb = unitSize / LOGICAL_BLOCK_SIZE;
+    const uint64_t allocLb = map.getAllocatedLb();
+    if (allocLb == unitLb * 8) {
+        ::printf("the file system does not make holes.\n");
+        return;
+    }
+    CYBOZU_TEST_EQUAL(map.getNextAllocated(0), unitLb * 2);
+    CYBOZU_TEST_EQUAL(map.getNextAllocated(unitLb * 3), unitLb * 4);
+    CYBOZU_TEST_EQUAL(map.getNextAllocated(unitLb * 5), UINT64_MAX);
+
+    const AllocMap map2 = getAllocMap(tmpFile.path());
+    CYBOZU_TEST_EQUAL(map2.getAllocatedLb(), allocLb);
+}
@@ -49,3 +49,79 @@ CYBOZU_TEST_AUTO(testAsyncBdevReader)
     test(tmpFile.path(), 1, bufSize, maxIoSize, buf0.data(), devSize);
     test(tmpFile.path(), (4 << 20) / LBS, bufSize, maxIoSize, buf0.data(), devSize); /* 4MiB */
 }
+
+CYBOZU_TEST_AUTO(testAsyncBdevReaderSeek)
+{
+    cybozu::util::Random<size_t> rand;
+    const size_t devSize = 4 << 20; /* 4MiB */
+    const size_t bufSize = 1 << 20; /* 1MiB */
+    const size_t maxIoSize = 64 << 10; /* 64KiB */
+    AArray buf0(devSize);
+    rand.fill(buf0.data(), buf0.size());
+
+    cybozu::TmpFile tmpFile(".");
+    {
+        cybozu::util::File f(tmpFile.fd());
+        f.write(buf0.data(), buf0.size());
+        f.fdatasync();
+    }
+
+    AsyncBdevReader reader(tmpFile.path(), 0, bufSize, maxIoSize);
+    AArray buf1(maxIoSize);
+    for (size_t i = 0; i < 100; i++) {
+        const uint64_t offLb = rand() % ((devSize - maxIoSize) / LBS);
+        const size_t size = (1 + rand() % (maxIoSize / LBS)) * LBS;
+        reader.seek(offLb);
+        reader.read(buf1.data(), size);
+        CYBOZU_TEST_EQUAL(::memcmp(&buf0[offLb * LBS], buf1.data(), size), 0);
+    }
+    reader.seek(devSize / LBS); // the end.
+    CYBOZU_TEST_EXCEPTION(reader.seek(devSize / LBS + 1), cybozu::Exception);
+}
+
+CYBOZU_TEST_AUTO(testReadAheadTuner)
+{
+    const size_t pbs = 4096;
+    const size_t maxWindow = 16 << 20; /* 16MiB */
+    const size_t maxIoSize = 1 << 20; /* 1MiB */
+    ReadAheadTuner tuner;
+    tuner.init(pbs, maxWindow, maxIoSize, {0, 0});
+    CYBOZU_TEST_EQUAL(tuner.params().ioSize, 64U << 10);
+    CYBOZU_TEST_EQUAL(tuner.params().windowSize, 256U << 10);
+
+    /*
+     * Simulated device: throughput grows with IO size up to 256KiB
+     * and with window size up to 4MiB. The consumer is always starved.
+     */
+    auto runEpoch = [&]() {
+        const ReadAheadParams &pa = tuner.params();
+        const double mbps = std::min<size_t>(pa.ioSize, 256 << 10) / 1024.0
+            + std::min<size_t>(pa.windowSize, 4 << 20) / 8192.0;
+        uint64_t total = 0;
+        while (!tuner.isEpochEnd()) {
+            tuner.addCompleted(pa.ioSize, 0.0);
+            total += pa.ioSize;
+        }
+        const double sec = total / (mbps * 1000000.0);
+        tuner.clearEpoch();
+        tuner.addCompleted(total, sec);
+        tuner.update(sec);
+    };
+    for (size_t i = 0; i < 40; i++) runEpoch();
+    CYBOZU_TEST_EQUAL(tuner.params().ioSize, 256U << 10);
+    CYBOZU_TEST_EQUAL(tuner.params().windowSize, 4U << 20);
+    CYBOZU_TEST_ASSERT(tuner.getStat().throughput > 0);
+
+    /* The consumer is the bottleneck: window shrinks to keep 2 IOs at least. */
+    for (size_t i = 0; i < 10; i++) {
+        tuner.addCompleted(tuner.params().windowSize * 2, 0.0);
+        tuner.update(1.0);
+    }
+    CYBOZU_TEST_EQUAL(tuner.params().ioSize, 256U << 10);
+    CYBOZU_TEST_EQUAL(tuner.params().windowSize, 512U << 10);
+
+    /* Initial parameters are clamped. */
+    tuner.init(pbs, maxWindow, maxIoSize, {64 << 20, 3 << 20});
+    CYBOZU_TEST_EQUAL(tuner.params().ioSize, maxIoSize);
+    CYBOZU_TEST_EQUAL(tuner.params().windowSize, maxWindow);
+}
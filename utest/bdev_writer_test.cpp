@@ -0,0 +1,146 @@
+#include "cybozu/test.hpp"
+#include "bdev_writer.hpp"
+#include "tmp_file.hpp"
+#include "random.hpp"
+
+using namespace walb;
+
+CYBOZU_TEST_AUTO(backgroundSyncer)
+{
+    cybozu::TmpFile tmpFile(".");
+    cybozu::util::File file(tmpFile.fd());
+    std::vector<char> buf(1 << 20);
+    cybozu::util::Random<size_t> rand;
+    rand.fill(buf.data(), buf.size());
+
+    BackgroundSyncer syncer(file.fd());
+    CYBOZU_TEST_ASSERT(!syncer.isRunning());
+    syncer.wait(); // nothing to wait for.
+    for (size_t i = 0; i < 10; i++) {
+        file.pwrite(buf.data(), buf.size(), i * buf.size());
+        syncer.start(); // waits for the previous one.
+        CYBOZU_TEST_ASSERT(syncer.isRunning());
+    }
+    syncer.wait();
+    CYBOZU_TEST_ASSERT(!syncer.isRunning());
+    syncer.wait();
+    CYBOZU_TEST_EQUAL(file.lseek(0, SEEK_END), off_t(buf.size() * 10));
+}
+
+CYBOZU_TEST_AUTO(backgroundSyncerRequest)
+{
+    cybozu::TmpFile tmpFile(".");
+    BackgroundSyncer syncer(tmpFile.fd());
+    syncer.update(100); // not requested.
+    CYBOZU_TEST_ASSERT(!syncer.isRunning());
+    syncer.request(10);
+    syncer.request(20); // the former request is kept.
+    syncer.update(5);
+    CYBOZU_TEST_ASSERT(syncer.isRequested());
+    CYBOZU_TEST_ASSERT(!syncer.isRunning());
+    syncer.update(10);
+    CYBOZU_TEST_ASSERT(!syncer.isRequested());
+    CYBOZU_TEST_ASSERT(syncer.isRunning());
+    syncer.wait();
+}
+
+CYBOZU_TEST_AUTO(backgroundSyncerError)
+{
+    const int fd = -1; // fdatasync() will fail with EBADF.
+    BackgroundSyncer syncer(fd);
+    syncer.start();
+    CYBOZU_TEST_EXCEPTION(syncer.wait(), cybozu::util::LibcError);
+    CYBOZU_TEST_ASSERT(!syncer.isRunning());
+
+    /* The error of the previous sync is thrown by the next start(). */
+    syncer.start();
+    CYBOZU_TEST_EXCEPTION(syncer.start(), cybozu::util::LibcError);
+    CYBOZU_TEST_ASSERT(!syncer.isRunning());
+
+    /* The destructor does not throw. */
+    {
+        BackgroundSyncer syncer2(fd);
+        syncer2.start();
+    }
+}
+
+namespace {
+
+struct Model
+{
+    std::vector<char> image;
+    cybozu::util::Random<size_t> rand;
+
+    explicit Model(size_t sizeLb) : image(sizeLb * LOGICAL_BLOCK_SIZE, char(0xff)) {}
+    AlignedArray write(uint64_t offLb, size_t sizeLb) {
+        AlignedArray buf(sizeLb * LOGICAL_BLOCK_SIZE, false);
+        rand.fill(buf.data(), buf.size());
+        ::memcpy(&image[offLb * LOGICAL_BLOCK_SIZE], buf.data(), buf.size());
+        return buf;
+    }
+    void discard(uint64_t offLb, size_t sizeLb) {
+        ::memset(&image[offLb * LOGICAL_BLOCK_SIZE], 0, sizeLb * LOGICAL_BLOCK_SIZE);
+    }
+};
+
+} // namespace
+
+CYBOZU_TEST_AUTO(asyncBdevWriterMerge)
+{
+    const size_t sizeLb = 1024;
+    const size_t maxIoSize = 64 * KIBI; // 128 LB.
+    Model model(sizeLb);
+    cybozu::TmpFile tmpFile(".");
+    {
+        cybozu::util::File file(tmpFile.fd());
+        file.pwrite(model.image.data(), model.image.size(), 0);
+        file.fdatasync();
+    }
+    cybozu::util::File file(tmpFile.path(), O_RDWR | O_DIRECT);
+    AsyncBdevWriter writer(file.fd(), MEBI, maxIoSize);
+
+    auto write = [&](uint64_t offLb, size_t sizeLb) {
+        CYBOZU_TEST_ASSERT(writer.prepare(offLb, sizeLb, model.write(offLb, sizeLb)));
+    };
+    auto discard = [&](uint64_t offLb, size_t sizeLb) {
+        CYBOZU_TEST_ASSERT(writer.discard(offLb, sizeLb));
+        model.discard(offLb, sizeLb);
+    };
+
+    /* Adjacent writes are merged: 2 merges, 16 LB. */
+    write(0, 8);
+    write(8, 8);
+    write(16, 8);
+    /* Non-adjacent and overlapped writes are not merged. */
+    write(100, 8);
+    write(104, 8);
+    /* Adjacent to the overlapped one: 1 merge, 8 LB. */
+    write(112, 8);
+    /* Merged IOs are limited by maxIoSize: 14 merges, 224 LB. */
+    for (size_t i = 0; i < 16; i++) write(400 + i * 16, 16);
+    /* Contiguous discards are merged: 1 merge, 8 LB. */
+    discard(600, 8);
+    discard(608, 8);
+    /* A write after the pending discard. */
+    write(612, 4);
+    /* A discard after an overlapped write. */
+    write(700, 8);
+    discard(700, 4);
+    /* Out of the device. */
+    CYBOZU_TEST_ASSERT(!writer.prepare(sizeLb - 4, 8, AlignedArray(8 * LOGICAL_BLOCK_SIZE)));
+    CYBOZU_TEST_EQUAL(writer.getPreparedLb(), 336); // 316 LB written and 20 LB discarded.
+    writer.waitForAll();
+    CYBOZU_TEST_EQUAL(writer.getCompletedLb(), writer.getPreparedLb());
+
+    const WriteIoStatistics &stat = writer.getStat();
+    CYBOZU_TEST_EQUAL(stat.normalNr, 24);
+    CYBOZU_TEST_EQUAL(stat.discardNr, 3);
+    CYBOZU_TEST_EQUAL(stat.mergedNr, 18);
+    CYBOZU_TEST_EQUAL(stat.mergedLb, 256);
+    CYBOZU_TEST_EQUAL(stat.clippedNr, 1);
+    CYBOZU_TEST_EQUAL(stat.clippedLb, 8);
+
+    AlignedArray buf(sizeLb * LOGICAL_BLOCK_SIZE, false);
+    file.pread(buf.data(), buf.size(), 0);
+    CYBOZU_TEST_ASSERT(::memcmp(buf.data(), model.image.data(), buf.size()) == 0);
+}
@@ -0,0 +1,49 @@
+#include "cybozu/test.hpp"
+#include "checksum.hpp"
+#include "random.hpp"
+
+using namespace cybozu::util;
+
+Random<size_t> rand_;
+
+const ChecksumImpl implV[] = {
+    ChecksumImpl::SCALAR, ChecksumImpl::SSE2, ChecksumImpl::AVX2, ChecksumImpl::AVX512,
+};
+
+CYBOZU_TEST_AUTO(checksumImpl)
+{
+    std::vector<char> buf(64 * 1024 + 64);
+    rand_.fill(buf.data(), buf.size());
+    for (size_t i = 0; i < 1000; i++) {
+        const size_t off = rand_() % 64;
+        const size_t size = i < 300 ? i : rand_() % (buf.size() - off);
+        const uint32_t salt = rand_();
+        const uint32_t csum0 = checksumPartialScalar(&buf[off], size, salt);
+        for (ChecksumImpl impl : implV) {
+            if (!isChecksumImplAvailable(impl)) continue;
+            const uint32_t csum1 = getChecksumPartialFunc(impl)(&buf[off], size, salt);
+            CYBOZU_TEST_EQUAL(csum0, csum1);
+        }
+        CYBOZU_TEST_EQUAL(csum0, checksumPartial(&buf[off], size, salt));
+    }
+}
+
+CYBOZU_TEST_AUTO(checksumPartialChain)
+{
+    std::vector<char> buf(64 * 1024);
+    rand_.fill(buf.data(), buf.size());
+    const uint32_t salt = rand_();
+    const uint32_t csum0 = calcChecksum(buf.data(), buf.size(), salt);
+    for (size_t i = 0; i < 100; i++) {
+        size_t off = 0;
+        uint32_t csum = salt;
+        while (off < buf.size()) {
+            /* Partial calls must be 4-byte aligned except the last one. */
+            const size_t s = std::min(buf.size() - off, (rand_() % 1024) * 4);
+            csum = checksumPartial(&buf[off], s, csum);
+            off += s;
+        }
+        CYBOZU_TEST_EQUAL(csum0, checksumFinish(csum));
+    }
+    CYBOZU_TEST_ASSERT(isChecksumImplAvailable(getBestChecksumImpl()));
+}
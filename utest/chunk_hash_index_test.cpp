@@ -0,0 +1,156 @@
+#include "cybozu/test.hpp"
+#include "chunk_hash_index.hpp"
+#include "file_path.hpp"
+#include "random.hpp"
+#include "walb_types.hpp"
+#include <vector>
+
+using namespace walb;
+
+using Hash = cybozu::murmurhash3::Hash;
+
+cybozu::util::Random<size_t> g_rand;
+
+Hash makeHash(uint64_t i)
+{
+    cybozu::murmurhash3::Hasher hasher;
+    return hasher(&i, sizeof(i));
+}
+
+struct TmpPath
+{
+    const std::string path;
+    explicit TmpPath(const std::string &path) : path(path) {
+        cybozu::FilePath(path).unlink();
+    }
+    ~TmpPath() noexcept {
+        cybozu::FilePath(path).unlink();
+    }
+};
+
+CYBOZU_TEST_AUTO(chunkHashIndexGetSet)
+{
+    TmpPath tp("tmp_chunk_hash_index0");
+    const uint32_t chunkLb = 8;
+    ChunkHashIndex index;
+    index.open(tp.path, 100, chunkLb);
+    CYBOZU_TEST_ASSERT(index.isOpen());
+    CYBOZU_TEST_EQUAL(index.nrChunks(), 12); // the last partial chunk is not indexed.
+    CYBOZU_TEST_EQUAL(index.getNrValid(), 0);
+    const uint32_t seed = index.seed();
+
+    Hash hash;
+    for (uint64_t i = 0; i < 12; i++) {
+        CYBOZU_TEST_ASSERT(!index.get(i, hash));
+        index.set(i, makeHash(i));
+    }
+    index.set(12, makeHash(12)); // ignored.
+    CYBOZU_TEST_ASSERT(!index.get(12, hash));
+    CYBOZU_TEST_EQUAL(index.getNrValid(), 12);
+
+    index.invalidate(9, 8); // chunk 1 and 2.
+    index.invalidate(40, 1); // chunk 5.
+    index.invalidate(96, 100); // not indexed.
+    CYBOZU_TEST_EQUAL(index.getNrValid(), 9);
+    for (uint64_t i = 0; i < 12; i++) {
+        const bool isValid = index.get(i, hash);
+        CYBOZU_TEST_EQUAL(isValid, i != 1 && i != 2 && i != 5);
+        if (isValid) CYBOZU_TEST_EQUAL(hash, makeHash(i));
+    }
+    index.close();
+
+    /* Reopen with a grown image. */
+    index.open(tp.path, 200, chunkLb);
+    CYBOZU_TEST_EQUAL(index.seed(), seed);
+    CYBOZU_TEST_EQUAL(index.nrChunks(), 25);
+    CYBOZU_TEST_EQUAL(index.getNrValid(), 9);
+    CYBOZU_TEST_ASSERT(index.get(0, hash));
+    CYBOZU_TEST_EQUAL(hash, makeHash(0));
+    CYBOZU_TEST_ASSERT(!index.get(20, hash));
+    index.close();
+
+    /* Different chunk size. */
+    index.open(tp.path, 200, chunkLb * 2);
+    CYBOZU_TEST_EQUAL(index.nrChunks(), 12);
+    CYBOZU_TEST_EQUAL(index.getNrValid(), 0);
+}
+
+CYBOZU_TEST_AUTO(chunkHashIndexUpdate)
+{
+    TmpPath tp("tmp_chunk_hash_index1");
+    const uint32_t chunkLb = 8;
+    ChunkHashIndex index;
+    index.open(tp.path, 64, chunkLb);
+    for (uint64_t i = 0; i < 8; i++) index.set(i, makeHash(i));
+    const uint32_t seed = index.seed();
+
+    /* Finished update. */
+    index.beginUpdate();
+    index.invalidate(0, 1);
+    index.endUpdate();
+    index.close();
+    index.open(tp.path, 64, chunkLb);
+    CYBOZU_TEST_EQUAL(index.seed(), seed);
+    CYBOZU_TEST_EQUAL(index.getNrValid(), 7);
+
+    /* Another hash algorithm. */
+    CYBOZU_TEST_EQUAL(index.hashAlgo(), HASH_ALGO_MURMUR3);
+    index.reset(HASH_ALGO_XXH128);
+    CYBOZU_TEST_EQUAL(index.hashAlgo(), HASH_ALGO_XXH128);
+    CYBOZU_TEST_EQUAL(index.getNrValid(), 0);
+    for (uint64_t i = 0; i < 8; i++) index.set(i, makeHash(i));
+    index.close();
+    index.open(tp.path, 64, chunkLb);
+    CYBOZU_TEST_EQUAL(index.hashAlgo(), HASH_ALGO_XXH128);
+    CYBOZU_TEST_EQUAL(index.getNrValid(), 8);
+
+    /* Unfinished update resets the index. */
+    index.beginUpdate();
+    index.invalidate(8, 1);
+    index.close();
+    index.open(tp.path, 64, chunkLb);
+    CYBOZU_TEST_EQUAL(index.getNrValid(), 0);
+    CYBOZU_TEST_EQUAL(index.hashAlgo(), HASH_ALGO_MURMUR3);
+}
+
+CYBOZU_TEST_AUTO(indexedVirtualReader)
+{
+    const std::string basePath = "tmp_chunk_hash_index_base";
+    TmpPath tpBase(basePath);
+    TmpPath tp("tmp_chunk_hash_index2");
+    const uint32_t chunkLb = 8;
+    const uint64_t sizeLb = 40;
+    std::vector<char> image(sizeLb * LOGICAL_BLOCK_SIZE);
+    g_rand.fill(image.data(), image.size());
+    {
+        cybozu::util::File file(basePath, O_CREAT | O_TRUNC | O_RDWR, 0644);
+        file.write(image.data(), image.size());
+    }
+    ChunkHashIndex index;
+    index.open(tp.path, sizeLb, chunkLb);
+    const cybozu::murmurhash3::Hasher hasher(index.seed());
+
+    for (size_t i = 0; i < 2; i++) {
+        IndexedVirtualReader reader;
+        reader.virt().init(cybozu::util::File(basePath, O_RDONLY), sizeLb, {}, 0);
+        reader.setIndex(&index);
+        std::vector<char> buf(chunkLb * LOGICAL_BLOCK_SIZE);
+        for (uint64_t addr = 0; addr < sizeLb; addr += chunkLb) {
+            const Hash expected = hasher(&image[addr * LOGICAL_BLOCK_SIZE], buf.size());
+            Hash hash;
+            if (i == 0) {
+                CYBOZU_TEST_ASSERT(!reader.getHash(chunkLb, hash));
+                reader.read(buf.data(), buf.size());
+                hash = hasher(buf.data(), buf.size());
+                reader.putHash(addr, chunkLb, hash);
+            } else {
+                CYBOZU_TEST_ASSERT(!reader.getHash(chunkLb / 2, hash)); // not a chunk.
+                CYBOZU_TEST_ASSERT(reader.getHash(chunkLb, hash));
+            }
+            CYBOZU_TEST_EQUAL(hash, expected);
+        }
+        CYBOZU_TEST_EQUAL(reader.nrHit(), i == 0 ? 0 : sizeLb / chunkLb);
+        CYBOZU_TEST_EQUAL(reader.nrPut(), i == 0 ? sizeLb / chunkLb : 0);
+    }
+    CYBOZU_TEST_EQUAL(index.getNrValid(), sizeLb / chunkLb);
+}
@@ -0,0 +1,93 @@
+#include "cybozu/test.hpp"
+#include "chunked_map.hpp"
+#include "random.hpp"
+#include <map>
+#include <string>
+
+using namespace cybozu::util;
+
+Random<size_t> rand_;
+
+using Map0 = std::map<uint64_t, std::string>;
+using Map1 = cybozu::ChunkedMap<uint64_t, std::string, 8>;
+
+void verifyEqual(const Map0 &m0, const Map1 &m1)
+{
+    CYBOZU_TEST_ASSERT(m1.isValid());
+    CYBOZU_TEST_EQUAL(m0.size(), m1.size());
+    Map0::const_iterator it0 = m0.begin();
+    Map1::const_iterator it1 = m1.begin();
+    while (it0 != m0.end() && it1 != m1.end()) {
+        CYBOZU_TEST_EQUAL(it0->first, it1->first);
+        CYBOZU_TEST_EQUAL(it0->second, it1->second);
+        ++it0;
+        ++it1;
+    }
+    CYBOZU_TEST_ASSERT(it0 == m0.end());
+    CYBOZU_TEST_ASSERT(it1 == m1.end());
+    if (m1.empty()) return;
+    /* Reverse iteration. */
+    Map0::const_reverse_iterator rit0 = m0.rbegin();
+    it1 = m1.end();
+    do {
+        --it1;
+        CYBOZU_TEST_EQUAL(rit0->first, it1->first);
+        ++rit0;
+    } while (it1 != m1.begin());
+}
+
+CYBOZU_TEST_AUTO(chunkedMapRandom)
+{
+    const uint64_t keyMax = 300;
+    Map0 m0;
+    Map1 m1;
+    for (size_t i = 0; i < 20000; i++) {
+        const uint64_t key = rand_() % keyMax;
+        const size_t op = rand_() % 10;
+        if (op < 5) {
+            const std::string val = std::to_string(rand_());
+            const bool inserted0 = m0.emplace(key, val).second;
+            std::pair<Map1::iterator, bool> ret = m1.emplace(key, val);
+            CYBOZU_TEST_EQUAL(inserted0, ret.second);
+            CYBOZU_TEST_EQUAL(ret.first->first, key);
+        } else if (op < 7) {
+            Map0::iterator it0 = m0.lower_bound(key);
+            Map1::iterator it1 = m1.lower_bound(key);
+            CYBOZU_TEST_EQUAL(it0 == m0.end(), it1 == m1.end());
+            if (it0 == m0.end()) continue;
+            CYBOZU_TEST_EQUAL(it0->first, it1->first);
+            it0 = m0.erase(it0);
+            it1 = m1.erase(it1);
+            CYBOZU_TEST_EQUAL(it0 == m0.end(), it1 == m1.end());
+            if (it0 != m0.end()) CYBOZU_TEST_EQUAL(it0->first, it1->first);
+        } else if (op < 9) {
+            const uint64_t key1 = key + rand_() % 64;
+            Map0::iterator it0 = m0.erase(m0.lower_bound(key), m0.lower_bound(key1));
+            Map1::iterator it1 = m1.erase(m1.lower_bound(key), m1.lower_bound(key1));
+            CYBOZU_TEST_EQUAL(it0 == m0.end(), it1 == m1.end());
+            if (it0 != m0.end()) CYBOZU_TEST_EQUAL(it0->first, it1->first);
+        } else {
+            /* Move a key to the smallest free key after the previous one. */
+            Map1::iterator it1 = m1.lower_bound(key);
+            if (it1 == m1.end()) continue;
+            uint64_t newKey = 0;
+            if (it1 != m1.begin()) {
+                Map1::iterator prev = it1;
+                --prev;
+                newKey = prev->first + 1;
+            }
+            if (newKey == it1->first) continue;
+            Map0::iterator it0 = m0.find(it1->first);
+            std::string val = it0->second;
+            m0.erase(it0);
+            m0.emplace(newKey, val);
+            m1.rekey(it1, newKey);
+        }
+        if (i % 100 == 0) verifyEqual(m0, m1);
+    }
+    verifyEqual(m0, m1);
+    CYBOZU_TEST_ASSERT(m1.nrChunks() <= m1.size());
+    m1.erase(m1.begin(), m1.end());
+    CYBOZU_TEST_ASSERT(m1.empty());
+    CYBOZU_TEST_ASSERT(m1.isValid());
+}
@@ -38,6 +38,50 @@ CYBOZU_TEST_AUTO(compressedData)
     }
 }
 
+CYBOZU_TEST_AUTO(compressFromMove)
+{
+    cybozu::util::Random<uint32_t> rand;
+    for (size_t i = 0; i < 100; i++) {
+        const size_t s = rand.get16() + 32;
+        AlignedArray v(s);
+        const bool isRandom = i % 2 == 0;
+        if (isRandom) {
+            rand.fill(&v[0], s);
+        } else {
+            rand.fill(&v[0], 32);
+        }
+        const AlignedArray orig(v);
+        const char *ptr = v.data();
+        CompressedData cd;
+        cd.compressFrom(std::move(v));
+        if (!cd.isCompressed()) {
+            CYBOZU_TEST_ASSERT(cd.rawData() == ptr); // not copied.
+        }
+        AlignedArray out;
+        cd.getUncompressed(out);
+        CYBOZU_TEST_EQUAL(out.size(), orig.size());
+        CYBOZU_TEST_ASSERT(::memcmp(out.data(), orig.data(), out.size()) == 0);
+    }
+}
+
+CYBOZU_TEST_AUTO(tryCompressToVec)
+{
+    cybozu::util::Random<uint32_t> rand;
+    const size_t s = 64 * 1024;
+    AlignedArray v(s);
+    rand.fill(&v[0], s);
+    AlignedArray out;
+    CYBOZU_TEST_ASSERT(!cmpr_local::tryCompressToVec(v.data(), s, out));
+    CYBOZU_TEST_ASSERT(out.empty());
+
+    ::memset(&v[0], 0x5a, s);
+    CYBOZU_TEST_ASSERT(cmpr_local::tryCompressToVec(v.data(), s, out));
+    CYBOZU_TEST_ASSERT(out.size() < s);
+    AlignedArray dec;
+    cmpr_local::uncompressToVec(out.data(), out.size(), dec, s);
+    CYBOZU_TEST_ASSERT(::memcmp(dec.data(), v.data(), s) == 0);
+}
+
 void throwErrorIf(std::vector<std::exception_ptr> &&ev)
 {
     bool isError = false;
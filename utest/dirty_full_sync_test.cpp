@@ -0,0 +1,164 @@
+#include "cybozu/test.hpp"
+#include "cybozu/socket.hpp"
+#include "dirty_full_sync.hpp"
+#include "constant.hpp"
+#include "tmp_file.hpp"
+#include "random.hpp"
+#include "for_test.hpp"
+
+using namespace walb;
+
+cybozu::util::Random<size_t> g_rand;
+
+const uint64_t BULK_LB = 128;
+const uint64_t MIN_SKIP_LB = DIRTY_FULL_SYNC_MIN_SKIP_LB;
+
+/*
+ * Layout of the source [logical block].
+ *   data0: allocated.
+ *   hole0: longer than MIN_SKIP_LB and not a multiple of BULK_LB,
+ *          so it is skipped except the last partial bulk, which is read.
+ *   data1: allocated.
+ *   hole1: shorter than MIN_SKIP_LB, so it is read and sent as zero bulks.
+ *   data2: allocated.
+ *   tail:  shorter than MIN_SKIP_LB, but it is skipped since it is the last range.
+ */
+const uint64_t DATA0_LB = BULK_LB * 3;
+const uint64_t HOLE0_ADDR = DATA0_LB;
+const uint64_t HOLE0_LB = MIN_SKIP_LB + BULK_LB * 2 + 8;
+const uint64_t DATA1_ADDR = HOLE0_ADDR + HOLE0_LB;
+const uint64_t DATA1_LB = BULK_LB * 2 + 16;
+const uint64_t HOLE1_ADDR = DATA1_ADDR + DATA1_LB;
+const uint64_t HOLE1_LB = BULK_LB * 4;
+const uint64_t DATA2_ADDR = HOLE1_ADDR + HOLE1_LB;
+const uint64_t DATA2_LB = BULK_LB * 3;
+const uint64_t TAIL_ADDR = DATA2_ADDR + DATA2_LB;
+const uint64_t TAIL_LB = 1000;
+const uint64_t SIZE_LB = TAIL_ADDR + TAIL_LB; // not a multiple of the bulk size.
+
+struct SparseSource
+{
+    cybozu::TmpFile tmpFile;
+    AllocMap allocMap;
+
+    SparseSource() : tmpFile("."), allocMap() {
+        cybozu::util::File file(tmpFile.fd());
+        file.ftruncate(SIZE_LB * LOGICAL_BLOCK_SIZE);
+        writeRandom(file, 0, DATA0_LB);
+        writeRandom(file, DATA1_ADDR, DATA1_LB);
+        writeRandom(file, DATA2_ADDR, DATA2_LB);
+        file.fdatasync();
+        allocMap.setAvailable();
+    }
+    void writeRandom(cybozu::util::File &file, uint64_t addr, uint64_t lb) {
+        std::vector<char> buf(lb * LOGICAL_BLOCK_SIZE);
+        g_rand.fill(buf.data(), buf.size());
+        file.pwrite(buf.data(), buf.size(), addr * LOGICAL_BLOCK_SIZE);
+        allocMap.add(addr, lb);
+    }
+};
+
+std::vector<char> readAll(const std::string &path)
+{
+    cybozu::util::File file(path, O_RDONLY);
+    std::vector<char> v(SIZE_LB * LOGICAL_BLOCK_SIZE);
+    file.read(v.data(), v.size());
+    return v;
+}
+
+void fillGarbage(const std::string &path, uint64_t addr, uint64_t lb)
+{
+    cybozu::util::File file(path, O_RDWR);
+    const std::vector<char> buf(MEBI, 0x5a);
+    const uint64_t unitLb = buf.size() / LOGICAL_BLOCK_SIZE;
+    while (lb > 0) {
+        const uint64_t lb0 = std::min(lb, unitLb);
+        file.pwrite(buf.data(), lb0 * LOGICAL_BLOCK_SIZE, addr * LOGICAL_BLOCK_SIZE);
+        addr += lb0;
+        lb -= lb0;
+    }
+    file.fdatasync();
+}
+
+/**
+ * Sync dst from startLb to the end through a loopback connection.
+ */
+void runSync(const std::string &srcPath, const AllocMap &allocMap, const std::string &dstPath,
+             uint64_t startLb, bool skipZero)
+{
+    const CompressOpt cmprOpt(::WALB_DIFF_CMPR_SNAPPY, 0, 2);
+    const std::atomic<int> stopState(NotStopping);
+    const ProcessStatus ps;
+    const std::atomic<uint64_t> maxLbPerSec(0);
+    std::atomic<uint64_t> progressLb(0);
+
+    cybozu::Socket ssock;
+    const uint16_t port = bindPort(ssock);
+    cybozu::thread::ThreadRunner serverTh([&]() {
+        cybozu::Socket sock;
+        ssock.accept(sock);
+        packet::Packet pkt(sock);
+        CYBOZU_TEST_ASSERT(dirtyFullSyncServer(
+            pkt, dstPath, startLb, SIZE_LB, BULK_LB, cmprOpt, stopState, ps, progressLb,
+            skipZero, 4 * MEBI));
+    });
+    serverTh.start();
+    {
+        cybozu::Socket sock;
+        sock.connect("localhost", port);
+        packet::Packet pkt(sock);
+        CYBOZU_TEST_ASSERT(dirtyFullSyncClient(
+            pkt, srcPath, startLb, SIZE_LB, BULK_LB, cmprOpt, stopState, ps, maxLbPerSec, allocMap));
+    }
+    serverTh.join();
+}
+
+CYBOZU_TEST_AUTO(zeroFill)
+{
+    const SparseSource src;
+    for (bool useAllocMap : {true, false}) {
+        cybozu::TmpFile dst(".");
+        cybozu::util::File(dst.fd()).ftruncate(SIZE_LB * LOGICAL_BLOCK_SIZE);
+        fillGarbage(dst.path(), 0, SIZE_LB);
+        runSync(src.tmpFile.path(), useAllocMap ? src.allocMap : AllocMap(), dst.path(), 0, false);
+        CYBOZU_TEST_ASSERT(readAll(dst.path()) == readAll(src.tmpFile.path()));
+    }
+}
+
+CYBOZU_TEST_AUTO(discard)
+{
+    const SparseSource src;
+    cybozu::TmpFile dst(".");
+    cybozu::util::File(dst.fd()).ftruncate(SIZE_LB * LOGICAL_BLOCK_SIZE);
+    /* Only the skipped ranges must be cleared since zero bulks are not written. */
+    fillGarbage(dst.path(), HOLE0_ADDR, HOLE0_LB);
+    fillGarbage(dst.path(), TAIL_ADDR, TAIL_LB);
+    runSync(src.tmpFile.path(), src.allocMap, dst.path(), 0, true);
+    CYBOZU_TEST_ASSERT(readAll(dst.path()) == readAll(src.tmpFile.path()));
+
+    AllocMap map;
+    if (!getFileAllocMap(dst.fd(), map)) {
+        ::printf("SEEK_DATA/SEEK_HOLE are not supported.\n");
+        return;
+    }
+    /* The skipped part of hole0 is a multiple of the bulk size. */
+    CYBOZU_TEST_ASSERT(map.getNextAllocated(HOLE0_ADDR) >= HOLE0_ADDR + HOLE0_LB / BULK_LB * BULK_LB);
+}
+
+CYBOZU_TEST_AUTO(resume)
+{
+    const SparseSource src;
+    const std::vector<char> srcImage = readAll(src.tmpFile.path());
+    /* In hole0, at data1, and in the tail. */
+    for (uint64_t startLb : {HOLE0_ADDR + 100, DATA1_ADDR, TAIL_ADDR + 10}) {
+        cybozu::TmpFile dst(".");
+        cybozu::util::File(dst.fd()).ftruncate(SIZE_LB * LOGICAL_BLOCK_SIZE);
+        fillGarbage(dst.path(), 0, SIZE_LB);
+        const std::vector<char> garbage = readAll(dst.path());
+        runSync(src.tmpFile.path(), src.allocMap, dst.path(), startLb, false);
+        const std::vector<char> dstImage = readAll(dst.path());
+        const size_t off = startLb * LOGICAL_BLOCK_SIZE;
+        CYBOZU_TEST_ASSERT(std::equal(dstImage.begin(), dstImage.begin() + off, garbage.begin()));
+        CYBOZU_TEST_ASSERT(std::equal(dstImage.begin() + off, dstImage.end(), srcImage.begin() + off));
+    }
+}
@@ -0,0 +1,209 @@
+#include "cybozu/test.hpp"
+#include "cybozu/socket.hpp"
+#include "dirty_hash_sync.hpp"
+#include "tmp_file.hpp"
+#include "random.hpp"
+#include "for_test.hpp"
+
+using namespace walb;
+
+cybozu::util::Random<size_t> g_rand;
+
+const uint64_t BULK_LB = 8;
+const uint64_t REGION_LB = BULK_LB * 4;
+const uint64_t SIZE_LB = REGION_LB * 10 + 13; // not a multiple of the region and bulk size.
+
+struct MemReader
+{
+    const std::vector<char> &image;
+    size_t off;
+
+    explicit MemReader(const std::vector<char> &image) : image(image), off(0) {}
+    void read(void *data, size_t size) {
+        CYBOZU_TEST_ASSERT(off + size <= image.size());
+        ::memcpy(data, &image[off], size);
+        off += size;
+    }
+};
+
+struct Record
+{
+    uint64_t addr;
+    uint32_t blks;
+    bool operator==(const Record &rhs) const {
+        return addr == rhs.addr && blks == rhs.blks;
+    }
+};
+
+struct SyncResult
+{
+    std::vector<char> image; // destination image after sync.
+    std::vector<Record> recV; // records of the wdiff.
+};
+
+/**
+ * Sync dst to src through a loopback connection.
+ * @regionLb requested region size. The server falls back to the flat mode if it is invalid.
+ * @doWriteDiff the server writes a wdiff if true, or applies the diffs to the image.
+ */
+SyncResult runSync(const std::vector<char> &src, const std::vector<char> &dst,
+                   uint64_t regionLb, bool doWriteDiff, uint8_t numCpu = 1)
+{
+    cybozu::TmpFile tmpFile(".");
+    cybozu::util::File file(tmpFile.fd());
+    if (!doWriteDiff) {
+        file.write(dst.data(), dst.size());
+        file.lseek(0);
+    }
+    const CompressOpt cmprOpt(::WALB_DIFF_CMPR_NONE, 0, numCpu);
+    const uint32_t hashSeed = 12345;
+    const uint8_t hashAlgo = HASH_ALGO_MURMUR3;
+    const std::atomic<int> stopState(NotStopping);
+    const ProcessStatus ps;
+    const std::atomic<uint64_t> maxLbPerSec(0);
+    std::atomic<uint64_t> progressLb(0);
+
+    cybozu::Socket ssock;
+    const uint16_t port = bindPort(ssock);
+    cybozu::thread::ThreadRunner serverTh([&]() {
+        cybozu::Socket sock;
+        ssock.accept(sock);
+        packet::Packet pkt(sock);
+        uint64_t serverRegionLb = 0;
+        pkt.read(serverRegionLb);
+        if (!isValidHashTreeRegionLb(serverRegionLb, BULK_LB)) serverRegionLb = 0;
+        pkt.write(serverRegionLb);
+        pkt.flush();
+        MemReader reader(dst);
+        CYBOZU_TEST_ASSERT(dirtyHashSyncServer(
+            pkt, reader, SIZE_LB, BULK_LB, cybozu::Uuid(), hashSeed, hashAlgo, doWriteDiff, file.fd(),
+            DiscardType::Passdown, stopState, ps, progressLb, MEBI, numCpu, serverRegionLb));
+    });
+    serverTh.start();
+    {
+        cybozu::Socket sock;
+        sock.connect("localhost", port);
+        packet::Packet pkt(sock);
+        pkt.write(regionLb);
+        pkt.flush();
+        pkt.read(regionLb);
+        MemReader reader(src);
+        CYBOZU_TEST_ASSERT(dirtyHashSyncClient(
+            pkt, reader, SIZE_LB, BULK_LB, cmprOpt, hashSeed, hashAlgo,
+            stopState, ps, maxLbPerSec, regionLb));
+    }
+    serverTh.join();
+
+    SyncResult ret;
+    ret.image = dst;
+    file.lseek(0);
+    if (doWriteDiff) {
+        SortedDiffReader reader(file.fd());
+        DiffFileHeader header;
+        reader.readHeader(header);
+        DiffRecord rec;
+        AlignedArray data;
+        while (reader.readDiff(rec, data)) {
+            CYBOZU_TEST_ASSERT(rec.isNormal());
+            ret.recV.push_back({rec.io_address, rec.io_blocks});
+            ::memcpy(&ret.image[rec.io_address * LOGICAL_BLOCK_SIZE], data.data(), data.size());
+        }
+    } else {
+        file.read(ret.image.data(), ret.image.size());
+    }
+    return ret;
+}
+
+void fillRandom(std::vector<char> &v, uint64_t addr, uint64_t lb)
+{
+    g_rand.fill(&v[addr * LOGICAL_BLOCK_SIZE], lb * LOGICAL_BLOCK_SIZE);
+}
+
+/**
+ * The tree mode must produce the same output as the flat mode.
+ * RETURN:
+ *   total dirty blocks.
+ */
+uint64_t verifyTreeAndFlat(const std::vector<char> &src, const std::vector<char> &dst)
+{
+    uint64_t dirtyLb = 0;
+    for (bool doWriteDiff : {false, true}) {
+        const SyncResult flat = runSync(src, dst, 0, doWriteDiff);
+        const SyncResult tree = runSync(src, dst, REGION_LB, doWriteDiff);
+        CYBOZU_TEST_ASSERT(flat.image == src);
+        CYBOZU_TEST_ASSERT(tree.image == src);
+        CYBOZU_TEST_ASSERT(flat.recV == tree.recV);
+        if (doWriteDiff) {
+            for (const Record &rec : tree.recV) dirtyLb += rec.blks;
+        }
+    }
+    return dirtyLb;
+}
+
+CYBOZU_TEST_AUTO(treeSyncIdentical)
+{
+    std::vector<char> src(SIZE_LB * LOGICAL_BLOCK_SIZE);
+    fillRandom(src, 0, SIZE_LB);
+    CYBOZU_TEST_EQUAL(verifyTreeAndFlat(src, src), 0);
+}
+
+CYBOZU_TEST_AUTO(treeSyncPartlyDifferent)
+{
+    std::vector<char> src(SIZE_LB * LOGICAL_BLOCK_SIZE);
+    fillRandom(src, 0, SIZE_LB);
+    std::vector<char> dst = src;
+    fillRandom(dst, 0, 1); // the first bulk.
+    fillRandom(dst, REGION_LB * 2 + BULK_LB + 3, 2); // a bulk in the middle of a region.
+    fillRandom(dst, REGION_LB * 5 - 1, 2); // across regions.
+    fillRandom(dst, SIZE_LB - 1, 1); // the last partial bulk.
+    /* 4 full bulks and the last partial bulk (13 % 8 = 5 LB). */
+    CYBOZU_TEST_EQUAL(verifyTreeAndFlat(src, dst), BULK_LB * 4 + 5);
+}
+
+CYBOZU_TEST_AUTO(treeSyncFullyDifferent)
+{
+    std::vector<char> src(SIZE_LB * LOGICAL_BLOCK_SIZE), dst(SIZE_LB * LOGICAL_BLOCK_SIZE);
+    fillRandom(src, 0, SIZE_LB);
+    fillRandom(dst, 0, SIZE_LB);
+    CYBOZU_TEST_EQUAL(verifyTreeAndFlat(src, dst), SIZE_LB);
+}
+
+CYBOZU_TEST_AUTO(treeSyncInvalidRegion)
+{
+    CYBOZU_TEST_ASSERT(isValidHashTreeRegionLb(REGION_LB, BULK_LB));
+    const uint64_t invalidV[] = {
+        BULK_LB, // just one bulk.
+        REGION_LB + 1, // not a multiple of the bulk size.
+        DIRTY_HASH_SYNC_MAX_REGION_LB + BULK_LB, // too large.
+    };
+    std::vector<char> src(SIZE_LB * LOGICAL_BLOCK_SIZE);
+    fillRandom(src, 0, SIZE_LB);
+    std::vector<char> dst = src;
+    fillRandom(dst, REGION_LB * 3, BULK_LB * 2);
+    const SyncResult flat = runSync(src, dst, 0, true);
+    for (uint64_t regionLb : invalidV) {
+        CYBOZU_TEST_ASSERT(!isValidHashTreeRegionLb(regionLb, BULK_LB));
+        const SyncResult ret = runSync(src, dst, regionLb, true);
+        CYBOZU_TEST_ASSERT(ret.image == src);
+        CYBOZU_TEST_ASSERT(ret.recV == flat.recV);
+    }
+    CYBOZU_TEST_EQUAL(getHashTreeRegionLb(0, BULK_LB), 0);
+    CYBOZU_TEST_EQUAL(getHashTreeRegionLb(1, BULK_LB), MEBI / LOGICAL_BLOCK_SIZE);
+}
+
+CYBOZU_TEST_AUTO(parallelHashSync)
+{
+    std::vector<char> src(SIZE_LB * LOGICAL_BLOCK_SIZE);
+    fillRandom(src, 0, SIZE_LB);
+    std::vector<char> dst = src;
+    for (uint64_t addr = 0; addr < SIZE_LB; addr += BULK_LB * 3) fillRandom(dst, addr, 1);
+    for (uint64_t regionLb : {uint64_t(0), REGION_LB}) {
+        const SyncResult single = runSync(src, dst, regionLb, true, 1);
+        CYBOZU_TEST_ASSERT(single.image == src);
+        for (uint8_t numCpu : {2, 4}) {
+            const SyncResult parallel = runSync(src, dst, regionLb, true, numCpu);
+            CYBOZU_TEST_ASSERT(parallel.image == src);
+            CYBOZU_TEST_ASSERT(parallel.recV == single.recV);
+        }
+    }
+}
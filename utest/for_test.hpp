@@ -2,6 +2,8 @@
 
 #include <string>
 #include <stdexcept>
+#include <unistd.h>
+#include "cybozu/socket.hpp"
 #include "file_path.hpp"
 #include "meta.hpp"
 #include "wdiff_data.hpp"
@@ -50,3 +52,19 @@ void createDiffFile(const walb::WalbDiffFiles &diffFiles, walb::MetaDiff &diff)
         + cybozu::FilePath(walb::createDiffFileName(diff));
     cybozu::util::createEmptyFile(fp.str());
 }
+
+/**
+ * The port may be used by another process.
+ */
+uint16_t bindPort(cybozu::Socket &sock)
+{
+    for (size_t i = 0; i < 100; i++) {
+        const uint16_t port = 30000 + (::getpid() + i * 97) % 20000;
+        try {
+            sock.bind(port);
+            return port;
+        } catch (std::exception &) {
+        }
+    }
+    throw cybozu::Exception(__func__) << "no port available";
+}
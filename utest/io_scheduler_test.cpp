@@ -0,0 +1,209 @@
+#include "cybozu/test.hpp"
+#include "io_scheduler.hpp"
+#include "constant.hpp"
+#include "thread_util.hpp"
+#include <atomic>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <chrono>
+
+using namespace walb;
+
+/**
+ * The clock advances only by advance().
+ */
+struct FakeClock
+{
+    const IoScheduler::Clock::time_point base;
+    std::atomic<uint64_t> ms;
+
+    FakeClock() : base(IoScheduler::Clock::now()), ms(0) {}
+    IoScheduler::Clock::time_point now() const {
+        return base + std::chrono::milliseconds(ms.load());
+    }
+    void advance(uint64_t addMs) { ms += addMs; }
+};
+
+template <typename Pred>
+void waitFor(Pred &&pred)
+{
+    while (!pred()) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+}
+
+const uint64_t IO_SIZE = 12 * KIBI; // divisible by the weights used in the tests.
+
+/**
+ * Each volume issues nrIos IOs in its own thread.
+ * The limit is 1 IOPS, whose bucket holds just 0.1 IOs,
+ * and the clock advances by 1 second only when all the unfinished volumes are waiting,
+ * so just one IO is allowed at each step.
+ * The volumes start waiting in order of volIdV.
+ * RETURN:
+ *   indexes of volIdV in order of the allowed IOs.
+ */
+std::vector<size_t> runVolumes(IoScheduler &sched, FakeClock &clock,
+                               const std::vector<std::string> &volIdV, size_t nrIos)
+{
+    sched.setLimit(0, 1);
+    CYBOZU_TEST_ASSERT(sched.acquire("drain", IO_SIZE)); // the bucket is in debt.
+
+    std::mutex mu;
+    std::vector<size_t> orderV;
+    auto getNrAllowed = [&]() {
+        std::lock_guard<std::mutex> lk(mu);
+        return orderV.size();
+    };
+    std::vector<cybozu::thread::ThreadRunner> thV;
+    for (size_t i = 0; i < volIdV.size(); i++) {
+        cybozu::thread::ThreadRunner th([&, i]() {
+            for (size_t j = 0; j < nrIos; j++) {
+                CYBOZU_TEST_ASSERT(sched.acquire(volIdV[i], IO_SIZE));
+                std::lock_guard<std::mutex> lk(mu);
+                orderV.push_back(i);
+            }
+        });
+        th.start();
+        thV.push_back(std::move(th));
+        waitFor([&]() { return sched.getNrWaiting() == i + 1; });
+    }
+    const size_t total = volIdV.size() * nrIos;
+    for (size_t nr = 0; nr < total; nr++) {
+        std::vector<size_t> nrV(volIdV.size());
+        {
+            std::lock_guard<std::mutex> lk(mu);
+            for (size_t i : orderV) nrV[i]++;
+        }
+        const size_t nrUnfinished = std::count_if(
+            nrV.begin(), nrV.end(), [&](size_t n) { return n < nrIos; });
+        waitFor([&]() { return sched.getNrWaiting() == nrUnfinished; });
+        CYBOZU_TEST_EQUAL(getNrAllowed(), nr);
+        clock.advance(1000);
+        waitFor([&]() { return getNrAllowed() == nr + 1; });
+    }
+    for (cybozu::thread::ThreadRunner &th : thV) th.join();
+    return orderV;
+}
+
+CYBOZU_TEST_AUTO(unlimited)
+{
+    IoScheduler sched;
+    for (size_t i = 0; i < 100; i++) {
+        CYBOZU_TEST_ASSERT(sched.acquire("vol0", 4096));
+    }
+    CYBOZU_TEST_EQUAL(sched.getTotalIos("vol0"), 100);
+}
+
+CYBOZU_TEST_AUTO(limit)
+{
+    FakeClock clock;
+    IoScheduler sched([&]() { return clock.now(); });
+    auto stop = []() { return true; };
+
+    /* The bucket holds 1 IO. An IO is allowed until the bucket is in debt. */
+    sched.setLimit(0, 10);
+    CYBOZU_TEST_ASSERT(sched.acquire("vol0", 4096));
+    CYBOZU_TEST_ASSERT(sched.acquire("vol0", 4096));
+    CYBOZU_TEST_ASSERT(!sched.acquire("vol0", 4096, stop));
+    clock.advance(100);
+    CYBOZU_TEST_ASSERT(sched.acquire("vol0", 4096));
+    CYBOZU_TEST_ASSERT(!sched.acquire("vol0", 4096, stop));
+    /* The bucket does not hold more than its capacity. */
+    clock.advance(10 * 1000);
+    CYBOZU_TEST_ASSERT(sched.acquire("vol0", 4096));
+    CYBOZU_TEST_ASSERT(sched.acquire("vol0", 4096));
+    CYBOZU_TEST_ASSERT(!sched.acquire("vol0", 4096, stop));
+    CYBOZU_TEST_EQUAL(sched.getTotalIos("vol0"), 5);
+
+    /* An IO larger than the budget is allowed and makes a debt. */
+    sched.setLimit(40960, 0);
+    CYBOZU_TEST_ASSERT(sched.acquire("vol0", 4096 * 2));
+    CYBOZU_TEST_ASSERT(!sched.acquire("vol0", 4096, stop));
+    clock.advance(50);
+    CYBOZU_TEST_ASSERT(!sched.acquire("vol0", 4096, stop));
+    clock.advance(50);
+    CYBOZU_TEST_ASSERT(sched.acquire("vol0", 4096));
+    CYBOZU_TEST_EQUAL(sched.getNrWaiting(), 0);
+}
+
+CYBOZU_TEST_AUTO(weight)
+{
+    FakeClock clock;
+    IoScheduler sched([&]() { return clock.now(); });
+    sched.setWeight("vol0", 1);
+    sched.setWeight("vol1", 3);
+    const std::vector<size_t> orderV = runVolumes(sched, clock, {"vol0", "vol1"}, 6);
+    const std::vector<size_t> expected = {0, 1, 1, 1, 0, 1, 1, 1, 0, 0, 0, 0};
+    CYBOZU_TEST_ASSERT(orderV == expected);
+}
+
+CYBOZU_TEST_AUTO(priority)
+{
+    FakeClock clock;
+    IoScheduler sched([&]() { return clock.now(); });
+    sched.setPriority("vol1", 1);
+    const std::vector<size_t> orderV = runVolumes(sched, clock, {"vol0", "vol1"}, 3);
+    const std::vector<size_t> expected = {1, 1, 1, 0, 0, 0};
+    CYBOZU_TEST_ASSERT(orderV == expected);
+}
+
+CYBOZU_TEST_AUTO(backlogFirst)
+{
+    for (bool isBacklogFirst : {false, true}) {
+        FakeClock clock;
+        IoScheduler sched([&]() { return clock.now(); });
+        sched.setBacklogFirst(isBacklogFirst);
+        sched.setBacklog("vol0", 0);
+        sched.setBacklog("vol1", 4 * GIBI); // weight 4 with backlog-first.
+        const std::vector<size_t> orderV = runVolumes(sched, clock, {"vol0", "vol1"}, 5);
+        const std::vector<size_t> expected = isBacklogFirst
+            ? std::vector<size_t>{0, 1, 1, 1, 1, 0, 1, 0, 0, 0}
+            : std::vector<size_t>{0, 1, 0, 1, 0, 1, 0, 1, 0, 1};
+        CYBOZU_TEST_ASSERT(orderV == expected);
+    }
+}
+
+CYBOZU_TEST_AUTO(stopDoesNotCharge)
+{
+    FakeClock clock;
+    IoScheduler sched([&]() { return clock.now(); });
+    auto stop = []() { return true; };
+    sched.setLimit(0, 1);
+    CYBOZU_TEST_ASSERT(sched.acquire("drain", IO_SIZE));
+    /* A stopped IO must not delay the following IOs of the volume. */
+    CYBOZU_TEST_ASSERT(!sched.acquire("vol0", IO_SIZE * 100, stop));
+    CYBOZU_TEST_EQUAL(sched.getTotalIos("vol0"), 0);
+    const std::vector<size_t> orderV = runVolumes(sched, clock, {"vol0", "vol1"}, 3);
+    const std::vector<size_t> expected = {0, 1, 0, 1, 0, 1};
+    CYBOZU_TEST_ASSERT(orderV == expected);
+}
+
+CYBOZU_TEST_AUTO(removeVolume)
+{
+    FakeClock clock;
+    IoScheduler sched([&]() { return clock.now(); });
+    sched.setWeight("vol0", 3);
+    CYBOZU_TEST_ASSERT(sched.acquire("vol0", IO_SIZE));
+    CYBOZU_TEST_EQUAL(sched.getNrVolumes(), 1);
+    sched.removeVolume("vol0");
+    sched.removeVolume("vol1"); // not exists.
+    CYBOZU_TEST_EQUAL(sched.getNrVolumes(), 0);
+    CYBOZU_TEST_EQUAL(sched.getTotalIos("vol0"), 0);
+
+    /* A volume is not removed while its IO is waiting. */
+    sched.setLimit(0, 1);
+    CYBOZU_TEST_ASSERT(sched.acquire("drain", IO_SIZE));
+    cybozu::thread::ThreadRunner th([&]() {
+        CYBOZU_TEST_ASSERT(sched.acquire("vol0", IO_SIZE));
+    });
+    th.start();
+    waitFor([&]() { return sched.getNrWaiting() == 1; });
+    sched.removeVolume("vol0");
+    CYBOZU_TEST_EQUAL(sched.getNrVolumes(), 2);
+    clock.advance(1000);
+    th.join();
+    CYBOZU_TEST_EQUAL(sched.getTotalIos("vol0"), 1);
+    sched.removeVolume("vol0");
+    sched.removeVolume("drain");
+    CYBOZU_TEST_EQUAL(sched.getNrVolumes(), 0);
+}
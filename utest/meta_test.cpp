@@ -865,6 +865,44 @@ CYBOZU_TEST_AUTO(metaDiffManagerMerge1)
     }
 }
 
+/**
+ * d0  |0|-->|1|
+ * d1        |1|-->|2|
+ * d2              |2|-->|3|
+ * d3  |0|-------------->|3| (merged)
+ * d4                    |3|-->|4|
+ */
+CYBOZU_TEST_AUTO(metaDiffManagerRestoreCost)
+{
+    MetaDiffVec v;
+    v.emplace_back(0, 1, true, 1000);
+    v.emplace_back(1, 2, true, 1001);
+    v.emplace_back(2, 3, true, 1002);
+    v.emplace_back(0, 3, true, 1002);
+    v.emplace_back(3, 4, false, 1003);
+    const uint64_t sizeV[] = {100, 200, 300, 400, 500};
+    MetaDiffManager mgr;
+    for (size_t i = 0; i < v.size(); i++) {
+        v[i].dataSize = sizeV[i];
+        mgr.add(v[i]);
+    }
+    uint64_t cost;
+    CYBOZU_TEST_ASSERT(mgr.getRestoreCost(MetaState(MetaSnap(0), 0), 0, cost));
+    CYBOZU_TEST_EQUAL(cost, 0);
+    /* The snapshots 1 and 2 are hidden by the merged diff d3. */
+    CYBOZU_TEST_ASSERT(!mgr.getRestoreCost(MetaState(MetaSnap(0), 0), 1, cost));
+    CYBOZU_TEST_ASSERT(!mgr.getRestoreCost(MetaState(MetaSnap(0), 0), 2, cost));
+    /* The merged diff d3 is used. */
+    CYBOZU_TEST_ASSERT(mgr.getRestoreCost(MetaState(MetaSnap(0), 0), 4, cost));
+    CYBOZU_TEST_EQUAL(cost, 900);
+    CYBOZU_TEST_ASSERT(mgr.getRestoreCost(MetaState(MetaSnap(2), 0), 4, cost));
+    CYBOZU_TEST_EQUAL(cost, 800);
+    CYBOZU_TEST_ASSERT(mgr.getRestoreCost(MetaState(MetaSnap(3), 0), 4, cost));
+    CYBOZU_TEST_EQUAL(cost, 500);
+    CYBOZU_TEST_ASSERT(!mgr.getRestoreCost(MetaState(MetaSnap(3), 0), 2, cost));
+    CYBOZU_TEST_ASSERT(!mgr.getRestoreCost(MetaState(MetaSnap(0), 0), 5, cost));
+}
+
 CYBOZU_TEST_AUTO(metaDiffManagerMerge2)
 {
     MetaSnap snap(0);
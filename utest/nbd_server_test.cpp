@@ -0,0 +1,254 @@
+#include "cybozu/test.hpp"
+#include "nbd_server.hpp"
+#include "thread_util.hpp"
+#include "random.hpp"
+#include "walb_types.hpp"
+#include "constant.hpp"
+#include <atomic>
+#include <vector>
+#include <cstring>
+#include <endian.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+using namespace walb;
+
+cybozu::util::Random<size_t> g_rand;
+
+const uint64_t NBD_MAGIC = 0x4e42444d41474943ULL;
+const uint64_t NBD_OPTS_MAGIC = 0x49484156454f5054ULL;
+const uint64_t NBD_REP_MAGIC = 0x3e889045565a9ULL;
+
+/**
+ * Minimal NBD client for test.
+ */
+struct Client
+{
+    cybozu::util::File file;
+
+    explicit Client(int fd) : file(fd, true) {}
+    void put64(uint64_t x) { x = htobe64(x); file.write(&x, sizeof(x)); }
+    void put32(uint32_t x) { x = htobe32(x); file.write(&x, sizeof(x)); }
+    void put16(uint16_t x) { x = htobe16(x); file.write(&x, sizeof(x)); }
+    uint64_t get64() { uint64_t x; file.read(&x, sizeof(x)); return be64toh(x); }
+    uint32_t get32() { uint32_t x; file.read(&x, sizeof(x)); return be32toh(x); }
+    uint16_t get16() { uint16_t x; file.read(&x, sizeof(x)); return be16toh(x); }
+
+    void putOpt(uint32_t opt, const std::string &data) {
+        put64(NBD_OPTS_MAGIC);
+        put32(opt);
+        put32(data.size());
+        if (!data.empty()) file.write(data.data(), data.size());
+    }
+    /**
+     * RETURN:
+     *   reply type.
+     */
+    uint32_t getOptReply(uint32_t opt, std::string &data) {
+        CYBOZU_TEST_EQUAL(get64(), NBD_REP_MAGIC);
+        CYBOZU_TEST_EQUAL(get32(), opt);
+        const uint32_t type = get32();
+        data.resize(get32());
+        if (!data.empty()) file.read(&data[0], data.size());
+        return type;
+    }
+    void handshake() {
+        CYBOZU_TEST_EQUAL(get64(), NBD_MAGIC);
+        CYBOZU_TEST_EQUAL(get64(), NBD_OPTS_MAGIC);
+        CYBOZU_TEST_EQUAL(get16(), 3); // FIXED_NEWSTYLE | NO_ZEROES
+        put32(3);
+    }
+    /**
+     * RETURN:
+     *   export size [byte].
+     */
+    uint64_t go(const std::string &name) {
+        std::string data(4, '\0');
+        const uint32_t len = htobe32(name.size());
+        ::memcpy(&data[0], &len, 4);
+        data += name;
+        data += std::string(2, '\0'); // no information request.
+        putOpt(7, data);
+        std::string rep;
+        CYBOZU_TEST_EQUAL(getOptReply(7, rep), 3U); // NBD_REP_INFO
+        CYBOZU_TEST_EQUAL(rep.size(), 12);
+        uint64_t size;
+        ::memcpy(&size, &rep[2], 8);
+        uint16_t flags;
+        ::memcpy(&flags, &rep[10], 2);
+        CYBOZU_TEST_ASSERT((be16toh(flags) & 2) != 0); // READ_ONLY
+        CYBOZU_TEST_ASSERT((be16toh(flags) & 0x100) == 0); // CAN_MULTI_CONN: one client only.
+        CYBOZU_TEST_EQUAL(getOptReply(7, rep), 1U); // NBD_REP_ACK
+        return be64toh(size);
+    }
+    void putReq(uint16_t type, uint64_t handle, uint64_t offset, uint32_t len) {
+        put32(0x25609513);
+        put16(0);
+        put16(type);
+        put64(handle);
+        put64(offset);
+        put32(len);
+    }
+    uint32_t getReply(uint64_t handle) {
+        CYBOZU_TEST_EQUAL(get32(), 0x67446698U);
+        const uint32_t error = get32();
+        CYBOZU_TEST_EQUAL(get64(), handle);
+        return error;
+    }
+};
+
+void makeSocketPair(int &fd0, int &fd1)
+{
+    int fds[2];
+    CYBOZU_TEST_EQUAL(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    fd0 = fds[0];
+    fd1 = fds[1];
+}
+
+CYBOZU_TEST_AUTO(nbdRead)
+{
+    const size_t size = 1 * MEBI;
+    std::vector<char> image(size);
+    g_rand.fill(image.data(), image.size());
+    NbdServer server("vol0", size, [&](uint64_t offset, size_t s, void *data) {
+        ::memcpy(data, &image[offset], s);
+    });
+
+    int fd0, fd1;
+    makeSocketPair(fd0, fd1);
+    cybozu::util::File serverFile(fd0, true);
+    bool isFinished = false;
+    cybozu::thread::ThreadRunner th([&]() { isFinished = server.serve(serverFile); });
+    th.start();
+
+    Client client(fd1);
+    client.handshake();
+    std::string rep;
+    client.putOpt(100, ""); // unknown option.
+    CYBOZU_TEST_EQUAL(client.getOptReply(100, rep), 0x80000001U); // NBD_REP_ERR_UNSUP
+    /* Broken NBD_OPT_INFO. */
+    for (uint32_t nameLen : {0xffffffffU, 0xfffffffaU, 5U}) {
+        std::string data(4, '\0');
+        const uint32_t len = htobe32(nameLen);
+        ::memcpy(&data[0], &len, 4);
+        data += "vol0";
+        data += std::string(2, '\0');
+        client.putOpt(6, data);
+        CYBOZU_TEST_EQUAL(client.getOptReply(6, rep), 0x80000003U); // NBD_REP_ERR_INVALID
+    }
+    {
+        std::string data(4, '\0'); // empty name.
+        data += std::string("\x00\x02\x00\x03", 4); // 2 information requests but only 1 follows.
+        client.putOpt(6, data);
+        CYBOZU_TEST_EQUAL(client.getOptReply(6, rep), 0x80000003U); // NBD_REP_ERR_INVALID
+    }
+    CYBOZU_TEST_EQUAL(client.go("vol0"), size);
+
+    std::vector<char> buf;
+    for (uint64_t handle = 0; handle < 100; handle++) {
+        const uint64_t offset = g_rand() % size;
+        const uint32_t len = g_rand() % std::min<size_t>(size - offset, 64 * KIBI) + 1;
+        client.putReq(0, handle, offset, len); // READ
+        CYBOZU_TEST_EQUAL(client.getReply(handle), 0U);
+        buf.resize(len);
+        client.file.read(buf.data(), len);
+        CYBOZU_TEST_ASSERT(::memcmp(buf.data(), &image[offset], len) == 0);
+    }
+    client.putReq(0, 100, size - 512, 1024); // out of range.
+    CYBOZU_TEST_EQUAL(client.getReply(100), 22U); // EINVAL
+    client.putReq(1, 101, 0, 512); // WRITE
+    client.file.write(image.data(), 512);
+    CYBOZU_TEST_EQUAL(client.getReply(101), 1U); // EPERM
+    client.putReq(3, 102, 0, 0); // FLUSH
+    CYBOZU_TEST_EQUAL(client.getReply(102), 0U);
+    client.putReq(2, 103, 0, 0); // DISC
+    th.join();
+    CYBOZU_TEST_ASSERT(isFinished);
+    CYBOZU_TEST_EQUAL(server.nrReads(), 100);
+}
+
+CYBOZU_TEST_AUTO(nbdStop)
+{
+    NbdServer server("vol0", MEBI, [](uint64_t, size_t, void *) {});
+    int fd0, fd1;
+    makeSocketPair(fd0, fd1);
+    cybozu::util::File serverFile(fd0, true);
+    std::atomic<bool> shouldStop(false);
+    bool isFinished = true;
+    cybozu::thread::ThreadRunner th([&]() {
+        isFinished = server.serve(serverFile, [&]() { return shouldStop.load(); });
+    });
+    th.start();
+    Client client(fd1);
+    client.handshake();
+    CYBOZU_TEST_EQUAL(client.go(""), MEBI);
+    shouldStop = true;
+    th.join();
+    CYBOZU_TEST_ASSERT(!isFinished);
+}
+
+CYBOZU_TEST_AUTO(nbdSilentClient)
+{
+    /* A client that connects and goes silent. */
+    {
+        NbdServer server("vol0", MEBI, [](uint64_t, size_t, void *) {}, 100);
+        int fd0, fd1;
+        makeSocketPair(fd0, fd1);
+        cybozu::util::File serverFile(fd0, true);
+        Client client(fd1);
+        CYBOZU_TEST_EXCEPTION(server.serve(serverFile), cybozu::Exception);
+    }
+    /* It can be stopped during the handshake. */
+    {
+        NbdServer server("vol0", MEBI, [](uint64_t, size_t, void *) {});
+        int fd0, fd1;
+        makeSocketPair(fd0, fd1);
+        cybozu::util::File serverFile(fd0, true);
+        Client client(fd1);
+        CYBOZU_TEST_ASSERT(!server.serve(serverFile, []() { return true; }));
+    }
+    /* A client that sends a part of a request and goes silent. */
+    {
+        NbdServer server("vol0", MEBI, [](uint64_t, size_t, void *) {}, 1000);
+        int fd0, fd1;
+        makeSocketPair(fd0, fd1);
+        cybozu::util::File serverFile(fd0, true);
+        std::atomic<bool> isThrown(false);
+        cybozu::thread::ThreadRunner th([&]() {
+            try {
+                server.serve(serverFile);
+            } catch (cybozu::Exception &) {
+                isThrown = true;
+            }
+        });
+        th.start();
+        Client client(fd1);
+        client.handshake();
+        CYBOZU_TEST_EQUAL(client.go(""), MEBI);
+        client.put32(0x25609513);
+        th.join();
+        CYBOZU_TEST_ASSERT(isThrown);
+    }
+}
+
+CYBOZU_TEST_AUTO(nbdListener)
+{
+    const std::string path = "./nbd_server_test.sock";
+    NbdListener listener;
+    listener.listen("unix:" + path);
+    cybozu::util::File file;
+    CYBOZU_TEST_ASSERT(!listener.accept(file, 100));
+
+    const int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    CYBOZU_TEST_ASSERT(fd >= 0);
+    Client client(fd);
+    struct sockaddr_un addr;
+    ::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    ::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    CYBOZU_TEST_EQUAL(::connect(fd, (const struct sockaddr *)&addr, sizeof(addr)), 0);
+    CYBOZU_TEST_ASSERT(listener.accept(file, 1000));
+    listener.close();
+    CYBOZU_TEST_ASSERT(::access(path.c_str(), F_OK) != 0);
+}
@@ -71,3 +71,30 @@ CYBOZU_TEST_AUTO(pipe)
     f0.get();
     f1.get();
 }
+
+CYBOZU_TEST_AUTO(callForEachLine)
+{
+    std::vector<std::string> v;
+    auto pushLine = [&](const std::string &line) { v.push_back(line); };
+    cybozu::process::callForEachLine("/bin/sh", {"-c", "printf 'a\\nbb\\n\\nccc'"}, pushLine);
+    const std::vector<std::string> expected = {"a", "bb", "", "ccc"};
+    CYBOZU_TEST_ASSERT(v == expected);
+
+    /* Lines longer than the read buffer. */
+    v.clear();
+    cybozu::process::callForEachLine("/bin/sh", {"-c", "seq 1 100000 | tr -d '\\n'; echo; seq 1 3"}, pushLine);
+    CYBOZU_TEST_EQUAL(v.size(), 4);
+    CYBOZU_TEST_EQUAL(v[1], "1");
+    CYBOZU_TEST_EQUAL(v[3], "3");
+
+    CYBOZU_TEST_EXCEPTION(cybozu::process::callForEachLine("/bin/sh", {"-c", "echo a; exit 1"}, pushLine),
+                          std::runtime_error);
+
+    /* An error of lineFunc stops reading the output. */
+    size_t nr = 0;
+    CYBOZU_TEST_EXCEPTION(cybozu::process::callForEachLine(
+                              "/bin/sh", {"-c", "seq 1 10000000"}, [&](const std::string &) {
+                                  if (++nr == 10) throw std::out_of_range("stop");
+                              }), std::out_of_range);
+    CYBOZU_TEST_EQUAL(nr, 10);
+}
@@ -0,0 +1,77 @@
+#include "cybozu/test.hpp"
+#include "sync_hash.hpp"
+#include "random.hpp"
+#include <vector>
+
+using namespace walb;
+
+using Hash = cybozu::murmurhash3::Hash;
+
+cybozu::util::Random<size_t> g_rand;
+
+CYBOZU_TEST_AUTO(hashAlgoStr)
+{
+    for (uint8_t algo : {HASH_ALGO_MURMUR3, HASH_ALGO_XXH128}) {
+        CYBOZU_TEST_ASSERT(isValidHashAlgo(algo));
+        CYBOZU_TEST_EQUAL(parseHashAlgo(hashAlgoToStr(algo)), algo);
+    }
+    CYBOZU_TEST_ASSERT(!isValidHashAlgo(2));
+    CYBOZU_TEST_EXCEPTION(parseHashAlgo("md5"), cybozu::Exception);
+    CYBOZU_TEST_EXCEPTION(hashAlgoToStr(2), cybozu::Exception);
+    CYBOZU_TEST_EXCEPTION(SyncHasher(0, 2), cybozu::Exception);
+}
+
+CYBOZU_TEST_AUTO(murmur3Compat)
+{
+    std::vector<char> v(64 * 1024 + 512);
+    g_rand.fill(v.data(), v.size());
+    for (uint32_t seed : {0, 1, 12345}) {
+        const cybozu::murmurhash3::Hasher hasher0(seed);
+        const SyncHasher hasher1(seed, HASH_ALGO_MURMUR3);
+        CYBOZU_TEST_EQUAL(hasher0(v.data(), v.size()), hasher1(v.data(), v.size()));
+    }
+
+    cybozu::murmurhash3::StreamHasher shasher0(5);
+    SyncStreamHasher shasher1(5, HASH_ALGO_MURMUR3);
+    for (size_t off = 0; off < v.size(); off += 4096) {
+        const size_t size = std::min<size_t>(v.size() - off, 4096);
+        shasher0.push(&v[off], size);
+        shasher1.push(&v[off], size);
+    }
+    CYBOZU_TEST_EQUAL(shasher0.get(), shasher1.get());
+}
+
+CYBOZU_TEST_AUTO(xxh128)
+{
+    /* Reference values of XXH3_128bits_withSeed(). */
+    std::vector<uint8_t> w(4096);
+    for (size_t i = 0; i < w.size(); i++) w[i] = i * 7 % 251;
+    struct {
+        uint32_t seed;
+        uint64_t low, high;
+    } tbl[] = {
+        { 0, 0x5d9027c84d5f33f7ULL, 0xdec463517b2529a1ULL },
+        { 5, 0x7d22d648f457b5c2ULL, 0x72baa67b20d4072eULL },
+    };
+    for (const auto &t : tbl) {
+        const Hash h = SyncHasher(t.seed, HASH_ALGO_XXH128)(w.data(), w.size());
+        uint64_t low, high;
+        ::memcpy(&low, &h.data[0], sizeof(low));
+        ::memcpy(&high, &h.data[sizeof(low)], sizeof(high));
+        CYBOZU_TEST_EQUAL(low, t.low);
+        CYBOZU_TEST_EQUAL(high, t.high);
+    }
+
+    std::vector<char> v(64 * 1024);
+    g_rand.fill(v.data(), v.size());
+    const SyncHasher hasher(7, HASH_ALGO_XXH128);
+    const Hash h0 = hasher(v.data(), v.size());
+    CYBOZU_TEST_EQUAL(h0, hasher(v.data(), v.size()));
+    CYBOZU_TEST_ASSERT(h0 != SyncHasher(8, HASH_ALGO_XXH128)(v.data(), v.size()));
+    CYBOZU_TEST_ASSERT(h0 != SyncHasher(7, HASH_ALGO_MURMUR3)(v.data(), v.size()));
+    for (size_t pos : {size_t(0), v.size() / 2, v.size() - 1}) {
+        v[pos]++;
+        CYBOZU_TEST_ASSERT(h0 != hasher(v.data(), v.size()));
+        v[pos]--;
+    }
+}
@@ -237,3 +237,104 @@ CYBOZU_TEST_AUTO(RandomIndexedDiffFile)
     testRandomIndexedDiffFile(::WALB_DIFF_CMPR_LZ4, nr);
     testRandomIndexedDiffFile(::WALB_DIFF_CMPR_ZSTD, nr);
 }
+
+CYBOZU_TEST_AUTO(ResumeIndexedDiffFile)
+{
+    cybozu::TmpFile tmpFile0("."), ckptFile0(".");
+    const size_t nrIos = 100;
+    const size_t nrCkpt = nrIos / 2;
+
+    DiffFileHeader header0;
+    std::vector<IndexedDiffRecord> recV0(nrIos);
+    std::vector<AlignedArray> dataV0(nrIos);
+    std::list<Sio> sioList0 = generateSioList(nrIos, false);
+    {
+        size_t i = 0;
+        for (const Sio& sio : sioList0) {
+            sio.copyTo(recV0[i], dataV0[i]);
+            i++;
+        }
+    }
+    sioList0.sort();
+    {
+        /* Written records after the last checkpoint will be discarded. */
+        IndexedDiffWriter iWriter;
+        iWriter.setFd(tmpFile0.fd());
+        iWriter.writeHeader(header0);
+        iWriter.setCheckpointFile(cybozu::util::File(ckptFile0.fd()));
+        iWriter.checkpoint(0);
+        for (size_t i = 0; i < nrIos; i++) {
+            if (i == nrCkpt) iWriter.checkpoint(nrCkpt);
+            iWriter.compressAndWriteDiff(recV0[i], dataV0[i].data());
+        }
+    }
+    {
+        IndexedDiffWriter iWriter;
+        uint64_t tag;
+        CYBOZU_TEST_ASSERT(iWriter.resume(cybozu::util::File(tmpFile0.fd()),
+                                          cybozu::util::File(ckptFile0.fd()), tag));
+        CYBOZU_TEST_EQUAL(tag, nrCkpt);
+        for (size_t i = nrCkpt; i < nrIos; i++) {
+            iWriter.compressAndWriteDiff(recV0[i], dataV0[i].data());
+        }
+        iWriter.finalize();
+    }
+    cybozu::util::File(tmpFile0.fd()).lseek(0);
+    std::list<Sio> sioList1;
+    {
+        IndexedDiffReader iReader;
+        IndexedDiffCache cache;
+        cache.setMaxSize(32 * MEBI);
+        iReader.setFile(cybozu::util::File(tmpFile0.fd()), cache);
+        IndexedDiffRecord iRec;
+        AlignedArray iData;
+        while (iReader.readDiff(iRec, iData)) {
+            Sio sio;
+            sio.copyFrom(iRec, iData);
+            mergeOrAddSioList(sioList1, std::move(sio));
+        }
+        compareSioList(sioList0, sioList1);
+    }
+}
+
+CYBOZU_TEST_AUTO(ParallelIndexedDiffFile)
+{
+    const size_t nrIos = 1000;
+    DiffFileHeader header0;
+    std::vector<IndexedDiffRecord> recV0(nrIos);
+    std::vector<AlignedArray> dataV0(nrIos);
+    {
+        size_t i = 0;
+        for (const Sio& sio : generateSioList(nrIos, false)) {
+            sio.copyTo(recV0[i], dataV0[i]);
+            i++;
+        }
+    }
+    /* The parallel mode must write the same file and checkpoints as the serial one. */
+    cybozu::TmpFile tmpFile0("."), ckptFile0("."), tmpFile1("."), ckptFile1(".");
+    for (size_t j = 0; j < 2; j++) {
+        const bool isParallel = j == 1;
+        IndexedDiffWriter iWriter;
+        iWriter.setFd(isParallel ? tmpFile1.fd() : tmpFile0.fd());
+        iWriter.writeHeader(header0);
+        iWriter.setCheckpointFile(cybozu::util::File(isParallel ? ckptFile1.fd() : ckptFile0.fd()));
+        if (isParallel) iWriter.startParallel(4);
+        for (size_t i = 0; i < nrIos; i++) {
+            if (i % 10 == 0) iWriter.checkpoint(i);
+            AlignedArray data = dataV0[i];
+            iWriter.compressAndWriteDiff(recV0[i], std::move(data));
+        }
+        iWriter.finalize();
+    }
+    auto readAll = [](int fd) {
+        cybozu::util::File file(fd);
+        file.lseek(0);
+        std::string s;
+        char buf[4096];
+        size_t r;
+        while ((r = file.readsome(buf, sizeof(buf))) > 0) s.append(buf, r);
+        return s;
+    };
+    CYBOZU_TEST_ASSERT(readAll(tmpFile0.fd()) == readAll(tmpFile1.fd()));
+    CYBOZU_TEST_ASSERT(readAll(ckptFile0.fd()) == readAll(ckptFile1.fd()));
+}
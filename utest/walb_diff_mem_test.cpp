@@ -86,3 +86,29 @@ CYBOZU_TEST_AUTO(SimpleDiff)
         testDiffMemory(diskLen, recipe);
     }
 }
+
+CYBOZU_TEST_AUTO(SplitCompressedDiff)
+{
+    /* A compressed IO larger than maxIoBlocks is uncompressed and split. */
+    DiffMemory diffM;
+    diffM.setMaxIoBlocks(8);
+    for (uint64_t addr : {0, 4}) {
+        Sio sio;
+        sio.setRandomly(addr, 28, DiffRecType::NORMAL);
+        DiffRecord rec0, rec1;
+        AlignedArray data0, data1;
+        sio.copyTo(rec0, data0);
+        ::memset(data0.data(), 'a' + addr, data0.size()); // compressible.
+        compressDiffIo(rec0, data0.data(), rec1, data1, ::WALB_DIFF_CMPR_LZMA);
+        CYBOZU_TEST_ASSERT(rec1.isCompressed());
+        diffM.add(rec1, std::move(data1));
+        diffM.checkStatistics();
+    }
+    diffM.checkNoOverlappedAndSorted();
+    CYBOZU_TEST_EQUAL(diffM.getNBlocks(), 32);
+    while (!diffM.empty()) {
+        DiffMemory::Map::iterator it = diffM.getMap().begin();
+        diffM.eraseFromMap(it);
+        diffM.checkStatistics();
+    }
+}
@@ -1,6 +1,7 @@
 #include "cybozu/test.hpp"
 #include "cybozu/array.hpp"
 #include "walb_diff_merge.hpp"
+#include "walb_diff_virt.hpp"
 #include "tmp_file.hpp"
 #include "random.hpp"
 #include "for_walb_diff_test.hpp"
@@ -35,7 +36,7 @@ void verifyMergedDiff(size_t len, TmpDiffFileVec &d)
     }
 
     TmpDiffFile merged;
-    DiffMerger merger(0);
+    DiffMerger merger;
     for (size_t i = 0; i < d.size(); i++) {
         merger.addWdiff(d[i].path());
     }
@@ -365,3 +366,358 @@ CYBOZU_TEST_AUTO(wdiffMergeRandom)
         testMerge2(len, recipe);
     }
 }
+
+CYBOZU_TEST_AUTO(wdiffMergeManyInputs)
+{
+    const size_t len = 2048;
+    const size_t ioNr = 8;
+    const size_t diffNr = 100;
+    Recipe recipe;
+    for (size_t j = 0; j < diffNr; j++) {
+        recipe.emplace_back();
+        for (size_t k = 0; k < ioNr; k++) {
+            const uint64_t ioAddr = g_rand() % len;
+            const uint32_t ioBlocks = std::min(g_rand() % 64 + 1, len - ioAddr);
+            recipe.back().push_back({ioAddr, ioBlocks});
+        }
+    }
+    testMerge2(len, recipe);
+}
+
+/**
+ * Half of each block is zero-filled so that the data can be compressed.
+ */
+void makeCompressibleSioListVec(SioListVec &slv)
+{
+    for (SioList &sl : slv) {
+        for (Sio &sio : sl) {
+            for (size_t off = 0; off < sio.data.size(); off += LOGICAL_BLOCK_SIZE) {
+                ::memset(sio.data.data() + off, 0, LOGICAL_BLOCK_SIZE / 2);
+            }
+        }
+    }
+}
+
+void makeLzmaWdiffs(TmpDiffFileVec &tfv, const SioListVec &slv, bool isIndexed)
+{
+    for (size_t i = 0; i < slv.size(); i++) {
+        if (isIndexed) {
+            IndexedDiffWriter writer;
+            writer.setFd(tfv[i].fd());
+            DiffFileHeader header;
+            writer.writeHeader(header);
+            for (const Sio &sio : slv[i]) {
+                IndexedDiffRecord rec;
+                AlignedArray data;
+                sio.copyTo(rec, data);
+                writer.compressAndWriteDiff(rec, data.data(), ::WALB_DIFF_CMPR_LZMA);
+            }
+            writer.finalize();
+        } else {
+            SortedDiffWriter writer(tfv[i].fd());
+            DiffFileHeader header;
+            writer.writeHeader(header);
+            for (const Sio &sio : slv[i]) {
+                DiffRecord rec;
+                AlignedArray data;
+                sio.copyTo(rec, data);
+                writer.compressAndWriteDiff(rec, data.data(), ::WALB_DIFF_CMPR_LZMA);
+            }
+            writer.close();
+        }
+    }
+}
+
+/**
+ * RETURN:
+ *   number of LZMA-compressed records in the merged wdiff.
+ */
+size_t verifyMergedDiffPassThrough(size_t len, TmpDiffFileVec &d, int type)
+{
+    TmpDisk disk0(len), disk1(len);
+    for (size_t i = 0; i < d.size(); i++) {
+        disk0.apply(d[i].path());
+    }
+    TmpDiffFile merged;
+    DiffMerger merger;
+    merger.setPassThroughCmprType(type);
+    for (size_t i = 0; i < d.size(); i++) {
+        merger.addWdiff(d[i].path());
+    }
+    merger.mergeToFd(merged.fd());
+    disk1.apply(merged.path());
+    disk0.verifyEquals(disk1);
+
+    SortedDiffReader reader(merged.path());
+    DiffFileHeader header;
+    reader.readHeader(header);
+    DiffRecord rec;
+    AlignedArray buf;
+    size_t nr = 0;
+    while (reader.readDiff(rec, buf)) {
+        if (rec.isNormal() && rec.compression_type == ::WALB_DIFF_CMPR_LZMA) nr++;
+    }
+    return nr;
+}
+
+CYBOZU_TEST_AUTO(wdiffMergePassThrough)
+{
+    /*
+     * Each IO overlaps the IOs of the neighbor diffs,
+     * and an IO at +20 of diff0 overlaps nothing.
+     */
+    const size_t len = 256;
+    const size_t diffNr = 4;
+    Recipe recipe(diffNr);
+    for (size_t k = 0; k < 8; k++) {
+        for (size_t j = 0; j < diffNr; j++) {
+            recipe[j].push_back({k * 32 + j * 3, 4});
+        }
+        recipe[0].push_back({k * 32 + 20, 4});
+    }
+    SioListVec slv = generateSioListVec(recipe);
+    makeCompressibleSioListVec(slv);
+    for (bool isIndexed : {false, true}) {
+        TmpDiffFileVec d(diffNr);
+        makeLzmaWdiffs(d, slv, isIndexed);
+        /* mergeToFd() compresses uncompressed IOs with snappy. */
+        CYBOZU_TEST_EQUAL(verifyMergedDiffPassThrough(len, d, ::WALB_DIFF_CMPR_NONE), 0);
+        CYBOZU_TEST_ASSERT(verifyMergedDiffPassThrough(len, d, ::WALB_DIFF_CMPR_LZMA) > 0);
+    }
+}
+
+void verifyPrefetchedDiff(size_t len, TmpDiffFileVec &d, size_t nrThreads)
+{
+    TmpDisk disk0(len), disk1(len);
+    for (size_t i = 0; i < d.size(); i++) {
+        disk0.apply(d[i].path());
+    }
+    DiffMerger merger;
+    merger.setPassThroughCmprType(PASS_THROUGH_ALL_CMPR);
+    for (size_t i = 0; i < d.size(); i++) {
+        merger.addWdiff(d[i].path());
+    }
+    merger.prepare();
+    DiffRecIoPrefetcher prefetcher(merger);
+    prefetcher.start(nrThreads);
+    DiffRecIo recIo;
+    uint64_t addr = 0;
+    while (prefetcher.getAndRemove(recIo)) {
+        const DiffRecord &rec = recIo.record();
+        CYBOZU_TEST_ASSERT(!recIo.isCompressed());
+        CYBOZU_TEST_ASSERT(addr <= rec.io_address);
+        addr = rec.endIoAddress();
+        disk1.writeDiff(rec, recIo.io());
+    }
+    disk0.verifyEquals(disk1);
+}
+
+CYBOZU_TEST_AUTO(wdiffMergePrefetch)
+{
+    const size_t len = 1024;
+    const size_t diffNr = 4;
+    Recipe recipe(diffNr);
+    /* IOs in each diff are sorted and not overlapped. */
+    for (size_t j = 0; j < diffNr; j++) {
+        for (size_t k = 0; k < len / 16; k++) {
+            recipe[j].push_back({k * 16 + g_rand() % 8, g_rand() % 8 + 1});
+        }
+    }
+    SioListVec slv = generateSioListVec(recipe);
+    makeCompressibleSioListVec(slv);
+    for (bool isIndexed : {false, true}) {
+        TmpDiffFileVec d(diffNr);
+        makeLzmaWdiffs(d, slv, isIndexed);
+        for (size_t nrThreads : {0, 1, 4}) {
+            verifyPrefetchedDiff(len, d, nrThreads);
+        }
+    }
+}
+
+void verifyParallelMergedDiff(size_t len, TmpDiffFileVec &d, size_t nrThreads)
+{
+    TmpDisk disk0(len), disk1(len);
+    for (size_t i = 0; i < d.size(); i++) {
+        disk0.apply(d[i].path());
+    }
+    TmpDiffFile merged;
+    ParallelDiffMerger merger(nrThreads);
+    for (size_t i = 0; i < d.size(); i++) {
+        merger.addWdiff(d[i].path());
+    }
+    CYBOZU_TEST_ASSERT(merger.mergeToFd(merged.fd(), CompressOpt(), "."));
+    CYBOZU_TEST_ASSERT(merger.nrRanges() > 1);
+    disk1.apply(merged.path());
+    disk0.verifyEquals(disk1);
+
+    /* IOs of each range must be sorted and in the range. */
+    ParallelDiffMerger merger2(nrThreads);
+    for (size_t i = 0; i < d.size(); i++) {
+        merger2.addWdiff(d[i].path());
+    }
+    merger2.prepare();
+    std::vector<std::vector<DiffRecord> > recVV(merger2.nrRanges());
+    merger2.run([&](size_t idx, DiffMerger &rangeMerger) {
+        DiffRecIo recIo;
+        while (rangeMerger.getAndRemove(recIo)) recVV[idx].push_back(recIo.record());
+    });
+    uint64_t addr = 0;
+    for (const std::vector<DiffRecord> &recV : recVV) {
+        CYBOZU_TEST_ASSERT(!recV.empty());
+        for (const DiffRecord &rec : recV) {
+            CYBOZU_TEST_ASSERT(addr <= rec.io_address);
+            addr = rec.endIoAddress();
+        }
+    }
+    CYBOZU_TEST_EQUAL(merger.statIn().normNr, merger2.statIn().normNr);
+}
+
+CYBOZU_TEST_AUTO(wdiffMergeParallel)
+{
+    const size_t len = 8192;
+    const size_t ioNr = 1000;
+    const size_t diffNr = 8;
+    Recipe recipe;
+    for (size_t j = 0; j < diffNr; j++) {
+        recipe.emplace_back();
+        for (size_t k = 0; k < ioNr; k++) {
+            const uint64_t ioAddr = g_rand() % len;
+            const uint32_t ioBlocks = std::min(g_rand() % 16 + 1, len - ioAddr);
+            recipe.back().push_back({ioAddr, ioBlocks});
+        }
+    }
+    SioListVec slv = generateSioListVec(recipe);
+    TmpDiffFileVec d0(diffNr), d1(diffNr);
+    makeSortedWdiffs2(d0, slv);
+    makeIndexedWdiffs(d1, slv);
+    verifyParallelMergedDiff(len, d0, 4);
+    verifyParallelMergedDiff(len, d1, 4);
+}
+
+CYBOZU_TEST_AUTO(mergeTournamentTree)
+{
+    for (size_t nr : {1, 2, 3, 7, 8, 100}) {
+        MergeTournamentTree tree;
+        tree.init(nr);
+        std::vector<uint64_t> addrV(nr, UINT64_MAX);
+        for (size_t i = 0; i < 1000; i++) {
+            const size_t idx = g_rand() % nr;
+            addrV[idx] = g_rand() % 4 == 0 ? UINT64_MAX : g_rand() % 64;
+            tree.update(idx, addrV[idx]);
+            for (size_t end = 0; end <= nr; end++) {
+                size_t idx0 = SIZE_MAX;
+                uint64_t min0 = UINT64_MAX;
+                for (size_t k = 0; k < end; k++) {
+                    if (addrV[k] < min0) {
+                        min0 = addrV[k];
+                        idx0 = k;
+                    }
+                }
+                size_t idx1;
+                CYBOZU_TEST_EQUAL(tree.prefixMin(end, idx1), min0);
+                if (min0 != UINT64_MAX) CYBOZU_TEST_EQUAL(idx1, idx0);
+            }
+            size_t idx1;
+            const uint64_t min1 = tree.min(idx1);
+            CYBOZU_TEST_EQUAL(min1, tree.prefixMin(nr, idx1));
+        }
+    }
+}
+
+CYBOZU_TEST_AUTO(boundedDiffMemory)
+{
+    const size_t len = 4096;
+    const size_t ioNr = 3000;
+    TmpDisk disk0(len), disk1(len), disk2(len);
+    DiffMemory diffMem0;
+    BoundedDiffMemory diffMem1(64 * KIBI, ".");
+    for (size_t i = 0; i < ioNr; i++) {
+        const uint64_t ioAddr = g_rand() % len;
+        const uint32_t ioBlocks = std::min(g_rand() % 16 + 1, len - ioAddr);
+        Sio sio;
+        sio.setRandomly(ioAddr, ioBlocks);
+        disk0.writeSio(sio);
+        DiffRecord rec;
+        AlignedArray data0, data1;
+        sio.copyTo(rec, data0);
+        sio.copyTo(rec, data1);
+        diffMem0.add(rec, std::move(data0));
+        diffMem1.add(rec, std::move(data1));
+        if (i % 100 == 0) diffMem0.checkStatistics();
+    }
+    CYBOZU_TEST_ASSERT(diffMem1.nrRuns() > 1);
+    TmpDiffFile merged0, merged1;
+    diffMem0.writeTo(merged0.fd(), ::WALB_DIFF_CMPR_NONE);
+    diffMem1.writeTo(merged1.fd(), ::WALB_DIFF_CMPR_NONE);
+    disk1.apply(merged0.path());
+    disk2.apply(merged1.path());
+    disk0.verifyEquals(disk1);
+    disk0.verifyEquals(disk2);
+}
+
+void verifyVirtualSnapshotReader(size_t len, size_t baseLen, TmpDiffFileVec &d, const SioListVec &slv)
+{
+    /* Base image is random and shorter than the device. */
+    TmpDiffFile base;
+    AlignedArray expected(len * LBS, true);
+    g_rand.fill(expected.data(), baseLen * LBS);
+    cybozu::util::File(base.fd()).write(expected.data(), baseLen * LBS);
+    for (const SioList &sl : slv) {
+        for (const Sio &sio : sl) {
+            char *p = &expected[sio.ioAddr * LBS];
+            if (sio.type == DiffRecType::NORMAL) {
+                ::memcpy(p, sio.data.data(), sio.data.size());
+            } else {
+                ::memset(p, 0, sio.ioBlocks * LBS);
+            }
+        }
+    }
+
+    std::vector<cybozu::util::File> fileV;
+    for (TmpDiffFile &f : d) fileV.emplace_back(f.path(), O_RDONLY);
+    VirtualSnapshotReader virt;
+    virt.init(cybozu::util::File(base.path(), O_RDONLY), len, std::move(fileV), 64 * KIBI);
+    CYBOZU_TEST_EQUAL(virt.sizeLb(), len);
+
+    AlignedArray buf(len * LBS);
+    virt.read(0, len, buf.data());
+    CYBOZU_TEST_ASSERT(::memcmp(buf.data(), expected.data(), buf.size()) == 0);
+    for (size_t i = 0; i < 1000; i++) {
+        const uint64_t addr = g_rand() % len;
+        const uint64_t blks = g_rand() % std::min<size_t>(len - addr, 64) + 1;
+        virt.read(addr, blks, buf.data());
+        CYBOZU_TEST_ASSERT(::memcmp(buf.data(), &expected[addr * LBS], blks * LBS) == 0);
+    }
+    CYBOZU_TEST_EXCEPTION(virt.read(len - 1, 2, buf.data()), cybozu::Exception);
+}
+
+CYBOZU_TEST_AUTO(virtualSnapshotReader)
+{
+    const size_t len = 1024;
+    const size_t diffNr = 4;
+    Recipe recipe(diffNr);
+    /* IOs in each diff are sorted and not overlapped. */
+    for (size_t j = 0; j < diffNr; j++) {
+        for (size_t k = 0; k < len / 16; k++) {
+            recipe[j].push_back({k * 16 + g_rand() % 8, g_rand() % 8 + 1});
+        }
+    }
+    SioListVec slv = generateSioListVec(recipe);
+    TmpDiffFileVec d0(diffNr), d1(diffNr);
+    makeSortedWdiffs1(d0, slv);
+    makeIndexedWdiffs(d1, slv);
+    verifyVirtualSnapshotReader(len, len, d0, slv);
+    verifyVirtualSnapshotReader(len, len, d1, slv);
+    verifyVirtualSnapshotReader(len, len / 2, d1, slv);
+
+    /* Sorted and indexed wdiffs can be mixed. */
+    TmpDiffFileVec d2(diffNr);
+    for (size_t i = 0; i < diffNr; i++) {
+        if (i % 2 == 0) {
+            makeSortedWdiff1(d2[i], slv[i]);
+        } else {
+            makeIndexedWdiff(d2[i], slv[i]);
+        }
+    }
+    verifyVirtualSnapshotReader(len, len, d2, slv);
+}